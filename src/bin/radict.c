@@ -60,6 +60,7 @@ DIAG_ON(unused-macros)
 static void usage(void)
 {
 	fprintf(stderr, "usage: radict [OPTS] <attribute> [attribute...]\n");
+	fprintf(stderr, "  -C               Write a binary image of each dictionary loaded, for faster loading.\n");
 	fprintf(stderr, "  -E               Export dictionary definitions.\n");
 	fprintf(stderr, "  -V               Write out all attribute values.\n");
 	fprintf(stderr, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -150,6 +151,18 @@ static int load_dicts(char const *dict_dir, char const *protocol)
 	return 0;
 }
 
+/** Write an image of a dictionary next to its text files
+ *
+ */
+static int image_write(fr_dict_t const *dict)
+{
+	if (fr_dict_image_write(dict, NULL) < 0) return -1;
+
+	INFO("Wrote image of dictionary %s", fr_dict_root(dict)->name);
+
+	return 0;
+}
+
 static void da_print_info_td(fr_dict_t const *dict, fr_dict_attr_t const *da)
 {
 	char 			oid_str[512];
@@ -294,6 +307,7 @@ int main(int argc, char *argv[])
 	bool			found = false;
 	bool			export = false;
 	bool			file_export = false;
+	bool			write_images = false;
 	char const		*protocol = NULL;
 
 	TALLOC_CTX		*autofree;
@@ -316,11 +330,15 @@ int main(int argc, char *argv[])
 
 	fr_debug_lvl = 1;
 
-	while ((c = getopt(argc, argv, "cfED:p:VxhH")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "cCfED:p:VxhH")) != -1) switch (c) {
 		case 'c':
 			output_format = RADICT_OUT_CSV;
 			break;
 
+		case 'C':
+			write_images = true;
+			break;
+
 		case 'H':
 			print_headers = true;
 			break;
@@ -394,6 +412,30 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Includes dictionaries which were only loaded because
+	 *	another one references them.
+	 */
+	if (write_images) {
+		fr_dict_global_ctx_iter_t	iter;
+		fr_dict_t			*dict;
+
+		if (image_write(fr_dict_internal()) < 0) {
+		image_error:
+			fr_perror("radict");
+			ret = 1;
+			goto finish;
+		}
+
+		for (dict = fr_dict_global_ctx_iter_init(&iter);
+		     dict;
+		     dict = fr_dict_global_ctx_iter_next(&iter)) {
+			if (image_write(dict) < 0) goto image_error;
+		}
+
+		found = true;
+	}
+
 	if (print_headers) switch(output_format) {
 		case RADICT_OUT_CSV:
 			printf("Dictionary,OID,Attribute,ID,Type,Flags\n");
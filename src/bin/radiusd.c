@@ -838,8 +838,16 @@ int main(int argc, char *argv[])
 		schedule->max_workers = config->max_workers;
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
+		schedule->run_to_completion = config->run_to_completion;
 
 		schedule->network.max_outstanding = config->max_requests;
+		schedule->network.overflow_threshold = config->overflow_threshold;
+		schedule->network.worker_select = config->worker_select;
+		schedule->network.worker_choices = config->worker_choices;
+		schedule->network.cost_percentile = config->worker_cost_percentile;
+		schedule->network.work_stealing = config->work_stealing;
+
+		request_free_list_max_set(config->free_requests);
 
 #define COPY(_x) schedule->worker._x = config->_x
 		COPY(max_requests);
@@ -45,16 +45,24 @@ typedef struct {
 	fr_io_set_fd_t			fd_set;		//!< Set the file descriptor to the instance.
 
 	fr_io_data_read_t		read;		//!< Read from a socket to a data buffer
+	fr_io_data_read_batch_t		read_batch;	//!< Read a batch of packets for subsequent read() calls
 	fr_io_data_write_t		write;		//!< Write from a data buffer to a socket
 
 	fr_io_data_inject_t		inject;		//!< Inject a packet into a socket.
 
+	fr_io_data_hash_t		hash;		//!< Hash the source of a packet, for choosing a worker.
+
 	fr_io_data_vnode_t		vnode;		//!< Handle notifications that the VNODE has changed
 
 	fr_io_decode_t			decode;		//!< Translate raw bytes into fr_pair_ts and metadata.
 	fr_io_encode_t			encode;		//!< Pack fr_pair_ts back into a byte array.
 
-	fr_io_signal_t			flush;		//!< Flush the data when the socket is ready for writing.
+	fr_io_signal_t			flush;		//!< Flush any data which write() has queued.  Called
+							///< by the network side after it has written
+							///< all of the replies which are available.
+							///< Returns -1 with errno EWOULDBLOCK if data
+							///< is still queued, and flush should be called
+							///< again once the socket is writable.
 
 	fr_io_signal_t			error;		//!< There was an error on the socket.
 	fr_io_close_t			close;		//!< Close the transport.
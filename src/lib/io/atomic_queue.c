@@ -262,6 +262,159 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ * All of the entries are claimed with one update of the head, so
+ * the cost of the atomic operations is shared by the whole batch.
+ * As with #fr_atomic_queue_push, any number of threads may push
+ * to the queue at the same time.
+ *
+ * If there isn't room for all of the data, as many entries as will
+ * fit are pushed, in order.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	array of pointers to push.  None of them may be NULL.
+ * @param[in] num	number of pointers in the array.
+ * @return
+ *	- 0 on queue full.
+ *	- the number of pointers which were pushed.
+ */
+unsigned int fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, unsigned int num)
+{
+	int64_t		head;
+	unsigned int	i, avail;
+
+	if (!data || !num) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		/*
+		 *	Count how many entries after the head are free.
+		 */
+		for (avail = 0; avail < num; avail++) {
+			seq = aquire(aq->entry[ (head + avail) % aq->size ].seq);
+			if (seq != (head + avail)) break;
+		}
+
+		if (avail == 0) {
+			seq = aquire(aq->entry[ head % aq->size ].seq);
+			diff = (seq - head);
+
+			/*
+			 *	head is larger than the current entry, the queue is full.
+			 */
+			if (diff < 0) return 0;
+
+			/*
+			 *	Someone else has already written to this
+			 *	entry.  Get the new head pointer, and
+			 *	continue.
+			 */
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	Claim all of the free entries at once.  If the
+		 *	write fails, head has been updated with the
+		 *	current value, and we try again.
+		 */
+		if (cas_add(aq->head, head, avail)) break;
+	}
+
+	/*
+	 *	Store the data in the queue, and publish each entry in
+	 *	order.  Readers will see the entries one at a time, as
+	 *	they become visible.
+	 */
+	for (i = 0; i < avail; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (head + i) % aq->size ];
+
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return avail;
+}
+
+/** Pop multiple pointers from the atomic queue
+ *
+ * All of the entries are claimed with one update of the tail, so
+ * the cost of the atomic operations is shared by the whole batch.
+ * As with #fr_atomic_queue_pop, any number of threads may pop from
+ * the queue at the same time.  Each entry is returned to exactly
+ * one of them.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the data.
+ * @param[in] num	maximum number of pointers to pop.
+ * @return
+ *	- 0 on queue empty.
+ *	- the number of pointers which were popped.
+ */
+unsigned int fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, unsigned int num)
+{
+	int64_t		tail;
+	unsigned int	i, avail;
+
+	if (!data || !num) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		/*
+		 *	Count how many entries after the tail have
+		 *	been written.
+		 */
+		for (avail = 0; avail < num; avail++) {
+			seq = aquire(aq->entry[ (tail + avail) % aq->size ].seq);
+			if (seq != (tail + avail + 1)) break;
+		}
+
+		if (avail == 0) {
+			seq = aquire(aq->entry[ tail % aq->size ].seq);
+			diff = (seq - (tail + 1));
+
+			/*
+			 *	Nothing has been written to the entry,
+			 *	the queue is empty.
+			 */
+			if (diff < 0) return 0;
+
+			/*
+			 *	Someone else has already read this
+			 *	entry.
+			 */
+			tail = load(aq->tail);
+			continue;
+		}
+
+		if (cas_add(aq->tail, tail, avail)) break;
+	}
+
+	/*
+	 *	Copy the pointers to the caller BEFORE updating the
+	 *	queue entries, and then mark the entries as unused.
+	 */
+	for (i = 0; i < avail; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (tail + i) % aq->size ];
+
+		data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return avail;
+}
+
 size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 {
 	return aq->size;
@@ -175,6 +175,29 @@ typedef size_t (*fr_io_nak_t)(fr_listen_t *li, void *packet_ctx, uint8_t *const
  */
 typedef ssize_t (*fr_io_data_read_t)(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time, uint8_t *buffer, size_t buffer_len, size_t *leftover);
 
+/** Check for, and optionally read, a batch of packets from a socket.
+ *
+ * Datagram transports can read many packets from the kernel with one
+ * system call (e.g. recvmmsg()).  Those packets are buffered by the
+ * transport, and are returned one at a time by subsequent calls to
+ * read().
+ *
+ * The network side calls this function after each read(), to see if
+ * there are more packets to process.  Since the socket does not become
+ * readable for packets which have already been taken from the kernel,
+ * the network side MUST keep calling read() until this function
+ * returns 0.
+ *
+ * @param[in] li		the listener for this socket
+ * @param[in] refill		if no packets are buffered, try to read a
+ *				new batch from the socket.
+ * @return
+ *	- 0 no packets are buffered.
+ *	- >0 the number of packets which can be returned by read()
+ *	  without calling into the kernel.
+ */
+typedef unsigned int (*fr_io_data_read_batch_t)(fr_listen_t *li, bool refill);
+
 /** Write a socket.
  *
  *  If the socket is a datagram socket, then the function can read or
@@ -248,6 +271,17 @@ typedef ssize_t (*fr_io_data_write_t)(fr_listen_t *li, void *packet_ctx, fr_time
  */
 typedef int (*fr_io_data_inject_t)(fr_listen_t *li,uint8_t const *buffer, size_t buffer_len, fr_time_t recv_time);
 
+/** Hash the source of a packet
+ *
+ * Used by the network side to send packets from the same source to
+ * the same worker.
+ *
+ * @param[in] li		the listener for this socket
+ * @param[in] packet_ctx	returned by the read() function for this packet.
+ * @return a hash of the source of the packet.
+ */
+typedef uint32_t (*fr_io_data_hash_t)(fr_listen_t *li, void const *packet_ctx);
+
 /** Tell the IO handler that a VNODE has changed
  *
  * @param[in] li		the listener for this socket
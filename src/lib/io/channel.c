@@ -66,6 +66,17 @@ size_t channel_direction_len = NUM_ELEMENTS(channel_direction);
 #define SIGNAL_INTERVAL (1000000)	//!< The minimum interval between responder signals.
 #endif
 
+/** Maximum number of messages to take from an atomic queue at once
+ *
+ */
+#define RECV_BATCH (16)
+
+/** Longest time a responder will poll its queue, instead of sleeping
+ *
+ * Requests which arrive further apart than this are signalled.
+ */
+#define POLL_WINDOW_MAX (fr_time_delta_from_usec(50))
+
 /** Size of the atomic queues
  *
  * The queue reader MUST service the queue occasionally,
@@ -131,6 +142,11 @@ typedef struct {
 
 	atomic_bool		active;		//!< Whether the channel is active.
 
+	atomic_bool		polling;	//!< The responder is polling the queue, so the requestor
+						///< doesn't need to signal it.
+	fr_time_t		poll_start;	//!< When the responder last read a request while polling.
+	fr_time_delta_t		arrival_interval; //!< Average interval between requests, as seen by the responder.
+
 	fr_channel_stats_t	stats;		//!< channel statistics
 } fr_channel_end_t;
 
@@ -245,6 +261,12 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_con
 	ch->end[TO_REQUESTOR].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_REQUESTOR].active, true);
 
+	/*
+	 *	Don't poll until we've seen how often requests arrive.
+	 */
+	ch->end[TO_REQUESTOR].arrival_interval = POLL_WINDOW_MAX;
+	atomic_store(&ch->end[TO_REQUESTOR].polling, false);
+
 	return ch;
 }
 
@@ -357,6 +379,20 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
+	/*
+	 *	The responder is polling its queue, and will see the
+	 *	message without being woken up.  The fence pairs with
+	 *	the one in fr_channel_responder_poll(), so either we
+	 *	see that the responder has stopped polling, or it sees
+	 *	this message.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ch->end[TO_REQUESTOR].polling, memory_order_relaxed)) {
+		MPRINT("REQUESTOR SKIPS signal, responder is polling\n");
+		requestor->stats.suppressed++;
+		return 0;
+	}
+
 #if ENABLE_SKIPS
 	/*
 	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
@@ -407,9 +443,10 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
  */
 bool fr_channel_recv_reply(fr_channel_t *ch)
 {
-	fr_channel_data_t *cd;
+	fr_channel_data_t *batch[RECV_BATCH];
 	fr_channel_end_t *requestor;
 	fr_atomic_queue_t *aq;
+	unsigned int i, num;
 
 	fr_assert(ch->end[TO_RESPONDER].recv != NULL);
 
@@ -419,48 +456,99 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	num = fr_atomic_queue_pop_n(aq, (void **) batch, NUM_ELEMENTS(batch));
+	if (!num) return false;
 
 	/*
-	 *	We want an exponential moving average for round trip
-	 *	time, where "alpha" is a number between [0,1)
-	 *
-	 *	RTT_new = alpha * RTT_old + (1 - alpha) * RTT_sample
-	 *
-	 *	BUT we use fixed-point arithmetic, so we need to use inverse alpha,
-	 *	which works out to the following equation:
-	 *
-	 *	RTT_new = (RTT_sample + (ialpha - 1) * RTT_old) / ialpha
-	 *
-	 *	NAKs have zero processing time, so we ignore them for
-	 *	the purpose of RTT.
+	 *	Account for all of the messages before calling the
+	 *	recv function.  It may read from the channel again,
+	 *	and will then see sequence numbers which are larger
+	 *	than the ones in this batch.
 	 */
-	if (fr_time_delta_ispos(cd->reply.processing_time)) {
-		ch->processing_time = RTT(ch->processing_time, cd->reply.processing_time);
+	for (i = 0; i < num; i++) {
+		fr_channel_data_t *cd = batch[i];
+
+		/*
+		 *	We want an exponential moving average for round trip
+		 *	time, where "alpha" is a number between [0,1)
+		 *
+		 *	RTT_new = alpha * RTT_old + (1 - alpha) * RTT_sample
+		 *
+		 *	BUT we use fixed-point arithmetic, so we need to use inverse alpha,
+		 *	which works out to the following equation:
+		 *
+		 *	RTT_new = (RTT_sample + (ialpha - 1) * RTT_old) / ialpha
+		 *
+		 *	NAKs have zero processing time, so we ignore them for
+		 *	the purpose of RTT.
+		 */
+		if (fr_time_delta_ispos(cd->reply.processing_time)) {
+			ch->processing_time = RTT(ch->processing_time, cd->reply.processing_time);
+		}
+		ch->cpu_time = cd->reply.cpu_time;
+
+		/*
+		 *	Update the outbound channel with the knowledge that
+		 *	we've received one more reply, and with the responders
+		 *	ACK.
+		 */
+		fr_assert(requestor->stats.outstanding > 0);
+		fr_assert(cd->live.sequence > requestor->ack);
+		fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
+
+		requestor->stats.outstanding--;
+		requestor->ack = cd->live.sequence;
+		requestor->their_view_of_my_sequence = cd->live.ack;
+
+		fr_assert(fr_time_lteq(requestor->stats.last_read_other, cd->m.when));
+		requestor->stats.last_read_other = cd->m.when;
 	}
-	ch->cpu_time = cd->reply.cpu_time;
+
+	for (i = 0; i < num; i++) ch->end[TO_RESPONDER].recv(ch->end[TO_RESPONDER].recv_uctx, ch, batch[i]);
+
+	return true;
+}
+
+
+/** Take back a request which the responder hasn't read yet
+ *
+ * The requestor and responder both pop from the same atomic queue,
+ * so each request is read by exactly one of them.  A request which
+ * is taken back will never get a reply on this channel.
+ *
+ * MUST only be called from the requestor.
+ *
+ * @param[in] ch	the channel to take the request from.
+ * @return
+ *	- NULL if the responder has already read all of the requests.
+ *	- the oldest request which the responder hasn't read.
+ */
+fr_channel_data_t *fr_channel_recall_request(fr_channel_t *ch)
+{
+	fr_channel_data_t *cd;
+	fr_channel_end_t *requestor;
 
 	/*
-	 *	Update the outbound channel with the knowledge that
-	 *	we've received one more reply, and with the responders
-	 *	ACK.
+	 *	Requests are passed directly to the responder, and
+	 *	are never queued.
 	 */
-	fr_assert(requestor->stats.outstanding > 0);
-	fr_assert(cd->live.sequence > requestor->ack);
-	fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
+	if (ch->same_thread) return NULL;
 
-	requestor->stats.outstanding--;
-	requestor->ack = cd->live.sequence;
-	requestor->their_view_of_my_sequence = cd->live.ack;
+	requestor = &(ch->end[TO_RESPONDER]);
 
-	fr_assert(fr_time_lteq(requestor->stats.last_read_other, cd->m.when));
-	requestor->stats.last_read_other = cd->m.when;
+	if (!fr_atomic_queue_pop(requestor->aq, (void **) &cd)) return NULL;
 
-	ch->end[TO_RESPONDER].recv(ch->end[TO_RESPONDER].recv_uctx, ch, cd);
+	/*
+	 *	The sequence numbers the responder sees will have a
+	 *	gap, which is fine.  They only have to increase.
+	 */
+	fr_assert(requestor->stats.outstanding > 0);
+	requestor->stats.outstanding--;
 
-	return true;
-}
+	MPRINT("REQUESTOR recalls %"PRIu64", num_outstanding %"PRIu64"\n", cd->live.sequence, requestor->stats.outstanding);
 
+	return cd;
+}
 
 /** Receive a request message from the channel
  *
@@ -471,9 +559,10 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
  */
 bool fr_channel_recv_request(fr_channel_t *ch)
 {
-	fr_channel_data_t *cd;
+	fr_channel_data_t *batch[RECV_BATCH];
 	fr_channel_end_t *responder;
 	fr_atomic_queue_t *aq;
+	unsigned int i, num;
 
 	aq = ch->end[TO_RESPONDER].aq;
 	responder = &(ch->end[TO_REQUESTOR]);
@@ -481,19 +570,31 @@ bool fr_channel_recv_request(fr_channel_t *ch)
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	num = fr_atomic_queue_pop_n(aq, (void **) batch, NUM_ELEMENTS(batch));
+	if (!num) return false;
 
-	fr_assert(cd->live.sequence > responder->ack);
-	fr_assert(cd->live.sequence >= responder->sequence); /* must have more requests than replies */
+	/*
+	 *	Account for all of the messages before calling the
+	 *	recv function.  It may send a reply, which reads from
+	 *	the channel again.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_channel_data_t *cd = batch[i];
 
-	responder->stats.outstanding++;
-	responder->ack = cd->live.sequence;
-	responder->their_view_of_my_sequence = cd->live.ack;
+		fr_assert(cd->live.sequence > responder->ack);
+		fr_assert(cd->live.sequence >= responder->sequence); /* must have more requests than replies */
 
-	fr_assert(fr_time_lteq(responder->stats.last_read_other, cd->m.when));
-	responder->stats.last_read_other = cd->m.when;
+		responder->stats.outstanding++;
+		responder->ack = cd->live.sequence;
+		responder->their_view_of_my_sequence = cd->live.ack;
+
+		fr_assert(fr_time_lteq(responder->stats.last_read_other, cd->m.when));
+		responder->arrival_interval = RTT(responder->arrival_interval,
+						  fr_time_sub(cd->m.when, responder->stats.last_read_other));
+		responder->stats.last_read_other = cd->m.when;
+	}
 
-	ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd);
+	for (i = 0; i < num; i++) ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, batch[i]);
 
 	return true;
 }
@@ -668,6 +769,84 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
 	return fr_control_message_send(responder->control, responder->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** How long a responder should poll its queue after reading a request
+ *
+ * A small multiple of the average interval between requests, so
+ * that the window closes quickly when the load drops.
+ */
+static inline CC_HINT(always_inline) fr_time_delta_t channel_poll_window(fr_channel_end_t const *responder)
+{
+	fr_time_delta_t window;
+
+	if (fr_time_delta_gteq(responder->arrival_interval, POLL_WINDOW_MAX)) return fr_time_delta_wrap(0);
+
+	window = fr_time_delta_wrap(fr_time_delta_unwrap(responder->arrival_interval) * 4);
+	if (fr_time_delta_gt(window, POLL_WINDOW_MAX)) return POLL_WINDOW_MAX;
+
+	return window;
+}
+
+/** Poll for new requests, instead of waiting to be signalled
+ *
+ * When requests arrive faster than the responder can go to sleep and
+ * be woken up again, it's cheaper for the responder to keep checking
+ * its queue.  While it does that, the requestor doesn't send it any
+ * signals.
+ *
+ * The responder keeps polling for a short window after the last
+ * request it read.  The window depends on how often requests arrive
+ * on this channel, so under low load the channel goes back to using
+ * signals.
+ *
+ * MUST only be called from the responder.
+ *
+ * @param[in] ch	the channel.
+ * @param[in] now	the current time.
+ * @param[in] idle	the responder has nothing else to do, and would otherwise sleep.
+ * @return
+ *	- true if the responder is polling, or has read new requests.  It should not sleep.
+ *	- false if the responder may sleep.  It will be signalled when there are new requests.
+ */
+bool fr_channel_responder_poll(fr_channel_t *ch, fr_time_t now, bool idle)
+{
+	fr_channel_end_t *responder;
+
+	if (ch->same_thread) return false;
+
+	responder = &(ch->end[TO_REQUESTOR]);
+
+	if (!atomic_load_explicit(&responder->polling, memory_order_relaxed)) {
+		if (!idle || !fr_time_delta_ispos(channel_poll_window(responder))) return false;
+
+		MPRINT("\tRESPONDER starts polling\n");
+		atomic_store_explicit(&responder->polling, true, memory_order_relaxed);
+		responder->poll_start = now;
+		return true;
+	}
+
+	if (fr_channel_recv_request(ch)) {
+		while (fr_channel_recv_request(ch));
+		responder->poll_start = now;
+		return true;
+	}
+
+	if (!idle || fr_time_lt(now, fr_time_add(responder->poll_start, channel_poll_window(responder)))) return true;
+
+	/*
+	 *	Stop polling, and check the queue one last time.  The
+	 *	requestor may have pushed a request without signalling
+	 *	us, just before it saw that we've stopped.
+	 */
+	MPRINT("\tRESPONDER stops polling\n");
+	atomic_store_explicit(&responder->polling, false, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!fr_channel_recv_request(ch)) return false;
+
+	while (fr_channel_recv_request(ch));
+	return true;
+}
+
 
 /** Service a control-plane message
  *
@@ -814,6 +993,28 @@ bool fr_channel_active(fr_channel_t *ch)
 	return atomic_load(&ch->end[TO_REQUESTOR].active) && atomic_load(&ch->end[TO_RESPONDER].active);
 }
 
+/** Get the statistics for the requestor end of a channel
+ *
+ * @param[in] ch the channel
+ * @return the statistics.
+ */
+fr_channel_stats_t const *fr_channel_requestor_stats(fr_channel_t const *ch)
+{
+	return &ch->end[TO_RESPONDER].stats;
+}
+
+/** Check if both ends of the channel are in the same thread
+ *
+ * @param[in] ch the channel
+ * @return
+ *	- false the ends are in different threads.
+ *	- true messages are passed by calling the other end directly.
+ */
+bool fr_channel_same_thread(fr_channel_t const *ch)
+{
+	return ch->same_thread;
+}
+
 /** Signal a responder that the channel is closing
  *
  * @param[in] ch	The channel.
@@ -965,6 +1166,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals suppressed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.suppressed);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
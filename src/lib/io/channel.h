@@ -82,6 +82,7 @@ typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
 	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		suppressed;	//!< Number of signals not sent, because the other end was polling.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -128,12 +129,16 @@ typedef struct {
 	union {
 		struct {
 			fr_time_t		recv_time;	//!< time original request was received (network -> worker)
+			bool			stolen;		//!< taken from a busy worker, and sent to an idle one.
+			fr_time_delta_t		predicted;	//!< processing time the network predicted, returned
+								///< in the reply (network -> worker).
 		} request;
 
 		struct {
 			fr_time_delta_t		cpu_time;		//!< Total CPU time, including predicted work, (only worker -> network).
 			fr_time_delta_t		processing_time; 	//!< Actual processing time for this packet (only worker -> network).
 			fr_time_t		request_time;		//!< Timestamp of the request packet.
+			fr_time_delta_t		predicted;		//!< Copied from the request (only worker -> network).
 	        } reply;
 	};
 
@@ -160,6 +165,7 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *frontend, fr_cont
 
 int	fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(nonnull);
 bool	fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
+fr_channel_data_t *fr_channel_recall_request(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd) CC_HINT(nonnull);
 int	fr_channel_null_reply(fr_channel_t *ch) CC_HINT(nonnull);
@@ -172,11 +178,17 @@ int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_cal
 
 int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
+bool	fr_channel_responder_poll(fr_channel_t *ch, fr_time_t now, bool idle) CC_HINT(nonnull);
+
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
 fr_channel_event_t	fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
 
 bool	fr_channel_active(fr_channel_t *ch) CC_HINT(nonnull);
 
+bool	fr_channel_same_thread(fr_channel_t const *ch) CC_HINT(nonnull);
+
+fr_channel_stats_t const *fr_channel_requestor_stats(fr_channel_t const *ch) CC_HINT(nonnull);
+
 int	fr_channel_signal_open(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_signal_responder_close(fr_channel_t *ch) CC_HINT(nonnull);
@@ -52,6 +52,8 @@ struct fr_listen {
  */
 struct fr_async_s {
 	fr_time_t		recv_time;
+	fr_time_delta_t		predicted;	//!< processing time the network predicted, returned
+						///< with the reply.
 	fr_event_list_t		*el;
 
 	fr_time_tracking_t	tracking;
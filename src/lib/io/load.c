@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/math.h>
 
 /*
  *	We use *inverse* numbers to avoid numerical calculation issues.
@@ -55,6 +56,19 @@ RCSID("$Id$")
 
 #define RTT(_old, _new) fr_time_delta_wrap((fr_time_delta_unwrap(_new) + (fr_time_delta_unwrap(_old) * (IALPHA - 1))) / IALPHA)
 
+/*
+ *	Response times are kept in a log-linear histogram, in the same
+ *	way as HdrHistogram.  Values below HIST_SUB nanoseconds get one
+ *	bucket each.  Above that, every power of two is split into
+ *	HIST_SUB buckets, which gives us about 3% precision across the
+ *	whole range.  Anything over 2^HIST_MAX_BITS ns (~18 minutes)
+ *	goes into the last bucket.
+ */
+#define HIST_SUB_BITS	(5)
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	(40)
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
 typedef enum {
 	FR_LOAD_STATE_INIT = 0,
 	FR_LOAD_STATE_SENDING,
@@ -74,6 +88,9 @@ struct fr_load_s {
 	fr_time_t		step_end;		//!< when the current step will end
 	int			step_received;
 
+	uint64_t		hist_count;		//!< number of response times in the histogram
+	uint32_t		hist[HIST_BUCKETS];	//!< response times for the current step
+
 	uint32_t		pps;
 	fr_time_delta_t		delta;			//!< between packets
 
@@ -104,6 +121,51 @@ fr_load_t *fr_load_generator_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_loa
 	return l;
 }
 
+/** Find the histogram bucket for a response time.
+ *
+ */
+static inline unsigned int hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB) return value;
+
+	if (value >= ((uint64_t) 1 << HIST_MAX_BITS)) return HIST_BUCKETS - 1;
+
+	/*
+	 *	Keep the top HIST_SUB_BITS + 1 bits of the value.  The
+	 *	highest of those is always set, so the rest pick the
+	 *	bucket within this power of two.
+	 */
+	shift = fr_high_bit_pos(value) - (HIST_SUB_BITS + 1);
+
+	return ((shift + 1) * HIST_SUB) + ((value >> shift) - HIST_SUB);
+}
+
+/** Return the largest response time which is counted in a bucket.
+ *
+ */
+static inline uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB) return index;
+
+	shift = (index / HIST_SUB) - 1;
+
+	return ((((uint64_t) (index % HIST_SUB) + HIST_SUB) << shift) + ((uint64_t) 1 << shift)) - 1;
+}
+
+/** Start a new step.
+ *
+ */
+static void load_step_reset(fr_load_t *l)
+{
+	memset(l->hist, 0, sizeof(l->hist));
+	l->hist_count = 0;
+	l->stats.max = fr_time_delta_wrap(0);
+}
+
 /** Send one or more packets.
  *
  */
@@ -146,6 +208,8 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		l->step_start = l->next;
 		l->step_end = fr_time_add(l->next, l->config->duration);
 		l->step_received = l->stats.received;
+		l->stats.step_num++;
+		load_step_reset(l);
 		l->pps += l->config->step;
 		l->stats.pps = l->pps;
 		l->stats.skipped = 0;
@@ -235,6 +299,8 @@ int fr_load_generator_start(fr_load_t *l)
 
 	l->pps = l->config->start_pps;
 	l->stats.pps = l->pps;
+	l->stats.step_num = 0;
+	load_step_reset(l);
 	l->count = l->config->parallel;
 
 	l->delta = fr_time_delta_div(fr_time_delta_from_sec(l->config->parallel), fr_time_delta_wrap(l->pps));
@@ -257,26 +323,17 @@ int fr_load_generator_stop(fr_load_t *l)
 }
 
 
-/** Tell the load generator that we have a reply to a packet we sent.
+/** Record the response time for one reply.
  *
  */
-fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time)
+static void load_rtt_record(fr_load_t *l, fr_time_delta_t t)
 {
-	fr_time_t now;
-	fr_time_delta_t t;
-
-	/*
-	 *	Note that the replies may come out of order with
-	 *	respect to the request.  So we can't use this reply
-	 *	for any kind of timing.
-	 */
-	now = fr_time();
-	t = fr_time_sub(now, request_time);
-
 	l->stats.rttvar = RTTVAR(l->stats.rtt, l->stats.rttvar, t);
 	l->stats.rtt = RTT(l->stats.rtt, t);
 
-	l->stats.received++;
+	l->hist[hist_index(fr_time_delta_unwrap(t) < 0 ? 0 : fr_time_delta_unwrap(t))]++;
+	l->hist_count++;
+	if (fr_time_delta_gt(t, l->stats.max)) l->stats.max = t;
 
 	/*
 	 *	t is in nanoseconds.
@@ -298,6 +355,24 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 	} else {
 	       l->stats.times[7]++; /* seconds */
 	}
+}
+
+/** Tell the load generator that we have a reply to a packet we sent.
+ *
+ */
+fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time)
+{
+	fr_time_t now;
+
+	/*
+	 *	Note that the replies may come out of order with
+	 *	respect to the request.  So we can't use this reply
+	 *	for any kind of timing.
+	 */
+	now = fr_time();
+	load_rtt_record(l, fr_time_sub(now, request_time));
+
+	l->stats.received++;
 
 	/*
 	 *	Still sending packets.  Rely on the timer to send more
@@ -335,23 +410,54 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 	return FR_LOAD_DONE;
 }
 
-/** Print load generator statistics in CVS format.
+/** Tell the load generator that we have a reply which is not the end of the conversation.
  *
+ *  The response time is recorded, but the packet which started the
+ *  conversation is still outstanding.
  */
-size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen)
+void fr_load_generator_have_partial_reply(fr_load_t *l, fr_time_t request_time)
 {
-	double now_f, last_send_f;
+	load_rtt_record(l, fr_time_sub(fr_time(), request_time));
+}
 
-	if (!l->header) {
-		l->header = true;
-		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\"\n");
-	}
+/** Return a response time percentile for the current step.
+ *
+ * @param[in] l		the load generator.
+ * @param[in] percentile	e.g. 99.9
+ * @return the largest response time at or below the given percentile.
+ */
+fr_time_delta_t fr_load_generator_percentile(fr_load_t const *l, double percentile)
+{
+	double		rank;
+	uint64_t	target, seen = 0;
+	unsigned int	i;
 
+	if (!l->hist_count) return fr_time_delta_wrap(0);
 
-	now_f = fr_time_delta_unwrap(fr_time_sub(now, l->stats.start)) / (double)NSEC;
+	rank = (percentile * l->hist_count) / 100.0;
+	target = (uint64_t) rank;
+	if (target < rank) target++;
+	if (target < 1) target = 1;
+	if (target > l->hist_count) target = l->hist_count;
 
-	last_send_f = fr_time_delta_unwrap(fr_time_sub(l->stats.last_send, l->stats.start)) / (double)NSEC;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += l->hist[i];
+		if (seen >= target) break;
+	}
 
+	/*
+	 *	The bucket may be wider than anything we've seen.
+	 */
+	if (fr_time_delta_lt(l->stats.max, fr_time_delta_wrap(hist_value(i)))) return l->stats.max;
+
+	return fr_time_delta_wrap(hist_value(i));
+}
+
+/** Update the derived statistics before printing them.
+ *
+ */
+static void load_stats_update(fr_load_t *l, fr_time_t now)
+{
 	/*
 	 *	Track packets/s.  Since times are in nanoseconds, we
 	 *	have to scale the counters up by NSEC.  And since NSEC
@@ -366,6 +472,30 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			);
 	}
 
+	l->stats.p50 = fr_load_generator_percentile(l, 50);
+	l->stats.p99 = fr_load_generator_percentile(l, 99);
+	l->stats.p999 = fr_load_generator_percentile(l, 99.9);
+}
+
+/** Print load generator statistics in CVS format.
+ *
+ */
+size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen)
+{
+	double now_f, last_send_f;
+
+	if (!l->header) {
+		l->header = true;
+		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\",\"step\",\"p50\",\"p99\",\"p99.9\",\"max\"\n");
+	}
+
+
+	now_f = fr_time_delta_unwrap(fr_time_sub(now, l->stats.start)) / (double)NSEC;
+
+	last_send_f = fr_time_delta_unwrap(fr_time_sub(l->stats.last_send, l->stats.start)) / (double)NSEC;
+
+	load_stats_update(l, now);
+
 	return snprintf(buffer, buflen,
 			"%f,%f,"
 			"%" PRIu64 ",%" PRIu64 ","
@@ -373,7 +503,42 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			"%d,%d,"
 			"%d,%d,"
 			"%d,%d,%d,%d,%d,%d,%d,%d,"
-			"%d\n",
+			"%d,"
+			"%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+			now_f, last_send_f,
+			fr_time_delta_unwrap(l->stats.rtt), fr_time_delta_unwrap(l->stats.rttvar),
+			l->stats.pps, l->stats.pps_accepted,
+			l->stats.sent, l->stats.received,
+			l->stats.backlog, l->stats.max_backlog,
+			l->stats.times[0], l->stats.times[1], l->stats.times[2], l->stats.times[3],
+			l->stats.times[4], l->stats.times[5], l->stats.times[6], l->stats.times[7],
+			l->stats.blocked,
+			l->stats.step_num, fr_time_delta_unwrap(l->stats.p50), fr_time_delta_unwrap(l->stats.p99),
+			fr_time_delta_unwrap(l->stats.p999), fr_time_delta_unwrap(l->stats.max));
+}
+
+/** Print load generator statistics as JSON, one object per line.
+ *
+ */
+size_t fr_load_generator_stats_json_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen)
+{
+	double now_f, last_send_f;
+
+	now_f = fr_time_delta_unwrap(fr_time_sub(now, l->stats.start)) / (double)NSEC;
+
+	last_send_f = fr_time_delta_unwrap(fr_time_sub(l->stats.last_send, l->stats.start)) / (double)NSEC;
+
+	load_stats_update(l, now);
+
+	return snprintf(buffer, buflen,
+			"{\"time\":%f,\"last_packet\":%f,"
+			"\"rtt\":%" PRIu64 ",\"rttvar\":%" PRIu64 ","
+			"\"pps\":%d,\"pps_accepted\":%d,"
+			"\"sent\":%d,\"received\":%d,"
+			"\"backlog\":%d,\"max_backlog\":%d,"
+			"\"times\":[%d,%d,%d,%d,%d,%d,%d,%d],"
+			"\"blocked\":%s,"
+			"\"step\":%d,\"latency\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p99.9\":%" PRIu64 ",\"max\":%" PRIu64 "}}\n",
 			now_f, last_send_f,
 			fr_time_delta_unwrap(l->stats.rtt), fr_time_delta_unwrap(l->stats.rttvar),
 			l->stats.pps, l->stats.pps_accepted,
@@ -381,7 +546,9 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			l->stats.backlog, l->stats.max_backlog,
 			l->stats.times[0], l->stats.times[1], l->stats.times[2], l->stats.times[3],
 			l->stats.times[4], l->stats.times[5], l->stats.times[6], l->stats.times[7],
-			l->stats.blocked);
+			l->stats.blocked ? "true" : "false",
+			l->stats.step_num, fr_time_delta_unwrap(l->stats.p50), fr_time_delta_unwrap(l->stats.p99),
+			fr_time_delta_unwrap(l->stats.p999), fr_time_delta_unwrap(l->stats.max));
 }
 
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l)
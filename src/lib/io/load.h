@@ -68,6 +68,11 @@ RCSIDH(load_h, "$Id$")
  *  "duration" seconds, even if the maximum backlog is currently
  *  reached.  This increase has the effect of also increasing the
  *  maximum backlog.
+ *
+ *  Response times are recorded in a log-linear histogram, which is
+ *  cleared at the start of each step.  The histogram has 32 buckets
+ *  for each power of two, so the percentiles it reports are accurate
+ *  to about 3%, no matter how large the response times are.
  */
 typedef struct {
 	uint32_t       	start_pps;	//!< start PPS
@@ -93,6 +98,12 @@ typedef struct {
 	int		max_backlog;	//!< maximum backlog we saw during the test
 	bool		blocked;	//!< whether or not we're blocked
 	int		times[8];	//!< response time in microseconds to tens of seconds
+
+	int		step_num;	//!< which step we're on, starting from zero
+	fr_time_delta_t	p50;		//!< median response time for the current step
+	fr_time_delta_t	p99;		//!< 99th percentile response time for the current step
+	fr_time_delta_t	p999;		//!< 99.9th percentile response time for the current step
+	fr_time_delta_t	max;		//!< maximum response time for the current step
 } fr_load_stats_t;
 
 typedef struct fr_load_s fr_load_t;
@@ -117,6 +128,12 @@ int fr_load_generator_stop(fr_load_t *l) CC_HINT(nonnull);
 
 fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time) CC_HINT(nonnull);
 
+void fr_load_generator_have_partial_reply(fr_load_t *l, fr_time_t request_time) CC_HINT(nonnull);
+
+fr_time_delta_t fr_load_generator_percentile(fr_load_t const *l, double percentile) CC_HINT(nonnull);
+
 size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen);
 
+size_t fr_load_generator_stats_json_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen);
+
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l) CC_HINT(nonnull);
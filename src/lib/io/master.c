@@ -30,6 +30,7 @@
 
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/udp.h>
 
 typedef struct {
 	fr_event_list_t			*el;				//!< event list, for the master socket.
@@ -1782,6 +1783,26 @@ have_client:
 	return 0;
 }
 
+/** Ask the child transport if it has buffered a batch of packets
+ *
+ *  Packets which are pending for dynamic clients or connected
+ *  sockets are handled by mod_read() as usual.  This function only
+ *  reports on packets which the child has already taken from the
+ *  kernel.
+ */
+static unsigned int mod_read_batch(fr_listen_t *li, bool refill)
+{
+	fr_io_instance_t const	*inst;
+	fr_io_connection_t	*connection;
+	fr_listen_t		*child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->read_batch) return 0;
+
+	return inst->app_io->read_batch(child, refill);
+}
+
 /** Inject a packet to a connection.
  *
  *  Always called in the context of the network.
@@ -2567,6 +2588,35 @@ reread:
 	return buffer_len;
 }
 
+/** Flush any replies which the child transport has queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const	*inst;
+	fr_io_connection_t	*connection;
+	fr_listen_t		*child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
+/** Hash the client address of a packet
+ *
+ */
+static uint32_t mod_hash(UNUSED fr_listen_t *li, void const *packet_ctx)
+{
+	fr_io_track_t const	*track = talloc_get_type_abort_const(packet_ctx, fr_io_track_t);
+	fr_ipaddr_t const	*ipaddr = &track->address->socket.inet.src_ipaddr;
+
+	if (ipaddr->af == AF_INET) return fr_hash(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4));
+
+	return fr_hash(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6));
+}
+
 /** Close the socket.
  *
  */
@@ -2670,6 +2720,16 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->per_network_socket && (inst->ipproto != IPPROTO_UDP)) {
+		cf_log_err(conf, "'per_network_socket' can only be used with UDP transports");
+		return -1;
+	}
+
+	if (inst->steer_by_client && !inst->per_network_socket) {
+		cf_log_err(conf, "'steer_by_client' requires 'per_network_socket = yes'");
+		return -1;
+	}
+
 	/*
 	 *	Ensure that the dynamic client sections exist
 	 */
@@ -2749,6 +2809,8 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 
 	for (i = 0; i < num; i++) {
 		fr_ipaddr_t *network;
+		void *found = NULL;
+		size_t found_prefix = 0;
 
 		/*
 		 *	Can't add v4 networks to a v6 socket, or vice versa.
@@ -2760,12 +2822,19 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 			return NULL;
 		}
 
+		/*
+		 *	Find the longest existing network which
+		 *	contains this one.  It's either a duplicate,
+		 *	or an overlap.
+		 */
+		(void) fr_trie_lookup_all_prefixes(trie, &allow[i].addr, allow[i].prefix,
+						   &found, &found_prefix, 1);
+		network = found;
+
 		/*
 		 *	Duplicates are bad.
 		 */
-		network = fr_trie_match_by_key(trie,
-					&allow[i].addr, allow[i].prefix);
-		if (network) {
+		if (network && (found_prefix == allow[i].prefix)) {
 			fr_strerror_printf("Cannot add duplicate entry 'allow = %pV'",
 					   fr_box_ipaddr(allow[i]));
 			talloc_free(trie);
@@ -2783,8 +2852,6 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 		 *	fr_trie_alloc() saying "we can only
 		 *	have terminal fr_trie_user_t nodes"
 		 */
-		network = fr_trie_lookup_by_key(trie,
-					 &allow[i].addr, allow[i].prefix);
 		if (network && (network->prefix <= allow[i].prefix)) {
 			fr_strerror_printf("Cannot add overlapping entry 'allow = %pV'", fr_box_ipaddr(allow[i]));
 			fr_strerror_const("Entry is completely enclosed inside of a previously defined network.");
@@ -2818,6 +2885,8 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 	 */
 	for (i = 0; i < num; i++) {
 		fr_ipaddr_t *network;
+		void *found = NULL;
+		size_t found_prefix = 0;
 
 		/*
 		 *	Can't add v4 networks to a v6 socket, or vice versa.
@@ -2829,12 +2898,18 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 			return NULL;
 		}
 
+		/*
+		 *	Find the longest existing network which
+		 *	contains this one.
+		 */
+		(void) fr_trie_lookup_all_prefixes(trie, &deny[i].addr, deny[i].prefix,
+						   &found, &found_prefix, 1);
+		network = found;
+
 		/*
 		 *	Duplicates are bad.
 		 */
-		network = fr_trie_match_by_key(trie,
-					&deny[i].addr, deny[i].prefix);
-		if (network) {
+		if (network && (found_prefix == deny[i].prefix)) {
 			fr_strerror_printf("Cannot add duplicate entry 'deny = %pV'", fr_box_ipaddr(deny[i]));
 			talloc_free(trie);
 			return NULL;
@@ -2843,8 +2918,6 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 		/*
 		 *	A "deny" can only be within a previous "allow".
 		 */
-		network = fr_trie_lookup_by_key(trie,
-					 &deny[i].addr, deny[i].prefix);
 		if (!network) {
 			fr_strerror_printf("The network in entry %zd - 'deny = %pV' is not "
 					   "contained within a previous 'allow'", i + 1, fr_box_ipaddr(deny[i]));
@@ -2916,25 +2989,27 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+/** Allocate a listener, and open its socket
+ *
+ * @param[in] ctx			to allocate the listener in.
+ * @param[in] inst			of the master IO handler.
+ * @param[in] sc			the scheduler the listener will be added to.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] record			whether this listener should be checked against, and
+ *					recorded in, the list of global listeners.  Only the
+ *					first of a set of per-network sockets is recorded, as
+ *					the others deliberately share its address and port.
+ * @return
+ *	- NULL on error.
+ *	- the new listener.
+ */
+static fr_listen_t *master_io_listen_open(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+					  size_t default_message_size, size_t num_messages, bool record)
 {
 	fr_listen_t	*li, *child;
 	fr_io_thread_t	*thread;
 
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->common.thread_inst_size) {
-		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
-		return -1;
-	}
-
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -3036,7 +3111,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	if (inst->app_io->open(child) < 0) {
 		cf_log_err(inst->app_io_conf, "Failed opening %s interface", inst->app_io->common.name);
 		talloc_free(li);
-		return -1;
+		return NULL;
 	}
 
 	li->fd = child->fd;	/* copy this back up */
@@ -3051,7 +3126,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	/*
 	 *	Record which socket we opened.
 	 */
-	if (child->app_io_addr) {
+	if (record && child->app_io_addr) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -3062,22 +3137,92 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 			ERROR("got socket %d %d\n", child->app_io_addr->inet.src_port, other->app_io_addr->inet.src_port);
 
 			talloc_free(li);
-			return -1;
+			return NULL;
 		}
 
 		(void) listen_record(child);
 	}
 
+	return li;
+}
+
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	fr_listen_t	**li;
+	unsigned int	i, num = 1, added = 0;
+
 	/*
-	 *	Add the socket to the scheduler, where it might end up
-	 *	in a different thread.
+	 *	No IO paths, so we don't initialize them.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
-		talloc_free(li);
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->common.thread_inst_size) {
+		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
 		return -1;
 	}
 
+	/*
+	 *	Each network thread gets its own socket, bound to the
+	 *	same address and port with SO_REUSEPORT.  The kernel
+	 *	spreads packets across the sockets, and each listener
+	 *	has its own clients and duplicate detection table, so
+	 *	the network threads don't share any state.
+	 */
+	if (inst->per_network_socket) num = fr_schedule_num_networks(sc);
+
+	MEM(li = talloc_zero_array(NULL, fr_listen_t *, num));
+
+	for (i = 0; i < num; i++) {
+		li[i] = master_io_listen_open(ctx, inst, sc, default_message_size, num_messages, (i == 0));
+		if (!li[i]) goto error;
+	}
+
+	/*
+	 *	The sockets are numbered in the order they were bound,
+	 *	which is also the order of the network threads.
+	 */
+	if (inst->steer_by_client && (num > 1)) {
+		fr_listen_t *child = ((fr_io_thread_t *)li[0]->thread_instance)->child;
+
+		if (!child->app_io_addr ||
+		    (udp_reuseport_steer_by_src(li[0]->fd, child->app_io_addr->inet.src_ipaddr.af, num) < 0)) {
+			cf_log_perr(inst->app_io_conf, "Failed enabling 'steer_by_client'");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Add the sockets to the scheduler, where they might end
+	 *	up in a different thread.
+	 */
+	for (added = 0; added < num; added++) {
+		fr_network_t *nr;
+
+		if (num == 1) {
+			nr = fr_schedule_listen_add(sc, li[added]);
+		} else {
+			nr = fr_schedule_listen_add_network(sc, li[added], added);
+		}
+		if (!nr) goto error;
+	}
+
+	talloc_free(li);
+
 	return 0;
+
+error:
+	/*
+	 *	Listeners which have already been added to the
+	 *	scheduler belong to the network side.
+	 */
+	for (i = added; i < num; i++) talloc_free(li[i]);
+	talloc_free(li);
+
+	return -1;
 }
 
 /*
@@ -3136,8 +3281,11 @@ fr_app_io_t fr_master_app_io = {
 	.track_duplicates	= true,
 
 	.read			= mod_read,
+	.read_batch		= mod_read_batch,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
+	.hash			= mod_hash,
 
 	.open			= mod_open,
 	.close			= mod_close,
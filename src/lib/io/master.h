@@ -82,6 +82,9 @@ typedef struct {
 	fr_time_delta_t			check_interval;			//!< polling for closed sockets
 
 	bool				dynamic_clients;		//!< do we have dynamic clients.
+	bool				per_network_socket;		//!< open one socket per network thread.
+	bool				steer_by_client;		//!< send all packets from a client to the
+									///< same per-network socket.
 
 	CONF_SECTION			*server_cs;			//!< server CS for this listener
 
@@ -29,6 +29,7 @@ RCSID("$Id$")
 #define LOG_DST nr->log
 
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/math.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rb.h>
@@ -46,6 +47,26 @@ RCSID("$Id$")
 
 #define MAX_WORKERS 64
 
+/*
+ *	Maximum number of packets we take from a transport's batch
+ *	(see app_io->read_batch) before we stop asking it to read
+ *	more packets from the kernel, and go service other sockets.
+ */
+#define MAX_READ_BATCHED (256)
+
+/*
+ *	Processing times are kept in a histogram with one bucket per
+ *	power of two microseconds.  The histogram is halved after
+ *	every COST_DECAY_SAMPLES replies, so that old samples are
+ *	gradually forgotten.
+ *
+ *	The prediction is the mean of the bucket which holds the
+ *	configured percentile, so a few slow packets raise it, where
+ *	they would be lost in the overall mean.
+ */
+#define COST_BUCKETS		(32)
+#define COST_DECAY_SAMPLES	(256)
+
 static _Thread_local fr_ring_buffer_t *fr_network_rb;
 
 typedef struct {
@@ -55,6 +76,20 @@ typedef struct {
 	fr_time_t		recv_time;
 } fr_network_inject_t;
 
+/** Decaying histogram of the processing time for packets sent to one virtual server
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< in the tree of costs, ordered by virtual server.
+	CONF_SECTION const	*server_cs;		//!< virtual server these costs are for.
+
+	uint32_t		samples;		//!< replies since the histogram was last decayed.
+	uint32_t		count[COST_BUCKETS];	//!< number of replies in each bucket.
+	uint64_t		sum[COST_BUCKETS];	//!< total processing time (usec) of the replies in each bucket.
+
+	fr_time_delta_t		predicted;		//!< processing time at the configured percentile.
+} fr_network_cost_t;
+
 /** Associate a worker thread with a network thread
  *
  */
@@ -62,6 +97,8 @@ typedef struct {
 	fr_heap_index_t		heap_id;		//!< workers are in a heap
 	fr_time_delta_t		cpu_time;		//!< how much CPU time this worker has spent
 	fr_time_delta_t		predicted;		//!< predicted processing time for one packet
+	fr_time_delta_t		backlog;		//!< predicted processing time of the packets outstanding
+							///< in this worker.
 
 	bool			blocked;		//!< is this worker blocked?
 
@@ -80,8 +117,11 @@ typedef struct {
 
 	fr_event_filter_t	filter;			//!< what type of filter it is
 
+	fr_network_cost_t	*cost;			//!< processing time for packets from this socket.
+
 	bool			dead;			//!< is it dead?
 	bool			blocked;		//!< is it blocked?
+	bool			unflushed;		//!< the transport has queued data it couldn't write.
 
 	unsigned int		outstanding;		//!< number of outstanding packets sent to the worker
 	fr_listen_t		*listen;		//!< I/O ctx and functions.
@@ -93,6 +133,7 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		flush_entry;		//!< in the list of sockets which need flushing
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -128,12 +169,16 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		flush;			//!< sockets which have had packets written in this
+							///< pass through the event loop, and need to be flushed.
 
 	fr_io_stats_t		stats;
 
 	fr_rb_tree_t		*sockets;		//!< list of sockets we're managing, ordered by the listener
 	fr_rb_tree_t		*sockets_by_num;       	//!< ordered by number;
 
+	fr_rb_tree_t		*costs;			//!< processing time histograms, by virtual server.
+
 	int			num_workers;		//!< number of active workers
 	int			num_blocked;		//!< number of blocked workers
 	int			num_pending_workers;	//!< number of workers we're waiting to start.
@@ -145,6 +190,8 @@ struct fr_network_s {
 
 	bool			exiting;		//!< are we exiting?
 
+	fr_network_worker_t	*local;			//!< worker running in this thread, if any.
+
 	fr_network_config_t	config;			//!< configuration
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
 };
@@ -183,6 +230,13 @@ static int8_t socket_listen_cmp(void const *one, void const *two)
 	return CMP(a->listen, b->listen);
 }
 
+static int8_t cost_cmp(void const *one, void const *two)
+{
+	fr_network_cost_t const *a = one, *b = two;
+
+	return CMP(a->server_cs, b->server_cs);
+}
+
 static int8_t socket_num_cmp(void const *one, void const *two)
 {
 	fr_network_socket_t const *a = one, *b = two;
@@ -483,7 +537,14 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 	worker = fr_channel_requestor_uctx_get(ch);
 	worker->stats.out++;
 	worker->cpu_time = cd->reply.cpu_time;
-	if (!fr_time_delta_ispos(worker->predicted)) {
+
+	/*
+	 *	NAKs have no processing time.
+	 */
+	if (!fr_time_delta_ispos(cd->reply.processing_time)) {
+		/* do nothing */
+
+	} else if (!fr_time_delta_ispos(worker->predicted)) {
 		worker->predicted = cd->reply.processing_time;
 	} else {
 		worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
@@ -559,6 +620,8 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 		/*
 		 *	Remove this worker from the array
 		 */
+		if (nr->local == w) nr->local = NULL;
+
 		for (i = 0; i < nr->num_workers; i++) {
 			DEBUG3("Worker acked our close request");
 			if (nr->workers[i] == w) {
@@ -581,97 +644,411 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 
 #define OUTSTANDING(_x) ((_x)->stats.in - (_x)->stats.out)
 
-/** Send a message on the "best" channel.
+/** Find or create the processing time histogram for a virtual server
  *
- * @param nr the network
- * @param cd the message we've received
  */
-static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+static fr_network_cost_t *network_cost_find(fr_network_t *nr, CONF_SECTION const *server_cs)
 {
-	fr_network_worker_t *worker;
+	fr_network_cost_t	*cost;
 
-	(void) talloc_get_type_abort(nr, fr_network_t);
+	cost = fr_rb_find(nr->costs, &(fr_network_cost_t){ .server_cs = server_cs });
+	if (cost) return cost;
 
-retry:
-	if (nr->num_workers == 1) {
-		worker = nr->workers[0];
-		if (worker->blocked) {
-			RATE_LIMIT_GLOBAL(ERROR, "Failed sending packet to worker - "
-					  "In single-threaded mode and worker is blocked");
-		drop:
-			worker->stats.dropped++;
-			return -1;
+	MEM(cost = talloc_zero(nr->costs, fr_network_cost_t));
+	cost->server_cs = server_cs;
+
+	if (!fr_rb_insert(nr->costs, cost)) {
+		talloc_free(cost);
+		return NULL;
+	}
+
+	return cost;
+}
+
+/** Add the processing time of a reply to the histogram, and update the prediction
+ *
+ * @param[in] cost		histogram for a virtual server.
+ * @param[in] processing_time	of the reply.
+ * @param[in] percentile	of the processing times to predict, 1..100.
+ */
+static void network_cost_update(fr_network_cost_t *cost, fr_time_delta_t processing_time, uint32_t percentile)
+{
+	int64_t		usec = fr_time_delta_to_usec(processing_time);
+	uint64_t	count = 0, want, seen = 0;
+	unsigned int	i;
+
+	if (usec < 0) usec = 0;
+
+	i = fr_high_bit_pos(usec);
+	if (i >= COST_BUCKETS) i = COST_BUCKETS - 1;
+
+	cost->count[i]++;
+	cost->sum[i] += usec;
+
+	/*
+	 *	Decay the histogram, so that the prediction follows
+	 *	changes in the workload.
+	 */
+	if (++cost->samples >= COST_DECAY_SAMPLES) {
+		for (i = 0; i < COST_BUCKETS; i++) {
+			cost->count[i] >>= 1;
+			cost->sum[i] >>= 1;
 		}
+		cost->samples = 0;
+	}
 
-	} else if (nr->num_blocked == 0) {
-		int64_t cmp;
-		uint32_t one, two;
+	for (i = 0; i < COST_BUCKETS; i++) count += cost->count[i];
+	if (!count) return;
 
-		one = fr_rand() % nr->num_workers;
-		do {
-			two = fr_rand() % nr->num_workers;
-		} while (two == one);
+	want = (count * percentile + 99) / 100;
+	for (i = 0; i < COST_BUCKETS; i++) {
+		seen += cost->count[i];
+		if (seen >= want) break;
+	}
+
+	/*
+	 *	Decaying can leave a bucket with samples but no
+	 *	time, which is fine, they were all very quick.
+	 */
+	cost->predicted = fr_time_delta_from_usec(cost->sum[i] / cost->count[i]);
+}
+
+/** Predict how long a worker will take to process a packet from a socket
+ *
+ * Until we've seen replies for the socket's virtual server, use the
+ * worker's own average.
+ */
+static inline CC_HINT(always_inline) fr_time_delta_t network_cost_predict(fr_network_socket_t const *s,
+									  fr_network_worker_t const *worker)
+{
+	if (!s || !s->cost || !fr_time_delta_ispos(s->cost->predicted)) return worker->predicted;
+
+	return s->cost->predicted;
+}
+
+/** Take a packet's predicted cost off of a worker's backlog
+ *
+ */
+static inline CC_HINT(always_inline) void network_backlog_sub(fr_network_worker_t *worker, fr_time_delta_t predicted)
+{
+	if (fr_time_delta_lteq(worker->backlog, predicted)) {
+		worker->backlog = fr_time_delta_wrap(0);
+	} else {
+		worker->backlog = fr_time_delta_sub(worker->backlog, predicted);
+	}
+}
+
+/** Account for the processing time of a reply
+ *
+ * Update the histogram for the socket's virtual server, and take the
+ * packet off of the worker's backlog.  Only called for replies which
+ * came from a worker.
+ *
+ * The reply carries the prediction which was added to the backlog when
+ * the packet was sent, so exactly that is removed, even if the
+ * prediction has changed since.
+ */
+static void network_cost_reply(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	fr_network_worker_t	*worker = talloc_get_type_abort(fr_channel_requestor_uctx_get(cd->channel.ch),
+								fr_network_worker_t);
+
+	network_backlog_sub(worker, cd->reply.predicted);
+
+	if (s->cost && fr_time_delta_ispos(cd->reply.processing_time)) {
+		network_cost_update(s->cost, cd->reply.processing_time, nr->config.cost_percentile);
+	}
+}
+
+/** Compare the load on two workers
+ *
+ * Prefer the worker with the least predicted processing time for its
+ * outstanding packets.  Then the one with the fewest outstanding
+ * packets, and then the one which has used the least CPU time.
+ */
+static int8_t network_worker_cmp(fr_network_worker_t const *a, fr_network_worker_t const *b)
+{
+	int8_t ret;
+
+	ret = fr_time_delta_cmp(a->backlog, b->backlog);
+	if (ret != 0) return ret;
+
+	ret = CMP(OUTSTANDING(a), OUTSTANDING(b));
+	if (ret != 0) return ret;
+
+	return fr_time_delta_cmp(a->cpu_time, b->cpu_time);
+}
+
+/** Pick the least loaded of all of the unblocked workers
+ *
+ * The load is the number of runnable requests reported by the worker
+ * itself, which also covers requests sent by other networks.
+ */
+static fr_network_worker_t *network_worker_least_loaded(fr_network_t *nr)
+{
+	int			i;
+	uint32_t		min_runnable = UINT32_MAX;
+	fr_network_worker_t	*found = NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_network_worker_t	*worker = nr->workers[i];
+		uint32_t		runnable;
+
+		if (worker->blocked) continue;
+
+		runnable = fr_worker_num_runnable(worker->worker);
+		if (!found || (runnable < min_runnable) ||
+		    ((runnable == min_runnable) && (network_worker_cmp(worker, found) < 0))) {
+			found = worker;
+			min_runnable = runnable;
+		}
+	}
+
+	return found;
+}
+
+/** Join the shortest queue of "choices" random workers
+ *
+ * With two choices, this is "Power of Two Choices".  See
+ * https://www.eecs.harvard.edu/~michaelm/postscripts/mythesis.pdf
+ */
+static fr_network_worker_t *network_worker_jsq(fr_network_t *nr, unsigned int choices)
+{
+	uint8_t			order[MAX_WORKERS];
+	unsigned int		i, num = nr->num_workers;
+	fr_network_worker_t	*found = NULL;
+
+	if (choices > num) choices = num;
+
+	for (i = 0; i < num; i++) order[i] = i;
+
+	/*
+	 *	Pick "choices" different workers at random, and
+	 *	choose the least loaded one.
+	 */
+	for (i = 0; i < choices; i++) {
+		unsigned int		j = i + (fr_rand() % (num - i));
+		uint8_t			tmp = order[i];
+		fr_network_worker_t	*worker;
+
+		order[i] = order[j];
+		order[j] = tmp;
+
+		worker = nr->workers[order[i]];
+		if (worker->blocked) continue;
+
+		if (!found || (network_worker_cmp(worker, found) < 0)) found = worker;
+	}
+
+	return found;
+}
+
+/** Map a hash to a worker
+ *
+ * Uses "jump" consistent hashing, so that only a small number of
+ * sources move to a different worker when the number of workers
+ * changes.  See https://arxiv.org/abs/1406.2294
+ */
+static fr_network_worker_t *network_worker_hash(fr_network_t *nr, uint32_t hash)
+{
+	uint64_t	key = hash;
+	int64_t		b = -1, j = 0;
+
+	while (j < nr->num_workers) {
+		b = j;
+		key = (key * 2862933555777941757ULL) + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+
+	return nr->workers[b];
+}
+
+/** Choose a worker for a packet, using the configured method
+ *
+ * @return
+ *	- NULL if all of the workers are blocked.
+ *	- the worker to send the packet to.
+ */
+static fr_network_worker_t *network_worker_select(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_worker_t *worker;
+
+	switch (nr->config.worker_select) {
+	case FR_NETWORK_WORKER_SELECT_CLIENT_HASH:
+		if (cd->listen->app_io->hash) {
+			worker = network_worker_hash(nr, cd->listen->app_io->hash(cd->listen, cd->packet_ctx));
+			if (!worker->blocked) return worker;
+		}
+		FALL_THROUGH;
+
+	case FR_NETWORK_WORKER_SELECT_JSQ:
+		worker = network_worker_jsq(nr, nr->config.worker_choices);
+		if (worker) return worker;
 
 		/*
-		 *	Choose a worker based on minimizing the amount
-		 *	of future work it's being asked to do.
-		 *
-		 *	If both workers have the same number of
-		 *	outstanding requests, then choose the worker
-		 *	which has used the least total CPU time.
+		 *	All of the workers we looked at are
+		 *	blocked.  Check all of them.
 		 */
-		cmp = (OUTSTANDING(nr->workers[one]) - OUTSTANDING(nr->workers[two]));
-		if (cmp < 0) {
-			worker = nr->workers[one];
+		FALL_THROUGH;
 
-		} else if (cmp > 0) {
-			worker = nr->workers[two];
+	case FR_NETWORK_WORKER_SELECT_LEAST_LOADED:
+		break;
+	}
 
-		} else if (fr_time_delta_lt(nr->workers[one]->cpu_time, nr->workers[two]->cpu_time)) {
-			worker = nr->workers[one];
+	return network_worker_least_loaded(nr);
+}
 
-		} else {
-			worker = nr->workers[two];
+/** Move one request from a busy worker to an idle one
+ *
+ * @return
+ *	- false if the busy worker has already read all of its requests.
+ *	- true if a request was moved.
+ */
+static bool network_worker_steal(fr_network_t *nr, fr_network_worker_t *busy, fr_network_worker_t *idle)
+{
+	fr_channel_data_t	*cd;
+	fr_time_delta_t		predicted;
+
+	cd = fr_channel_recall_request(busy->channel);
+	if (!cd) return false;
+
+	fr_assert(busy->stats.in > busy->stats.out);
+	busy->stats.in--;
+
+	predicted = cd->request.predicted;
+	network_backlog_sub(busy, predicted);
+
+	/*
+	 *	The channel requires that timestamps only increase.
+	 */
+	cd->m.when = fr_time();
+	cd->request.stolen = true;
+
+	if (fr_channel_send_request(idle->channel, cd) == 0) {
+		idle->stats.in++;
+		idle->backlog = fr_time_delta_add(idle->backlog, predicted);
+		return true;
+	}
+
+	/*
+	 *	We just made room in the busy worker's queue, so
+	 *	giving the request back should always succeed.
+	 */
+	cd->request.stolen = false;
+	if (fr_channel_send_request(busy->channel, cd) < 0) {
+		RATE_LIMIT_GLOBAL(PERROR, "Failed returning packet to worker - dropping packet");
+		busy->stats.dropped++;
+		fr_message_done(&cd->m);
+		return false;
+	}
+
+	busy->stats.in++;
+	busy->backlog = fr_time_delta_add(busy->backlog, predicted);
+	return false;
+}
+
+/** Move requests from the busiest worker to idle ones
+ *
+ * Requests which are still in a worker's channel queue haven't
+ * been started.  When other workers have nothing to do, we take
+ * those requests back, and share them out between the busy worker
+ * and the idle ones.  Requests which the busy worker has already
+ * read stay with it.
+ *
+ * @param nr	the network
+ */
+static void network_work_steal(fr_network_t *nr)
+{
+	int			i;
+	unsigned int		j, num_idle = 0;
+	uint64_t		share;
+	fr_network_worker_t	*busy = NULL;
+	fr_network_worker_t	*idle[MAX_WORKERS];
+
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_network_worker_t *worker = nr->workers[i];
+
+		/*
+		 *	A worker may have requests from other
+		 *	networks, so ask it if it's really idle.
+		 */
+		if (!OUTSTANDING(worker)) {
+			if (!worker->blocked && !fr_worker_num_runnable(worker->worker)) idle[num_idle++] = worker;
+			continue;
 		}
-	} else {
-		int i;
-		uint64_t min_outstanding = UINT64_MAX;
-		fr_network_worker_t *found = NULL;
 
 		/*
-		 *	Some workers are blocked.  Pick the worker
-		 *	with the least amount of future work to do.
+		 *	Workers in this thread are called directly,
+		 *	so they never have anything queued.
 		 */
-		for (i = 0; i < nr->num_workers; i++) {
-			uint64_t outstanding;
+		if (fr_channel_same_thread(worker->channel)) continue;
 
-			worker = nr->workers[i];
-			if (worker->blocked) continue;
+		if (!busy || (OUTSTANDING(worker) > OUTSTANDING(busy))) busy = worker;
+	}
 
-			outstanding = OUTSTANDING(worker);
-			if ((outstanding < min_outstanding) || !found) {
-				found = worker;
-				min_outstanding = outstanding;
+	/*
+	 *	The busy worker is probably running one of its
+	 *	requests, so it needs to have at least one more before
+	 *	there's anything to take.
+	 */
+	if (!num_idle || !busy || (OUTSTANDING(busy) < 2)) return;
 
-			} else if (outstanding == min_outstanding) {
-				/*
-				 *	Queue lengths are the same.
-				 *	Choose this worker if it's
-				 *	less busy than the previous one we found.
-				 */
-				if (fr_time_delta_lt(worker->cpu_time, found->cpu_time)) {
-					found = worker;
-				}
-			}
+	share = OUTSTANDING(busy) / (num_idle + 1);
+	if (!share) share = 1;
+
+	for (j = 0; j < num_idle; j++) {
+		uint64_t num;
+
+		for (num = 0; num < share; num++) {
+			if (!network_worker_steal(nr, busy, idle[j])) return;
 		}
+	}
+}
 
-		if (!found) {
+/** Send a message on the "best" channel.
+ *
+ * @param nr the network
+ * @param s the socket the message was read from.
+ * @param cd the message we've received
+ */
+static int fr_network_send_request(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	fr_network_worker_t *worker;
+	fr_time_delta_t predicted;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	cd->request.stolen = false;
+
+retry:
+	if (nr->num_workers == 1) {
+		worker = nr->workers[0];
+		if (worker->blocked) {
+			RATE_LIMIT_GLOBAL(ERROR, "Failed sending packet to worker - "
+					  "In single-threaded mode and worker is blocked");
+		drop:
+			worker->stats.dropped++;
+			return -1;
+		}
+
+	/*
+	 *	Run-to-completion.  The worker in this thread gets
+	 *	the packet, and processes it without any hand-off
+	 *	through the channel queues.  Other workers are only
+	 *	used when the local one has too much to do.
+	 */
+	} else if (nr->local && !nr->local->blocked &&
+		   (!nr->config.overflow_threshold ||
+		    (OUTSTANDING(nr->local) < nr->config.overflow_threshold))) {
+		worker = nr->local;
+
+	} else {
+		worker = network_worker_select(nr, cd);
+		if (!worker) {
 			 RATE_LIMIT_GLOBAL(PERROR, "Failed sending packet to worker - Couldn't find active worker, "
 			 		   "%u/%u workers are blocked", nr->num_blocked, nr->num_workers);
 			 return -1;
 		}
-
-		worker = found;
 	}
 
 	(void) talloc_get_type_abort(worker, fr_network_worker_t);
@@ -696,6 +1073,21 @@ retry:
 		goto drop;
 	}
 
+	/*
+	 *	We're projecting that the worker will use more CPU
+	 *	time to process this request.  The CPU time will be
+	 *	updated with a more accurate number when we receive a
+	 *	reply from this channel.
+	 *
+	 *	The prediction is based on the virtual server the
+	 *	packet is for, as some virtual servers do much more
+	 *	work than others.  It's sent with the packet, and
+	 *	returned with the reply, so that the same amount is
+	 *	taken off of the backlog.
+	 */
+	predicted = network_cost_predict(s, worker);
+	cd->request.predicted = predicted;
+
 	/*
 	 *	Send the message to the channel.  If we fail, drop the
 	 *	packet.  The only reason for failure is that the
@@ -719,14 +1111,8 @@ retry:
 	}
 
 	worker->stats.in++;
-
-	/*
-	 *	We're projecting that the worker will use more CPU
-	 *	time to process this request.  The CPU time will be
-	 *	updated with a more accurate number when we receive a
-	 *	reply from this channel.
-	 */
-	worker->cpu_time = fr_time_delta_add(worker->cpu_time, worker->predicted);
+	worker->cpu_time = fr_time_delta_add(worker->cpu_time, predicted);
+	worker->backlog = fr_time_delta_add(worker->backlog, predicted);
 
 	return 0;
 }
@@ -769,7 +1155,7 @@ int fr_network_listen_send_packet(fr_network_t *nr, fr_listen_t *parent, fr_list
 	memcpy(cd->m.data, buffer, buflen);
 	cd->m.when = fr_time();
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	if (fr_network_send_request(nr, s, cd) < 0) {
 		talloc_free(cd->packet_ctx);
 		fr_message_done(&cd->m);
 		nr->stats.dropped++;
@@ -849,6 +1235,7 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
 {
 	int			num_messages = 0;
+	unsigned int		num_batched = 0;
 	fr_network_socket_t	*s = ctx;
 	fr_network_t		*nr = s->nr;
 	ssize_t			data_size;
@@ -898,6 +1285,14 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover);
 	if (data_size == 0) {
+		/*
+		 *	The read routine discarded a packet, but
+		 *	there may be more packets in the batch.
+		 *	Re-use the same buffer for the next one.
+		 */
+		if (s->listen->app_io->read_batch &&
+		    s->listen->app_io->read_batch(s->listen, false)) goto next_message;
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -985,7 +1380,7 @@ next_message:
 		cd->priority = priority;
 	}
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	if (fr_network_send_request(nr, s, cd) < 0) {
 	discard:
 		talloc_free(cd->packet_ctx); /* not sure what else to do here */
 		fr_message_done(&cd->m);
@@ -1012,6 +1407,29 @@ next_message:
 		num_messages++;
 		goto next_message;
 	}
+
+	/*
+	 *	The transport may have read a batch of packets with
+	 *	one system call.  The socket won't become readable
+	 *	again for packets which have already been taken from
+	 *	the kernel, so we MUST process all of them now.
+	 *
+	 *	We only ask the transport to read a new batch if we
+	 *	haven't already spent too long on this socket.
+	 */
+	if (s->listen->app_io->read_batch &&
+	    s->listen->app_io->read_batch(s->listen, (num_batched < MAX_READ_BATCHED))) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		if (!cd) {
+			ERROR("Failed allocating message size %zd! - Closing socket",
+			      s->listen->default_message_size);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+
+		num_batched++;
+		goto next_message;
+	}
 }
 
 int fr_network_sendto_worker(fr_network_t *nr, fr_listen_t *li, void *packet_ctx, uint8_t const *data, size_t data_len, fr_time_t recv_time)
@@ -1035,7 +1453,7 @@ int fr_network_sendto_worker(fr_network_t *nr, fr_listen_t *li, void *packet_ctx
 
 	memcpy(cd->m.data, data, data_len);
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	if (fr_network_send_request(nr, s, cd) < 0) {
 		talloc_free(packet_ctx);
 		fr_message_done(&cd->m);
 		nr->stats.dropped++;
@@ -1131,6 +1549,19 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
+	/*
+	 *	Write out the packets which the transport queued,
+	 *	but couldn't write when it was last flushed.
+	 */
+	if (s->unflushed) {
+		if (li->app_io->flush(li) < 0) {
+			if (errno == EWOULDBLOCK) return;
+
+			PERROR("Failed flushing socket %s", li->name);
+		}
+		s->unflushed = false;
+	}
+
 	/*
 	 *	Start with the currently pending message, and then
 	 *	work through the priority heap.
@@ -1229,6 +1660,14 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		nr->stats.out++;
 		s->stats.out++;
 
+		/*
+		 *	The transport may have queued the packet.
+		 *	It will be flushed in fr_network_post_event().
+		 */
+		if (li->app_io->flush && !fr_dlist_entry_in_list(&s->flush_entry)) {
+			fr_dlist_insert_tail(&nr->flush, s);
+		}
+
 		/*
 		 *	Grab the net entry.
 		 */
@@ -1257,6 +1696,8 @@ static int _network_socket_free(fr_network_socket_t *s)
 	fr_rb_delete(nr->sockets, s);
 	fr_rb_delete(nr->sockets_by_num, s);
 
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
+
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
 	if (s->listen->app_io->close) {
@@ -1341,6 +1782,7 @@ static int fr_network_listen_add_self(fr_network_t *nr, fr_listen_t *listen)
 
 	s->nr = nr;
 	s->listen = listen;
+	s->cost = network_cost_find(nr, listen->server_cs);
 	s->number = nr->num_sockets++;
 
 	MEM(s->waiting = fr_heap_alloc(s, waiting_cmp, fr_channel_data_t, channel.heap_id, 0));
@@ -1507,6 +1949,12 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	fr_channel_requestor_uctx_add(w->channel, w);
 	fr_channel_set_recv_reply(w->channel, nr, fr_network_recv_reply);
 
+	/*
+	 *	The worker shares our event loop, so prefer it
+	 *	over the other workers.
+	 */
+	if (fr_channel_same_thread(w->channel)) nr->local = w;
+
 	/*
 	 *	FIXME: This creates a race in the network loop
 	 *	exit condition, because it can theoretically
@@ -1592,6 +2040,7 @@ static int fr_network_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wak
 static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_channel_data_t *cd;
+	fr_network_socket_t *s;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
 
 	/*
@@ -1600,7 +2049,6 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 	 */
 	while ((cd = fr_heap_pop(&nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1618,9 +2066,16 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 			continue;
 		}
 
+		/*
+		 *	Localized replies were written by the network
+		 *	side itself, e.g. for duplicate packets.  They
+		 *	didn't come from a worker, and have no channel.
+		 */
 		if (cd->m.status != FR_MESSAGE_LOCALIZED) {
 			fr_assert(s->outstanding > 0);
 			s->outstanding--;
+
+			network_cost_reply(nr, s, cd);
 		}
 
 		/*
@@ -1653,11 +2108,55 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		 *	waiting for IO write to become ready.
 		 */
 		if (!s->pending) {
-			fr_assert(!s->blocked);
 			(void) fr_heap_insert(&s->waiting, cd);
+
+			/*
+			 *	The socket is waiting to flush, the
+			 *	reply will be written when it's writable.
+			 */
+			if (s->unflushed) continue;
+
+			fr_assert(!s->blocked);
 			fr_network_write(nr->el, s->listen->fd, 0, s);
 		}
 	}
+
+	/*
+	 *	All of the replies have been passed to the transports.
+	 *	Tell the ones which queued packets to write them out,
+	 *	so that datagram transports can send many replies with
+	 *	one system call.
+	 */
+	while ((s = fr_dlist_pop_head(&nr->flush)) != NULL) {
+		if (s->dead) continue;
+
+		if (s->listen->app_io->flush(s->listen) == 0) continue;
+
+		if (errno != EWOULDBLOCK) {
+			PERROR("Failed flushing socket %s", s->listen->name);
+			continue;
+		}
+
+		/*
+		 *	The socket is full.  Try again when it's
+		 *	writable.
+		 */
+		s->unflushed = true;
+		if (s->blocked) continue;
+
+		if (fr_event_filter_update(nr->el, s->listen->fd, FR_EVENT_FILTER_IO, resume_write) < 0) {
+			PERROR("Failed adding write callback to event loop");
+			fr_network_socket_dead(nr, s);
+			continue;
+		}
+		s->blocked = true;
+	}
+
+	/*
+	 *	The replies may have left some workers with nothing
+	 *	to do.
+	 */
+	if (nr->config.work_stealing && (nr->num_workers > 1)) network_work_steal(nr);
 }
 
 /** Stop a network thread in an orderly way
@@ -1882,6 +2381,7 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 
 	nr->thread_id = pthread_self();
 	nr->el = el;
+	fr_dlist_init(&nr->flush, fr_network_socket_t, flush_entry);
 	nr->log = logger;
 	nr->lvl = lvl;
 
@@ -1890,6 +2390,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
 	if (config) nr->config = *config;
+	if (!nr->config.worker_choices) nr->config.worker_choices = 2;
+	if (!nr->config.cost_percentile || (nr->config.cost_percentile > 100)) nr->config.cost_percentile = 90;
 
 	nr->aq_control = fr_atomic_queue_alloc(nr, 1024);
 	if (!nr->aq_control) {
@@ -1959,6 +2461,12 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	nr->costs = fr_rb_inline_talloc_alloc(nr, fr_network_cost_t, node, cost_cmp, NULL);
+	if (!nr->costs) {
+		fr_strerror_const_push("Failed creating tree for processing costs");
+		goto fail2;
+	}
+
 	nr->replies = fr_heap_alloc(nr, reply_cmp, fr_channel_data_t, channel.heap_id, 0);
 	if (!nr->replies) {
 		fr_strerror_const_push("Failed creating heap for replies");
@@ -2023,12 +2531,32 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
 {
 	fr_network_t const *nr = ctx;
+	uint64_t signals = 0, suppressed = 0;
+	int i;
+
+	/*
+	 *	Signals to workers which were skipped, because the
+	 *	worker was already polling for new packets.
+	 */
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_channel_stats_t const *stats;
+
+		if (!nr->workers[i]) continue;
+
+		stats = fr_channel_requestor_stats(nr->workers[i]->channel);
+		signals += stats->signals;
+		suppressed += stats->suppressed;
+	}
 
 	fprintf(fp, "count.in\t%" PRIu64 "\n", nr->stats.in);
 	fprintf(fp, "count.out\t%" PRIu64 "\n", nr->stats.out);
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", nr->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
 	fprintf(fp, "count.sockets\t%u\n", fr_rb_num_elements(nr->sockets));
+	fprintf(fp, "count.signals\t%" PRIu64 "\n", signals);
+	fprintf(fp, "count.signals_suppressed\t%" PRIu64 "\n", suppressed);
+	fprintf(fp, "ratio.signals_suppressed\t%.3f\n",
+		(signals + suppressed) ? ((double) suppressed / (signals + suppressed)) : 0.0);
 
 	return 0;
 }
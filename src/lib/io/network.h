@@ -42,8 +42,27 @@ typedef struct fr_network_s fr_network_t;
 extern "C" {
 #endif
 
+/** How a network chooses the worker for a new packet
+ *
+ */
+typedef enum {
+	FR_NETWORK_WORKER_SELECT_JSQ = 0,		//!< Join the shortest queue, by predicted processing
+							///< time, of "worker_choices" random workers.
+	FR_NETWORK_WORKER_SELECT_LEAST_LOADED,		//!< Fewest runnable requests of all of the workers.
+	FR_NETWORK_WORKER_SELECT_CLIENT_HASH		//!< Consistent hash of the packet source.
+} fr_network_worker_select_t;
+
 typedef struct {
 	uint32_t	max_outstanding;
+	uint32_t	overflow_threshold;	//!< outstanding packets in a worker in the same thread
+						///< before we send packets to other workers.  0 is no limit.
+
+	fr_network_worker_select_t worker_select;	//!< how we choose a worker.
+	uint32_t	worker_choices;		//!< number of workers to compare for FR_NETWORK_WORKER_SELECT_JSQ.
+	uint32_t	cost_percentile;	//!< percentile of the processing times used to predict
+						///< the cost of a packet.
+	bool		work_stealing;		//!< move packets which haven't been started from busy
+						///< workers to idle ones.
 } fr_network_config_t;
 
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
@@ -75,48 +75,50 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
 
-/** Scheduler specific information for worker threads
+/** Scheduler specific information for network threads
  *
- * Wraps a fr_worker_t, tracking additional information that
+ * Wraps a fr_network_t, tracking additional information that
  * the scheduler uses.
  */
 typedef struct {
 	TALLOC_CTX	*ctx;			//!< our allocation ctx
-	fr_event_list_t	*el;			//!< our event list
-	pthread_t	pthread_id;		//!< the thread of this worker
+	pthread_t	pthread_id;		//!< the thread of this network
 
 	unsigned int	id;			//!< a unique ID
-	int		uses;			//!< how many network threads are using it
-	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
 
-	fr_dlist_t	entry;			//!< our entry into the linked list of workers
+	fr_dlist_t	entry;			//!< our entry into the linked list of networks
 
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
-	fr_worker_t	*worker;		//!< the worker data structure
-} fr_schedule_worker_t;
+	fr_network_t	*nr;			//!< the receive data structure
 
-/** Scheduler specific information for network threads
+	fr_event_timer_t const *ev;		//!< timer for stats_interval
+} fr_schedule_network_t;
+
+/** Scheduler specific information for worker threads
  *
- * Wraps a fr_network_t, tracking additional information that
+ * Wraps a fr_worker_t, tracking additional information that
  * the scheduler uses.
  */
 typedef struct {
 	TALLOC_CTX	*ctx;			//!< our allocation ctx
-	pthread_t	pthread_id;		//!< the thread of this network
+	fr_event_list_t	*el;			//!< our event list
+	pthread_t	pthread_id;		//!< the thread of this worker
 
 	unsigned int	id;			//!< a unique ID
+	int		uses;			//!< how many network threads are using it
+	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
 
-	fr_dlist_t	entry;			//!< our entry into the linked list of networks
+	fr_dlist_t	entry;			//!< our entry into the linked list of workers
 
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
-	fr_network_t	*nr;			//!< the receive data structure
+	fr_worker_t	*worker;		//!< the worker data structure
 
-	fr_event_timer_t const *ev;		//!< timer for stats_interval
-} fr_schedule_network_t;
+	fr_schedule_network_t *sn;		//!< network in the same thread, in run-to-completion mode
+} fr_schedule_worker_t;
 
 
 /**
@@ -159,6 +161,38 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+/** Call the thread instantiation callback for a worker
+ *
+ * @param[in] sw		the fr_schedule_worker_t
+ * @param[in] worker_name	for logging.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_schedule_worker_instantiate(fr_schedule_worker_t *sw, char const *worker_name)
+{
+	fr_schedule_t	*sc = sw->sc;
+	CONF_SECTION	*cs;
+	char		section_name[32];
+
+	/*
+	 *	@todo make this a registry
+	 */
+	if (!sc->worker_thread_instantiate) return 0;
+
+	snprintf(section_name, sizeof(section_name), "%u", sw->id);
+
+	cs = cf_section_find(sc->cs, "worker", section_name);
+	if (!cs) cs = cf_section_find(sc->cs, "worker", NULL);
+
+	if (sc->worker_thread_instantiate(sw->ctx, sw->el, cs) < 0) {
+		PERROR("%s - Worker thread instantiation failed", worker_name);
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -198,23 +232,7 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
-	/*
-	 *	@todo make this a registry
-	 */
-	if (sc->worker_thread_instantiate) {
-		CONF_SECTION	*cs;
-		char		section_name[32];
-
-		snprintf(section_name, sizeof(section_name), "%u", sw->id);
-
-		cs = cf_section_find(sc->cs, "worker", section_name);
-		if (!cs) cs = cf_section_find(sc->cs, "worker", NULL);
-
-		if (sc->worker_thread_instantiate(sw->ctx, sw->el, cs) < 0) {
-			PERROR("%s - Worker thread instantiation failed", worker_name);
-			goto fail;
-		}
-	}
+	if (fr_schedule_worker_instantiate(sw, worker_name) < 0) goto fail;
 
 	sw->status = FR_CHILD_RUNNING;
 
@@ -355,6 +373,129 @@ fail:
 	return NULL;
 }
 
+/** Initialize and run a combined network and worker thread
+ *
+ * Used in run-to-completion mode.  The network and the worker share
+ * one event list, so packets read by the network are passed directly
+ * to the worker, and run to completion in the same pass through the
+ * event loop.  The channels to workers in other threads are only
+ * used when the local worker is busy.
+ *
+ * @param[in] arg the fr_schedule_worker_t
+ * @return NULL
+ */
+static void *fr_schedule_rtc_thread(void *arg)
+{
+	TALLOC_CTX			*ctx;
+	fr_schedule_worker_t		*sw = talloc_get_type_abort(arg, fr_schedule_worker_t);
+	fr_schedule_network_t		*sn = sw->sn;
+	fr_schedule_t			*sc = sw->sc;
+	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
+	char				worker_name[32];
+	char				network_name[32];
+
+	worker_id = sw->id;		/* Store the current worker ID */
+
+	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
+	snprintf(network_name, sizeof(network_name), "Network %d", sn->id);
+
+	sw->ctx = sn->ctx = ctx = talloc_init("%s", worker_name);
+	if (!ctx) {
+		ERROR("%s - Failed allocating memory", worker_name);
+		goto fail;
+	}
+
+	INFO("%s - Starting in run-to-completion mode", worker_name);
+
+	sw->el = fr_event_list_alloc(ctx, NULL, NULL);
+	if (!sw->el) {
+		PERROR("%s - Failed creating event list", worker_name);
+		goto fail;
+	}
+
+	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, &sc->config->worker);
+	if (!sw->worker) {
+		PERROR("%s - Failed creating worker", worker_name);
+		goto fail;
+	}
+
+	if (fr_schedule_worker_instantiate(sw, worker_name) < 0) goto fail;
+
+	/*
+	 *	Run requests from the post event, as in
+	 *	single-threaded mode.  It's inserted before the
+	 *	network is created, so that the network writes the
+	 *	replies in the same pass through the event loop.
+	 */
+	if (fr_event_post_insert(sw->el, fr_worker_post_event, sw->worker) < 0) {
+		PERROR("%s - Failed inserting post-processing event", worker_name);
+		goto fail;
+	}
+
+	sn->nr = fr_network_create(ctx, sw->el, network_name, sc->log, sc->lvl, &sc->config->network);
+	if (!sn->nr) {
+		PERROR("%s - Failed creating network", network_name);
+		goto fail;
+	}
+
+	/*
+	 *	Our own worker is added first.  The scheduler adds
+	 *	the workers from the other threads once they've all
+	 *	started.
+	 */
+	(void) fr_network_worker_add(sn->nr, sw->worker);
+
+	sw->status = sn->status = FR_CHILD_RUNNING;
+
+	DEBUG3("%s - Started", worker_name);
+
+	/*
+	 *	Tell the originator that the thread has started.
+	 */
+	sem_post(&sc->worker_sem);
+
+	if (fr_time_delta_ispos(sc->config->stats_interval)) {
+		(void) fr_event_timer_in(sn, sw->el, &sn->ev, sc->config->stats_interval, stats_timer, sn);
+	}
+
+	/*
+	 *	The worker exits once all of the networks have closed
+	 *	their channels to it.  Our network may still be
+	 *	waiting for workers in other threads to acknowledge
+	 *	its own close, so keep servicing the event list until
+	 *	they have.
+	 */
+	fr_worker(sw->worker);
+	fr_network(sn->nr);
+
+	status = FR_CHILD_EXITED;
+
+fail:
+	sw->status = sn->status = status;
+
+	if (sw->worker) {
+		fr_worker_destroy(sw->worker);
+		sw->worker = NULL;
+	}
+
+	INFO("%s - Exiting", worker_name);
+
+	if (sc->worker_thread_detach) sc->worker_thread_detach(NULL);	/* Fixme once we figure out what uctx should be */
+
+	if (sw->el) fr_event_loop_exit(sw->el, 1);
+
+	/*
+	 *	Tell the scheduler we're done.  If we failed to
+	 *	start, it's only waiting on the worker semaphore.
+	 */
+	if (status == FR_CHILD_EXITED) sem_post(&sc->network_sem);
+	sem_post(&sc->worker_sem);
+
+	talloc_free(ctx);
+
+	return NULL;
+}
+
 /** Creates a new thread using our standard set of options
  *
  * New threads are:
@@ -536,6 +677,86 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
+	/*
+	 *	Run-to-completion mode.  Each thread runs both a
+	 *	network and a worker, so there are as many networks
+	 *	as there are workers.
+	 */
+	if (sc->config->run_to_completion) {
+		sc->config->max_networks = sc->config->max_workers;
+
+		for (i = 0; i < sc->config->max_workers; i++) {
+			DEBUG3("Creating %u/%u run-to-completion threads", i + 1, sc->config->max_workers);
+
+			sw = talloc_zero(sc, fr_schedule_worker_t);
+			sn = talloc_zero(sc, fr_schedule_network_t);
+			if (!sw || !sn) {
+				ERROR("Worker %u - Failed allocating memory", i);
+				break;
+			}
+
+			sw->id = sn->id = i;
+			sw->sc = sn->sc = sc;
+			sw->status = sn->status = FR_CHILD_INITIALIZING;
+			sw->sn = sn;
+
+			if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_rtc_thread, sw) < 0) {
+				PERROR("Failed creating worker %u", i);
+				break;
+			}
+
+			/*
+			 *	The thread is joined through the worker.
+			 */
+			sn->pthread_id = sw->pthread_id;
+			fr_dlist_insert_head(&sc->workers, sw);
+			fr_dlist_insert_head(&sc->networks, sn);
+		}
+
+		for (i = 0; i < (unsigned int)fr_dlist_num_elements(&sc->workers); i++) {
+			DEBUG3("Waiting for semaphore from worker %u/%u",
+			       i + 1, (unsigned int)fr_dlist_num_elements(&sc->workers));
+			SEM_WAIT_INTR(&sc->worker_sem);
+		}
+
+		for (sw = fr_dlist_head(&sc->workers);
+		     sw != NULL;
+		     sw = next_sw) {
+			next_sw = fr_dlist_next(&sc->workers, sw);
+
+			if (sw->status != FR_CHILD_RUNNING) {
+				fr_dlist_remove(&sc->networks, sw->sn);
+				fr_dlist_remove(&sc->workers, sw);
+				continue;
+			}
+		}
+
+		if ((unsigned int)fr_dlist_num_elements(&sc->workers) < sc->config->max_workers) {
+			fr_schedule_destroy(&sc);
+			return NULL;
+		}
+
+		/*
+		 *	Each network already has its own worker.  Add
+		 *	the workers from the other threads, so that
+		 *	packets can be sent to them when the local
+		 *	worker is busy.
+		 */
+		for (sn = fr_dlist_head(&sc->networks);
+		     sn != NULL;
+		     sn = fr_dlist_next(&sc->networks, sn)) {
+			for (sw = fr_dlist_head(&sc->workers);
+			     sw != NULL;
+			     sw = fr_dlist_next(&sc->workers, sw)) {
+				if (sw->sn == sn) continue;
+
+				(void) fr_network_worker_add(sn->nr, sw->worker);
+			}
+		}
+
+		goto commands;
+	}
+
 	/*
 	 *	Create the network threads first.
 	 */
@@ -655,6 +876,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
+commands:
 	for (sw = fr_dlist_head(&sc->workers), i = 0;
 	     sw != NULL;
 	     sw = next_sw, i++) {
@@ -683,8 +905,10 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
-	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
-		     sc->config->max_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
+	if (sc) INFO("Scheduler created successfully with %u networks and %u workers%s",
+		     (unsigned int)fr_dlist_num_elements(&sc->networks),
+		     (unsigned int)fr_dlist_num_elements(&sc->workers),
+		     sc->config->run_to_completion ? " in run-to-completion mode" : "");
 
 	return sc;
 }
@@ -758,7 +982,12 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 		 *	This also ensures that the child threads have
 		 *	exited before the main thread cleans up the
 		 *	module instances.
+		 *
+		 *	In run-to-completion mode, the thread is
+		 *	shared with a worker, and is joined below.
 		 */
+		if (sc->config->run_to_completion) continue;
+
 		if ((ret = pthread_join(sn->pthread_id, NULL)) != 0) {
 			ERROR("Failed joining network %i: %s", sn->id, fr_syserror(ret));
 		} else {
@@ -844,6 +1073,62 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	return nr;
 }
 
+/** Return the number of network threads
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads, which is 1 in single-threaded mode.
+ */
+unsigned int fr_schedule_num_networks(fr_schedule_t *sc)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
+/** Add a fr_listen_t to a specific network thread
+ *
+ * Used by listeners which open one socket per network thread, so that
+ * each thread reads from its own socket.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] id of the network thread, modulo the number of network threads.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id)
+{
+	fr_network_t *nr;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn;
+
+		id %= fr_dlist_num_elements(&sc->networks);
+
+		for (sn = fr_dlist_head(&sc->networks);
+		     sn != NULL;
+		     sn = fr_dlist_next(&sc->networks, sn)) {
+			if (sn->id == id) break;
+		}
+		if (!sn) {
+			fr_strerror_printf("No network thread with id %u", id);
+			return NULL;
+		}
+		nr = sn->nr;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
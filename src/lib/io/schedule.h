@@ -64,6 +64,10 @@ typedef struct {
 	uint32_t	max_networks;		//!< number of network threads
 	uint32_t	max_workers;		//!< number of network threads
 
+	bool		run_to_completion;	//!< each worker thread also runs its own network,
+						///< and packets are only passed to other
+						///< threads when the local worker is busy.
+
 	fr_worker_config_t worker;		//!< configuration for each worker
 	fr_network_config_t network;		//!< configuration for each network;
 
@@ -80,7 +84,9 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 /* schedulers are async, so there's no fr_schedule_run() */
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
+unsigned int		fr_schedule_num_networks(fr_schedule_t *sc) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
@@ -61,6 +61,7 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/minmax_heap.h>
+#include <freeradius-devel/util/regex.h>
 
 #include <stdalign.h>
 
@@ -109,6 +110,7 @@ struct fr_worker_s {
 	int			num_channels;	//!< actual number of channels
 
 	fr_heap_t      		*runnable;	//!< current runnable requests which we've spent time processing
+	atomic_uint32_t		num_runnable;	//!< size of the runnable heap, for the network threads
 	fr_minmax_heap_t	*time_order;	//!< time ordered heap of requests
 	fr_rb_tree_t		*dedup;		//!< de-dup tree
 
@@ -119,6 +121,7 @@ struct fr_worker_s {
 	fr_time_elapsed_t	wall_clock;	//!< histogram of wall clock time per request
 
 	uint64_t    		num_naks;	//!< number of messages which were nak'd
+	uint64_t		num_stolen;	//!< number of requests taken from busy workers
 	uint64_t    		num_active;	//!< number of active requests
 
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
@@ -132,6 +135,12 @@ struct fr_worker_s {
 	fr_event_timer_t const	*ev_cleanup;	//!< timer for max_request_time
 
 	fr_worker_channel_t	*channel;	//!< list of channels
+
+	request_arena_stats_t const *arena;	//!< stats for the arenas of this thread's requests
+
+#ifdef HAVE_REGEX
+	fr_regex_cache_stats_t const *regex_cache;	//!< stats for this thread's runtime regex cache
+#endif
 };
 
 typedef struct {
@@ -196,6 +205,15 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool do_n
 static void worker_max_request_time(UNUSED fr_event_list_t *el, UNUSED fr_time_t when, void *uctx);
 static void worker_max_request_timer(fr_worker_t *worker);
 
+/** Tell the network threads how many requests we have waiting to run
+ *
+ * This is only a hint, so it doesn't need to be exact.
+ */
+static inline CC_HINT(always_inline) void worker_num_runnable_update(fr_worker_t *worker)
+{
+	atomic_store_explicit(&worker->num_runnable, fr_heap_num_elements(worker->runnable), memory_order_relaxed);
+}
+
 /** Callback which handles a message being received on the worker side.
  *
  * @param[in] ctx the worker
@@ -207,9 +225,11 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	fr_worker_t *worker = ctx;
 
 	worker->stats.in++;
+	if (cd->request.stolen) worker->num_stolen++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
 	worker_request_bootstrap(worker, cd, fr_time());
+	worker_num_runnable_update(worker);
 }
 
 static void worker_requests_cancel(fr_worker_channel_t *ch)
@@ -466,8 +486,9 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	 */
 	reply->m.when = now;
 	reply->reply.cpu_time = worker->tracking.running_total;
-	reply->reply.processing_time = fr_time_delta_from_sec(10); /* @todo - set to something better? */
+	reply->reply.processing_time = fr_time_delta_wrap(0); /* not processed, so don't skew the network's predictions */
 	reply->reply.request_time = cd->request.recv_time;
+	reply->reply.predicted = cd->request.predicted;
 
 	reply->listen = cd->listen;
 	reply->packet_ctx = cd->packet_ctx;
@@ -701,6 +722,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = request->async->tracking.running_total;
 	reply->reply.request_time = request->async->recv_time;
+	reply->reply.predicted = request->async->predicted;
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
@@ -802,7 +824,11 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 
 	if (fr_minmax_heap_num_elements(worker->time_order) >= (uint32_t) worker->config.max_requests) goto nak;
 
-	ctx = request = request_alloc_external(NULL, NULL);
+	/*
+	 *	The request's arena is sized for the virtual
+	 *	server it's going to.
+	 */
+	ctx = request = request_alloc_external(NULL, &(request_init_args_t){ .server_cs = cd->listen->server_cs });
 	if (!request) goto nak;
 
 	worker_request_init(worker, request, now);
@@ -827,6 +853,7 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	request->async->channel = cd->channel.ch;
 
 	request->async->recv_time = cd->request.recv_time;
+	request->async->predicted = cd->request.predicted;
 
 	request->async->listen = cd->listen;
 	request->async->packet_ctx = cd->packet_ctx;
@@ -1322,6 +1349,8 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 
 		now = fr_time();
 	}
+
+	worker_num_runnable_update(worker);
 }
 
 /** Create a worker
@@ -1380,6 +1409,10 @@ nomem:
 
 	worker->thread_id = pthread_self();
 	worker->el = el;
+	worker->arena = request_arena_stats();
+#ifdef HAVE_REGEX
+	worker->regex_cache = regex_cache_stats();
+#endif
 	worker->log = logger;
 	worker->lvl = lvl;
 
@@ -1465,6 +1498,33 @@ nomem:
 }
 
 
+/** Poll the channels for new requests
+ *
+ * When requests arrive quickly, it's cheaper to keep checking the
+ * channels than to sleep and be woken up by the network.
+ *
+ * @param[in] worker	the worker
+ * @param[in] now	the current time.
+ * @param[in] idle	the worker has no runnable requests.
+ * @return
+ *	- true if the worker should not sleep.
+ *	- false if the worker may sleep until it is signalled.
+ */
+static bool worker_channels_poll(fr_worker_t *worker, fr_time_t now, bool idle)
+{
+	int	i, found = 0;
+	bool	polling = false;
+
+	for (i = 0; (i < worker->config.max_channels) && (found < worker->num_channels); i++) {
+		if (!worker->channel[i].ch) continue;
+		found++;
+
+		if (fr_channel_responder_poll(worker->channel[i].ch, now, idle)) polling = true;
+	}
+
+	return polling;
+}
+
 /** The main loop and entry point of the stand-alone worker thread.
  *
  *  Where there is only one thread, the event loop runs fr_worker_pre_event() and fr_worker_post_event()
@@ -1494,6 +1554,12 @@ void fr_worker(fr_worker_t *worker)
 			DEBUG4("Ready to process requests");
 		}
 
+		/*
+		 *	Requests are arriving quickly, so we keep
+		 *	checking for them instead of sleeping.
+		 */
+		if (worker_channels_poll(worker, fr_time(), wait_for_event)) wait_for_event = false;
+
 		/*
 		 *	Check the event list.  If there's an error
 		 *	(e.g. exit), we stop looping and clean up.
@@ -1527,12 +1593,13 @@ void fr_worker(fr_worker_t *worker)
  *
  *	This should be run ONLY in single-threaded mode!
  */
-int fr_worker_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wake, void *uctx)
+int fr_worker_pre_event(fr_time_t now, UNUSED fr_time_delta_t wake, void *uctx)
 {
 	fr_worker_t *worker = talloc_get_type_abort(uctx, fr_worker_t);
 	request_t *request;
 
 	request = fr_heap_peek(worker->runnable);
+	if (worker_channels_poll(worker, now, !request)) return 1;
 	if (!request) return 0;
 
 	/*
@@ -1555,6 +1622,19 @@ void fr_worker_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void
 	worker_run_request(worker, fr_time());	/* Event loop time can be too old, and trigger asserts */
 }
 
+/** Return the number of requests which are waiting to run
+ *
+ * May be called from any thread.
+ *
+ * @param[in] worker the worker
+ * @return the number of requests in the worker's runnable heap, as of
+ *	the last time the worker updated it.
+ */
+uint32_t fr_worker_num_runnable(fr_worker_t const *worker)
+{
+	return atomic_load_explicit(&worker->num_runnable, memory_order_relaxed);
+}
+
 /** Print debug information about the worker structure
  *
  * @param[in] worker the worker
@@ -1678,6 +1758,20 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	return 6;
 }
 
+/** Print the arena usage of one virtual server
+ *
+ */
+static void cmd_stats_worker_arena(CONF_SECTION const *server_cs, uint64_t requests,
+				   size_t size, size_t max_used, void *uctx)
+{
+	FILE		*fp = uctx;
+	char const	*name = server_cs ? cf_section_name2(server_cs) : "<none>";
+
+	fprintf(fp, "memory.server.%s.requests\t%" PRIu64 "\n", name, requests);
+	fprintf(fp, "memory.server.%s.size\t%zu\n", name, size);
+	fprintf(fp, "memory.server.%s.max_used\t%zu\n", name, max_used);
+}
+
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	fr_worker_t const *worker = ctx;
@@ -1689,6 +1783,7 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.dup\t\t\t%" PRIu64 "\n", worker->stats.dup);
 		fprintf(fp, "count.dropped\t\t\t%" PRIu64 "\n", worker->stats.dropped);
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
+		fprintf(fp, "count.stolen\t\t\t%" PRIu64 "\n", worker->num_stolen);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
 	}
@@ -1711,6 +1806,24 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "memory") == 0)) {
+		fprintf(fp, "memory.requests\t\t\t%" PRIu64 "\n", worker->arena->requests);
+		fprintf(fp, "memory.overflows\t\t%" PRIu64 "\n", worker->arena->overflows);
+		fprintf(fp, "memory.resized\t\t\t%" PRIu64 "\n", worker->arena->resized);
+		fprintf(fp, "memory.max_used\t\t\t%zu\n", worker->arena->max_used);
+		request_arena_server_walk(worker->arena, cmd_stats_worker_arena, fp);
+	}
+
+#ifdef HAVE_REGEX
+	if ((info->argc == 0) || (strcmp(info->argv[0], "regex") == 0)) {
+		fprintf(fp, "regex.cache.hits\t\t%" PRIu64 "\n", worker->regex_cache->hits);
+		fprintf(fp, "regex.cache.misses\t\t%" PRIu64 "\n", worker->regex_cache->misses);
+		fprintf(fp, "regex.cache.evictions\t\t%" PRIu64 "\n", worker->regex_cache->evictions);
+		fprintf(fp, "regex.cache.jit\t\t\t%" PRIu64 "\n", worker->regex_cache->jit);
+		fprintf(fp, "regex.cache.entries\t\t%u\n", worker->regex_cache->entries);
+	}
+#endif
+
 	return 0;
 }
 
@@ -1726,7 +1839,11 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+#ifdef HAVE_REGEX
+		.syntax = "[(count|cpu|memory|regex)]",
+#else
+		.syntax = "[(count|cpu|memory)]",
+#endif
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
@@ -85,6 +85,8 @@ fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+uint32_t	fr_worker_num_runnable(fr_worker_t const *worker) CC_HINT(nonnull);
+
 int		fr_worker_listen_cancel(fr_worker_t *worker, fr_listen_t const *li);
 
 #include <freeradius-devel/server/module.h>
@@ -31,6 +31,7 @@ RCSIDH(redis_h, "$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
 
 //DIAG_OFF(extra-semi-stmt)
 #include <hiredis/hiredis.h>
@@ -127,6 +128,9 @@ typedef struct {
 
 	fr_time_delta_t		reconnection_delay;
 
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the per-thread trunks used
+						//!< for asynchronous I/O.
+
 	char const		*log_prefix;
 } fr_redis_conf_t;
 
@@ -140,7 +144,8 @@ typedef struct {
 	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, fr_redis_conf_t, password) }, \
 	{ FR_CONF_OFFSET("max_nodes", FR_TYPE_UINT8, fr_redis_conf_t, max_nodes), .dflt = "20" }, \
 	{ FR_CONF_OFFSET("max_alt", FR_TYPE_UINT32, fr_redis_conf_t, max_alt), .dflt = "3" }, \
-	{ FR_CONF_OFFSET("max_redirects", FR_TYPE_UINT32, fr_redis_conf_t, max_redirects), .dflt = "2" }
+	{ FR_CONF_OFFSET("max_redirects", FR_TYPE_UINT32, fr_redis_conf_t, max_redirects), .dflt = "2" }, \
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, fr_redis_conf_t, trunk_conf), .subcs = (void const *) fr_trunk_config }
 
 void		fr_redis_version_print(void);
 
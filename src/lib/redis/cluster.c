@@ -1186,6 +1186,67 @@ static fr_redis_cluster_rcode_t cluster_redirect(fr_redis_cluster_node_t **out,
 	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
 }
 
+/** Remap the cluster using the node a -MOVED redirect pointed us to
+ *
+ * Used by callers which followed the redirect themselves, and so
+ * didn't go through #fr_redis_cluster_state_next.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[in] request	The current request (may be NULL).
+ * @param[in] cluster	to remap.
+ * @param[in] reply	Redis reply containing the redirect information.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_IGNORED if the cluster was remapped recently.
+ *	- FR_REDIS_CLUSTER_RCODE_FAILED on failure.
+ *	- FR_REDIS_CLUSTER_RCODE_NO_CONNECTION connection failure.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT on validation failure (bad data returned from Redis).
+ */
+fr_redis_cluster_rcode_t fr_redis_cluster_remap_by_redirect(request_t *request, fr_redis_cluster_t *cluster,
+							    redisReply *reply)
+{
+	fr_redis_cluster_node_t		*node;
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_rcode_t	ret;
+
+	ret = cluster_redirect(&node, cluster, reply);
+	if (ret != FR_REDIS_CLUSTER_RCODE_SUCCESS) {
+		if (ret == FR_REDIS_CLUSTER_RCODE_NO_CONNECTION) cluster->remap_needed = true;
+		return ret;
+	}
+
+	conn = fr_pool_connection_get(node->pool, request);
+	if (!conn) {
+		cluster->remap_needed = true;
+		return FR_REDIS_CLUSTER_RCODE_NO_CONNECTION;
+	}
+
+	ret = fr_redis_cluster_remap(request, cluster, conn);
+	if (ret == FR_REDIS_CLUSTER_RCODE_NO_CONNECTION) {
+		fr_pool_connection_close(node->pool, request, conn);
+	} else {
+		fr_pool_connection_release(node->pool, request, conn);
+	}
+
+	return ret;
+}
+
+/** Get the address of the node a -MOVED or -ASK redirect points to
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[out] node_addr	Where to write the address of the node.
+ * @param[in] reply		Redis reply containing the redirect information.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT if the server returned an invalid redirect.
+ */
+fr_redis_cluster_rcode_t fr_redis_cluster_node_addr_by_redirect(fr_socket_t *node_addr, redisReply *reply)
+{
+	return cluster_node_conf_from_redirect(NULL, node_addr, reply);
+}
+
 
 /** Try to determine the health of a cluster node passively by examining its pool state
  *
@@ -1691,6 +1752,70 @@ int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node)
 	return 0;
 }
 
+/** Resolve a key to the address of the node that should service it
+ *
+ * Used by callers which do their own I/O, and only need to know
+ * which node to send commands to.
+ *
+ * @param[out] out		Address of the node.
+ * @param[in] cluster		To resolve key in.
+ * @param[in] request		The current request (may be NULL).
+ * @param[in] key		to resolve.
+ * @param[in] key_len		Length of the key.
+ * @param[in] read_only		Pick a slave at random, if the key slot has any.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no node is currently servicing the key slot.
+ */
+int fr_redis_cluster_node_addr_by_key(fr_socket_t *out, fr_redis_cluster_t *cluster, request_t *request,
+				      uint8_t const *key, size_t key_len, bool read_only)
+{
+	fr_redis_cluster_key_slot_t const	*key_slot;
+	fr_redis_cluster_node_t const		*node;
+
+	pthread_mutex_lock(&cluster->mutex);
+	key_slot = fr_redis_cluster_slot_by_key(cluster, request, key, key_len);
+	if (read_only && (key_slot->slave_num > 0)) {
+		node = &cluster->node[key_slot->slave[fr_rand() % key_slot->slave_num]];
+	} else {
+		node = &cluster->node[key_slot->master];
+	}
+
+	if (!node->is_active) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_strerror_const("No node available for key slot");
+		return -1;
+	}
+	*out = node->addr;
+	pthread_mutex_unlock(&cluster->mutex);
+
+	return 0;
+}
+
+#ifdef WITH_TLS
+/** Return the TLS context connections to the cluster's nodes should use
+ *
+ * Used by callers which make their own connections to the nodes, so that
+ * they're encrypted in the same way as those in the pools.
+ *
+ * @param[in] cluster	to return the context for.
+ * @return
+ *	- The SSL context.
+ *	- NULL if use_tls isn't set, or TLS isn't supported by hiredis.
+ */
+#ifdef HAVE_REDIS_SSL
+SSL_CTX *fr_redis_cluster_ssl_ctx(fr_redis_cluster_t const *cluster)
+{
+	return cluster->ssl_ctx;
+}
+#else
+SSL_CTX *fr_redis_cluster_ssl_ctx(UNUSED fr_redis_cluster_t const *cluster)
+{
+	return NULL;
+}
+#endif
+#endif
+
 /** Resolve a key to a pool, and reserve a connection in that pool
  *
  * This should be used with #fr_redis_cluster_state_next, and #fr_redis_command_status, to
@@ -31,6 +31,10 @@ RCSIDH(cluster_h, "$Id$")
 
 #include <freeradius-devel/server/pool.h>
 
+#ifdef WITH_TLS
+#  include <openssl/ssl.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -78,6 +82,11 @@ extern size_t fr_redis_cluster_rcodes_table_len;
 
 fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_cluster_t *cluster, fr_redis_conn_t *conn);
 
+fr_redis_cluster_rcode_t fr_redis_cluster_remap_by_redirect(request_t *request, fr_redis_cluster_t *cluster,
+							    redisReply *reply);
+
+fr_redis_cluster_rcode_t fr_redis_cluster_node_addr_by_redirect(fr_socket_t *node_addr, redisReply *reply);
+
 /*
  *	Callback for the connection pool to create a new connection
  */
@@ -100,6 +109,13 @@ int fr_redis_cluster_ipaddr(fr_ipaddr_t *out, fr_redis_cluster_node_t const *nod
 
 int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node);
 
+int fr_redis_cluster_node_addr_by_key(fr_socket_t *out, fr_redis_cluster_t *cluster, request_t *request,
+				      uint8_t const *key, size_t key_len, bool read_only);
+
+#ifdef WITH_TLS
+SSL_CTX *fr_redis_cluster_ssl_ctx(fr_redis_cluster_t const *cluster);
+#endif
+
 
 
 /*
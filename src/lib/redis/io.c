@@ -30,6 +30,14 @@
 
 #include <hiredis/async.h>
 
+#include "config.h"
+
+#ifdef HAVE_REDIS_SSL
+#include <freeradius-devel/tls/session.h>
+#include <freeradius-devel/tls/strerror.h>
+#include <hiredis/hiredis_ssl.h>
+#endif
+
 /** Called by hiredis to indicate the connection is dead
  *
  */
@@ -51,18 +59,93 @@ static void _redis_disconnected(redisAsyncContext const *ac, UNUSED int status)
 
 	DEBUG4("Signalled by hiredis, connection disconnected");
 
+	/*
+	 *	hiredis frees the context itself
+	 *	when this callback returns.
+	 */
+	h->ac = NULL;
+
 	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
 }
 
+/** Called by hiredis with the reply to an AUTH or SELECT command
+ *
+ * The connection is only signalled as connected once all the setup
+ * commands have succeeded.
+ */
+static void _redis_setup_reply(redisAsyncContext *ac, void *vreply, void *privdata)
+{
+	fr_connection_t		*conn;
+	fr_redis_handle_t	*h;
+	redisReply		*reply = vreply;
+	char const		*cmd = privdata;
+
+	if (!reply) return;	/* Connection is being freed */
+
+	conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	h = conn->h;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("%s failed: %s", cmd, reply->str);
+		fr_redis_reply_free(&reply);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+	fr_redis_reply_free(&reply);
+
+	if (--h->setup_pending > 0) return;
+
+	DEBUG4("Connection setup complete");
+
+	fr_connection_signal_connected(conn);
+}
+
 /** Called by hiredis to indicate the connection is live
  *
+ * If we need to authenticate, or select a database, the commands
+ * are sent now, and we signal the connection as connected when
+ * we get replies to them.
  */
-static void _redis_connected(redisAsyncContext const *ac, UNUSED int status)
+static void _redis_connected(redisAsyncContext const *ac, int status)
 {
-	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	fr_connection_t			*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	fr_redis_handle_t		*h = conn->h;
+	fr_redis_io_conf_t const	*conf = h->conf;
+	redisAsyncContext		*our_ac = UNCONST(redisAsyncContext *, ac);
+
+	if (h->ignore_disconnect_cb) return;
+
+	if (status != REDIS_OK) {
+		ERROR("Failed connecting to %s:%u: %s", conf->hostname, conf->port, ac->errstr);
+		h->ac = NULL;	/* hiredis frees the context when this callback returns */
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
 
 	DEBUG4("Signalled by hiredis, connection is open");
 
+	if (conf->password) {
+		if (conf->username) {
+			DEBUG3("Executing: AUTH %s <redacted>", conf->username);
+			redisAsyncCommand(our_ac, _redis_setup_reply, UNCONST(char *, "AUTH"),
+					  "AUTH %s %s", conf->username, conf->password);
+		} else {
+			DEBUG3("Executing: AUTH <redacted>");
+			redisAsyncCommand(our_ac, _redis_setup_reply, UNCONST(char *, "AUTH"),
+					  "AUTH %s", conf->password);
+		}
+		h->setup_pending++;
+	}
+
+	if (conf->database) {
+		DEBUG3("Executing: SELECT %u", conf->database);
+		redisAsyncCommand(our_ac, _redis_setup_reply, UNCONST(char *, "SELECT"),
+				  "SELECT %u", conf->database);
+		h->setup_pending++;
+	}
+
+	if (h->setup_pending > 0) return;
+
 	fr_connection_signal_connected(conn);
 }
 
@@ -129,6 +212,8 @@ static void _redis_io_common(fr_connection_t *conn, fr_redis_handle_t *h, bool r
 		if (fr_event_fd_delete(el, c->fd, FR_EVENT_FILTER_IO) < 0) {
 			PERROR("redis handle %p - De-registration failed for FD %i", h, c->fd);
 		}
+		h->read_set = false;
+		h->write_set = false;
 		return;
 	}
 
@@ -285,7 +370,23 @@ static int _redis_handle_free(fr_redis_handle_t *h)
 	 *      freeing the handle.
 	 */
 	h->ignore_disconnect_cb = true;
-	if (h->ac) redisAsyncFree(h->ac);
+	if (!h->ac) return 0;
+
+	/*
+	 *	If we're being freed from within one of
+	 *	hiredis' callbacks, the context isn't freed
+	 *	until the callback returns, by which time
+	 *	the handle is gone, and the connection may
+	 *	have a new one.  Remove the I/O events now,
+	 *	and stop hiredis calling back into us.
+	 */
+	_redis_io_common(h->ac->ev.data, h, false, false);
+	memset(&h->ac->ev, 0, sizeof(h->ac->ev));
+	h->ac->onConnect = NULL;
+	h->ac->onDisconnect = NULL;
+	h->ac->data = NULL;
+
+	redisAsyncFree(h->ac);
 
 	return 0;
 }
@@ -304,7 +405,7 @@ static int _redis_handle_free(fr_redis_handle_t *h)
  */
 static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connection_t *conn, void *uctx)
 {
-	fr_redis_io_conf_t	*conf = uctx;
+	fr_redis_io_conf_t const *conf = uctx;
 	char const		*host = conf->hostname;
 	uint16_t		port = conf->port;
 	fr_redis_handle_t	*h;
@@ -320,19 +421,58 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 		return FR_CONNECTION_STATE_FAILED;
 	}
 	talloc_set_destructor(h, _redis_handle_free);
+	h->conf = conf;
 
 	h->ac = redisAsyncConnect(host, port);
 	if (!h->ac) {
 		ERROR("Failed allocating handle for %s:%u", host, port);
+	error:
+		*h_out = NULL;
+		talloc_free(h);		/* Destructor frees the async context */
 		return FR_CONNECTION_STATE_FAILED;
 	}
 
 	if (h->ac->err) {
 		ERROR("Failed allocating handle for %s:%u: %s", host, port, h->ac->errstr);
-	error:
-		redisAsyncFree(h->ac);
-		return FR_CONNECTION_STATE_FAILED;
+		goto error;
+	}
+
+#ifdef HAVE_REDIS_SSL
+	/*
+	 *	The TLS handshake is done by hiredis when
+	 *	the socket becomes writable, along with
+	 *	the rest of the connection setup.
+	 */
+	if (conf->ssl_ctx) {
+		fr_tls_session_t *tls_session;
+
+		tls_session = fr_tls_session_alloc_client(h, conf->ssl_ctx);
+		if (!tls_session) {
+			fr_tls_strerror_printf(NULL);
+			PERROR("Failed allocating TLS session for %s:%u", host, port);
+			goto error;
+		}
+
+		/*
+		 *	redisInitiateSSL() takes ownership of
+		 *	the SSL object on success.
+		 */
+		SSL_up_ref(tls_session->ssl);
+		if (redisInitiateSSL(&h->ac->c, tls_session->ssl) != REDIS_OK) {
+			ERROR("Failed initiating TLS for %s:%u: %s", host, port, h->ac->c.errstr);
+			SSL_free(tls_session->ssl);
+			goto error;
+		}
 	}
+#endif
+
+	/*
+	 *	Replies are passed back to the caller
+	 *	with the rest of the command set, so
+	 *	hiredis mustn't free them when our
+	 *	callback returns.
+	 */
+	h->ac->c.flags |= REDIS_NO_AUTO_FREE_REPLIES;
 
 	/*
 	 *	Store the connection in private data,
@@ -368,18 +508,19 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 	 *      machine, to let it handle
 	 *	reconnecting.
 	 */
+	fr_dlist_talloc_init(&h->ignore, fr_redis_sqn_ignore_t, entry);
+
 	ret = redisAsyncSetConnectCallback(h->ac, _redis_connected);
 	if (ret != REDIS_OK) {
 		ERROR("Failed setting connected callback: Error %i", ret);
 		goto error;
 	}
-	if (redisAsyncSetDisconnectCallback(h->ac, _redis_disconnected) != REDIS_OK) {
+	ret = redisAsyncSetDisconnectCallback(h->ac, _redis_disconnected);
+	if (ret != REDIS_OK) {
 		ERROR("Failed setting disconnected callback: Error %i", ret);
 		goto error;
 	}
 
-	fr_dlist_talloc_init(&h->ignore, fr_redis_sqn_ignore_t, entry);
-
 	return FR_CONNECTION_STATE_CONNECTING;
 }
 
@@ -390,7 +531,7 @@ static fr_connection_state_t _redis_io_connection_shutdown(UNUSED fr_event_list_
 {
 	fr_redis_handle_t	*our_h = talloc_get_type_abort(h, fr_redis_handle_t);
 
-	redisAsyncDisconnect(our_h->ac);	/* Should not free the handle */
+	if (our_h->ac) redisAsyncDisconnect(our_h->ac);	/* Should not free the handle */
 
 	return FR_CONNECTION_STATE_SHUTDOWN;
 }
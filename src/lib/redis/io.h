@@ -34,19 +34,27 @@ RCSIDH(redis_io_h, "$Id$")
 
 #include <hiredis/async.h>
 
+#ifdef WITH_TLS
+#  include <openssl/ssl.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct {
-	char			*hostname;
+	char const		*hostname;
 	uint16_t		port;
 	uint32_t		database;	//!< number on Redis server.
 
+	char const		*username;	//!< for acls.
 	char const		*password;	//!< to authenticate to Redis.
 	fr_time_delta_t		connection_timeout;
 	fr_time_delta_t		reconnection_delay;
 	char const		*log_prefix;
+#ifdef WITH_TLS
+	SSL_CTX			*ssl_ctx;	//!< To create TLS sessions with.  NULL if TLS isn't used.
+#endif
 } fr_redis_io_conf_t;
 
 typedef uint64_t fr_redis_sqn_t;
@@ -68,9 +76,11 @@ typedef struct {
 	bool			write_set;		//!< We're listening for writes.
 	bool			ignore_disconnect_cb;	//!< Ensure that redisAsyncFree doesn't cause
 							///< a callback loop.
+	uint8_t			setup_pending;		//!< AUTH and SELECT commands we're waiting for
+							///< replies to before the connection is usable.
 	fr_event_timer_t const	*timer;			//!< Connection timer.
 
-
+	fr_redis_io_conf_t const *conf;			//!< Host and credentials we're connecting with.
 	redisAsyncContext	*ac;			//!< Async handle for hiredis.
 
 	fr_dlist_head_t		ignore;			//!< Contains SQNs for responses that should be ignored.
@@ -105,13 +115,23 @@ static inline fr_redis_sqn_t fr_redis_connection_sent_request(fr_redis_handle_t
  */
 static inline void fr_redis_connection_ignore_response(fr_redis_handle_t *h, fr_redis_sqn_t sqn)
 {
-	fr_redis_sqn_ignore_t *ignore;
+	fr_redis_sqn_ignore_t *ignore, *prev;
 
-	fr_assert(sqn <= h->rsp_sqn);
+	fr_assert(sqn >= h->rsp_sqn);		/* Can't ignore a response we've already received */
 
 	MEM(ignore = talloc_zero(h, fr_redis_sqn_ignore_t));
 	ignore->sqn = sqn;
-	fr_dlist_insert_tail(&h->ignore, ignore);
+
+	/*
+	 *	Responses are checked in SQN order, so the
+	 *	list must be kept sorted.  Commands are
+	 *	usually ignored in the order they were sent,
+	 *	so search back from the tail.
+	 */
+	for (prev = fr_dlist_tail(&h->ignore);
+	     prev && (prev->sqn > sqn);
+	     prev = fr_dlist_prev(&h->ignore, prev));
+	fr_dlist_insert_after(&h->ignore, prev, ignore);
 }
 
 /** Update the response sequence number and check if we should ignore the response
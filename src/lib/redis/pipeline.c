@@ -27,38 +27,40 @@
 
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/debug.h>
 
 #include "pipeline.h"
 #include "io.h"
 
-
 /** Thread local state for a cluster
  *
- * MOVE ME TO NEW ASYNC CLUSTER CODE
+ * Holds the trunks used to communicate with each cluster member.
+ * Trunks are allocated lazily, the first time a command set is
+ * routed to a particular node.
  */
 struct fr_redis_cluster_thread_s {
 	fr_event_list_t			*el;
 	fr_trunk_conf_t	const		*tconf;		//!< Configuration for all trunks in the cluster.
-	char				*log_prefix;	//!< Common log prefix to use for all cluster related
+	fr_redis_conf_t const		*conf;		//!< Redis configuration for the cluster.
+	fr_redis_cluster_t		*cluster;	//!< Shared cluster state.  Used to map keys to nodes.
+	fr_rb_tree_t			*trunks;	//!< Trunks to each cluster member, ordered by address.
+	char const			*log_prefix;	//!< Common log prefix to use for all cluster related
 							///< messages.
 	bool				delay_start;	//!< Prevent connections from spawning immediately.
 };
 
-/** The thread local free list
- *
- * Any entries remaining in the list will be freed when the thread is joined
- */
-static _Thread_local fr_dlist_head_t *command_set_free_list;
-
 typedef enum {
 	FR_REDIS_COMMAND_NORMAL = 0,			//!< A normal, non-transactional command.
 	FR_REDIS_COMMAND_TRANSACTION_START,		//!< Start of a transaction block. Either WATCH or MULTI.
 							///< if a transaction is started with WATCH, then multi
 							///< is not marked up as a transaction start.
-	FR_REDIS_COMMAND_TRANSACTION_END		//!< End of a transaction block. Either EXEC or DISCARD.
+	FR_REDIS_COMMAND_TRANSACTION_END,		//!< End of a transaction block. Either EXEC or DISCARD.
 							///< If this command fails with
 							///< MOVED or ASK, all commands back to the previous
 							///< MULTI command must be requeued.
+	FR_REDIS_COMMAND_ASKING				//!< ASKING command inserted to follow an ASK redirect.
+							///< Removed before the replies are passed back to the
+							///< module.
 } fr_redis_command_type_t;
 
 /** Represents a single command
@@ -85,8 +87,6 @@ struct fr_redis_command_s {
  * Commands MUST map to the same cluster node if using clustering.
  */
 struct fr_redis_command_set_s {
-	fr_dlist_t			entry;
-
 	/** @name Command state lists
 	 * @{
  	 */
@@ -96,6 +96,9 @@ struct fr_redis_command_set_s {
 	/** @} */
 
 	uint8_t				redirected;	//!< How many times this command set was redirected.
+	bool				requeued;	//!< Command set was moved to another trunk by the
+							///< complete callback, and must not be freed when
+							///< the original trunk request is.
 
 	/** @name Request state
 	 *
@@ -142,50 +145,23 @@ struct fr_redis_command_set_s {
 };
 
 struct fr_redis_trunk_s {
-	fr_redis_io_conf_t const	*io_conf;	//!< Redis I/O configuration.  Specifies how to connect
+	fr_rb_node_t			node;		//!< Entry in the cluster thread's tree of trunks.
+	fr_socket_t			addr;		//!< Address of the node this trunk connects to.
+	char				hostname[FR_IPADDR_STRLEN];	//!< Printed version of the address.
+	fr_redis_io_conf_t		io_conf;	//!< Redis I/O configuration.  Specifies how to connect
 							///< to the host this trunk is used to communicate with.
 	fr_trunk_t			*trunk;		//!< Trunk containing all the connections to a specific
 							///< host.
 	fr_redis_cluster_thread_t	*cluster;	//!< Cluster this trunk belongs to.
 };
 
-/** Free any free requests when the thread is joined
- *
- */
-static int _command_set_free_list_free_on_exit(void *arg)
-{
-	fr_dlist_head_t		*list = talloc_get_type_abort(arg, fr_dlist_head_t);
-	fr_redis_command_set_t	*cmds;
-
-	/*
-	 *	See the destructor for why this works
-	 */
-	while ((cmds = fr_dlist_head(list))) if (talloc_free(cmds) < 0) return -1;
-	return talloc_free(list);
-}
-
-/** Free a command set
+/** Sent before a command which is being retried after an ASK redirect
  *
  */
-static int _redis_command_set_free(fr_redis_command_set_t *cmds)
-{
-	if (fr_dlist_num_elements(command_set_free_list) >= 1024) return 0;	/* Keep a buffer of 1024 */
-
-	/*
-	 *	Freed from the free list....
-	 */
-	if (unlikely(fr_dlist_entry_in_list(&cmds->entry))) {
-		fr_dlist_entry_unlink(&cmds->entry);	/* Don't trust the list head to be available */
-		return 0;
-	}
-
-	talloc_free_children(cmds);
-	memset(&cmds, 0, sizeof(cmds));
+static char const redis_asking_cmd[] = "*1\r\n$6\r\nASKING\r\n";
 
-	fr_dlist_insert_head(command_set_free_list, cmds);
-
-	return -1;	/* Prevent the free */
-}
+#define COMMAND_PRE_ALLOC_COUNT	8	//!< How much room we pre-allocate for commands.
+#define COMMAND_PRE_ALLOC_LEN	64	//!< How much we allocate for each command string.
 
 /** Allocate a new command set
  *
@@ -193,55 +169,28 @@ static int _redis_command_set_free(fr_redis_command_set_t *cmds)
  * on the redis server in sequence.
  *
  * Control will be returned to the caller via the registered complete
- * and fail functions.
+ * and fail functions.  The command set is freed once they return, so
+ * any results the caller wants to keep must be stolen with
+ * #fr_redis_command_steal_result.
  *
- * @param[in] ctx	to bind the command set's lifetime to.
  * @param[in] request	to pass to places that need it.
  * @param[in] complete	Function to call when all commands have been processed.
  * @param[in] fail	Function to call if the command set was not executed
  *			or was partially executed.
  * @param[in] rctx	Resume context to pass to complete and fail functions.
- * @return A new or refurbished command set.
+ * @return A new command set.
  */
-fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
-						   request_t *request,
+fr_redis_command_set_t *fr_redis_command_set_alloc(request_t *request,
 						   fr_redis_command_set_complete_t complete,
 						   fr_redis_command_set_fail_t fail,
 						   void *rctx)
-
 {
 	fr_redis_command_set_t	*cmds;
-	fr_dlist_head_t		*free_list;
-
-#define COMMAND_PRE_ALLOC_COUNT	8	//!< How much room we pre-allocate for commands.
-#define COMMAND_PRE_ALLOC_LEN	64	//!< How much we allocate for each command string.
 
-	/*
-	 *	Initialise the free list
-	 */
-	if (unlikely(!command_set_free_list)) {
-		MEM(free_list = talloc(NULL, fr_dlist_head_t));
-		fr_dlist_init(free_list, fr_redis_command_set_t, entry);
-		fr_atexit_thread_local(command_set_free_list, _command_set_free_list_free_on_exit, free_list);
-	} else {
-		free_list = command_set_free_list;
-	}
-
-	/*
-	 *	Pull an element out of the free list
-	 *	or allocate a new one.
-	 */
-	cmds = fr_dlist_head(free_list);
-	if (!cmds) {
-		MEM(cmds = talloc_zero_pooled_object(NULL, fr_redis_command_set_t,
-						     COMMAND_PRE_ALLOC_COUNT,
-						     COMMAND_PRE_ALLOC_COUNT * (sizeof(fr_redis_command_t) +
-						     COMMAND_PRE_ALLOC_LEN)));
-		talloc_set_destructor(cmds, _redis_command_set_free);
-		fr_dlist_entry_init(&cmds->entry);
-	} else {
-		fr_dlist_remove(free_list, cmds);
-	}
+	MEM(cmds = talloc_zero_pooled_object(NULL, fr_redis_command_set_t,
+					     COMMAND_PRE_ALLOC_COUNT,
+					     COMMAND_PRE_ALLOC_COUNT * (sizeof(fr_redis_command_t) +
+					     COMMAND_PRE_ALLOC_LEN)));
 
 	fr_dlist_talloc_init(&cmds->pending, fr_redis_command_t, entry);
 	fr_dlist_talloc_init(&cmds->sent, fr_redis_command_t, entry);
@@ -251,8 +200,6 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
 	cmds->fail = fail;
 	cmds->rctx = rctx;
 
-	if (ctx) talloc_link_ctx(ctx, cmds);
-
 	return cmds;
 }
 
@@ -262,60 +209,97 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+	fr_redis_reply_free(&cmd->result);
 
 	return 0;
 }
 
+/** Return the reply to a command
+ *
+ * The reply is freed with the command set.
+ */
 redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 {
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
+/** Take ownership of the reply to a command
  *
- * The command must either be entirely static, or parented by the command set.
+ * The caller must free the reply with #fr_redis_reply_free.
+ */
+redisReply *fr_redis_command_steal_result(fr_redis_command_t *cmd)
+{
+	redisReply *reply = cmd->result;
+
+	cmd->result = NULL;
+
+	return reply;
+}
+
+/** Find the name of a command
  *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+ * Commands may either be RESP arrays, or inline commands.
  *
- * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
- * @param[in] cmd_len	Length of the command.
+ * @param[out] len	Length of the command name.
+ * @param[in] cmd_str	to find the name in.
+ * @param[in] cmd_len	Length of cmd_str.
  * @return
- *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
- *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ *	- The start of the command name.
+ *	- NULL if the command is malformed.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static char const *redis_command_name(size_t *len, char const *cmd_str, size_t cmd_len)
 {
-	request_t			*request = cmds->request;
-	fr_redis_command_t	*cmd;
-	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
+	char const	*p = cmd_str, *end = cmd_str + cmd_len;
+	char		*q;
+	unsigned long	name_len;
+
+	if ((p == end) || (*p != '*')) {
+		*len = strcspn(p, " \r\n");
+		if (*len > cmd_len) *len = cmd_len;
+		return p;
+	}
 
-	/*
-	 *	Transaction sanity checks.
-	 *
-	 *	Because commands from many different requests share the same connection
-	 *	we need to ensure that transaction blocks aren't left dangling and
-	 *	that the commands are all in the right order.
-	 *
-	 *	We try very hard to do this without incurring a performance penalty
-	 *      for non-transactional commands.
-	 */
-	switch (tolower(cmd_str[0])) {
+	p = memchr(p, '\n', end - p);
+	if (!p || (++p == end) || (*p != '$')) return NULL;
+
+	name_len = strtoul(p + 1, &q, 10);
+	if ((q + 2 > end) || (q[0] != '\r') || (q[1] != '\n')) return NULL;
+	p = q + 2;
+	if (name_len > (size_t)(end - p)) return NULL;
+
+	*len = name_len;
+	return p;
+}
+
+#define COMMAND_IS(_name) ((name_len == (sizeof(_name) - 1)) && (strncasecmp(name, _name, name_len) == 0))
+
+/** Work out the transaction type of a command, and check the transaction is well formed
+ *
+ * Because commands from many different requests share the same connection
+ * we need to ensure that transaction blocks aren't left dangling and
+ * that the commands are all in the right order.
+ *
+ * We try very hard to do this without incurring a performance penalty
+ * for non-transactional commands.
+ */
+static fr_redis_pipeline_status_t redis_command_type(fr_redis_command_type_t *out, fr_redis_command_set_t *cmds,
+						     char const *name, size_t name_len)
+{
+	request_t *request = cmds->request;
+
+	*out = FR_REDIS_COMMAND_NORMAL;
+
+	if (name_len < 4) return FR_REDIS_PIPELINE_OK;
+
+	switch (tolower((uint8_t) name[0])) {
 	case 'm':
-		if (tolower(cmd_str[1] != 'u')) break;
-		if (strncasecmp(cmd_str, "multi", sizeof("multi") - 1) != 0) break;
+		if (!COMMAND_IS("multi")) break;
 		/*
 		 *	There should only ever be a difference of
 		 *	1 between txn starts and txn ends.
 		 */
-		if ((cmds->txn_end < cmds->txn_start) && ((cmds->txn_start - cmds->txn_end) > 1)) {
-			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"MULTI\" commands");
+		if (cmds->txn_start > cmds->txn_end) {
+			ROPTIONAL(REDEBUG, ERROR, "Too many consecutive \"MULTI\" commands");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
 		/*
@@ -323,13 +307,12 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		 *	that's marked as the start of the transaction
 		 *	block.
 		 */
-		type = cmds->txn_watch ? FR_REDIS_COMMAND_TRANSACTION_START : FR_REDIS_COMMAND_NORMAL;
+		*out = cmds->txn_watch ? FR_REDIS_COMMAND_NORMAL : FR_REDIS_COMMAND_TRANSACTION_START;
 		cmds->txn_start++;	/* Yes MULTI increments start, not WATCH */
 		break;
 
 	case 'e':
-		if (tolower(cmd_str[1] != 'e')) break;
-		if (strncasecmp(cmd_str, "exec", sizeof("exec") - 1) != 0) break;
+		if (!COMMAND_IS("exec")) break;
 		goto txn_end;
 
 	/*
@@ -338,41 +321,135 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	executing the commands.
 	 */
 	case 'd':
-		if (tolower(cmd_str[1] != 'i')) break;
-		if (strncasecmp(cmd_str, "discard", sizeof("discard") - 1) != 0) break;
+		if (!COMMAND_IS("discard")) break;
 	txn_end:
 		if (cmds->txn_start <= cmds->txn_end) {
-			ROPTIONAL(ERROR, REDEBUG, "Transaction not started, missing \"MULTI\" command");
+			ROPTIONAL(REDEBUG, ERROR, "Transaction not started, missing \"MULTI\" command");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
-		type = FR_REDIS_COMMAND_TRANSACTION_END;
+		*out = FR_REDIS_COMMAND_TRANSACTION_END;
 		cmds->txn_end++;
+		cmds->txn_watch = false;
 		break;
 
 	case 'w':
-		if (tolower(cmd_str[1] != 'a')) break;
-		if (strncasecmp(cmd_str, "watch", sizeof("watch") - 1) != 0) break;
+		if (!COMMAND_IS("watch")) break;
 		if (cmds->txn_watch) {
-			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"WATCH\" commands");
+			ROPTIONAL(REDEBUG, ERROR, "Too many consecutive \"WATCH\" commands");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
 		if (cmds->txn_start > cmds->txn_end) {
-			ROPTIONAL(ERROR, REDEBUG, "\"WATCH\" can only be used before \"MULTI\"");
+			ROPTIONAL(REDEBUG, ERROR, "\"WATCH\" can only be used before \"MULTI\"");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
-		FALL_THROUGH;
+		*out = FR_REDIS_COMMAND_TRANSACTION_START;
+		cmds->txn_watch = true;
+		break;
 
 	default:
 		break;
 	}
 
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command to the pending list
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_redis_command_t *redis_command_alloc(fr_redis_command_set_t *cmds, fr_redis_command_type_t type,
+					char const *cmd_str, size_t cmd_len)
+{
+	fr_redis_command_t *cmd;
+
 	MEM(cmd = talloc_zero(cmds, fr_redis_command_t));
 	talloc_set_destructor(cmd, _redis_command_free);
 	cmd->cmds = cmds;
 	cmd->type = type;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
-	fr_dlist_insert_tail(&cmds->pending, cmd);
+
+	return cmd;
+}
+
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ *			Should be in RESP format, as produced by redisFormatCommand.
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	request_t		*request = cmds->request;
+	fr_redis_command_type_t	type;
+	fr_redis_pipeline_status_t ret;
+	char const		*name;
+	size_t			name_len;
+
+	name = redis_command_name(&name_len, cmd_str, cmd_len);
+	if (!name) {
+		ROPTIONAL(REDEBUG, ERROR, "Malformed command");
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	ret = redis_command_type(&type, cmds, name, name_len);
+	if (ret != FR_REDIS_PIPELINE_OK) return ret;
+
+	fr_dlist_insert_tail(&cmds->pending, redis_command_alloc(cmds, type, cmd_str, cmd_len));
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Format a command from a set of arguments, and add it to the command set
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments, including the command name.
+ * @param[in] argv	Arguments.  Copied into the command, so may be freed
+ *			once this function returns.
+ * @param[in] argv_len	Length of each argument.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argv_len)
+{
+	request_t		*request = cmds->request;
+	fr_redis_command_type_t	type;
+	fr_redis_pipeline_status_t ret;
+	char			*formatted, *cmd_str;
+	long long		cmd_len;
+
+	if (argc < 1) {
+		ROPTIONAL(REDEBUG, ERROR, "Missing command");
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	ret = redis_command_type(&type, cmds, argv[0], argv_len[0]);
+	if (ret != FR_REDIS_PIPELINE_OK) return ret;
+
+	cmd_len = redisFormatCommandArgv(&formatted, argc, argv, argv_len);
+	if (cmd_len < 0) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed formatting command");
+		return FR_REDIS_PIPELINE_FAIL;
+	}
+	MEM(cmd_str = talloc_memdup(cmds, formatted, cmd_len));
+	redisFreeCommand(formatted);
+
+	fr_dlist_insert_tail(&cmds->pending, redis_command_alloc(cmds, type, cmd_str, cmd_len));
 
 	return FR_REDIS_PIPELINE_OK;
 }
@@ -389,10 +466,12 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
  *	- FR_REDIS_PIPELINE_DST_UNAVAILABLE if the REDIS host is unreachable.
  *	- FR_REDIS_PIPELINE_FAIL any other general error.
  */
-fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds)
+fr_redis_pipeline_status_t fr_redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds)
 {
+	request_t *request = cmds->request;
+
 	if (cmds->txn_start != cmds->txn_end) {
-		ERROR("Refusing to enqueue - Unbalanced transaction start/stop commands");
+		ROPTIONAL(REDEBUG, ERROR, "Refusing to enqueue - Unbalanced transaction start/stop commands");
 		return FR_REDIS_PIPELINE_BAD_CMDS;
 	}
 
@@ -409,6 +488,23 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Cancel a command set
+ *
+ * Neither the complete nor the fail callbacks will be called, and the
+ * command set is freed.
+ *
+ * @param[in] cmds	to cancel.
+ */
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) {
+		talloc_free(cmds);
+		return;
+	}
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -428,23 +524,30 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 {
 	fr_redis_command_t	*cmd;
 	fr_redis_command_set_t	*cmds;
-	fr_connection_t		*conn = talloc_get_type_abort(ac->ev.data, fr_connection_t);
-	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+	fr_connection_t		*conn;
+	fr_redis_handle_t	*h;
 	redisReply		*reply = vreply;
+
+	/*
+	 *	hiredis calls all outstanding callbacks with
+	 *	a NULL reply when the context is freed.  By
+	 *	then the commands will have been cancelled,
+	 *	or moved to another connection.
+	 */
+	if (!reply) return;
+
+	conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+
 	/*
 	 *	First check if we should ignore the response
 	 */
 	if (!fr_redis_connection_process_response(h)) {
 		DEBUG4("Ignoring response with SQN %"PRIu64, (h->rsp_sqn - 1));	/* Already incremented */
-		fr_redis_reply_free((redisReply **)&reply);
+		fr_redis_reply_free(&reply);
 		return;
 	}
 
-	/*
-	 *	FIXME - Need to check TRYAGAIN, MOVED etc...
-	 *	I guess we might want to wait for the end of
-	 *	the command set to do that.
-	 */
 	cmd = talloc_get_type_abort(privdata, fr_redis_command_t);
 	cmds = cmd->cmds;
 	cmd->result = reply;
@@ -455,7 +558,8 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	/*
 	 *	Check is the command set is complete,
 	 *	and if it is, tell the trunk the treq
-	 *	is complete.
+	 *	is complete.  Redirects are dealt with
+	 *	by the complete callback.
 	 */
 	if ((fr_dlist_num_elements(&cmds->pending) == 0) &&
 	    (fr_dlist_num_elements(&cmds->sent) == 0)) fr_trunk_request_signal_complete(cmds->treq);
@@ -467,50 +571,69 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
 {
 	fr_redis_trunk_t *rtrunk = talloc_get_type_abort(uctx, fr_redis_trunk_t);
 
-	return fr_redis_connection_alloc(tconn, el, conf, rtrunk->io_conf, log_prefix);
+	return fr_redis_connection_alloc(tconn, el, conf, &rtrunk->io_conf, log_prefix);
 }
 
 /** Enqueue one or more command sets onto a redis handle
  *
  * Because the trunk is in always writable mode, _redis_pipeline_mux
- * will be called any time fr_trunk_request_enqueue is called, so there'll only
- * ever be one command to dequeue.
+ * will be called any time fr_trunk_request_enqueue is called.  hiredis
+ * buffers the commands, and writes as many as it can when the socket
+ * becomes writable, so commands from many requests share each write.
  *
+ * @param[in] el		Event list.  Unused.
  * @param[in] tconn		Trunk connection holding the commands to enqueue.
  * @param[in] conn		Connection handle containing the fr_redis_handle_t.
- * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ * @param[in] uctx		fr_redis_trunk_t.  Unused.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
 	fr_trunk_request_t	*treq;
-	fr_redis_command_set_t 	*cmds;
-	fr_redis_command_t	*cmd;
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	request_t			*request;
 
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
-	while ((cmd = fr_dlist_head(&cmds->pending))) {
-		/*
-		 *	If this fails it probably means the connection
-		 *	is disconnecting, but if that's happening then
-		 *	we shouldn't be enqueueing new requests?
-		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+	while ((fr_trunk_connection_pop_request(&treq, tconn) == 0) && treq) {
+		fr_redis_command_set_t	*cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+		request_t		*request = treq->request;
+		fr_redis_command_t	*cmd;
 
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
-				fr_redis_connection_ignore_response(h, cmd->sqn);
-				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+		while ((cmd = fr_dlist_head(&cmds->pending))) {
+			/*
+			 *	If this fails it probably means the connection
+			 *	is disconnecting, in which case we shouldn't
+			 *	have been given any requests.
+			 */
+			if (unlikely(!h->ac ||
+				     (redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd,
+								 cmd->str, cmd->len) != REDIS_OK))) {
+				ROPTIONAL(REDEBUG, ERROR, "Unexpected error queueing REDIS command");
+
+				while ((cmd = fr_dlist_tail(&cmds->sent))) {
+					fr_redis_connection_ignore_response(h, cmd->sqn);
+					fr_dlist_remove(&cmds->sent, cmd);
+					fr_dlist_insert_head(&cmds->pending, cmd);
+				}
+				fr_trunk_request_signal_fail(treq);
+				goto next;
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			cmd->sqn = fr_redis_connection_sent_request(h);
+			fr_dlist_remove(&cmds->pending, cmd);
+			fr_dlist_insert_tail(&cmds->sent, cmd);
 		}
-		cmd->sqn = fr_redis_connection_sent_request(h);
-		fr_dlist_remove(&cmds->pending, cmd);
-		fr_dlist_insert_tail(&cmds->sent, cmd);
+		fr_trunk_request_signal_sent(treq);
+	next:
+		continue;
 	}
-	fr_trunk_request_signal_sent(treq);
+}
+
+/** Ignore the replies to any commands we've sent
+ *
+ */
+static void redis_command_set_ignore_sent(fr_redis_handle_t *h, fr_redis_command_set_t *cmds)
+{
+	fr_redis_command_t *cmd = NULL;
+
+	while ((cmd = fr_dlist_next(&cmds->sent, cmd))) fr_redis_connection_ignore_response(h, cmd->sqn);
 }
 
 /** Deal with cancellation of sent requests
@@ -519,11 +642,12 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
-	fr_redis_handle_t	*h = conn->h;
+	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+	fr_redis_command_t	*cmd = NULL;
 
 	/*
 	 *	How we cancel is very different depending
@@ -531,17 +655,24 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 */
 	switch (reason) {
 	/*
-	 *	Cancel is only called for requests that
-	 *	have been sent, and only when the connection
-	 *	is about to be closed for some reason.
+	 *	The command set is being moved to another
+	 *	connection, usually because this one is
+	 *	being closed, or being resent.
 	 *
-	 *	We don't need to tell the handle to ignore
-	 *	the responses, we just need to get the
-	 *	command set back into the correct state for
-	 *	execution by another handle.
+	 *	The connection may still be usable, so
+	 *	tell the handle to ignore the responses,
+	 *	then get the command set back into the
+	 *	correct state for execution by another
+	 *	handle.  The whole set is resent, as
+	 *	transaction blocks can't be split across
+	 *	connections.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
-		fr_dlist_move(&cmds->pending, &cmds->sent);
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
+		redis_command_set_ignore_sent(h, cmds);
+		while ((cmd = fr_dlist_next(&cmds->completed, cmd))) fr_redis_reply_free(&cmd->result);
+		fr_dlist_move_head(&cmds->pending, &cmds->sent);
+		fr_dlist_move_head(&cmds->pending, &cmds->completed);
 		return;
 
 	/*
@@ -555,15 +686,8 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 *	pending commands.
 	 */
 	case FR_TRUNK_CANCEL_REASON_SIGNAL:
-	{
-		fr_redis_command_t	*cmd;
-
-		for (cmd = fr_dlist_head(&cmds->sent);
-		     cmd;
-		     cmd = fr_dlist_next(&cmds->sent, cmd)) {
-			fr_redis_connection_ignore_response(h, cmd->sqn);
-		}
-	}
+		redis_command_set_ignore_sent(h, cmds);
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -571,13 +695,137 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	}
 }
 
+/** Check the replies to a command set for redirects, and follow them
+ *
+ * All commands in a set must map to the same key slot, so a redirect
+ * for any command applies to the whole set.  The whole set is resent
+ * to the node we were redirected to.
+ *
+ * @return
+ *	- true if the command set was requeued, or failed.
+ *	- false if there were no redirects to follow, or we've been
+ *	  redirected too many times.  The error replies are passed
+ *	  back to the module.
+ */
+static bool redis_command_set_redirect(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = rtrunk->cluster;
+	request_t			*request = cmds->request;
+	fr_redis_command_t		*cmd = NULL, *next;
+	redisReply			*redirect = NULL;
+	fr_redis_trunk_t		*new_rtrunk;
+	fr_socket_t			node_addr = {};
+	bool				ask;
+
+	while ((cmd = fr_dlist_next(&cmds->completed, cmd))) {
+		redisReply *reply = cmd->result;
+
+		if (!reply || (reply->type != REDIS_REPLY_ERROR)) continue;
+
+		if ((strncmp(reply->str, REDIS_ERROR_MOVED_STR, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) ||
+		    (strncmp(reply->str, REDIS_ERROR_ASK_STR, sizeof(REDIS_ERROR_ASK_STR) - 1) == 0)) {
+			redirect = reply;
+			break;
+		}
+	}
+	if (!redirect) return false;
+
+	if (cmds->redirected >= cluster_thread->conf->max_redirects) {
+		ROPTIONAL(REDEBUG, ERROR, "Too many redirects (%u)", cluster_thread->conf->max_redirects);
+		return false;
+	}
+	cmds->redirected++;
+
+	ask = (redirect->str[0] == 'A');
+	if (fr_redis_cluster_node_addr_by_redirect(&node_addr, redirect) != FR_REDIS_CLUSTER_RCODE_SUCCESS) {
+		ROPTIONAL(RPERROR, PERROR, "Failed parsing redirect");
+		return false;
+	}
+
+	/*
+	 *	MOVED means the slot has moved permanently,
+	 *	so update the cluster map before following it.
+	 */
+	if (!ask && cluster_thread->cluster) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Key slot moved, updating cluster map");
+		(void) fr_redis_cluster_remap_by_redirect(request, cluster_thread->cluster, redirect);
+	}
+
+	new_rtrunk = fr_redis_trunk_by_addr(cluster_thread, &node_addr);
+	if (!new_rtrunk) return false;
+	if (new_rtrunk == rtrunk) {
+		ROPTIONAL(REDEBUG, ERROR, "Redirected to the node we sent the commands to");
+		return false;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Following %s redirect to %s:%u",
+		  ask ? "ASK" : "MOVED", new_rtrunk->hostname, new_rtrunk->addr.inet.dst_port);
+
+	/*
+	 *	Put the commands back in their original
+	 *	order, dropping the results, and any ASKING
+	 *	commands from previous redirects.
+	 */
+	for (cmd = fr_dlist_head(&cmds->completed); cmd; cmd = next) {
+		next = fr_dlist_next(&cmds->completed, cmd);
+
+		fr_dlist_remove(&cmds->completed, cmd);
+		if (cmd->type == FR_REDIS_COMMAND_ASKING) {
+			talloc_free(cmd);
+			continue;
+		}
+		fr_redis_reply_free(&cmd->result);
+
+		if (ask) {
+			fr_dlist_insert_tail(&cmds->pending,
+					     redis_command_alloc(cmds, FR_REDIS_COMMAND_ASKING,
+								 redis_asking_cmd, sizeof(redis_asking_cmd) - 1));
+		}
+		fr_dlist_insert_tail(&cmds->pending, cmd);
+	}
+
+	/*
+	 *	The original trunk request is freed after
+	 *	we return, so the command set needs a new one.
+	 *
+	 *	The command set may fail, and be "freed" by
+	 *	the new trunk before the enqueue function
+	 *	returns.  requeued is cleared if that happens,
+	 *	so the original trunk frees it instead.
+	 */
+	cmds->treq = NULL;
+	cmds->requeued = true;
+	if (fr_redis_command_set_enqueue(new_rtrunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed enqueueing redirected commands");
+		cmds->requeued = false;
+		if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
+	}
+
+	return true;
+}
+
 /** Signal the API client that we got a complete set of responses to a command set
  *
  */
 static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void *preq,
-						 UNUSED void *rctx, UNUSED void *uctx)
+						 UNUSED void *rctx, void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
+	fr_redis_command_t	*cmd, *next;
+
+	if (redis_command_set_redirect(talloc_get_type_abort(uctx, fr_redis_trunk_t), cmds)) return;
+
+	/*
+	 *	The module doesn't know about the ASKING
+	 *	commands we added.
+	 */
+	for (cmd = fr_dlist_head(&cmds->completed); cmd; cmd = next) {
+		next = fr_dlist_next(&cmds->completed, cmd);
+
+		if (cmd->type != FR_REDIS_COMMAND_ASKING) continue;
+		fr_dlist_remove(&cmds->completed, cmd);
+		talloc_free(cmd);
+	}
 
 	if (cmds->complete) cmds->complete(cmds->request, &cmds->completed, cmds->rctx);
 }
@@ -586,7 +834,8 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED request_t *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state,
+					     UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
@@ -601,20 +850,48 @@ static void _redis_pipeline_command_set_free(UNUSED request_t *request, void *pr
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	/*
+	 *	Now belongs to another trunk, or is still
+	 *	owned by the trunk it was redirected from.
+	 */
+	if (cmds->requeued) {
+		cmds->requeued = false;
+		return;
+	}
+
 	talloc_free(cmds);
 }
 
+static int8_t _redis_trunk_cmp(void const *one, void const *two)
+{
+	fr_redis_trunk_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = fr_ipaddr_cmp(&a->addr.inet.dst_ipaddr, &b->addr.inet.dst_ipaddr);
+	if (ret != 0) return ret;
+
+	return CMP(a->addr.inet.dst_port, b->addr.inet.dst_port);
+}
+
+static int _redis_trunk_free(fr_redis_trunk_t *rtrunk)
+{
+	if (fr_rb_node_inline_in_tree(&rtrunk->node)) fr_rb_remove(rtrunk->cluster->trunks, rtrunk);
+
+	return 0;
+}
+
 /** Allocate a new trunk
  *
  * @param[in] cluster_thread	to allocate the trunk for.
- * @param[in] io_conf		Describing the connection to a single REDIS host.
+ * @param[in] node_addr		of the REDIS host to connect to.
  * @return
  *	- On success, a new fr_redis_trunk_t which can be used for pipelining commands.
  *	- NULL on failure.
  */
-fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread, fr_redis_io_conf_t const *io_conf)
+static fr_redis_trunk_t *redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread, fr_socket_t const *node_addr)
 {
 	fr_redis_trunk_t	*rtrunk;
+	fr_redis_conf_t const	*conf = cluster_thread->conf;
 	fr_trunk_io_funcs_t	io_funcs = {
 					.connection_alloc	= _redis_pipeline_connection_alloc,
 					.request_mux		= _redis_pipeline_mux,
@@ -626,7 +903,25 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 				};
 
 	MEM(rtrunk = talloc_zero(cluster_thread, fr_redis_trunk_t));
-	rtrunk->io_conf = io_conf;
+	rtrunk->cluster = cluster_thread;
+	rtrunk->addr.inet.dst_ipaddr = node_addr->inet.dst_ipaddr;
+	rtrunk->addr.inet.dst_port = node_addr->inet.dst_port;
+	fr_inet_ntop(rtrunk->hostname, sizeof(rtrunk->hostname), &rtrunk->addr.inet.dst_ipaddr);
+
+	rtrunk->io_conf = (fr_redis_io_conf_t){
+		.hostname = rtrunk->hostname,
+		.port = rtrunk->addr.inet.dst_port,
+		.database = conf->database,
+		.username = conf->username,
+		.password = conf->password,
+		.connection_timeout = conf->connection_timeout,
+		.reconnection_delay = conf->reconnection_delay,
+		.log_prefix = cluster_thread->log_prefix,
+#ifdef WITH_TLS
+		.ssl_ctx = cluster_thread->cluster ? fr_redis_cluster_ssl_ctx(cluster_thread->cluster) : NULL
+#endif
+	};
+
 	rtrunk->trunk = fr_trunk_alloc(rtrunk, cluster_thread->el,
 				       &io_funcs, cluster_thread->tconf, cluster_thread->log_prefix, rtrunk,
 				       cluster_thread->delay_start);
@@ -635,28 +930,90 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 		return NULL;
 	}
 
+	fr_rb_insert(cluster_thread->trunks, rtrunk);
+	talloc_set_destructor(rtrunk, _redis_trunk_free);
+
 	return rtrunk;
 }
 
+/** Find or allocate the trunk for a particular cluster node
+ *
+ * @param[in] cluster_thread	to search for the trunk in.
+ * @param[in] node_addr		of the REDIS host.
+ * @return
+ *	- The trunk to the host.
+ *	- NULL on failure.
+ */
+fr_redis_trunk_t *fr_redis_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread, fr_socket_t const *node_addr)
+{
+	fr_redis_trunk_t *found, find = {
+		.addr = {
+			.inet = {
+				.dst_ipaddr = node_addr->inet.dst_ipaddr,
+				.dst_port = node_addr->inet.dst_port
+			}
+		}
+	};
+
+	found = fr_rb_find(cluster_thread->trunks, &find);
+	if (found) return found;
+
+	return redis_trunk_alloc(cluster_thread, node_addr);
+}
+
+/** Find or allocate the trunk for the node responsible for a key
+ *
+ * @param[in] cluster_thread	to search for the trunk in.
+ * @param[in] request		The current request.
+ * @param[in] key		to find the node for.
+ * @param[in] key_len		Length of the key.
+ * @param[in] read_only		If true, may return the trunk for a slave.
+ * @return
+ *	- The trunk to the node.
+ *	- NULL on failure.
+ */
+fr_redis_trunk_t *fr_redis_trunk_by_key(fr_redis_cluster_thread_t *cluster_thread, request_t *request,
+					uint8_t const *key, size_t key_len, bool read_only)
+{
+	fr_socket_t	node_addr = {};
+
+	if (fr_redis_cluster_node_addr_by_key(&node_addr, cluster_thread->cluster, request,
+					      key, key_len, read_only) < 0) {
+		ROPTIONAL(RPERROR, PERROR, "Failed finding node for key");
+		return NULL;
+	}
+
+	return fr_redis_trunk_by_addr(cluster_thread, &node_addr);
+}
+
 /** Allocate per-thread, per-cluster instance
  *
  * This structure represents all the connections for a given thread for a given cluster.
  * The structures holds the trunk connections to talk to each cluster member.
  *
+ * @param[in] ctx	to allocate the cluster thread in.  Usually the module's thread instance data.
+ * @param[in] el	to run the connections in.
+ * @param[in] cluster	to use for mapping keys to nodes.
+ * @param[in] conf	Redis configuration, including the trunk configuration.
+ * @return A new cluster thread.
  */
-fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf)
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+							 fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf)
 {
 	fr_redis_cluster_thread_t *cluster_thread;
 	fr_trunk_conf_t *our_tconf;
 
 	MEM(cluster_thread = talloc_zero(ctx, fr_redis_cluster_thread_t));
-	MEM(our_tconf = talloc_memdup(cluster_thread, tconf, sizeof(*tconf)));
+	MEM(our_tconf = talloc_memdup(cluster_thread, &conf->trunk_conf, sizeof(conf->trunk_conf)));
 	our_tconf->always_writable = true;
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	cluster_thread->conf = conf;
+	cluster_thread->cluster = cluster;
+	cluster_thread->log_prefix = conf->log_prefix;
+	MEM(cluster_thread->trunks = fr_rb_inline_talloc_alloc(cluster_thread, fr_redis_trunk_t, node,
+							       _redis_trunk_cmp, NULL));
 
 	return cluster_thread;
 }
-
-
@@ -32,6 +32,7 @@ RCSIDH(redis_pipeline_h, "$Id$")
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/redis/io.h>
+#include <freeradius-devel/redis/cluster.h>
 #include <hiredis/async.h>
 
 #ifdef __cplusplus
@@ -66,24 +67,30 @@ typedef void (*fr_redis_command_set_fail_t)(request_t *request, fr_dlist_head_t
 fr_redis_pipeline_status_t	fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
 							     	  char const *cmd_str, size_t cmd_len);
 
-/*
- *	TEMPORARY
- */
-fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds);
+fr_redis_pipeline_status_t	fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+							  int argc, char const **argv, size_t const *argv_len);
+
+fr_redis_pipeline_status_t	fr_redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds);
 
-redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd);
+void				fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds);
 
-fr_redis_command_set_t		*fr_redis_command_set_alloc(TALLOC_CTX *ctx,
-							    request_t *request,
+redisReply			*fr_redis_command_get_result(fr_redis_command_t *cmd);
+
+redisReply			*fr_redis_command_steal_result(fr_redis_command_t *cmd);
+
+fr_redis_command_set_t		*fr_redis_command_set_alloc(request_t *request,
 							    fr_redis_command_set_complete_t complete,
 							    fr_redis_command_set_fail_t fail,
 							    void *rctx);
 
-fr_redis_trunk_t		*fr_redis_trunk_alloc(fr_redis_cluster_thread_t *rtcluster,
-						      fr_redis_io_conf_t const *conf);
+fr_redis_trunk_t		*fr_redis_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+							fr_socket_t const *node_addr);
+
+fr_redis_trunk_t		*fr_redis_trunk_by_key(fr_redis_cluster_thread_t *cluster_thread, request_t *request,
+						       uint8_t const *key, size_t key_len, bool read_only);
 
 fr_redis_cluster_thread_t	*fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-							       fr_trunk_conf_t const *tconf);
+							       fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf);
 
 #ifdef __cplusplus
 }
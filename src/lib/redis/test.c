@@ -1,37 +1,38 @@
 /*
- *  cc  -g3 -Wall -DHAVE_DLFCN_H -I../../../src -include freeradius-devel/build.h -L../../../build/lib/local/.libs -ltalloc -lhiredis -lfreeradius-unlang -lfreeradius-util -lfreeradius-server -o test_redis test.c redis.c io.c crc16.c
+ *  cc  -g3 -Wall -DHAVE_DLFCN_H -I../../../src -include freeradius-devel/build.h -L../../../build/lib/local/.libs -ltalloc -lhiredis -lfreeradius-unlang -lfreeradius-util -lfreeradius-server -o test_redis test.c redis.c io.c crc16.c cluster.c pipeline.c
  */
 #include <freeradius-devel/util/acutest.h>
 #include "base.h"
 #include "io.h"
 #include "pipeline.h"
 
-#define DEBUG_LVL_SET if (test_verbose_level_ >= 3) fr_debug_lvl = L_DBG_LVL_4 + 1
+#define DEBUG_LVL_SET if (acutest_verbose_level_ >= 3) fr_debug_lvl = L_DBG_LVL_4 + 1
 
 
 typedef struct {
 	fr_time_t	start;
 	uint64_t	enqueued;
+	uint64_t	completed;
 } redis_pipeline_stats_t;
 
-static void _command_complete(request_t *request, fr_dlist_head_t *completed, void *rctx)
+static void _command_complete(UNUSED request_t *request, fr_dlist_head_t *completed, void *rctx)
 {
-	fr_time_t		io_stop;
 	fr_time_delta_t		io_time;
 	redis_pipeline_stats_t	*stats = rctx;
 	fr_redis_command_t	*cmd = talloc_get_type_abort(fr_dlist_head(completed), fr_redis_command_t);
 	redisReply		*reply = fr_redis_command_get_result(cmd);
-	io_stop = fr_time();
-	io_time = io_stop - stats->start;
 
+	TEST_CHECK(reply && (reply->type == REDIS_REPLY_STATUS));
+
+	if (++stats->completed < stats->enqueued) return;
+
+	io_time = fr_time_sub(fr_time(), stats->start);
 	INFO("I/O time %pV (%u rps)",
 	     fr_box_time_delta(io_time),
-	     (uint32_t)(stats->enqueued / ((float)io_time / NSEC)));
-
-	fr_assert(fr_dlist_num_elements(completed) == stats->enqueued);
+	     (uint32_t)(stats->enqueued / ((float)fr_time_delta_unwrap(io_time) / NSEC)));
 }
 
-static void _command_failed(request_t *request, fr_dlist_head_t *completed, void *rctx)
+static void _command_failed(UNUSED request_t *request, UNUSED fr_dlist_head_t *completed, UNUSED void *rctx)
 {
 	TEST_CHECK(0);
 }
@@ -45,40 +46,63 @@ static void test_basic_connection(void)
 	fr_redis_cluster_thread_t	*cluster_thread;
 	fr_redis_trunk_t		*rtrunk;
 	fr_connection_conf_t		conn_conf;
-	fr_trunk_conf_t			trunk_conf;
+	fr_redis_conf_t			conf;
+	fr_socket_t			node_addr;
 	size_t				i;
 	redis_pipeline_stats_t		stats;
+	static char const		ping[] = "*1\r\n$4\r\nPING\r\n";
 
 	DEBUG_LVL_SET;
 
 	memset(&conn_conf, 0, sizeof(conn_conf));
-	memset(&trunk_conf, 0, sizeof(trunk_conf));
-
-	trunk_conf.conn_conf = &conn_conf;
+	memset(&conf, 0, sizeof(conf));
+	memset(&node_addr, 0, sizeof(node_addr));
+	memset(&stats, 0, sizeof(stats));
+
+	conn_conf.connection_timeout = fr_time_delta_from_sec(5);
+	conf.trunk_conf.conn_conf = &conn_conf;
+	conf.trunk_conf.start = 1;
+	conf.trunk_conf.min = 1;
+	conf.trunk_conf.max = 1;
+	conf.trunk_conf.target_req_per_conn = 1000;
+	conf.trunk_conf.max_req_per_conn = 100000;
+	conf.connection_timeout = fr_time_delta_from_sec(5);
+	conf.log_prefix = "test_redis";
 
 	ctx = talloc_init("test_ctx");
 	el = fr_event_list_alloc(ctx, NULL, NULL);
 
-	cmds = fr_redis_command_set_alloc(ctx, NULL, _command_complete, _command_failed, &stats);
 	/*
-	 *	Enqueue 10 set commands
+	 *	Talks to a single redis-server, without
+	 *	a cluster map.
 	 */
-	for (i = 0; i < 1000000; i++) {
-		TEST_CHECK(fr_redis_command_preformatted_add(cmds, "PING", sizeof("PING") - 1) == FR_REDIS_PIPELINE_OK);
-	}
-
-	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, &trunk_conf);
-	rtrunk = fr_redis_trunk_alloc(cluster_thread,  &(fr_redis_io_conf_t){ .hostname = "127.0.0.1", .port = 30001 });
+	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, NULL, &conf);
+	TEST_CHECK(fr_inet_pton4(&node_addr.inet.dst_ipaddr, "127.0.0.1", -1, false, false, false) == 0);
+	node_addr.inet.dst_port = REDIS_DEFAULT_PORT;
+	rtrunk = fr_redis_trunk_by_addr(cluster_thread, &node_addr);
+	TEST_CHECK(rtrunk != NULL);
 
-	stats.enqueued = 1000000;
+	stats.enqueued = 100000;
 	stats.start = fr_time();
 
-	TEST_CHECK(redis_command_set_enqueue(rtrunk, cmds) == FR_REDIS_PIPELINE_OK);
+	/*
+	 *	Many command sets, as if from many requests,
+	 *	all pipelined onto the same connection.
+	 */
+	for (i = 0; i < stats.enqueued; i++) {
+		cmds = fr_redis_command_set_alloc(NULL, _command_complete, _command_failed, &stats);
+		TEST_CHECK(fr_redis_command_preformatted_add(cmds, ping, sizeof(ping) - 1) == FR_REDIS_PIPELINE_OK);
+		TEST_CHECK(fr_redis_command_set_enqueue(rtrunk, cmds) == FR_REDIS_PIPELINE_OK);
+	}
 
 	do {
 		events = fr_event_corral(el, fr_time(), true);
 		fr_event_service(el);
-	} while (events > 0);
+	} while ((events > 0) && (stats.completed < stats.enqueued));
+
+	TEST_CHECK(stats.completed == stats.enqueued);
+
+	talloc_free(ctx);
 }
 
 TEST_LIST = {
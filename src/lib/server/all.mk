@@ -1,5 +1,7 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
 	pair_server_tests.mk \
+	reload_tests.mk \
+	request_tests.mk \
 	tmpl_dcursor_tests.mk \
 	trunk_tests.mk
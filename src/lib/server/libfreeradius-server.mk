@@ -30,6 +30,7 @@ SOURCES	:= \
 	pool.c \
 	rcode.c \
 	regex.c \
+	reload.c \
 	request.c \
 	request_data.c \
 	snmp.c \
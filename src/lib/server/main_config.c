@@ -37,6 +37,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
+#include <freeradius-devel/io/network.h>
+
 #include <freeradius-devel/unlang/xlat.h>
 
 #include <freeradius-devel/util/conf.h>
@@ -88,6 +90,9 @@ static int reverse_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent,CONF_I
 static int hostname_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int worker_choices_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int worker_cost_percentile_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int free_requests_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int num_workers_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int num_workers_dflt(CONF_PAIR **out, void *parent, CONF_SECTION *cs, fr_token_t quote, CONF_PARSER const *rule);
 
@@ -168,12 +173,37 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static fr_table_num_sorted_t const worker_select_table[] = {
+	{ L("client-hash"),	FR_NETWORK_WORKER_SELECT_CLIENT_HASH	},
+	{ L("jsq"),		FR_NETWORK_WORKER_SELECT_JSQ		},
+	{ L("least-loaded"),	FR_NETWORK_WORKER_SELECT_LEAST_LOADED	}
+};
+static size_t worker_select_table_len = NUM_ELEMENTS(worker_select_table);
+
 static const CONF_PARSER thread_config[] = {
+	/*
+	 *	Parsed first, as it changes the default number of workers.
+	 */
+	{ FR_CONF_OFFSET("run_to_completion", FR_TYPE_BOOL, main_config_t, run_to_completion), .dflt = "no" },
+	{ FR_CONF_OFFSET("overflow_threshold", FR_TYPE_UINT32, main_config_t, overflow_threshold), .dflt = "64" },
+
 	{ FR_CONF_OFFSET("num_networks", FR_TYPE_UINT32, main_config_t, max_networks), .dflt = STRINGIFY(1),
 	  .func = num_networks_parse },
 	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, main_config_t, max_workers), .dflt = STRINGIFY(0),
 	  .func = num_workers_parse, .dflt_func = num_workers_dflt },
 
+	{ FR_CONF_OFFSET("worker_selection", FR_TYPE_VOID, main_config_t, worker_select),
+	  .func = cf_table_parse_int,
+	  .uctx = &(cf_table_parse_ctx_t){ .table = worker_select_table, .len = &worker_select_table_len },
+	  .dflt = "jsq" },
+	{ FR_CONF_OFFSET("worker_choices", FR_TYPE_UINT32, main_config_t, worker_choices), .dflt = "2",
+	  .func = worker_choices_parse },
+	{ FR_CONF_OFFSET("worker_cost_percentile", FR_TYPE_UINT32, main_config_t, worker_cost_percentile), .dflt = "90",
+	  .func = worker_cost_percentile_parse },
+	{ FR_CONF_OFFSET("work_stealing", FR_TYPE_BOOL, main_config_t, work_stealing), .dflt = "no" },
+	{ FR_CONF_OFFSET("free_requests", FR_TYPE_UINT32, main_config_t, free_requests), .dflt = "256",
+	  .func = free_requests_parse },
+
 	{ FR_CONF_OFFSET("stats_interval", FR_TYPE_TIME_DELTA | FR_TYPE_HIDDEN, main_config_t, stats_interval), },
 
 #ifdef WITH_TLS
@@ -414,7 +444,61 @@ static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent,
 
 	memcpy(&value, out, sizeof(value));
 
-	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, ==, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, <=, 64);
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
+static int worker_choices_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int		ret;
+	uint32_t	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_INTEGER_BOUND_CHECK("thread.worker_choices", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.worker_choices", value, <=, 64);
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
+static int worker_cost_percentile_parse(TALLOC_CTX *ctx, void *out, void *parent,
+					CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int		ret;
+	uint32_t	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_INTEGER_BOUND_CHECK("thread.worker_cost_percentile", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.worker_cost_percentile", value, <=, 100);
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
+static int free_requests_parse(TALLOC_CTX *ctx, void *out, void *parent,
+			       CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int		ret;
+	uint32_t	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_INTEGER_BOUND_CHECK("thread.free_requests", value, <=, 65536);
 
 	memcpy(out, &value, sizeof(value));
 
@@ -442,8 +526,12 @@ uint32_t num_workers_auto(main_config_t *conf, CONF_ITEM *parent)
 	 *	This ensures at a least a 4:1
 	 *	ratio of workers to networks,
 	 *      which seems like a sensible ratio.
+	 *
+	 *	In run-to-completion mode each worker
+	 *	reads its own packets, so there are no
+	 *	separate network threads to leave room for.
 	 */
-	else if (value > (conf->max_networks * 4)) {
+	else if (!conf->run_to_completion && (value > (conf->max_networks * 4))) {
 		value -= conf->max_networks;
 	}
 
@@ -150,6 +150,13 @@ struct main_config_s {
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
+	bool		run_to_completion;		//!< for the scheduler
+	uint32_t	overflow_threshold;		//!< for the scheduler
+	int		worker_select;			//!< for the scheduler
+	uint32_t	worker_choices;			//!< for the scheduler
+	uint32_t	worker_cost_percentile;		//!< for the scheduler
+	bool		work_stealing;			//!< for the scheduler
+	uint32_t	free_requests;			//!< Requests each worker keeps for reuse.
 
 #ifndef NDEBUG
 	uint32_t	ins_max;			//!< max instruction count
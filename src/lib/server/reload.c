@@ -0,0 +1,384 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file reload.c
+ * @brief Reload data built from files, in the background, when the files change.
+ *
+ * Modules such as rlm_files build an index from one or more files when
+ * they're instantiated.  With a reload interval, a thread checks the
+ * files for changes, builds a new index from them, and swaps it in.
+ *
+ * Workers never block.  They take a reference to the current data with
+ * fr_reload_data_acquire(), and drop it with fr_reload_data_release()
+ * when they're done with it, which must be before they yield.
+ *
+ * The references are counted in one of two slots, picked by the low bit
+ * of an epoch counter.  After publishing new data, the reload thread
+ * increments the epoch, so new readers use the other slot, and waits for
+ * the old slot to drain.  Nothing can be using the old data after that,
+ * so it's freed by the reload thread, not by a worker.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/reload.h>
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+/** A file which the data is built from
+ *
+ */
+typedef struct {
+	char const		*filename;
+	bool			exists;		//!< Whether the last stat() succeeded.
+	struct stat		loaded;		//!< When the data was last built.
+	struct stat		seen;		//!< At the last check.
+} fr_reload_file_t;
+
+struct fr_reload_s {
+	char const		*name;		//!< For log messages, usually the module name.
+
+	fr_reload_load_t	func;		//!< Builds the data.
+	void			*uctx;		//!< Passed to func.
+
+	fr_reload_file_t	*files;		//!< Files to check for changes.
+	fr_time_delta_t		interval;	//!< How often to check them.
+
+	atomic_uintptr_t	data;		//!< Current data.
+	atomic_uint		epoch;		//!< Low bit picks the slot readers are counted in.
+	atomic_uint		readers[2];	//!< Readers of the data, by slot.
+
+	bool			running;	//!< Whether the reload thread has been started.
+	bool			stop;		//!< Tells the reload thread to exit.
+	pthread_t		thread;
+	pthread_mutex_t		mutex;		//!< Protects stop.
+	pthread_cond_t		cond;		//!< Wakes the reload thread early, to stop it.
+};
+
+/** Whether a file has changed
+ *
+ */
+static inline bool reload_stat_cmp(struct stat const *a, struct stat const *b)
+{
+	return (a->st_mtime != b->st_mtime) || (a->st_size != b->st_size) ||
+	       (a->st_ino != b->st_ino) || (a->st_dev != b->st_dev);
+}
+
+/** Check the files for changes
+ *
+ * A file is only treated as changed when it has been the same for two
+ * checks in a row, so we don't read it while it's being written.
+ *
+ * @return
+ *	- true if the data should be rebuilt.
+ *	- false if nothing has changed.
+ */
+static bool reload_files_changed(fr_reload_t *reload)
+{
+	size_t	i, num = talloc_array_length(reload->files);
+	bool	changed = false, settled = true;
+
+	for (i = 0; i < num; i++) {
+		fr_reload_file_t	*file = &reload->files[i];
+		struct stat		st;
+
+		if (stat(file->filename, &st) < 0) {
+			if (file->exists) {
+				WARN("%s - Failed checking %s: %s.  Keeping existing data",
+				     reload->name, file->filename, fr_syserror(errno));
+				file->exists = false;
+			}
+			settled = false;
+			continue;
+		}
+		file->exists = true;
+
+		if (reload_stat_cmp(&st, &file->seen)) {
+			file->seen = st;
+			settled = false;
+			continue;
+		}
+
+		if (reload_stat_cmp(&st, &file->loaded)) changed = true;
+	}
+
+	return changed && settled;
+}
+
+/** Publish new data, and free the old data once no worker is using it
+ *
+ */
+static void reload_data_swap(fr_reload_t *reload, void *data)
+{
+	void		*old;
+	unsigned int	slot;
+
+	old = (void *) atomic_exchange(&reload->data, (uintptr_t) data);
+
+	/*
+	 *	New readers are counted in the other slot, and will
+	 *	see the new data.  Wait for the ones which might have
+	 *	the old data.
+	 */
+	slot = atomic_fetch_add(&reload->epoch, 1) & 0x01;
+	while (atomic_load(&reload->readers[slot]) != 0) nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+
+	talloc_free(old);
+}
+
+/** Rebuild the data from the files
+ *
+ */
+static void reload_data(fr_reload_t *reload)
+{
+	size_t	i, num = talloc_array_length(reload->files);
+	void	*data = NULL;
+
+	INFO("%s - Files have changed, reloading data", reload->name);
+
+	/*
+	 *	Don't try again until they change again.
+	 */
+	for (i = 0; i < num; i++) reload->files[i].loaded = reload->files[i].seen;
+
+	if (reload->func(&data, reload->uctx) < 0) {
+		PERROR("%s - Failed reloading data.  Keeping existing data", reload->name);
+		return;
+	}
+
+	reload_data_swap(reload, data);
+
+	INFO("%s - Reloaded data", reload->name);
+}
+
+static void *reload_thread(void *arg)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(arg, fr_reload_t);
+	int64_t		interval = fr_time_delta_unwrap(reload->interval);
+
+	pthread_mutex_lock(&reload->mutex);
+	while (!reload->stop) {
+		struct timespec	when;
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += interval / NSEC;
+		when.tv_nsec += interval % NSEC;
+		if (when.tv_nsec >= NSEC) {
+			when.tv_sec++;
+			when.tv_nsec -= NSEC;
+		}
+
+		(void) pthread_cond_timedwait(&reload->cond, &reload->mutex, &when);
+		if (reload->stop) break;
+
+		pthread_mutex_unlock(&reload->mutex);
+		if (reload_files_changed(reload)) reload_data(reload);
+		pthread_mutex_lock(&reload->mutex);
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return NULL;
+}
+
+static int _reload_free(fr_reload_t *reload)
+{
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->stop = true;
+		pthread_cond_signal(&reload->cond);
+		pthread_mutex_unlock(&reload->mutex);
+
+		pthread_join(reload->thread, NULL);
+	}
+
+	pthread_mutex_destroy(&reload->mutex);
+	pthread_cond_destroy(&reload->cond);
+
+	talloc_free((void *) atomic_load(&reload->data));
+
+	return 0;
+}
+
+/** Allocate a structure to manage data which is rebuilt when files change
+ *
+ * @note The reload thread must be stopped before anything it uses is freed,
+ *	so modules should free this in their detach callback.
+ *
+ * @param[in] ctx	to allocate in.
+ * @param[in] name	for log messages.  Usually the module instance name.
+ * @param[in] load	callback to build the data.
+ * @param[in] uctx	passed to load.
+ * @return
+ *	- A new reload structure on success.
+ *	- NULL on error.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name, fr_reload_load_t load, void *uctx)
+{
+	fr_reload_t *reload;
+
+	MEM(reload = talloc_zero(ctx, fr_reload_t));
+	MEM(reload->name = talloc_typed_strdup(reload, name));
+	MEM(reload->files = talloc_zero_array(reload, fr_reload_file_t, 0));
+	reload->func = load;
+	reload->uctx = uctx;
+
+	atomic_init(&reload->data, (uintptr_t) 0);
+	atomic_init(&reload->epoch, 0);
+	atomic_init(&reload->readers[0], 0);
+	atomic_init(&reload->readers[1], 0);
+
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->cond, NULL);
+	talloc_set_destructor(reload, _reload_free);
+
+	return reload;
+}
+
+/** Add a file to check for changes
+ *
+ * @param[in] reload	to add the file to.
+ * @param[in] filename	to check.  NULL is ignored, for optional files.
+ * @return
+ *	- 0 on success.
+ *	- -1 if called after fr_reload_start().
+ */
+int fr_reload_watch(fr_reload_t *reload, char const *filename)
+{
+	size_t num;
+
+	if (!filename) return 0;
+
+	if (reload->running) {
+		fr_strerror_const("Files must be added before the reload thread is started");
+		return -1;
+	}
+
+	num = talloc_array_length(reload->files);
+	MEM(reload->files = talloc_realloc(reload, reload->files, fr_reload_file_t, num + 1));
+	reload->files[num] = (fr_reload_file_t) {
+		.filename = talloc_typed_strdup(reload->files, filename)
+	};
+
+	return 0;
+}
+
+/** Build the data, and start checking the files for changes
+ *
+ * @param[in] reload	to start.
+ * @param[in] interval	between checks.  If zero, the data is built,
+ *			but never reloaded.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the data couldn't be built, or the thread couldn't be started.
+ */
+int fr_reload_start(fr_reload_t *reload, fr_time_delta_t interval)
+{
+	size_t	i, num = talloc_array_length(reload->files);
+	void	*data = NULL;
+	int	ret;
+
+	/*
+	 *	Record the state of the files before reading them,
+	 *	so that changes made while we're reading them
+	 *	trigger a reload.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_reload_file_t *file = &reload->files[i];
+
+		if (stat(file->filename, &file->loaded) == 0) file->exists = true;
+		file->seen = file->loaded;
+	}
+
+	if (reload->func(&data, reload->uctx) < 0) return -1;
+	atomic_store(&reload->data, (uintptr_t) data);
+
+	if (!fr_time_delta_ispos(interval) || (num == 0)) return 0;
+
+	reload->interval = interval;
+
+	ret = pthread_create(&reload->thread, NULL, reload_thread, reload);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating reload thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	reload->running = true;
+
+	return 0;
+}
+
+/** Get the current data
+ *
+ * Must be paired with a call to fr_reload_data_release() before the caller
+ * yields, as the reload thread waits for all readers of the old data.
+ *
+ * @param[in] reload	to get the data from.
+ * @param[out] slot	to pass to fr_reload_data_release().
+ * @return the current data.
+ */
+void *fr_reload_data_acquire(fr_reload_t *reload, unsigned int *slot)
+{
+	unsigned int epoch;
+
+	/*
+	 *	The data never changes, so we don't need to count
+	 *	the readers.
+	 */
+	if (!reload->running) {
+		*slot = 0;
+		return (void *) atomic_load_explicit(&reload->data, memory_order_relaxed);
+	}
+
+	/*
+	 *	If the epoch changed before we were counted, the reload
+	 *	thread may already have checked our slot, so try again.
+	 */
+	for (;;) {
+		epoch = atomic_load(&reload->epoch);
+		atomic_fetch_add(&reload->readers[epoch & 0x01], 1);
+		if (atomic_load(&reload->epoch) == epoch) break;
+		atomic_fetch_sub(&reload->readers[epoch & 0x01], 1);
+	}
+	*slot = epoch & 0x01;
+
+	return (void *) atomic_load(&reload->data);
+}
+
+/** Release data returned by fr_reload_data_acquire()
+ *
+ * @param[in] reload	the data was acquired from.
+ * @param[in] slot	from fr_reload_data_acquire().
+ */
+void fr_reload_data_release(fr_reload_t *reload, unsigned int slot)
+{
+	if (!reload->running) return;
+
+	atomic_fetch_sub(&reload->readers[slot], 1);
+}
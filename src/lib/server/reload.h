@@ -0,0 +1,65 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief Reload data built from files, in the background, when the files change.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_reload_s fr_reload_t;
+
+/** Build a new copy of the data from the watched files
+ *
+ * Called from instantiate, and then from the reload thread whenever the
+ * files change.  When called from the reload thread, it runs concurrently
+ * with the workers, so it must not modify anything they use.
+ *
+ * @param[out] out	The new data.  Must be allocated in the NULL ctx, and
+ *			will be freed with talloc_free() once no worker
+ *			is using it.
+ * @param[in] uctx	passed to fr_reload_alloc().
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, in which case the existing data is kept.
+ */
+typedef int (*fr_reload_load_t)(void **out, void *uctx);
+
+fr_reload_t	*fr_reload_alloc(TALLOC_CTX *ctx, char const *name, fr_reload_load_t load, void *uctx);
+
+int		fr_reload_watch(fr_reload_t *reload, char const *filename) CC_HINT(nonnull(1));
+
+int		fr_reload_start(fr_reload_t *reload, fr_time_delta_t interval) CC_HINT(nonnull);
+
+void		*fr_reload_data_acquire(fr_reload_t *reload, unsigned int *slot) CC_HINT(nonnull);
+
+void		fr_reload_data_release(fr_reload_t *reload, unsigned int slot) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,294 @@
+/** Tests for reloading data built from files
+ *
+ * @file src/lib/server/reload_tests.c
+ *
+ * @copyright 2026 Network RADIUS SAS (legal@networkradius.com)
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <freeradius-devel/server/reload.h>
+
+#include <unistd.h>
+
+static TALLOC_CTX	*autofree;
+
+/** Data built from a file containing a number
+ *
+ */
+typedef struct {
+	int			value;
+	bool			*freed;		//!< Set when the data is freed.
+} test_data_t;
+
+typedef struct {
+	char const		*filename;
+	unsigned int		loads;		//!< How many times the data has been built.
+	bool			freed[8];	//!< Whether the data from each load has been freed.
+} test_ctx_t;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+		fr_perror("reload_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+static int _test_data_free(test_data_t *data)
+{
+	*data->freed = true;
+
+	return 0;
+}
+
+/** Build the data, failing if the file doesn't contain a number
+ *
+ */
+static int test_load(void **out, void *uctx)
+{
+	test_ctx_t	*test = uctx;
+	test_data_t	*data;
+	FILE		*fp;
+	int		value;
+
+	fp = fopen(test->filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", test->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fscanf(fp, "%d", &value) != 1) {
+		fclose(fp);
+		fr_strerror_printf("No number in %s", test->filename);
+		return -1;
+	}
+	fclose(fp);
+
+	if (test->loads >= NUM_ELEMENTS(test->freed)) {
+		fr_strerror_const("Too many loads");
+		return -1;
+	}
+
+	MEM(data = talloc_zero(NULL, test_data_t));
+	data->value = value;
+	data->freed = &test->freed[test->loads++];
+	talloc_set_destructor(data, _test_data_free);
+
+	*out = data;
+	return 0;
+}
+
+static void test_file_write(char const *filename, char const *contents)
+{
+	FILE *fp;
+
+	fp = fopen(filename, "w");
+	TEST_ASSERT(fp != NULL);
+	TEST_CHECK(fputs(contents, fp) >= 0);
+	fclose(fp);
+}
+
+/** Return the value of the current data
+ *
+ */
+static int test_value(fr_reload_t *reload)
+{
+	test_data_t	*data;
+	unsigned int	slot;
+	int		value;
+
+	data = fr_reload_data_acquire(reload, &slot);
+	value = data->value;
+	fr_reload_data_release(reload, slot);
+
+	return value;
+}
+
+/** Wait up to five seconds for the current data to have a value
+ *
+ */
+static bool test_value_wait(fr_reload_t *reload, int value)
+{
+	int i;
+
+	for (i = 0; i < 500; i++) {
+		if (test_value(reload) == value) return true;
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+
+	return false;
+}
+
+/** Wait up to five seconds for a flag to be set by the reload thread
+ *
+ */
+static bool test_flag_wait(bool const *flag)
+{
+	int i;
+
+	for (i = 0; i < 500; i++) {
+		if (__atomic_load_n(flag, __ATOMIC_SEQ_CST)) return true;
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+
+	return false;
+}
+
+static char *test_file_alloc(char const *contents)
+{
+	char	*filename;
+	int	fd;
+
+	filename = talloc_typed_strdup(autofree, "/tmp/reload_tests.XXXXXX");
+	fd = mkstemp(filename);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+
+	test_file_write(filename, contents);
+
+	return filename;
+}
+
+static void test_no_interval(void)
+{
+	test_ctx_t	test = { .filename = test_file_alloc("1\n") };
+	fr_reload_t	*reload;
+
+	reload = fr_reload_alloc(autofree, "test", test_load, &test);
+	TEST_CHECK(fr_reload_watch(reload, test.filename) == 0);
+
+	TEST_CASE("Data is built once when there's no interval");
+	TEST_CHECK(fr_reload_start(reload, fr_time_delta_wrap(0)) == 0);
+	TEST_CHECK_RET(test_value(reload), 1);
+	TEST_CHECK_RET(test.loads, 1);
+
+	TEST_CASE("Data is freed with the reload structure");
+	talloc_free(reload);
+	TEST_CHECK(test.freed[0]);
+
+	unlink(test.filename);
+}
+
+static void test_handoff(void)
+{
+	test_ctx_t	test = { .filename = test_file_alloc("1\n") };
+	fr_reload_t	*reload;
+	test_data_t	*old;
+	unsigned int	slot;
+
+	reload = fr_reload_alloc(autofree, "test", test_load, &test);
+	TEST_CHECK(fr_reload_watch(reload, test.filename) == 0);
+	TEST_CHECK(fr_reload_start(reload, fr_time_delta_from_msec(10)) == 0);
+	TEST_CHECK_RET(test_value(reload), 1);
+
+	TEST_CASE("Data held by a reader isn't freed when new data is published");
+	old = fr_reload_data_acquire(reload, &slot);
+	TEST_CHECK_RET(old->value, 1);
+
+	test_file_write(test.filename, "22\n");
+	TEST_CHECK(test_value_wait(reload, 22));
+	TEST_CHECK_RET(old->value, 1);
+	TEST_CHECK(!test.freed[0]);
+
+	TEST_CASE("Data is freed once the last reader releases it");
+	fr_reload_data_release(reload, slot);
+	TEST_CHECK(test_flag_wait(&test.freed[0]));
+	TEST_CHECK(!test.freed[1]);
+
+	TEST_CASE("Readers of the second data are waited for too");
+	old = fr_reload_data_acquire(reload, &slot);
+	TEST_CHECK_RET(old->value, 22);
+
+	test_file_write(test.filename, "333\n");
+	TEST_CHECK(test_value_wait(reload, 333));
+	TEST_CHECK(!test.freed[1]);
+
+	fr_reload_data_release(reload, slot);
+	TEST_CHECK(test_flag_wait(&test.freed[1]));
+
+	talloc_free(reload);
+	TEST_CHECK(test.freed[2]);
+
+	unlink(test.filename);
+}
+
+static void test_failed_reload(void)
+{
+	test_ctx_t	test = { .filename = test_file_alloc("1\n") };
+	fr_reload_t	*reload;
+	int		i;
+
+	reload = fr_reload_alloc(autofree, "test", test_load, &test);
+	TEST_CHECK(fr_reload_watch(reload, test.filename) == 0);
+	TEST_CHECK(fr_reload_start(reload, fr_time_delta_from_msec(10)) == 0);
+
+	TEST_CASE("The existing data is kept when the new data can't be built");
+	test_file_write(test.filename, "invalid\n");
+
+	/*
+	 *	Long enough for the change to be seen, and
+	 *	for the file to have settled.
+	 */
+	for (i = 0; i < 50; i++) {
+		TEST_CHECK_RET(test_value(reload), 1);
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	TEST_CHECK_RET(test.loads, 1);
+	TEST_CHECK(!test.freed[0]);
+
+	TEST_CASE("The data is built once the file is fixed");
+	test_file_write(test.filename, "4444\n");
+	TEST_CHECK(test_value_wait(reload, 4444));
+	TEST_CHECK(test_flag_wait(&test.freed[0]));
+
+	talloc_free(reload);
+
+	unlink(test.filename);
+}
+
+static void test_initial_failure(void)
+{
+	test_ctx_t	test = { .filename = test_file_alloc("invalid\n") };
+	fr_reload_t	*reload;
+
+	reload = fr_reload_alloc(autofree, "test", test_load, &test);
+	TEST_CHECK(fr_reload_watch(reload, test.filename) == 0);
+
+	TEST_CASE("Starting fails if the data can't be built");
+	TEST_CHECK(fr_reload_start(reload, fr_time_delta_from_msec(10)) < 0);
+
+	TEST_CASE("Files can't be added once the thread is started");
+	test_file_write(test.filename, "1\n");
+	TEST_CHECK(fr_reload_start(reload, fr_time_delta_from_msec(10)) == 0);
+	TEST_CHECK(fr_reload_watch(reload, test.filename) < 0);
+
+	talloc_free(reload);
+
+	unlink(test.filename);
+}
+
+TEST_LIST = {
+	{ "no_interval",	test_no_interval },
+	{ "handoff",		test_handoff },
+	{ "failed_reload",	test_failed_reload },
+	{ "initial_failure",	test_initial_failure },
+
+	{ NULL }
+};
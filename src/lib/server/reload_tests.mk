@@ -0,0 +1,8 @@
+TARGET		:= reload_tests$(E)
+SOURCES		:= reload_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-server$(L)
+
+TGT_INSTALLDIR	:=
@@ -61,6 +61,163 @@ fr_dict_attr_autoload_t request_dict_attr[] = {
  */
 static _Thread_local fr_dlist_head_t *request_free_list; /* macro */
 
+/** Maximum number of requests each thread keeps in its free list
+ *
+ */
+static uint32_t request_free_list_max = 256;
+
+/** Initial size of the arena the request's pair lists are allocated from
+ *
+ * Enough for the decoded request, and the reply, for most protocols.
+ * Allocations which don't fit fall back to malloc.  Once enough requests
+ * have been seen for a virtual server, its arenas are sized from their
+ * usage instead.
+ */
+#define REQUEST_ARENA_SIZE	(16 * 1024)
+
+#define REQUEST_ARENA_MIN	(1024)			//!< Smallest arena, and the first histogram bucket.
+#define REQUEST_ARENA_BUCKETS	(10)			//!< Powers of two, so the largest arena is 512k.
+#define REQUEST_ARENA_SAMPLES	(64)			//!< Resize after this many requests.
+#define REQUEST_ARENA_DECAY	(1024)			//!< Halve the histogram after this many requests.
+#define REQUEST_ARENA_PERCENTILE (95)			//!< Fraction of requests which should fit in the arena.
+
+/** Approximate overhead of each talloc chunk allocated from the arena
+ *
+ * talloc doesn't publish the size of its headers, and talloc_total_size()
+ * only counts the memory which was asked for.
+ */
+#define REQUEST_ARENA_CHUNK_OVERHEAD	(96)
+
+/** Arena usage for the requests of one virtual server
+ *
+ */
+struct request_arena_profile_s {
+	fr_rb_node_t		node;		//!< In the tree of profiles.
+	CONF_SECTION const	*server_cs;	//!< Virtual server.  NULL for requests with no virtual server.
+
+	uint32_t		hist[REQUEST_ARENA_BUCKETS];	//!< Usage, as powers of two from REQUEST_ARENA_MIN.
+	uint32_t		samples;	//!< Number of requests in the histogram.
+	uint32_t		pending;	//!< Requests recorded since the arena size was last calculated.
+
+	size_t			size;		//!< Size of new arenas.
+
+	uint64_t		requests;	//!< Requests whose arena usage was recorded.
+	size_t			max_used;	//!< High-water mark of arena usage.
+
+	request_arena_profile_t	*next;		//!< Previously created profile, so the profiles
+						///< can be walked by other threads.
+};
+
+/** The thread local tree of request_arena_profile_t, by virtual server
+ *
+ * Parented by the free list, so that it's freed after the requests in it.
+ */
+static _Thread_local fr_rb_tree_t *request_arena_profiles;
+
+static _Thread_local request_arena_stats_t request_arena_thread_stats;
+
+static int8_t request_arena_profile_cmp(void const *one, void const *two)
+{
+	request_arena_profile_t const *a = one, *b = two;
+
+	return CMP(a->server_cs, b->server_cs);
+}
+
+/** Find or create the arena profile for a virtual server
+ *
+ */
+static request_arena_profile_t *request_arena_profile_find(CONF_SECTION const *server_cs)
+{
+	request_arena_profile_t *profile;
+
+	profile = fr_rb_find(request_arena_profiles, &(request_arena_profile_t){ .server_cs = server_cs });
+	if (profile) return profile;
+
+	MEM(profile = talloc_zero(request_arena_profiles, request_arena_profile_t));
+	profile->server_cs = server_cs;
+	profile->size = REQUEST_ARENA_SIZE;
+	fr_rb_insert(request_arena_profiles, profile);
+
+	/*
+	 *	The tree can't be walked while it's being
+	 *	modified, so the stats are read from a list
+	 *	which is only ever added to.
+	 */
+	profile->next = request_arena_thread_stats.profiles;
+	__atomic_store_n(&request_arena_thread_stats.profiles, profile, __ATOMIC_RELEASE);
+
+	return profile;
+}
+
+/** Calculate the arena size which fits REQUEST_ARENA_PERCENTILE of the requests
+ *
+ */
+static void request_arena_profile_size(request_arena_profile_t *profile)
+{
+	uint64_t	want, total = 0;
+	size_t		size = REQUEST_ARENA_MIN;
+	unsigned int	i;
+
+	want = ((uint64_t) profile->samples * REQUEST_ARENA_PERCENTILE + 99) / 100;
+
+	for (i = 0; i < REQUEST_ARENA_BUCKETS; i++, size <<= 1) {
+		total += profile->hist[i];
+		if (total >= want) break;
+	}
+	if (i == REQUEST_ARENA_BUCKETS) size >>= 1;
+
+	if (size == profile->size) return;
+
+	DEBUG3("Resizing request arenas for virtual server %s from %zu to %zu bytes",
+	       profile->server_cs ? cf_section_name2(profile->server_cs) : "<none>", profile->size, size);
+	profile->size = size;
+}
+
+/** Record how much of its arena a request used
+ *
+ * Must be called before the arena is reset.
+ *
+ * Chunks which were freed while the request was running don't count,
+ * even though the pool doesn't get their memory back, so this is a
+ * slight underestimate.
+ */
+static void request_arena_record(request_t *request)
+{
+	request_arena_profile_t	*profile = request->arena_profile;
+	size_t			used;
+	unsigned int		i;
+
+	used = talloc_total_size(request->arena) - talloc_get_size(request->arena);
+	used += (talloc_total_blocks(request->arena) - 1) * REQUEST_ARENA_CHUNK_OVERHEAD;
+
+	request_arena_thread_stats.requests++;
+	if (used > request->arena_size) request_arena_thread_stats.overflows++;
+	if (used > request_arena_thread_stats.max_used) request_arena_thread_stats.max_used = used;
+
+	profile->requests++;
+	if (used > profile->max_used) profile->max_used = used;
+
+	for (i = 0; (i < (REQUEST_ARENA_BUCKETS - 1)) && (used > ((size_t) REQUEST_ARENA_MIN << i)); i++);
+	profile->hist[i]++;
+	profile->samples++;
+
+	if (++profile->pending >= REQUEST_ARENA_SAMPLES) {
+		request_arena_profile_size(profile);
+		profile->pending = 0;
+	}
+
+	/*
+	 *	Forget old requests, so we follow changes in traffic.
+	 */
+	if (profile->samples >= REQUEST_ARENA_DECAY) {
+		profile->samples = 0;
+		for (i = 0; i < REQUEST_ARENA_BUCKETS; i++) {
+			profile->hist[i] >>= 1;
+			profile->samples += profile->hist[i];
+		}
+	}
+}
+
 #ifndef NDEBUG
 static int _state_ctx_free(fr_pair_t *state)
 {
@@ -167,8 +324,10 @@ static inline CC_HINT(always_inline) int request_child_init(request_t *child, re
  */
 static inline CC_HINT(always_inline) int request_init(char const *file, int line,
 						      request_t *request, request_type_t type,
-						      request_init_args_t const *args)
+						      request_init_args_t const *args, size_t arena_size)
 {
+	TALLOC_CTX	*arena = request->arena;
+	size_t		old_size = request->arena_size;
 
 	/*
 	 *	Sanity checks for different requests types
@@ -202,6 +361,25 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 		.alloc_line = line
 	};
 
+	/*
+	 *	The arena is kept when the request is returned to
+	 *	the free list, so we only need to allocate it once,
+	 *	unless it's too small for the requests of this
+	 *	virtual server, or much too large.
+	 */
+	if (arena && ((old_size < arena_size) || (old_size > (arena_size * 4)))) {
+		talloc_free(arena);
+		arena = NULL;
+		request_arena_thread_stats.resized++;
+	}
+
+	if (!arena) {
+		MEM(arena = talloc_pool(NULL, arena_size));
+		talloc_set_name_const(arena, "request_arena");
+		old_size = arena_size;
+	}
+	request->arena = arena;
+	request->arena_size = old_size;
 
 	/*
 	 *	Initialise the stack
@@ -222,7 +400,7 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 		 *	free its children when it is
 		 *	freed.
 		 */
-		pair_root = fr_pair_root_afrom_da(request, request_attr_root);
+		pair_root = fr_pair_root_afrom_da(request->arena, request_attr_root);
 		if (unlikely(!pair_root)) return -1;
 		request->pair_root = pair_root;
 
@@ -243,6 +421,7 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 			return -1; \
 		} \
 		fr_pair_append(&pair_root->children, vp); \
+		fr_pair_list_index_enable(&vp->children); \
 		request->pair_list._list = vp; \
 	} while(0)
 
@@ -287,6 +466,8 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
  */
 static int _request_free(request_t *request)
 {
+	TALLOC_CTX *arena;
+
 	fr_assert_msg(!fr_heap_entry_inserted(request->time_order_id),
 		      "alloced %s:%i: %s still in the time_order heap ID %i",
 		      request->alloc_file,
@@ -311,25 +492,39 @@ static int _request_free(request_t *request)
 		goto really_free;
 	}
 
+	if (request->arena_profile) request_arena_record(request);
+
 	/*
 	 *	We keep a buffer of <active> + N requests per
 	 *	thread, to avoid spurious allocations.
 	 */
-	if (fr_dlist_num_elements(request_free_list) <= 256) {
+	if (fr_dlist_num_elements(request_free_list) < request_free_list_max) {
 		fr_dlist_head_t		*free_list;
+		size_t			arena_size;
 
 		if (request->session_state_ctx) {
 			fr_assert(talloc_parent(request->session_state_ctx) != request);	/* Should never be directly parented */
 			TALLOC_FREE(request->session_state_ctx);				/* Not parented from the request */
 		}
 		free_list = request_free_list;
+		arena = request->arena;
+		arena_size = request->arena_size;
 
 		/*
 		 *	Reinitialise the request
 		 */
 		talloc_free_children(request);
 
+		/*
+		 *	Free the pair lists after anything which
+		 *	might reference them.  If nothing was stolen
+		 *	out of the arena, this resets it.
+		 */
+		talloc_free_children(arena);
+
 		memset(request, 0, sizeof(*request));
+		request->arena = arena;
+		request->arena_size = arena_size;
 		request->component = "free_list";
 #ifndef NDEBUG
 		/*
@@ -363,6 +558,12 @@ really_free:
 	 */
 	if (request->session_state_ctx) TALLOC_FREE(request->session_state_ctx);
 
+	/*
+	 *	As is the arena.  Any chunks which were stolen
+	 *	from it keep the memory alive until they're freed.
+	 */
+	TALLOC_FREE(request->arena);
+
 #ifndef NDEBUG
 	request->magic = 0x01020304;	/* set the request to be nonsense */
 #endif
@@ -382,6 +583,10 @@ static int _request_free_list_free_on_exit(void *arg)
 	 *	See the destructor for why this works
 	 */
 	while ((request = fr_dlist_head(list))) if (talloc_free(request) < 0) return -1;
+
+	request_arena_thread_stats.profiles = NULL;
+	request_arena_profiles = NULL;	/* Freed with the list */
+
 	return talloc_free(list);
 }
 
@@ -410,6 +615,9 @@ static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *c
 					   ));
 	fr_assert(ctx != request);
 
+	request->arena = NULL;
+	request->arena_size = 0;
+
 	return request;
 }
 
@@ -429,6 +637,7 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 {
 	request_t		*request;
 	fr_dlist_head_t		*free_list;
+	request_arena_profile_t	*profile;
 
 	if (!args) args = &default_args;
 
@@ -439,11 +648,15 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 	if (unlikely(!request_free_list)) {
 		MEM(free_list = talloc(NULL, fr_dlist_head_t));
 		fr_dlist_init(free_list, request_t, free_entry);
+		MEM(request_arena_profiles = fr_rb_inline_talloc_alloc(free_list, request_arena_profile_t, node,
+								       request_arena_profile_cmp, NULL));
 		fr_atexit_thread_local(request_free_list, _request_free_list_free_on_exit, free_list);
 	} else {
 		free_list = request_free_list;
 	}
 
+	profile = request_arena_profile_find(args->server_cs);
+
 	request = fr_dlist_head(free_list);
 	if (!request) {
 		/*
@@ -460,10 +673,11 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 		fr_dlist_remove(free_list, request);
 	}
 
-	if (request_init(file, line, request, type, args) < 0) {
+	if (request_init(file, line, request, type, args, profile->size) < 0) {
 		talloc_free(request);
 		return NULL;
 	}
+	request->arena_profile = profile;
 
 	/*
 	 *	Initialise entry in free list
@@ -518,6 +732,8 @@ static int _request_local_free(request_t *request)
 		talloc_free(request->session_state_ctx);
 	}
 
+	TALLOC_FREE(request->arena);
+
 #ifndef NDEBUG
 	request->magic = 0x01020304;	/* set the request to be nonsense */
 #endif
@@ -539,7 +755,7 @@ request_t *_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx,
 	if (!args) args = &default_args;
 
 	request = request_alloc_pool(ctx);
-	if (request_init(file, line, request, type, args) < 0) return NULL;
+	if (request_init(file, line, request, type, args, REQUEST_ARENA_SIZE) < 0) return NULL;
 
 	talloc_set_destructor(request, _request_local_free);
 
@@ -625,6 +841,48 @@ int request_detach(request_t *child)
 	return 0;
 }
 
+/** Return the statistics for the arenas of requests allocated by this thread
+ *
+ * The statistics are thread local, but the pointer remains valid for the
+ * life of the thread, so it can be read from other threads.
+ */
+request_arena_stats_t const *request_arena_stats(void)
+{
+	return &request_arena_thread_stats;
+}
+
+/** Call a function for the arena usage of each virtual server
+ *
+ * May be called from other threads.  Virtual servers added while the
+ * profiles are being walked may be missed.
+ *
+ * @param[in] stats	returned by request_arena_stats() in the thread
+ *			which allocated the requests.
+ * @param[in] walker	called for each virtual server.
+ * @param[in] uctx	passed to walker.
+ */
+void request_arena_server_walk(request_arena_stats_t const *stats, request_arena_server_walk_t walker, void *uctx)
+{
+	request_arena_profile_t const *profile;
+
+	for (profile = __atomic_load_n(&stats->profiles, __ATOMIC_ACQUIRE);
+	     profile;
+	     profile = profile->next) {
+		walker(profile->server_cs, profile->requests, profile->size, profile->max_used, uctx);
+	}
+}
+
+/** Set the maximum number of requests each thread keeps in its free list
+ *
+ * Should be called before the worker threads are started.
+ *
+ * @param[in] max	number of requests.  0 disables the free list.
+ */
+void request_free_list_max_set(uint32_t max)
+{
+	request_free_list_max = max;
+}
+
 int request_global_init(void)
 {
 	if (fr_dict_autoload(request_dict) < 0) {
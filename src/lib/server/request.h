@@ -37,10 +37,13 @@ typedef struct request_s request_t;
 
 typedef struct fr_client_s fr_client_t;
 
+typedef struct request_arena_profile_s request_arena_profile_t;
+
 #ifdef __cplusplus
 }
 #endif
 
+#include <freeradius-devel/server/cf_util.h>
 #include <freeradius-devel/server/log.h>
 #include <freeradius-devel/server/rcode.h>
 #include <freeradius-devel/server/signal.h>
@@ -188,6 +191,21 @@ struct request_s {
 	fr_pair_t		*pair_root;	//!< Root atribute which contains the
 						///< other list attributes as children.
 
+	/** Arena the pair lists are allocated from
+	 *
+	 * A talloc pool, so pairs and value buffers decoded into the
+	 * request's lists are bump allocated, and released together
+	 * when the request completes.
+	 *
+	 * @note Anything which needs to outlive the request should be
+	 *	 copied out of its lists, not stolen.  Stolen chunks keep
+	 *	 the whole arena allocated until they're freed.
+	 */
+	TALLOC_CTX		*arena;
+	size_t			arena_size;	//!< How large the arena is.
+	request_arena_profile_t	*arena_profile;	//!< Usage of the arenas of requests for the same
+						///< virtual server.  Used to size new arenas.
+
 	/** Pair lists associated with the request
 	 *
 	 * @warning DO NOT allocate pairs directly beneath the root
@@ -264,8 +282,37 @@ typedef struct {
 
 	bool			detachable;	//!< Request should be detachable, i.e. able to run even
 						///< if its parent exits.
+
+	CONF_SECTION const	*server_cs;	//!< Virtual server the request will be run through.
+						///< The request's arena is sized from the usage of
+						///< previous requests for the same virtual server.
 } request_init_args_t;
 
+/** Statistics for the arenas of the requests allocated by a thread
+ *
+ */
+typedef struct {
+	uint64_t		requests;	//!< Requests whose arena usage was recorded.
+	uint64_t		overflows;	//!< Requests which used more memory than their arena held,
+						///< so some of their allocations fell back to malloc.
+	uint64_t		resized;	//!< Arenas which were replaced with one of a different size.
+	size_t			max_used;	//!< High-water mark of arena usage.
+
+	request_arena_profile_t	*profiles;	//!< Usage for each virtual server.
+						///< Read with request_arena_server_walk().
+} request_arena_stats_t;
+
+/** Called with the arena usage of a virtual server
+ *
+ * @param[in] server_cs	virtual server.  NULL for requests with no virtual server.
+ * @param[in] requests	whose arena usage was recorded.
+ * @param[in] size	of new arenas for the virtual server.
+ * @param[in] max_used	high-water mark of arena usage.
+ * @param[in] uctx	passed to request_arena_server_walk().
+ */
+typedef void (*request_arena_server_walk_t)(CONF_SECTION const *server_cs, uint64_t requests,
+					     size_t size, size_t max_used, void *uctx);
+
 #ifdef WITH_VERIFY_PTR
 #  define REQUEST_VERIFY(_x) request_verify(__FILE__, __LINE__, _x)
 #else
@@ -332,6 +379,13 @@ fr_pair_t	*request_state_replace(request_t *request, fr_pair_t *state) CC_HINT(n
 
 int		request_detach(request_t *child);
 
+request_arena_stats_t const *request_arena_stats(void);
+
+void		request_arena_server_walk(request_arena_stats_t const *stats,
+					  request_arena_server_walk_t walker, void *uctx);
+
+void		request_free_list_max_set(uint32_t max);
+
 int		request_global_init(void);
 void		request_global_free(void);
 
@@ -0,0 +1,162 @@
+/** Tests for sizing request arenas
+ *
+ * @file src/lib/server/request_tests.c
+ *
+ * @copyright 2026 Network RADIUS SAS (legal@networkradius.com)
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict_test.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <freeradius-devel/server/cf_util.h>
+#include <freeradius-devel/server/request.h>
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*test_dict;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("request_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+/** Allocate a request for a virtual server, and return it to the free list after using some of its arena
+ *
+ */
+static size_t request_use(CONF_SECTION const *server_cs, size_t used)
+{
+	request_t	*request;
+	size_t		arena_size;
+
+	request = request_alloc_internal(NULL, (&(request_init_args_t){ .server_cs = server_cs }));
+	TEST_ASSERT(request != NULL);
+
+	arena_size = request->arena_size;
+	if (used) TEST_CHECK(talloc_zero_array(request->arena, uint8_t, used) != NULL);
+
+	talloc_free(request);
+
+	return arena_size;
+}
+
+typedef struct {
+	CONF_SECTION const	*server_cs;
+	uint64_t		requests;
+	size_t			size;
+	size_t			max_used;
+} test_server_stats_t;
+
+static void test_server_walk(CONF_SECTION const *server_cs, uint64_t requests,
+			     size_t size, size_t max_used, void *uctx)
+{
+	test_server_stats_t *stats = uctx;
+
+	if (server_cs != stats->server_cs) return;
+
+	stats->requests = requests;
+	stats->size = size;
+	stats->max_used = max_used;
+}
+
+/*
+ *	Profiles are found by the address of the virtual server, so the
+ *	sections are left for autofree, to keep the tests independent
+ *	when they're run in one process.
+ */
+static void test_arena_default(void)
+{
+	CONF_SECTION	*server_cs;
+	size_t		arena_size;
+
+	server_cs = cf_section_alloc(autofree, NULL, "server", "default");
+
+	TEST_CASE("New virtual servers start with 16k arenas");
+	arena_size = request_use(server_cs, 0);
+	TEST_CHECK_RET(arena_size, 16 * 1024);
+
+	TEST_CASE("Requests without a virtual server start with 16k arenas");
+	arena_size = request_use(NULL, 0);
+	TEST_CHECK_RET(arena_size, 16 * 1024);
+}
+
+static void test_arena_resize(void)
+{
+	CONF_SECTION		*large_cs, *small_cs;
+	request_arena_stats_t	before = *request_arena_stats();
+	request_arena_stats_t const *after;
+	size_t			arena_size;
+	test_server_stats_t	large = {}, small = {};
+	int			i;
+
+	large_cs = cf_section_alloc(autofree, NULL, "server", "large");
+	small_cs = cf_section_alloc(autofree, NULL, "server", "small");
+
+	TEST_CASE("Requests using more than their arena are counted as overflows");
+	for (i = 0; i < 64; i++) request_use(large_cs, 100 * 1024);
+
+	after = request_arena_stats();
+	TEST_CHECK_RET(after->requests - before.requests, 64);
+	TEST_CHECK_RET(after->overflows - before.overflows, 64);
+	TEST_CHECK(after->max_used >= (100 * 1024));
+
+	TEST_CASE("The arena is resized to fit the usage of the virtual server");
+	arena_size = request_use(large_cs, 0);
+	TEST_CHECK_RET(arena_size, 128 * 1024);
+	TEST_CHECK_RET(after->resized - before.resized, 1);
+
+	TEST_CASE("Other virtual servers aren't affected, and much larger arenas are replaced");
+	arena_size = request_use(small_cs, 0);
+	TEST_CHECK_RET(arena_size, 16 * 1024);
+	TEST_CHECK_RET(after->resized - before.resized, 2);
+
+	TEST_CASE("Arenas which are large enough, and not much too large, are kept");
+	arena_size = request_use(small_cs, 0);
+	TEST_CHECK_RET(arena_size, 16 * 1024);
+	TEST_CHECK_RET(after->resized - before.resized, 2);
+
+	TEST_CASE("The usage of each virtual server is reported");
+	large.server_cs = large_cs;
+	request_arena_server_walk(after, test_server_walk, &large);
+	TEST_CHECK_RET(large.requests, 65);
+	TEST_CHECK_RET(large.size, 128 * 1024);
+	TEST_CHECK(large.max_used >= (100 * 1024));
+
+	small.server_cs = small_cs;
+	request_arena_server_walk(after, test_server_walk, &small);
+	TEST_CHECK_RET(small.requests, 2);
+	TEST_CHECK_RET(small.size, 16 * 1024);
+	TEST_CHECK(small.max_used < (16 * 1024));
+}
+
+TEST_LIST = {
+	{ "arena_default",	test_arena_default },
+	{ "arena_resize",	test_arena_resize },
+
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= request_tests$(E)
+SOURCES		:= request_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-server$(L) libfreeradius-unlang$(L)
+
+TGT_INSTALLDIR	:=
@@ -1510,6 +1510,8 @@ int virtual_servers_instantiate(void)
 		}
 	}
 
+	unlang_compile_stats_dump();
+
 	return 0;
 }
 
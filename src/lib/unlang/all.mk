@@ -28,6 +28,7 @@ SOURCES	:=	base.c \
 		xlat.c \
 		xlat_alloc.c \
 		xlat_builtin.c \
+		xlat_bytecode.c \
 		xlat_eval.c \
 		xlat_expr.c \
 		xlat_func.c \
@@ -52,4 +53,4 @@ LOG_ID_LIB	:= 2
 $(call DEFINE_LOG_ID_SECTION,compile,	1,compile.c)
 $(call DEFINE_LOG_ID_SECTION,keywords,	2,call.c caller.c condition.c detach.c foreach.c function.c group.c io.c load_balance.c map.c module.c parallel.c return.c subrequest.c subrequest_child.c switch.c)
 $(call DEFINE_LOG_ID_SECTION,interpret,	3, interpret.c interpret_synchronous.c)
-$(call DEFINE_LOG_ID_SECTION,expand,	4,tmpl.c xlat.c xlat_builtin.c xlat_eval.c xlat_inst.c xlat_pair.c xlat_tokenize.c)
+$(call DEFINE_LOG_ID_SECTION,expand,	4,tmpl.c xlat.c xlat_builtin.c xlat_bytecode.c xlat_eval.c xlat_inst.c xlat_pair.c xlat_tokenize.c)
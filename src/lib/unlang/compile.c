@@ -46,6 +46,23 @@ RCSID("$Id$")
 
 #define UNLANG_IGNORE ((unlang_t *) -1)
 
+#define UNLANG_JUMP_TABLE_MIN		(4)	//!< Minimum number of values for a jump table.
+#define UNLANG_JUMP_TABLE_DENSITY	(2)	//!< Maximum number of entries in a jump table, per value.
+#define UNLANG_COND_DISPATCH_MIN	(4)	//!< Minimum number of 'if' / 'elsif' to replace with a lookup.
+
+/** Counters for the lookup tables created when compiling
+ *
+ */
+typedef struct {
+	uint64_t	switch_htrie;		//!< 'switch' statements using an htrie.
+	uint64_t	switch_jump;		//!< 'switch' statements using a jump table.
+	uint64_t	cond_htrie;		//!< 'if' / 'elsif' chains replaced with an htrie.
+	uint64_t	cond_jump;		//!< 'if' / 'elsif' chains replaced with a jump table.
+	uint64_t	cond_dispatched;	//!< Conditions in those chains.
+} unlang_compile_stats_t;
+
+static unlang_compile_stats_t unlang_compile_stats;
+
 static unsigned int unlang_number = 1;
 
 /*
@@ -2165,6 +2182,236 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Create a jump table, if the values are dense enough
+ *
+ * @param[in] ctx	to allocate the table in.
+ * @param[in] values	to look up.
+ * @param[in] targets	instruction to run for each value.
+ * @param[in] num	number of values.
+ * @return
+ *	- the jump table.
+ *	- NULL if the values aren't integers, or if there are too many gaps between them.
+ */
+static unlang_jump_table_t *jump_table_alloc(TALLOC_CTX *ctx, fr_value_box_t const **values, unlang_t **targets,
+					     size_t num)
+{
+	unlang_jump_table_t	*jump;
+	int64_t			min = INT64_MAX, max = INT64_MIN, value;
+	size_t			i;
+
+	if (num < UNLANG_JUMP_TABLE_MIN) return NULL;
+
+	for (i = 0; i < num; i++) {
+		if (!unlang_jump_table_value(&value, values[i])) return NULL;
+
+		if (value < min) min = value;
+		if (value > max) max = value;
+	}
+
+	if (((uint64_t) max - (uint64_t) min) >= (num * UNLANG_JUMP_TABLE_DENSITY)) return NULL;
+
+	MEM(jump = talloc_zero(ctx, unlang_jump_table_t));
+	jump->min = min;
+	jump->num = ((uint64_t) max - (uint64_t) min) + 1;
+	MEM(jump->target = talloc_zero_array(jump, unlang_t *, jump->num));
+
+	/*
+	 *	If a value is listed twice, the first one wins.
+	 */
+	for (i = 0; i < num; i++) {
+		unlang_t **slot;
+
+		(void) unlang_jump_table_value(&value, values[i]);
+
+		slot = &jump->target[(uint64_t) value - (uint64_t) min];
+		if (!*slot) *slot = targets[i];
+	}
+
+	return jump;
+}
+
+static int8_t cond_case_cmp(void const *one, void const *two)
+{
+	unlang_cond_case_t const *a = (unlang_cond_case_t const *) one; /* may not be talloc'd! See condition.c */
+	unlang_cond_case_t const *b = (unlang_cond_case_t const *) two; /* may not be talloc'd! */
+
+	return fr_value_box_cmp(a->value, b->value);
+}
+
+static uint32_t cond_case_hash(void const *data)
+{
+	unlang_cond_case_t const *a = (unlang_cond_case_t const *) data; /* may not be talloc'd! */
+
+	return fr_value_box_hash(a->value);
+}
+
+static int cond_case_to_key(uint8_t **out, size_t *outlen, void const *data)
+{
+	unlang_cond_case_t const *a = (unlang_cond_case_t const *) data; /* may not be talloc'd! */
+
+	return fr_value_box_to_key(out, outlen, a->value);
+}
+
+/** See if an 'if' or 'elsif' can be part of a dispatch table
+ *
+ * It can if the condition is "&Attribute == literal", and the
+ * literal is the same data type as the attribute, or can be cast to it.
+ */
+static bool cond_dispatch_check(unlang_t *c, tmpl_t const **vpt, fr_value_box_t const **value)
+{
+	unlang_cond_t		*gext;
+	fr_token_t		op;
+	fr_type_t		type;
+
+	if ((c->type != UNLANG_TYPE_IF) && (c->type != UNLANG_TYPE_ELSIF)) return false;
+
+	gext = unlang_group_to_cond(unlang_generic_to_group(c));
+	if (gext->is_truthy) return false;
+
+	if (!xlat_is_attr_cmp(gext->head, vpt, &op, value)) return false;
+
+	if (op != T_OP_CMP_EQ) return false;
+
+	if (tmpl_rules_cast(*vpt)) return false;
+
+	/*
+	 *	Integer literals are parsed into the smallest type
+	 *	which holds them, and are cast at run time.
+	 */
+	type = tmpl_attr_tail_da(*vpt)->type;
+	if ((*value)->type != type) {
+		fr_value_box_t tmp;
+
+		if (!fr_type_is_integer(type) || !fr_type_is_integer((*value)->type)) return false;
+
+		if (fr_value_box_cast(NULL, &tmp, type, NULL, *value) < 0) return false;
+	}
+
+	/*
+	 *	Prefixes can match more than one address.
+	 */
+	switch (type) {
+	case FR_TYPE_IPV4_PREFIX:
+	case FR_TYPE_IPV6_PREFIX:
+	case FR_TYPE_COMBO_IP_PREFIX:
+		return false;
+
+	default:
+		break;
+	}
+
+	return (fr_htrie_hint(type) != FR_HTRIE_INVALID);
+}
+
+/** Replace a chain of 'if' / 'elsif' which compare the same attribute with a lookup
+ *
+ *	if (&Foo == 1) {
+ *		...
+ *	} elsif (&Foo == 2) {
+ *		...
+ *	} elsif ...
+ *
+ * is run the same way as a "switch &Foo" statement.  The first
+ * condition is given a table of values, and jumps straight to the
+ * condition which matches.  The conditions themselves are left in
+ * place, so that they're still printed when debugging.
+ *
+ * @param[in] head	the first condition to check.
+ * @return the next instruction to check for chains.
+ */
+static unlang_t *compile_cond_dispatch(unlang_t *head)
+{
+	unlang_t		*c, **targets;
+	tmpl_t const		*vpt, *next_vpt;
+	fr_value_box_t const	*value, **values;
+	fr_type_t		type;
+	unsigned int		i, num = 1;
+	unlang_cond_t		*gext;
+	unlang_cond_dispatch_t	*dispatch;
+
+	if (!cond_dispatch_check(head, &vpt, &value)) return head->next;
+
+	for (c = head->next; c != NULL; c = c->next) {
+		if (c->type != UNLANG_TYPE_ELSIF) break;
+
+		if (!cond_dispatch_check(c, &next_vpt, &value)) break;
+
+		if ((tmpl_attr_tail_da(next_vpt) != tmpl_attr_tail_da(vpt)) ||
+		    (next_vpt->len != vpt->len) || (memcmp(next_vpt->name, vpt->name, vpt->len) != 0)) break;
+
+		num++;
+	}
+
+	if (num < UNLANG_COND_DISPATCH_MIN) return head->next;
+
+	type = tmpl_attr_tail_da(vpt)->type;
+
+	MEM(dispatch = talloc_zero(head, unlang_cond_dispatch_t));
+	dispatch->vpt = vpt;
+	dispatch->next = c;
+	dispatch->num = num;
+
+	MEM(values = talloc_array(dispatch, fr_value_box_t const *, num));
+	MEM(targets = talloc_array(dispatch, unlang_t *, num));
+
+	for (c = head, i = 0; i < num; c = c->next, i++) {
+		fr_value_box_t *copy;
+
+		(void) cond_dispatch_check(c, &next_vpt, &value);
+
+		MEM(copy = fr_value_box_alloc_null(dispatch));
+		if (fr_value_box_cast(copy, copy, type, NULL, value) < 0) {
+		error:
+			talloc_free(dispatch);
+			return head->next;
+		}
+
+		values[i] = copy;
+		targets[i] = c;
+	}
+
+	dispatch->jump = jump_table_alloc(dispatch, values, targets, num);
+	if (!dispatch->jump) {
+		dispatch->ht = fr_htrie_alloc(dispatch, fr_htrie_hint(type),
+					      (fr_hash_t) cond_case_hash,
+					      (fr_cmp_t) cond_case_cmp,
+					      (fr_trie_key_t) cond_case_to_key,
+					      NULL);
+		if (!dispatch->ht) goto error;
+
+		for (i = 0; i < num; i++) {
+			unlang_cond_case_t *entry;
+
+			MEM(entry = talloc(dispatch, unlang_cond_case_t));
+			entry->value = values[i];
+			entry->target = targets[i];
+
+			/*
+			 *	If a value is listed twice, the first one wins.
+			 */
+			if (!fr_htrie_insert(dispatch->ht, entry)) talloc_free(entry);
+		}
+	}
+
+	talloc_free(values);
+	talloc_free(targets);
+
+	gext = unlang_group_to_cond(unlang_generic_to_group(head));
+	gext->dispatch = dispatch;
+
+	cf_log_debug(unlang_generic_to_group(head)->cs, "Replacing %u 'if' / 'elsif' conditions on %s with a %s",
+		     num, vpt->name, dispatch->jump ? "jump table" : "lookup table");
+
+	if (dispatch->jump) {
+		unlang_compile_stats.cond_jump++;
+	} else {
+		unlang_compile_stats.cond_htrie++;
+	}
+	unlang_compile_stats.cond_dispatched += num;
+
+	return dispatch->next;
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ctx_in)
 {
 	CONF_ITEM	*ci = NULL;
@@ -2417,6 +2664,12 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ct
 		}
 	}
 
+	/*
+	 *	Replace long chains of "if" / "elsif" with lookups.
+	 */
+	single = g->children;
+	while (single) single = compile_cond_dispatch(single);
+
 	/*
 	 *	Set the default actions, if they haven't already been
 	 *	set by an "actions" section above.
@@ -2767,6 +3020,42 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		g->num_children++;
 	}
 
+	/*
+	 *	Dense integer values can be looked up directly,
+	 *	instead of being hashed.
+	 */
+	if (tmpl_is_attr(gext->vpt) && !tmpl_rules_cast(gext->vpt) && fr_type_is_integer(type)) {
+		fr_value_box_t const	**values;
+		unlang_t		**targets;
+		unlang_t		*child;
+		unlang_case_t		*case_gext;
+		size_t			num = 0;
+
+		MEM(values = talloc_array(gext, fr_value_box_t const *, g->num_children));
+		MEM(targets = talloc_array(gext, unlang_t *, g->num_children));
+
+		for (child = g->children; child != NULL; child = child->next) {
+			case_gext = unlang_group_to_case(unlang_generic_to_group(child));
+			if (!case_gext->vpt) continue;
+
+			values[num] = tmpl_value(case_gext->vpt);
+			targets[num] = child;
+			num++;
+		}
+
+		gext->jump = jump_table_alloc(gext, values, targets, num);
+
+		talloc_free(values);
+		talloc_free(targets);
+	}
+
+	if (gext->jump) {
+		cf_log_debug(cs, "Using a jump table with %zu entries for '%s'", gext->jump->num, c->debug_name);
+		unlang_compile_stats.switch_jump++;
+	} else {
+		unlang_compile_stats.switch_htrie++;
+	}
+
 	compile_action_defaults(c, unlang_ctx);
 
 	return c;
@@ -4772,6 +5061,22 @@ bool unlang_compile_is_keyword(const char *name)
 	return (fr_table_value_by_str(unlang_pair_keywords, name, NULL) != NULL);
 }
 
+/** Print statistics about the lookup tables created when compiling
+ *
+ */
+void unlang_compile_stats_dump(void)
+{
+	if (!DEBUG_ENABLED2) return;
+
+	DEBUG2("Compiled lookup tables {");
+	DEBUG2("	switch.htrie = %" PRIu64, unlang_compile_stats.switch_htrie);
+	DEBUG2("	switch.jump = %" PRIu64, unlang_compile_stats.switch_jump);
+	DEBUG2("	if.htrie = %" PRIu64, unlang_compile_stats.cond_htrie);
+	DEBUG2("	if.jump = %" PRIu64, unlang_compile_stats.cond_jump);
+	DEBUG2("	if.conditions = %" PRIu64, unlang_compile_stats.cond_dispatched);
+	DEBUG2("}");
+}
+
 /*
  *	These are really unlang_foo_t, but that's fine...
  */
@@ -46,6 +46,8 @@ bool		unlang_compile_is_keyword(const char *name);
 
 bool		unlang_compile_actions(unlang_actions_t *actions, CONF_SECTION *parent, bool module_retry);
 
+void		unlang_compile_stats_dump(void);
+
 #ifdef __cplusplus
 }
 #endif
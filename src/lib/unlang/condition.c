@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/server/main_config.h>
+#include <freeradius-devel/server/tmpl_dcursor.h>
 
 #include "condition_priv.h"
 #include "group_priv.h"
@@ -36,6 +37,24 @@ typedef struct {
 								///< of the execution.
 } unlang_frame_state_cond_t;
 
+static unlang_action_t unlang_if_taken(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
+{
+	/*
+	 *	Tell the main interpreter to skip over the else /
+	 *	elsif blocks, as this "if" condition was taken.
+	 */
+	while (frame->next &&
+	       ((frame->next->type == UNLANG_TYPE_ELSE) ||
+		(frame->next->type == UNLANG_TYPE_ELSIF))) {
+		frame->next = frame->next->next;
+	}
+
+	/*
+	 *	We took the "if".  Go recurse into its' children.
+	 */
+	return unlang_group(p_result, request, frame);
+}
+
 static unlang_action_t unlang_if_resume(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_frame_state_cond_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_cond_t);
@@ -57,20 +76,76 @@ static unlang_action_t unlang_if_resume(rlm_rcode_t *p_result, request_t *reques
 		return UNLANG_ACTION_EXECUTE_NEXT;
 	}
 
+	return unlang_if_taken(p_result, request, frame);
+}
+
+/** Find the first condition in a chain which matches the value of the attribute
+ *
+ * @param[out] found	the matching 'if' / 'elsif', or NULL for no match.
+ * @param[in] request	The current request.
+ * @param[in] frame	of the first condition in the chain.
+ * @param[in] dispatch	table of the chain.
+ * @return
+ *	- true if the lookup was done.
+ *	- false if the attribute doesn't exist, and the conditions have to be evaluated.
+ */
+static bool unlang_if_dispatch(unlang_t **found, request_t *request, unlang_stack_frame_t *frame,
+			       unlang_cond_dispatch_t const *dispatch)
+{
+	fr_dcursor_t		cursor;
+	tmpl_dcursor_ctx_t	cc;
+	fr_pair_t		*vp;
+	unlang_t		*match = NULL;
+	bool			exists = false;
+	int			err;
+
 	/*
-	 *	Tell the main interpreter to skip over the else /
-	 *	elsif blocks, as this "if" condition was taken.
+	 *	"==" matches if any of the values of the attribute
+	 *	match, so we have to check all of them.
 	 */
-	while (frame->next &&
-	       ((frame->next->type == UNLANG_TYPE_ELSE) ||
-		(frame->next->type == UNLANG_TYPE_ELSIF))) {
-		frame->next = frame->next->next;
+	for (vp = tmpl_dcursor_init(&err, request, &cc, &cursor, request, dispatch->vpt);
+	     vp != NULL;
+	     vp = fr_dcursor_next(&cursor)) {
+		unlang_t		*this;
+		unlang_t const		*c;
+
+		exists = true;
+
+		if (dispatch->jump) {
+			this = unlang_jump_table_find(dispatch->jump, &vp->data);
+		} else {
+			unlang_cond_case_t const *entry;
+
+			entry = fr_htrie_find(dispatch->ht, &(unlang_cond_case_t){ .value = &vp->data });
+			this = entry ? entry->target : NULL;
+		}
+
+		if (!this || (this == match)) continue;
+
+		if (!match) {
+			match = this;
+			continue;
+		}
+
+		/*
+		 *	Different values match different conditions.  The
+		 *	earlier condition wins.
+		 */
+		for (c = frame->instruction; c != dispatch->next; c = c->next) {
+			if ((c == this) || (c == match)) break;
+		}
+		match = UNCONST(unlang_t *, c);
 	}
+	tmpl_dcursor_clear(&cc);
 
 	/*
-	 *	We took the "if".  Go recurse into its' children.
+	 *	Comparisons with a missing attribute are errors, so we
+	 *	leave it to the conditions to report them.
 	 */
-	return unlang_group(p_result, request, frame);
+	if (!exists) return false;
+
+	*found = match;
+	return true;
 }
 
 static unlang_action_t unlang_if(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
@@ -92,8 +167,6 @@ static unlang_action_t unlang_if(rlm_rcode_t *p_result, request_t *request, unla
 		return unlang_group(p_result, request, frame);
 	}
 
-	frame_repeat(frame, unlang_if_resume);
-
 	fr_value_box_list_init(&state->out);
 
 	/*
@@ -103,6 +176,49 @@ static unlang_action_t unlang_if(rlm_rcode_t *p_result, request_t *request, unla
 	 */
 	request->rcode = *p_result;
 
+	/*
+	 *	This is the first of a chain of conditions which
+	 *	compare the same attribute.  Jump straight to the one
+	 *	which matches.
+	 */
+	if (gext->dispatch) {
+		unlang_t *found;
+
+		if (unlang_if_dispatch(&found, request, frame, gext->dispatch)) {
+			if (!found) {
+				RDEBUG2("... no match for %s in lookup table, skipping %u conditions",
+					gext->dispatch->vpt->name, gext->dispatch->num);
+				frame->next = gext->dispatch->next;
+				return UNLANG_ACTION_EXECUTE_NEXT;
+			}
+
+			if (found == frame->instruction) return unlang_if_taken(p_result, request, frame);
+
+			RDEBUG2("... %s matches '%s' in lookup table", gext->dispatch->vpt->name, found->debug_name);
+			frame->next = found;
+			return UNLANG_ACTION_EXECUTE_NEXT;
+		}
+	}
+
+	/*
+	 *	Simple conditions don't need an xlat frame.  If the
+	 *	expression fails, the result is the same as when an
+	 *	xlat frame fails, and the condition is false.
+	 */
+	switch (xlat_bytecode_eval_head(state, &state->out, request, gext->head)) {
+	case 0:
+		return unlang_if_resume(p_result, request, frame);
+
+	case -1:
+		*p_result = RLM_MODULE_FAIL;
+		return unlang_if_resume(p_result, request, frame);
+
+	default:
+		break;
+	}
+
+	frame_repeat(frame, unlang_if_resume);
+
 	if (unlang_xlat_push(state, &state->success, &state->out,
 			     request, gext->head, UNLANG_SUB_FRAME) < 0) return UNLANG_ACTION_FAIL;
 
@@ -27,12 +27,36 @@ extern "C" {
 #endif
 
 #include "unlang_priv.h"
+#include "switch_priv.h"
+
+/** An entry in the dispatch table of an if / elsif chain
+ *
+ */
+typedef struct {
+	fr_value_box_t const	*value;		//!< Literal the attribute is compared against.
+	unlang_t		*target;	//!< The first 'if' / 'elsif' which compares against it.
+} unlang_cond_case_t;
+
+/** A chain of 'if' / 'elsif' which compare the same attribute against literals
+ *
+ * The chain is evaluated by looking up the value of the attribute,
+ * instead of checking each condition in turn.  It's attached to the
+ * first condition in the chain.
+ */
+typedef struct {
+	tmpl_t const		*vpt;		//!< Attribute all of the conditions compare.
+	fr_htrie_t		*ht;		//!< Of unlang_cond_case_t, keyed by value.
+	unlang_jump_table_t	*jump;		//!< Used instead of the htrie, if the values are dense.
+	unlang_t		*next;		//!< The first instruction after the chain.
+	unsigned int		num;		//!< Number of conditions in the chain.
+} unlang_cond_dispatch_t;
 
 typedef struct {
-	unlang_group_t	group;
-	xlat_exp_head_t	*head;
-	bool		is_truthy;
-	bool		value;
+	unlang_group_t		group;
+	xlat_exp_head_t		*head;
+	bool			is_truthy;
+	bool			value;
+	unlang_cond_dispatch_t	*dispatch;	//!< Set if this is the first condition of a chain.
 } unlang_cond_t;
 
 /** Cast a group structure to the cond keyword extension
@@ -95,6 +95,15 @@ static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request,
 		return UNLANG_ACTION_FAIL;
 	}
 
+	/*
+	 *	Dense integer values are looked up directly.
+	 */
+	if (switch_gext->jump) {
+		found = unlang_jump_table_find(switch_gext->jump, box);
+		if (!found) found = switch_gext->default_case;
+		goto do_null_case;
+	}
+
 	/*
 	 *	case_gext->vpt.data.literal is an in-line box, so we
 	 *	have to make a shallow copy of its contents.
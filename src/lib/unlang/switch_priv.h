@@ -29,13 +29,91 @@ extern "C" {
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/util/htrie.h>
 
+/** Lookup table for dense integer values
+ *
+ * Used instead of the htrie when all of the values being switched
+ * over are integers, and there are few gaps between them.
+ */
 typedef struct {
-	unlang_group_t	group;
-	unlang_t	*default_case;
-	tmpl_t		*vpt;
-	fr_htrie_t	*ht;
+	int64_t		min;		//!< Value of the first entry.
+	size_t		num;		//!< Number of entries.
+	unlang_t	**target;	//!< Indexed by (value - min).  NULL for no match.
+} unlang_jump_table_t;
+
+typedef struct {
+	unlang_group_t		group;
+	unlang_t		*default_case;
+	tmpl_t			*vpt;
+	fr_htrie_t		*ht;
+	unlang_jump_table_t	*jump;		//!< Used instead of the htrie, if the values are dense.
 } unlang_switch_t;
 
+/** Get the value of an integer box, as used to index a jump table
+ *
+ * @param[out] out	the value.
+ * @param[in] box	to get the value of.
+ * @return
+ *	- true if the box is an integer which fits into an int64_t.
+ *	- false otherwise.
+ */
+static inline bool unlang_jump_table_value(int64_t *out, fr_value_box_t const *box)
+{
+	switch (box->type) {
+	case FR_TYPE_UINT8:
+		*out = box->vb_uint8;
+		return true;
+
+	case FR_TYPE_UINT16:
+		*out = box->vb_uint16;
+		return true;
+
+	case FR_TYPE_UINT32:
+		*out = box->vb_uint32;
+		return true;
+
+	case FR_TYPE_UINT64:
+		if (box->vb_uint64 > INT64_MAX) return false;
+		*out = box->vb_uint64;
+		return true;
+
+	case FR_TYPE_INT8:
+		*out = box->vb_int8;
+		return true;
+
+	case FR_TYPE_INT16:
+		*out = box->vb_int16;
+		return true;
+
+	case FR_TYPE_INT32:
+		*out = box->vb_int32;
+		return true;
+
+	case FR_TYPE_INT64:
+		*out = box->vb_int64;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Find the instruction for a value in a jump table
+ *
+ * @return
+ *	- the instruction to run.
+ *	- NULL if the value isn't in the table.
+ */
+static inline unlang_t *unlang_jump_table_find(unlang_jump_table_t const *jump, fr_value_box_t const *box)
+{
+	int64_t value;
+
+	if (!unlang_jump_table_value(&value, box)) return NULL;
+
+	if ((value < jump->min) || ((uint64_t) value - (uint64_t) jump->min >= jump->num)) return NULL;
+
+	return jump->target[(uint64_t) value - (uint64_t) jump->min];
+}
+
 /** Cast a group structure to the switch keyword extension
  *
  */
@@ -381,6 +381,13 @@ ssize_t		xlat_aeval_compiled(TALLOC_CTX *ctx, char **out, request_t *request,
 				    xlat_exp_head_t const *head, xlat_escape_legacy_t escape, void const *escape_ctx)
 				    CC_HINT(nonnull (2, 3, 4));
 
+int		xlat_aeval_list(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, char const *fmt)
+				CC_HINT(nonnull(2, 3, 4));
+
+ssize_t		xlat_list_aprint(TALLOC_CTX *ctx, char **out, request_t *request, fr_value_box_list_t *list,
+				 xlat_escape_legacy_t escape, void const *escape_ctx)
+				 CC_HINT(nonnull(2, 4));
+
 int		xlat_aeval_compiled_argv(TALLOC_CTX *ctx, char ***argv, request_t *request,
 					 xlat_exp_head_t const *head, xlat_escape_legacy_t escape, void const *escape_ctx);
 
@@ -415,6 +422,9 @@ static inline fr_slen_t xlat_aprint(TALLOC_CTX *ctx, char **out, xlat_exp_head_t
 
 bool		xlat_is_truthy(xlat_exp_head_t const *head, bool *out);
 
+bool		xlat_is_attr_cmp(xlat_exp_head_t const *head, tmpl_t const **vpt, fr_token_t *op,
+				 fr_value_box_t const **value);
+
 int		xlat_validate_function_mono(xlat_exp_t *node);
 
 int		xlat_validate_function_args(xlat_exp_t *node);
@@ -427,6 +437,8 @@ bool		xlat_is_literal(xlat_exp_head_t const *head);
 
 bool		xlat_needs_resolving(xlat_exp_head_t const *head);
 
+bool		xlat_contains_func(xlat_exp_head_t const *head);
+
 bool		xlat_to_string(TALLOC_CTX *ctx, char **str, xlat_exp_head_t **head);
 
 int		xlat_resolve(xlat_exp_head_t *head, xlat_res_rules_t const *xr_rules);
@@ -458,6 +470,12 @@ void		xlat_exp_head_verify(xlat_exp_head_t const *head);
 #  define XLAT_HEAD_VERIFY(_head)
 #endif
 
+/*
+ *	xlat_bytecode.c
+ */
+int		xlat_bytecode_eval_head(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request,
+					xlat_exp_head_t const *head) CC_HINT(nonnull(2,3));
+
 /*
  *	xlat_inst.c
  */
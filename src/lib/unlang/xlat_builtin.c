@@ -2537,7 +2537,7 @@ static xlat_action_t xlat_func_subst_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	/*
 	 *	Process the substitution
 	 */
-	if (regex_compile(NULL, &pattern, regex, regex_len, &flags, false, true) <= 0) {
+	if (regex_compile_cached(&pattern, regex, regex_len, &flags, false) <= 0) {
 		RPEDEBUG("Failed compiling regex");
 		return XLAT_ACTION_FAIL;
 	}
@@ -2548,7 +2548,6 @@ static xlat_action_t xlat_func_subst_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			     rep_vb->vb_strvalue, rep_vb->vb_length, NULL) < 0) {
 		RPEDEBUG("Failed performing substitution");
 		talloc_free(vb);
-		talloc_free(pattern);
 		return XLAT_ACTION_FAIL;
 	}
 	fr_value_box_bstrdup_buffer_shallow(NULL, vb, NULL, buff, subject_vb->tainted);
@@ -2556,8 +2555,6 @@ static xlat_action_t xlat_func_subst_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	fr_dcursor_append(out, vb);
 
-	talloc_free(pattern);
-
 	return XLAT_ACTION_DONE;
 }
 #endif
@@ -0,0 +1,735 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file xlat_bytecode.c
+ * @brief Lower simple expressions to a flat bytecode, which is run without interpreter frames.
+ *
+ * Most expressions in a policy are comparisons of an attribute against a
+ * literal, joined by && and ||.  Evaluating those through xlat_frame_eval()
+ * pushes a frame for every function call and argument, and wraps every
+ * argument in a group box.
+ *
+ * Once an xlat has been instantiated (and purified), calls which only use
+ * operators we know are synchronous are lowered to a list of instructions
+ * operating on registers.  Each register is a list of value boxes.
+ * Register 0 is the output, registers 1..XLAT_BYTECODE_MAX_REGS are
+ * scratch space, and constants are addressed after that.  The result of
+ * && and || is built in a box which is kept outside of the register
+ * lists, as the value box functions it's passed to reinitialise it.
+ *
+ * Anything else (module calls, regexes, execs, function calls which may
+ * yield) is left alone, and is evaluated by the interpreter as before.
+ *
+ * Errors are reported with the same messages as the expression functions
+ * use.  As with the interpreter, when an argument of an operator fails,
+ * the operator is still called, with that argument (and any after it)
+ * empty.  Logical not treats that as NULL, the other operators fail in
+ * turn.  So a missing attribute doesn't cause the expression to be
+ * evaluated a second time by the interpreter.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/xlat_priv.h>
+#include <freeradius-devel/util/calc.h>
+
+#define XLAT_BYTECODE_MAX_REGS		(16)
+#define XLAT_BYTECODE_MAX_CONSTS	(32)
+#define XLAT_BYTECODE_MAX_INSNS		(64)
+
+#define XLAT_BYTECODE_CONST(_n)		(XLAT_BYTECODE_MAX_REGS + 1 + (_n))
+
+typedef enum {
+	XLAT_INSN_COPY = 0,				//!< Append a copy of a constant to a register.
+	XLAT_INSN_ATTR,					//!< Append the values of an attribute to a register.
+	XLAT_INSN_BINARY,				//!< Binary operator, or comparison.
+	XLAT_INSN_NOT,					//!< Logical not.
+	XLAT_INSN_LOGICAL_INIT,				//!< Allocate the result of && or ||.
+	XLAT_INSN_LOGICAL,				//!< Check one argument of && or ||, and jump to
+							///< the end if the result is known.
+	XLAT_INSN_LOGICAL_DONE				//!< Append the result of && or || to a register.
+} xlat_opcode_t;
+
+typedef struct {
+	xlat_opcode_t		opcode;
+	uint8_t			dst;			//!< Register to append the result to.
+	uint8_t			a;			//!< First operand.
+	uint8_t			b;			//!< Second operand.
+	uint8_t			jump;			//!< Instruction to continue at, for XLAT_INSN_LOGICAL.
+	uint8_t			start;			//!< First instruction of the operands, for
+							///< XLAT_INSN_BINARY and XLAT_INSN_NOT.
+	uint8_t			start_b;		//!< First instruction of the second operand,
+							///< for XLAT_INSN_BINARY.
+
+	xlat_t const		*func;			//!< Function the instruction replaces, for errors.
+	fr_token_t		op;			//!< Operator for XLAT_INSN_BINARY.
+	fr_type_t		hint;			//!< Output type for XLAT_INSN_BINARY.
+	fr_dict_attr_t const	*enumv;			//!< Enumeration of the output for XLAT_INSN_BINARY.
+	bool			stop_on_match;		//!< true for ||, false for &&.
+
+	tmpl_t const		*vpt;			//!< Attribute for XLAT_INSN_ATTR.
+
+	char const		*name;			//!< Printed form of the expression which produced
+							///< the result, or NULL.  Used for debugging.
+} xlat_insn_t;
+
+struct xlat_bytecode_s {
+	unsigned int		num_regs;		//!< Number of scratch registers used.
+
+	fr_value_box_list_t	**consts;		//!< Constant operands.
+	unsigned int		num_consts;
+
+	xlat_insn_t		*insns;
+	unsigned int		num_insns;
+};
+
+typedef struct {
+	xlat_bytecode_t		*code;			//!< Being built.
+	xlat_insn_t		insns[XLAT_BYTECODE_MAX_INSNS];
+	unsigned int		num_insns;
+	unsigned int		reg_top;		//!< Last scratch register in use.
+} xlat_bytecode_build_t;
+
+static int bytecode_head(xlat_bytecode_build_t *b, xlat_exp_head_t const *head, uint8_t dst);
+
+static int bytecode_emit(xlat_bytecode_build_t *b, xlat_insn_t const *insn)
+{
+	if (b->num_insns >= NUM_ELEMENTS(b->insns)) return -1;
+
+	b->insns[b->num_insns++] = *insn;
+	return 0;
+}
+
+static int bytecode_reg_alloc(xlat_bytecode_build_t *b, uint8_t *reg)
+{
+	if (b->reg_top >= XLAT_BYTECODE_MAX_REGS) return -1;
+
+	*reg = ++b->reg_top;
+	if (b->reg_top > b->code->num_regs) b->code->num_regs = b->reg_top;
+
+	return 0;
+}
+
+/** Add a new, empty, constant
+ *
+ */
+static fr_value_box_list_t *bytecode_const_alloc(xlat_bytecode_build_t *b, uint8_t *reg)
+{
+	xlat_bytecode_t		*code = b->code;
+	fr_value_box_list_t	*list;
+
+	if (code->num_consts >= XLAT_BYTECODE_MAX_CONSTS) return NULL;
+
+	MEM(code->consts = talloc_realloc(code, code->consts, fr_value_box_list_t *, code->num_consts + 1));
+	MEM(list = talloc(code->consts, fr_value_box_list_t));
+	fr_value_box_list_init(list);
+
+	*reg = XLAT_BYTECODE_CONST(code->num_consts);
+	code->consts[code->num_consts++] = list;
+
+	return list;
+}
+
+/** Turn a literal into a constant
+ *
+ * @return
+ *	- 1 if the node was a literal, and has been added as a constant.
+ *	- 0 if the node isn't a literal.
+ *	- -1 if the node can't be lowered.
+ */
+static int bytecode_const(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t *reg)
+{
+	fr_value_box_list_t	*list;
+	fr_value_box_t		*box;
+
+	switch (node->type) {
+	case XLAT_BOX:
+		list = bytecode_const_alloc(b, reg);
+		if (!list) return -1;
+
+		MEM(box = fr_value_box_alloc_null(list));
+		if (fr_value_box_copy(box, box, &node->data) < 0) return -1;
+		fr_value_box_list_insert_tail(list, box);
+		return 1;
+
+	case XLAT_TMPL:
+		if (!tmpl_is_data(node->vpt)) return 0;
+
+		list = bytecode_const_alloc(b, reg);
+		if (!list) return -1;
+
+		MEM(box = fr_value_box_alloc(list, tmpl_value_type(node->vpt), NULL));
+		if (fr_value_box_copy(box, box, tmpl_value(node->vpt)) < 0) return -1;
+		fr_value_box_list_insert_tail(list, box);
+
+		/*
+		 *	Do the cast now, instead of for every request.
+		 *	If it fails, the interpreter will report the
+		 *	error at run time.
+		 */
+		if (tmpl_eval_cast_in_place(list, node->vpt) < 0) return -1;
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/** Print a node for debugging
+ *
+ */
+static char const *bytecode_name(xlat_bytecode_build_t *b, xlat_exp_t const *node)
+{
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+
+	if (!fr_sbuff_init_talloc(b->code, &sbuff, &tctx, 64, SIZE_MAX)) return NULL;
+
+	if (xlat_print_node(&sbuff, NULL, node, NULL) < 0) {
+		talloc_free(sbuff.buff);
+		return NULL;
+	}
+
+	fr_sbuff_trim_talloc(&sbuff, SIZE_MAX);
+	return sbuff.buff;
+}
+
+/** Lower a function argument, which is always a group
+ *
+ * Arguments which are a single literal use a constant register, and need no instructions.
+ */
+static int bytecode_arg(xlat_bytecode_build_t *b, xlat_exp_t const *arg, uint8_t *reg)
+{
+	xlat_exp_t const	*node;
+
+	if (arg->type != XLAT_GROUP) return -1;
+
+	node = xlat_exp_head(arg->group);
+	if (node && !xlat_exp_next(arg->group, node)) {
+		int ret;
+
+		ret = bytecode_const(b, node, reg);
+		if (ret != 0) return (ret < 0) ? -1 : 0;
+	}
+
+	if (bytecode_reg_alloc(b, reg) < 0) return -1;
+
+	return bytecode_head(b, arg->group, *reg);
+}
+
+/** Lower a binary operator, or comparison
+ *
+ * Mirrors xlat_binary_op().
+ */
+static int bytecode_binary(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t dst,
+			   fr_type_t hint, fr_dict_attr_t const *enumv)
+{
+	xlat_exp_t const	*arg1, *arg2;
+	unsigned int		reg_top = b->reg_top;
+	xlat_insn_t		insn = {
+					.opcode = XLAT_INSN_BINARY,
+					.dst = dst,
+					.func = node->call.func,
+					.op = node->call.func->token,
+					.hint = hint,
+					.enumv = enumv,
+				};
+
+	arg1 = xlat_exp_head(node->call.args);
+	if (!arg1) return -1;
+
+	arg2 = xlat_exp_next(node->call.args, arg1);
+	if (!arg2 || xlat_exp_next(node->call.args, arg2)) return -1;
+
+	insn.start = b->num_insns;
+	if (bytecode_arg(b, arg1, &insn.a) < 0) return -1;
+
+	insn.start_b = b->num_insns;
+	if (bytecode_arg(b, arg2, &insn.b) < 0) return -1;
+
+	insn.name = bytecode_name(b, node);
+	b->reg_top = reg_top;
+
+	return bytecode_emit(b, &insn);
+}
+
+/** Lower a logical not
+ *
+ * Mirrors xlat_func_unary_not().  The argument is concatenated, and
+ * must exist, so we only lower operands which always produce exactly
+ * one value, i.e. not attribute references.
+ */
+static int bytecode_not(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t dst)
+{
+	xlat_exp_t const	*arg, *operand;
+	unsigned int		reg_top = b->reg_top;
+	xlat_insn_t		insn = {
+					.opcode = XLAT_INSN_NOT,
+					.dst = dst,
+				};
+
+	arg = xlat_exp_head(node->call.args);
+	if (!arg || xlat_exp_next(node->call.args, arg)) return -1;
+	if (arg->type != XLAT_GROUP) return -1;
+
+	operand = xlat_exp_head(arg->group);
+	if (!operand || xlat_exp_next(arg->group, operand)) return -1;
+	if ((operand->type == XLAT_TMPL) && !tmpl_is_data(operand->vpt)) return -1;
+
+	insn.start = b->num_insns;
+	if (bytecode_arg(b, arg, &insn.a) < 0) return -1;
+
+	insn.name = bytecode_name(b, node);
+	b->reg_top = reg_top;
+
+	return bytecode_emit(b, &insn);
+}
+
+/** Lower && and ||
+ *
+ * Mirrors xlat_logical_resume().  Each argument is evaluated in turn,
+ * and we jump to the end as soon as the result is known.
+ */
+static int bytecode_logical(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t dst)
+{
+	xlat_logical_inst_t const	*inst;
+	unsigned int			reg_top = b->reg_top;
+	unsigned int			start, i;
+	uint8_t				acc;
+	int				j;
+
+	if (!node->call.inst) return -1;
+
+	inst = talloc_get_type_abort_const(node->call.inst->data, xlat_logical_inst_t);
+	if (!inst->argv || (inst->argc < 1)) return -1;
+
+	if (bytecode_reg_alloc(b, &acc) < 0) return -1;
+
+	if (bytecode_emit(b, &(xlat_insn_t){ .opcode = XLAT_INSN_LOGICAL_INIT, .a = acc }) < 0) return -1;
+	start = b->num_insns;
+
+	for (j = 0; j < inst->argc; j++) {
+		uint8_t arg;
+
+		if (bytecode_reg_alloc(b, &arg) < 0) return -1;
+		if (bytecode_head(b, inst->argv[j], arg) < 0) return -1;
+
+		if (bytecode_emit(b, &(xlat_insn_t){
+					.opcode = XLAT_INSN_LOGICAL,
+					.a = acc,
+					.b = arg,
+					.stop_on_match = inst->stop_on_match
+				  }) < 0) return -1;
+		b->reg_top--;
+	}
+
+	/*
+	 *	All of the checks for this operator jump to the
+	 *	end.  Nested operators use different accumulators,
+	 *	so they're left alone.
+	 */
+	for (i = start; i < b->num_insns; i++) {
+		if ((b->insns[i].opcode == XLAT_INSN_LOGICAL) && (b->insns[i].a == acc)) b->insns[i].jump = b->num_insns;
+	}
+
+	b->reg_top = reg_top;
+
+	return bytecode_emit(b, &(xlat_insn_t){
+				.opcode = XLAT_INSN_LOGICAL_DONE,
+				.dst = dst,
+				.a = acc,
+				.name = bytecode_name(b, node)
+			     });
+}
+
+static int bytecode_func(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t dst)
+{
+	xlat_t const *func = node->call.func;
+
+	/*
+	 *	Only the expression functions are known to be
+	 *	synchronous.  Internal functions can't be
+	 *	redefined, so the names are reliable.
+	 */
+	if (!func->internal) return -1;
+
+	if (strncmp(func->name, "cmp_", 4) == 0) return bytecode_binary(b, node, dst, FR_TYPE_BOOL, attr_expr_bool_enum);
+
+	if (strncmp(func->name, "op_", 3) == 0) return bytecode_binary(b, node, dst, FR_TYPE_NULL, NULL);
+
+	if (strcmp(func->name, "unary_not") == 0) return bytecode_not(b, node, dst);
+
+	if ((strcmp(func->name, "logical_and") == 0) ||
+	    (strcmp(func->name, "logical_or") == 0)) return bytecode_logical(b, node, dst);
+
+	return -1;
+}
+
+static int bytecode_node(xlat_bytecode_build_t *b, xlat_exp_t const *node, uint8_t dst)
+{
+	xlat_insn_t	insn = { .dst = dst };
+	int		ret;
+
+	switch (node->type) {
+	case XLAT_BOX:
+	case XLAT_TMPL:
+		ret = bytecode_const(b, node, &insn.a);
+		if (ret < 0) return -1;
+
+		if (ret > 0) {
+			insn.opcode = XLAT_INSN_COPY;
+			break;
+		}
+
+		if (!tmpl_is_attr(node->vpt)) return -1;
+
+		insn.opcode = XLAT_INSN_ATTR;
+		insn.vpt = node->vpt;
+		break;
+
+	case XLAT_FUNC:
+		return bytecode_func(b, node, dst);
+
+	default:
+		return -1;
+	}
+
+	return bytecode_emit(b, &insn);
+}
+
+static int bytecode_head(xlat_bytecode_build_t *b, xlat_exp_head_t const *head, uint8_t dst)
+{
+	xlat_exp_foreach(head, node) {
+		if (bytecode_node(b, node, dst) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Lower a function call to bytecode, if it's simple enough
+ *
+ * Must be called after the node has been instantiated, as the
+ * instantiation functions may rearrange the arguments.
+ *
+ * @param[in] node	to lower.
+ * @return
+ *	- 1 if the node was lowered.
+ *	- 0 if the node must be evaluated by the interpreter.
+ */
+int xlat_bytecode_compile(xlat_exp_t *node)
+{
+	xlat_bytecode_build_t	*b;
+	xlat_bytecode_t		*code;
+
+	if (node->type != XLAT_FUNC) return 0;
+	if (node->call.bytecode) return 1;
+
+	MEM(b = talloc_zero(NULL, xlat_bytecode_build_t));
+	MEM(code = b->code = talloc_zero(node, xlat_bytecode_t));
+
+	if (bytecode_func(b, node, 0) < 0) {
+		talloc_free(code);
+		talloc_free(b);
+		return 0;
+	}
+
+	MEM(code->insns = talloc_memdup(code, b->insns, sizeof(b->insns[0]) * b->num_insns));
+	code->num_insns = b->num_insns;
+	talloc_free(b);
+
+	node->call.bytecode = code;
+
+	return 1;
+}
+
+static inline CC_HINT(always_inline)
+fr_value_box_list_t *bytecode_reg(xlat_bytecode_t const *code, fr_value_box_list_t *out,
+				  fr_value_box_list_t *scratch, uint8_t reg)
+{
+	if (reg == 0) return out;
+	if (reg <= XLAT_BYTECODE_MAX_REGS) return &scratch[reg - 1];
+
+	return code->consts[reg - XLAT_BYTECODE_CONST(0)];
+}
+
+static inline CC_HINT(always_inline)
+void bytecode_reg_clear(fr_value_box_list_t *scratch, uint8_t reg)
+{
+	if ((reg == 0) || (reg > XLAT_BYTECODE_MAX_REGS)) return;
+
+	fr_value_box_list_talloc_free(&scratch[reg - 1]);
+}
+
+/** Find the operator which a failed instruction is an operand of
+ *
+ * Operands are emitted before the operator which uses them, so the
+ * innermost operator is the first one after the failed instruction
+ * whose operands start at, or before, it.
+ *
+ * @return
+ *	- The index of the operator.
+ *	- -1 if the instruction isn't an operand, and the expression fails.
+ */
+static int bytecode_operator_find(xlat_bytecode_t const *code, unsigned int failed)
+{
+	unsigned int i;
+
+	for (i = failed + 1; i < code->num_insns; i++) {
+		xlat_insn_t const *insn = &code->insns[i];
+
+		if ((insn->opcode != XLAT_INSN_BINARY) && (insn->opcode != XLAT_INSN_NOT)) continue;
+
+		if (insn->start <= failed) return i;
+	}
+
+	return -1;
+}
+
+/** Run bytecode produced by xlat_bytecode_compile()
+ *
+ * @param[in] ctx	to allocate value boxes in.
+ * @param[out] out	where to append the result.  Left untouched on failure.
+ * @param[in] request	being processed.
+ * @param[in] code	to run.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The error has been reported, and the caller
+ *	  should fail the expansion.
+ */
+int xlat_bytecode_eval(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, xlat_bytecode_t const *code)
+{
+	fr_value_box_list_t	result;
+	fr_value_box_list_t	scratch[XLAT_BYTECODE_MAX_REGS];
+	fr_value_box_t		*acc[XLAT_BYTECODE_MAX_REGS];	/* results of && and || */
+	unsigned int		pc, i;
+	int			op;
+
+#define REG(_n) bytecode_reg(code, &result, scratch, _n)
+
+	fr_value_box_list_init(&result);
+	for (i = 0; i < code->num_regs; i++) {
+		fr_value_box_list_init(&scratch[i]);
+		acc[i] = NULL;
+	}
+
+	pc = 0;
+	while (pc < code->num_insns) {
+		xlat_insn_t const	*insn = &code->insns[pc++];
+		fr_value_box_list_t	*a, *b;
+		fr_value_box_t		*box;
+
+		switch (insn->opcode) {
+		case XLAT_INSN_COPY:
+			fr_value_box_list_foreach(REG(insn->a), src) {
+				MEM(box = fr_value_box_alloc_null(ctx));
+				if (unlikely(fr_value_box_copy(box, box, src) < 0)) {
+					talloc_free(box);
+					goto fail;
+				}
+				fr_value_box_list_insert_tail(REG(insn->dst), box);
+			}
+			break;
+
+		case XLAT_INSN_ATTR:
+			if (tmpl_eval_pair(ctx, REG(insn->dst), request, insn->vpt) < 0) goto fail;
+			break;
+
+		case XLAT_INSN_BINARY:
+		{
+			int rcode;
+
+			a = REG(insn->a);
+			b = REG(insn->b);
+
+			/*
+			 *	Missing arguments are an error, as
+			 *	both arguments are required.
+			 */
+			if (fr_value_box_list_empty(a) || fr_value_box_list_empty(b)) {
+				REDEBUG("Function \"%s\" is missing required argument %u",
+					insn->func->name, fr_value_box_list_empty(a) ? 1 : 2);
+				goto fail;
+			}
+
+			if (fr_comparison_op[insn->op]) {
+				MEM(box = fr_value_box_alloc_null(ctx));
+				rcode = fr_value_calc_list_cmp(box, box, a, insn->op, b);
+
+			} else {
+				if (fr_value_box_list_num_elements(a) != 1) {
+					REDEBUG("Expected one value as the first argument, got %d",
+						fr_value_box_list_num_elements(a));
+					goto fail;
+				}
+
+				if (fr_value_box_list_num_elements(b) != 1) {
+					REDEBUG("Expected one value as the second argument, got %d",
+						fr_value_box_list_num_elements(b));
+					goto fail;
+				}
+
+				MEM(box = fr_value_box_alloc_null(ctx));
+				rcode = fr_value_calc_binary_op(box, box, insn->hint,
+								fr_value_box_list_head(a),
+								insn->op,
+								fr_value_box_list_head(b));
+			}
+
+			/*
+			 *	As with the functions, a failed
+			 *	calculation results in NULL, and
+			 *	isn't an error.
+			 */
+			if (rcode < 0) {
+				RPEDEBUG("Failed calculating result, returning NULL");
+
+			} else if (insn->enumv) {
+				box->enumv = insn->enumv;
+			}
+
+			bytecode_reg_clear(scratch, insn->a);
+			bytecode_reg_clear(scratch, insn->b);
+
+			fr_value_box_list_insert_tail(REG(insn->dst), box);
+		}
+			break;
+
+		case XLAT_INSN_NOT:
+		{
+			fr_value_box_t *vb = fr_value_box_list_head(REG(insn->a));
+
+			MEM(box = fr_value_box_alloc(ctx, FR_TYPE_BOOL, attr_expr_bool_enum));
+
+			/*
+			 *	!NULL = true
+			 */
+			box->vb_bool = !vb || !fr_value_box_is_truthy(vb);
+
+			bytecode_reg_clear(scratch, insn->a);
+			fr_value_box_list_insert_tail(REG(insn->dst), box);
+		}
+			break;
+
+		case XLAT_INSN_LOGICAL_INIT:
+			MEM(acc[insn->a - 1] = fr_value_box_alloc(ctx, FR_TYPE_BOOL, attr_expr_bool_enum));
+			break;
+
+		case XLAT_INSN_LOGICAL:
+		{
+			bool match;
+
+			box = acc[insn->a - 1];
+			b = REG(insn->b);
+
+			match = xlat_logical_match(&box, b, insn->stop_on_match);
+			bytecode_reg_clear(scratch, insn->b);
+
+			if (!match) {
+				if (box->type != FR_TYPE_BOOL) {
+					fr_value_box_clear(box);
+					fr_value_box_init(box, FR_TYPE_BOOL, NULL, false);
+				}
+				box->vb_bool = false;
+
+				if (!insn->stop_on_match) {
+					pc = insn->jump;
+					break;
+				}
+			}
+
+			if (insn->stop_on_match && match && fr_value_box_is_truthy(box)) pc = insn->jump;
+		}
+			break;
+
+		case XLAT_INSN_LOGICAL_DONE:
+			fr_value_box_list_insert_tail(REG(insn->dst), acc[insn->a - 1]);
+			acc[insn->a - 1] = NULL;
+			break;
+		}
+
+		if (insn->name && RDEBUG_ENABLED2) {
+			RDEBUG2("| %s", insn->name);
+			RDEBUG2("| --> %pV", fr_value_box_list_tail(REG(insn->dst)));
+		}
+		continue;
+
+	fail:
+		/*
+		 *	The operator is called with the failed operand,
+		 *	and any operands after it, empty.  Registers are
+		 *	allocated in order, so everything from the failed
+		 *	operand's register onwards is thrown away.
+		 */
+		op = bytecode_operator_find(code, pc - 1);
+		if (op < 0) goto error;
+
+		insn = &code->insns[op];
+		if ((insn->opcode == XLAT_INSN_BINARY) && ((pc - 1) >= insn->start_b)) {
+			i = insn->b - 1;
+		} else {
+			i = insn->a - 1;
+		}
+
+		for (; i < code->num_regs; i++) {
+			fr_value_box_list_talloc_free(&scratch[i]);
+			TALLOC_FREE(acc[i]);
+		}
+
+		pc = op;
+	}
+
+#undef REG
+
+	fr_value_box_list_move(out, &result);
+	return 0;
+
+error:
+	for (i = 0; i < code->num_regs; i++) {
+		fr_value_box_list_talloc_free(&scratch[i]);
+		talloc_free(acc[i]);
+	}
+	fr_value_box_list_talloc_free(&result);
+	return -1;
+}
+
+/** Evaluate an expression without pushing any frames, if it was lowered to bytecode
+ *
+ * @param[in] ctx	to allocate value boxes in.
+ * @param[out] out	where to append the result.
+ * @param[in] request	being processed.
+ * @param[in] head	of the expression.
+ * @return
+ *	- 1 if the expression must be evaluated with unlang_xlat_push().
+ *	- 0 on success.
+ *	- -1 if the expression failed.  The error has been reported.
+ */
+int xlat_bytecode_eval_head(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, xlat_exp_head_t const *head)
+{
+	xlat_exp_t const *node;
+
+	node = xlat_exp_head(head);
+	if (!node || xlat_exp_next(head, node)) return 1;
+
+	if ((node->type != XLAT_FUNC) || !node->call.bytecode) return 1;
+
+	return xlat_bytecode_eval(ctx, out, request, node->call.bytecode);
+}
@@ -1253,6 +1253,18 @@ xlat_action_t xlat_frame_eval(TALLOC_CTX *ctx, fr_dcursor_t *out, xlat_exp_head_
 			XLAT_DEBUG("** [%i] %s(func) - %%{%s:...}", unlang_interpret_stack_depth(request), __FUNCTION__,
 				   node->fmt);
 
+			/*
+			 *	Simple expressions are evaluated in place.
+			 *	Errors are reported by the bytecode, and
+			 *	fail the expansion as the function would.
+			 */
+			if (node->call.bytecode) {
+				if (xlat_bytecode_eval(ctx, &result, request, node->call.bytecode) < 0) goto fail;
+
+				fr_value_box_list_move((fr_value_box_list_t *)out->dlist, &result);
+				continue;
+			}
+
 			/*
 			 *	Hand back the child node to the caller
 			 *	for evaluation.
@@ -1334,29 +1346,30 @@ finish:
 	return xa;
 }
 
-static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, xlat_exp_head_t const * const head,
-			      xlat_escape_legacy_t escape, void const *escape_ctx)
+/** Evaluate an xlat synchronously, leaving the result as a list of boxes
+ *
+ * @param[in] ctx		to allocate the boxes in.
+ * @param[out] out		where to write the boxes.
+ * @param[in] request		current request.
+ * @param[in] head		the xlat structure to expand.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int xlat_eval_sync_list(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request,
+			       xlat_exp_head_t const * const head)
 {
-	fr_value_box_list_t	result;
 	bool			success = false;
-	TALLOC_CTX		*pool = talloc_new(NULL);
 	rlm_rcode_t		rcode;
-	char			*str;
 
 	XLAT_DEBUG("xlat_eval_sync");
 
-	*out = NULL;
-
-	fr_value_box_list_init(&result);
 	/*
 	 *	Use the unlang stack to evaluate
 	 *	the async xlat up until the point
 	 *	that it needs to yield.
 	 */
-	if (unlang_xlat_push(pool, &success, &result, request, head, true) < 0) {
-		talloc_free(pool);
-		return -1;
-	}
+	if (unlang_xlat_push(ctx, &success, out, request, head, true) < 0) return -1;
 
 	rcode = unlang_interpret_synchronous(unlang_interpret_event_list(request), request);
 	switch (rcode) {
@@ -1365,55 +1378,96 @@ static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, x
 
 	case RLM_MODULE_REJECT:
 	case RLM_MODULE_FAIL:
-	eval_failed:
+		return -1;
+	}
+	if (!success) return -1;
+
+	return 0;
+}
+
+static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, xlat_exp_head_t const * const head,
+			      xlat_escape_legacy_t escape, void const *escape_ctx)
+{
+	fr_value_box_list_t	result;
+	TALLOC_CTX		*pool = talloc_new(NULL);
+	ssize_t			slen;
+
+	*out = NULL;
+
+	fr_value_box_list_init(&result);
+	if (xlat_eval_sync_list(pool, &result, request, head) < 0) {
 		talloc_free(pool);
 		return -1;
 	}
-	if (!success) goto eval_failed;
 
-	if (!fr_value_box_list_empty(&result)) {
-		if (escape) {
-			fr_value_box_t *vb = NULL;
+	slen = xlat_list_aprint(ctx, out, request, &result, escape, escape_ctx);
+	talloc_free(pool);	/* Memory should be in new ctx */
 
-			/*
-			 *	For tainted boxes perform the requested escaping
-			 */
-			while ((vb = fr_value_box_list_next(&result, vb))) {
-				fr_value_box_entry_t entry;
-				size_t len, real_len;
-				char *escaped;
-
-				if (!vb->tainted) continue;
-
-				if (fr_value_box_cast_in_place(pool, vb, FR_TYPE_STRING, NULL) < 0) {
-					RPEDEBUG("Failed casting result to string");
-				error:
-					talloc_free(pool);
-					return -1;
-				}
+	return slen;
+}
+
+/** Escape the tainted boxes in the result of an expansion, and concatenate them
+ *
+ * This is the second half of xlat_aeval(), for callers which need to
+ * escape the result later than it's expanded, e.g. when the escape
+ * function needs a connection which isn't available yet.
+ *
+ * @param[in] ctx		to allocate the string in.
+ * @param[out] out		Where to write pointer to the string.
+ * @param[in] request		current request.
+ * @param[in] list		result of xlat_aeval_list().  Tainted boxes are
+ *				replaced with their escaped values.
+ * @param[in] escape		function to escape tainted values e.g. SQL quoting.
+ * @param[in] escape_ctx	pointer to pass to escape function.
+ * @return
+ *	- length of the string on success.
+ *	- -1 on failure.
+ */
+ssize_t xlat_list_aprint(TALLOC_CTX *ctx, char **out, request_t *request, fr_value_box_list_t *list,
+			 xlat_escape_legacy_t escape, void const *escape_ctx)
+{
+	char			*str;
 
-				len = vb->vb_length * 3;
-				escaped = talloc_array(pool, char, len);
-				real_len = escape(request, escaped, len, vb->vb_strvalue, UNCONST(void *, escape_ctx));
+	*out = NULL;
+
+	if (fr_value_box_list_empty(list)) {
+		*out = talloc_strdup(ctx, "");
+		return 0;
+	}
+
+	if (escape) {
+		fr_value_box_t *vb = NULL;
+
+		/*
+		 *	For tainted boxes perform the requested escaping
+		 */
+		while ((vb = fr_value_box_list_next(list, vb))) {
+			fr_value_box_entry_t entry;
+			size_t len, real_len;
+			char *escaped;
 
-				entry = vb->entry;
-				fr_value_box_clear_value(vb);
-				fr_value_box_bstrndup(vb, vb, NULL, escaped, real_len, false);
-				vb->entry = entry;
+			if (!vb->tainted) continue;
 
-				talloc_free(escaped);
+			if (fr_value_box_cast_in_place(vb, vb, FR_TYPE_STRING, NULL) < 0) {
+				RPEDEBUG("Failed casting result to string");
+				return -1;
 			}
-		}
 
-		str = fr_value_box_list_aprint(ctx, &result, NULL, NULL);
-		if (!str) {
-			talloc_free(pool);
-			goto error;
+			len = vb->vb_length * 3;
+			escaped = talloc_array(NULL, char, len);
+			real_len = escape(request, escaped, len, vb->vb_strvalue, UNCONST(void *, escape_ctx));
+
+			entry = vb->entry;
+			fr_value_box_clear_value(vb);
+			fr_value_box_bstrndup(vb, vb, NULL, escaped, real_len, false);
+			vb->entry = entry;
+
+			talloc_free(escaped);
 		}
-	} else {
-		str = talloc_strdup(ctx, "");
 	}
-	talloc_free(pool);	/* Memory should be in new ctx */
+
+	str = fr_value_box_list_aprint(ctx, list, NULL, NULL);
+	if (!str) return -1;
 
 	*out = str;
 
@@ -1565,6 +1619,57 @@ ssize_t xlat_aeval_compiled(TALLOC_CTX *ctx, char **out, request_t *request,
 	return _xlat_eval_compiled(ctx, out, 0, request, xlat, escape, escape_ctx);
 }
 
+/** Expand a string, leaving the result as a list of boxes
+ *
+ * Nothing is escaped, so tainted values stay tainted.  The result can
+ * be escaped and concatenated with xlat_list_aprint().
+ *
+ * @param[in] ctx		to allocate the boxes in.
+ * @param[out] out		where to write the boxes.  Must be initialised.
+ * @param[in] request		current request.
+ * @param[in] fmt		string to expand.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int xlat_aeval_list(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, char const *fmt)
+{
+	ssize_t			len;
+	int			ret;
+	xlat_exp_head_t		*head;
+
+	fr_assert(done_init);
+
+	RINDENT();
+
+	len = xlat_tokenize_ephemeral(ctx, &head, unlang_interpret_event_list(request),
+				      &FR_SBUFF_IN(fmt, strlen(fmt)),
+				      NULL,
+				      &(tmpl_rules_t){
+				      	.attr = {
+				      		.dict_def = request->dict,
+						.list_def = request_attr_request,
+				      	}
+				      });
+	if (len == 0) {
+		REXDENT();
+		return 0;
+	}
+
+	if (len < 0) {
+		REMARKER(fmt, -(len), "%s", fr_strerror());
+		REXDENT();
+		return -1;
+	}
+
+	ret = xlat_eval_sync_list(ctx, out, request, head);
+	talloc_free(head);
+
+	REXDENT();
+
+	return ret;
+}
+
 
 /** Synchronous compile xlat_tokenize_argv() into argv[] array.
  *
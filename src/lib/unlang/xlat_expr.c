@@ -726,8 +726,8 @@ static xlat_action_t xlat_regex_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	fr_assert(inst->regex == NULL);
 
-	slen = regex_compile(rctx, &preg, fr_sbuff_start(agg), fr_sbuff_used(agg),
-			     tmpl_regex_flags(inst->xlat->vpt), true, true); /* flags, allow subcaptures, at runtime */
+	slen = regex_compile_cached(&preg, fr_sbuff_start(agg), fr_sbuff_used(agg),
+				    tmpl_regex_flags(inst->xlat->vpt), true); /* flags, allow subcaptures */
 	if (slen <= 0) return XLAT_ACTION_FAIL;
 
 	return xlat_regex_match(ctx, request, in, &preg, out, inst->op);
@@ -777,12 +777,6 @@ static xlat_action_t xlat_func_ ## _name(TALLOC_CTX *ctx, fr_dcursor_t *out, \
 XLAT_REGEX_FUNC(reg_eq,  T_OP_REG_EQ)
 XLAT_REGEX_FUNC(reg_ne,  T_OP_REG_NE)
 
-typedef struct {
-	bool		stop_on_match;
-	int		argc;
-	xlat_exp_head_t	**argv;
-} xlat_logical_inst_t;
-
 typedef struct {
 	bool			last_success;
 	fr_value_box_t		*box;		//!< output value-box
@@ -1058,7 +1052,7 @@ static int xlat_expr_logical_purify(xlat_exp_t *node, void *instance, request_t
  *
  *  Empty lists are not truthy.
  */
-static bool xlat_logical_match(fr_value_box_t **dst, fr_value_box_list_t const *in, bool logical_or)
+bool xlat_logical_match(fr_value_box_t **dst, fr_value_box_list_t const *in, bool logical_or)
 {
 	fr_value_box_t *last = NULL;
 
@@ -2997,3 +2991,77 @@ bool xlat_is_truthy(xlat_exp_head_t const *head, bool *out)
 	*out = fr_value_box_is_truthy(box);
 	return true;
 }
+
+/** Allow callers to see if an xlat is a comparison of an attribute against a literal
+ *
+ *  So the caller can replace a series of such comparisons with a
+ *  lookup table.
+ *
+ *  @param[in] head	of the xlat to check.
+ *  @param[out] vpt	the attribute reference.
+ *  @param[out] op	the comparison operator.
+ *  @param[out] value	the literal value.
+ *  @return
+ *	- false - xlat is not a simple comparison, the outputs are unchanged.
+ *	- true - xlat is a comparison of an attribute against a literal.
+ */
+bool xlat_is_attr_cmp(xlat_exp_head_t const *head, tmpl_t const **vpt, fr_token_t *op, fr_value_box_t const **value)
+{
+	xlat_exp_t const	*node, *arg[2];
+	xlat_exp_t const	*attr = NULL;
+	fr_value_box_t const	*box = NULL;
+	int			i;
+
+	node = xlat_exp_head(head);
+	if (!node || xlat_exp_next(head, node)) return false;
+
+	if ((node->type != XLAT_FUNC) || !node->call.func->internal) return false;
+
+	if (!fr_comparison_op[node->call.func->token]) return false;
+
+	arg[0] = xlat_exp_head(node->call.args);
+	if (!arg[0]) return false;
+
+	arg[1] = xlat_exp_next(node->call.args, arg[0]);
+	if (!arg[1] || xlat_exp_next(node->call.args, arg[1])) return false;
+
+	/*
+	 *	The literal can be on either side.
+	 */
+	for (i = 0; i < 2; i++) {
+		xlat_exp_t const *child;
+
+		if (arg[i]->type != XLAT_GROUP) return false;
+
+		child = xlat_exp_head(arg[i]->group);
+		if (!child || xlat_exp_next(arg[i]->group, child)) return false;
+
+		if (child->type == XLAT_BOX) {
+			if (box) return false;
+			box = &child->data;
+
+		} else if ((child->type == XLAT_TMPL) && tmpl_is_data(child->vpt)) {
+			if (box) return false;
+
+			/*
+			 *	The value has to be used as-is.
+			 */
+			if (tmpl_rules_cast(child->vpt) &&
+			    (tmpl_rules_cast(child->vpt) != tmpl_value_type(child->vpt))) return false;
+
+			box = tmpl_value(child->vpt);
+
+		} else if ((child->type == XLAT_TMPL) && tmpl_is_attr(child->vpt)) {
+			if (attr) return false;
+			attr = child;
+
+		} else {
+			return false;
+		}
+	}
+
+	*vpt = attr->vpt;
+	*op = node->call.func->token;
+	*value = box;
+	return true;
+}
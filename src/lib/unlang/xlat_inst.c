@@ -348,6 +348,16 @@ static int _xlat_instantiate_ephemeral_walker(xlat_exp_t *node, void *uctx)
 	return 0;
 }
 
+/** Callback for lowering function calls to bytecode
+ *
+ */
+static int _xlat_bytecode_walker(xlat_exp_t *node, UNUSED void *uctx)
+{
+	(void) xlat_bytecode_compile(node);
+
+	return 0;
+}
+
 /** Create instance data for "ephemeral" xlats
  *
  * @note This must only be used for xlats created at runtime.
@@ -373,6 +383,12 @@ int xlat_instantiate_ephemeral(xlat_exp_head_t *head, fr_event_list_t *el)
 	ret = xlat_eval_walk(head, _xlat_instantiate_ephemeral_walker, XLAT_INVALID, el);
 	if (ret < 0) return ret;
 
+	/*
+	 *	Instantiation may have rearranged the arguments, so
+	 *	we can only lower the calls once it's all done.
+	 */
+	(void) xlat_eval_walk(head, _xlat_bytecode_walker, XLAT_FUNC, NULL);
+
 	head->instantiated = true;
 
 	return 0;
@@ -519,6 +535,14 @@ int xlat_instantiate(void)
 		    					  call->func->uctx)) < 0) return -1;
 	}}
 
+	/*
+	 *	Now that all of the arguments are where they're
+	 *	going to be, lower the calls which are simple enough.
+	 */
+	fr_heap_foreach(xlat_inst_tree, xlat_inst_t, xi) {
+		(void) xlat_bytecode_compile(xi->node);
+	}}
+
 	return 0;
 }
 
@@ -651,6 +675,11 @@ int xlat_inst_remove(xlat_exp_t *node)
 	fr_assert(!node->call.func->detach);
 	fr_assert(!node->call.func->thread_detach);
 
+	if (node->call.bytecode) {
+		talloc_const_free(node->call.bytecode);
+		node->call.bytecode = NULL;
+	}
+
 	if (node->call.inst) {
 		ret = fr_heap_extract(&xlat_inst_tree, node->call.inst);
 		if (ret < 0) return ret;
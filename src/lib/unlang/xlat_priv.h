@@ -113,6 +113,8 @@ typedef enum {
 	XLAT_GROUP		= 0x0200		//!< encapsulated string of xlats
 } xlat_type_t;
 
+typedef struct xlat_bytecode_s xlat_bytecode_t;
+
 /** An xlat function call
  *
  */
@@ -134,6 +136,9 @@ typedef struct {
 							///< bracketing style.
 
 	fr_dict_t const		*dict;			//!< Dictionary to use when resolving call env tmpls
+
+	xlat_bytecode_t const	*bytecode;		//!< The call lowered to bytecode, if it's pure and
+							///< synchronous.  NULL if it must be interpreted.
 } xlat_call_t;
 
 /** An xlat expansion node
@@ -328,8 +333,24 @@ int 		xlat_decode_value_box_list(TALLOC_CTX *ctx, fr_pair_list_t *out,
 /*
  *	xlat_expr.c
  */
+typedef struct {
+	bool		stop_on_match;
+	int		argc;
+	xlat_exp_head_t	**argv;
+} xlat_logical_inst_t;
+
 int		xlat_register_expressions(void);
 
+bool		xlat_logical_match(fr_value_box_t **dst, fr_value_box_list_t const *in, bool logical_or);
+
+/*
+ *	xlat_bytecode.c
+ */
+int		xlat_bytecode_compile(xlat_exp_t *node) CC_HINT(nonnull);
+
+int		xlat_bytecode_eval(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request,
+				   xlat_bytecode_t const *code) CC_HINT(nonnull);
+
 /*
  *	xlat_tokenize.c
  */
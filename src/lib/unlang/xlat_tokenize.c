@@ -1615,6 +1615,16 @@ fr_slen_t xlat_tokenize_ephemeral(TALLOC_CTX *ctx, xlat_exp_head_t **out,
 		return 0;
 	}
 
+	/*
+	 *	Function calls need thread instance data, which
+	 *	can't be created without an event list.
+	 */
+	if (!el && xlat_contains_func(head)) {
+		fr_strerror_const("Function calls are not allowed here");
+		talloc_free(head);
+		FR_SBUFF_ERROR_RETURN(&our_in);
+	}
+
 	/*
 	 *	Create ephemeral instance data for the xlat
 	 */
@@ -1915,6 +1925,46 @@ bool xlat_needs_resolving(xlat_exp_head_t const *head)
 	return head->flags.needs_resolving;
 }
 
+/** Check to see if the expansion calls any functions
+ *
+ * Function calls have instance data which is created at startup,
+ * so expansions containing them can't be created by other threads
+ * once the server is running.
+ *
+ * @param[in] head	to check.
+ * @return
+ *	- true if expansion contains function calls.
+ *	- false otherwise
+ */
+bool xlat_contains_func(xlat_exp_head_t const *head)
+{
+	xlat_exp_foreach(head, node) {
+		switch (node->type) {
+		case XLAT_FUNC:
+		case XLAT_FUNC_UNRESOLVED:
+			return true;
+
+		case XLAT_GROUP:
+			if (xlat_contains_func(node->group)) return true;
+			break;
+
+		case XLAT_ALTERNATE:
+			if (xlat_contains_func(node->alternate[0]) ||
+			    xlat_contains_func(node->alternate[1])) return true;
+			break;
+
+		case XLAT_TMPL:
+			if (tmpl_contains_xlat(node->vpt) && xlat_contains_func(tmpl_xlat(node->vpt))) return true;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
 /** Convert an xlat node to an unescaped literal string and free the original node
  *
  *  This is really "unparse the xlat nodes, and convert back to their original string".
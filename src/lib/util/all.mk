@@ -3,8 +3,10 @@ SUBMAKEFILES := \
 	dbuff_tests.mk \
 	dcursor_tests.mk \
 	dcursor_typed_tests.mk \
+	dict_image_tests.mk \
 	dlist_tests.mk \
 	edit_tests.mk \
+	event_tests.mk \
 	heap_tests.mk \
 	hmac_tests.mk \
 	libfreeradius-util.mk \
@@ -5,6 +5,7 @@
 #define L_DST_DIR			LOGDIR
 
 #define FR_DICTIONARY_FILE		"dictionary"
+#define FR_DICTIONARY_IMAGE_FILE	FR_DICTIONARY_FILE ".image"
 #define FR_DICTIONARY_INTERNAL_DIR	"freeradius"
 #define RADIUS_CLIENTS			"clients"
 #define RADIUS_NASLIST			"naslist"
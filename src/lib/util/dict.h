@@ -601,6 +601,8 @@ int			fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char
 fr_dict_t		*fr_dict_protocol_alloc(fr_dict_t const *parent);
 
 int			fr_dict_read(fr_dict_t *dict, char const *dict_dir, char const *filename);
+
+int			fr_dict_image_write(fr_dict_t const *dict, char const *filename);
 /** @} */
 
 /** @name Autoloader interface
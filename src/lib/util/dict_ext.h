@@ -52,6 +52,11 @@ extern fr_ext_t const fr_dict_enum_ext_def;
 typedef struct {
 	fr_hash_table_t		*child_by_name;			//!< Namespace at this level in the hierarchy.
 	fr_dict_attr_t const	**children;			//!< Children of this attribute.
+
+	fr_dict_attr_t const	**dense;			//!< Children indexed directly by number.  Only built
+								///< when the dictionary is frozen, and only if the
+								///< children are numbered densely enough.
+	unsigned int		dense_len;			//!< Number of slots in the dense array.
 } fr_dict_attr_ext_children_t;
 
 /** Attribute extension - Holds a reference to an attribute in another dictionary
@@ -663,6 +663,12 @@ void dict_hash_tables_finalise(fr_dict_t *dict)
 
 	fr_dict_walk(root, _dict_attr_fixup_hash_tables, NULL);
 
+	/*
+	 *	Now that nothing more will be added, index the
+	 *	children of any attributes with dense numbering.
+	 */
+	dict_attr_children_dense_build(root);
+
 	/*
 	 *	Walk over all of the hash tables to ensure they're
 	 *	initialized.  We do this because the threads may perform
@@ -0,0 +1,1314 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Precompiled binary images of dictionaries
+ *
+ * Tokenizing the text dictionaries is the bulk of the start up time of
+ * every binary which loads them.  Once a dictionary has been loaded, its
+ * attribute tree can be written out as a flat image, which is mapped into
+ * memory and replayed into a new dictionary on the next load, skipping the
+ * parser, the validation checks and the fixups entirely.
+ *
+ * Images are a cache, never a source of truth.  Each image records the
+ * text files it was built from, and is ignored in favour of those files
+ * if any of them has changed, or if the image was written by a different
+ * build of the library.
+ *
+ * The image is a sequence of sections, all integers big endian:
+ *
+ * - header		magic, format version, library magic, struct sizes.
+ * - sources		path, mtime and size of each text file read.
+ * - protocol		root attribute and protocol options.
+ * - vendors		every vendor name, non-primary names first.
+ * - attributes		every attribute, parents before children.
+ *			Attributes are referred to by their index here.
+ * - refs		ref extensions, and foreign dictionary owners.
+ * - children		contents of the children-by-number bins.
+ * - namespaces		contents of the children-by-name tables.
+ * - enums		enumeration values, non-primary names first.
+ *
+ * @file src/lib/util/dict_image.c
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dbuff.h>
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/file.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/version.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DICT_IMAGE_MAGIC	"FRDICTIM"		//!< First 8 bytes of every image.
+#define DICT_IMAGE_VERSION	1			//!< Bump when the layout below changes.
+#define DICT_IMAGE_NONE		UINT32_MAX		//!< "No attribute" index.
+
+/** What an attribute's ref extension points to
+ *
+ */
+typedef enum {
+	DICT_IMAGE_REF_NONE = 0,			//!< Extension present, but empty.
+	DICT_IMAGE_REF_LOCAL,				//!< Attribute in this image, by index.
+	DICT_IMAGE_REF_FOREIGN				//!< Attribute in another dictionary, by name.
+} dict_image_ref_t;
+
+/** Maps an attribute to its position in the image
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;
+	uint32_t		idx;
+} dict_image_idx_t;
+
+/** State for writing an image
+ *
+ */
+typedef struct {
+	fr_dict_t const		*dict;			//!< Dictionary being written.
+	fr_dict_attr_t const	*skip;			//!< Don't descend into this attribute.
+	fr_dict_attr_t const	**attrs;		//!< Every attribute, in image order.
+	fr_hash_table_t		*by_da;			//!< Attribute to image index.
+	fr_dbuff_t		dbuff;			//!< The image.
+	fr_dbuff_uctx_talloc_t	tctx;
+} dict_image_wctx_t;
+
+static uint32_t dict_image_idx_hash(void const *data)
+{
+	dict_image_idx_t const *idx = data;
+
+	return fr_hash(&idx->da, sizeof(idx->da));
+}
+
+static int8_t dict_image_idx_cmp(void const *one, void const *two)
+{
+	dict_image_idx_t const *a = one, *b = two;
+
+	return CMP(a->da, b->da);
+}
+
+static uint32_t dict_image_idx(dict_image_wctx_t *wctx, fr_dict_attr_t const *da)
+{
+	dict_image_idx_t *found;
+
+	if (!da) return DICT_IMAGE_NONE;
+
+	found = fr_hash_table_find(wctx->by_da, &(dict_image_idx_t){ .da = da });
+	if (!found) return DICT_IMAGE_NONE;
+
+	return found->idx;
+}
+
+/** Add an attribute to the list of attributes to write, if we haven't seen it already
+ *
+ */
+static int dict_image_collect_one(dict_image_wctx_t *wctx, fr_dict_attr_t const *da)
+{
+	dict_image_idx_t	*idx;
+	size_t			num;
+
+	if (dict_image_idx(wctx, da) != DICT_IMAGE_NONE) return 0;
+
+	if (da->parent && (dict_image_collect_one(wctx, da->parent) < 0)) return -1;
+
+	idx = talloc(wctx->by_da, dict_image_idx_t);
+	if (unlikely(!idx)) return -1;
+	*idx = (dict_image_idx_t){ .da = da };
+
+	if (!fr_hash_table_insert(wctx->by_da, idx)) return -1;
+
+	num = talloc_array_length(wctx->attrs);
+	wctx->attrs = talloc_realloc(wctx->by_da, wctx->attrs, fr_dict_attr_t const *, num + 1);
+	if (unlikely(!wctx->attrs)) return -1;
+	wctx->attrs[num] = da;
+
+	return 0;
+}
+
+/** Find every attribute reachable from the root of the dictionary, and number them
+ *
+ * Attributes are found through the children-by-number bins, which contain
+ * attributes that have since been replaced by name, through the namespace
+ * tables, which contain attributes that aren't tracked by number, and ALIASes,
+ * and through the child structures of VALUEs, which are the only way to reach
+ * some of the structures copied by "clone=".
+ *
+ * The final order is by depth, so that the loader always sees a parent
+ * before any of its children.
+ */
+static int dict_image_collect(dict_image_wctx_t *wctx)
+{
+	fr_dict_attr_t const	**found;
+	size_t			i, j, num;
+	unsigned int		depth, max_depth = 0;
+
+	if (dict_image_collect_one(wctx, wctx->dict->root) < 0) return -1;
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const		*da = wctx->attrs[i];
+		fr_dict_attr_t const		**children;
+		fr_dict_attr_ext_namespace_t	*ns;
+		fr_dict_attr_ext_enumv_t	*ext;
+
+		if (da->depth > max_depth) max_depth = da->depth;
+
+		if (da == wctx->skip) continue;
+
+		children = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_CHILDREN) ? dict_attr_children(da) : NULL;
+		if (children) for (j = 0; j <= UINT8_MAX; j++) {
+			fr_dict_attr_t const *child;
+
+			for (child = children[j]; child; child = child->next) {
+				if (dict_image_collect_one(wctx, child) < 0) return -1;
+			}
+		}
+
+		ns = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_NAMESPACE);
+		if (ns && ns->namespace) {
+			fr_hash_iter_t		iter;
+			fr_dict_attr_t const	*child;
+
+			for (child = fr_hash_table_iter_init(ns->namespace, &iter);
+			     child;
+			     child = fr_hash_table_iter_next(ns->namespace, &iter)) {
+				if (dict_image_collect_one(wctx, child) < 0) return -1;
+			}
+		}
+
+		ext = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_ENUMV);
+		if (ext && ext->value_by_name && fr_dict_attr_is_key_field(da)) {
+			fr_hash_iter_t			iter;
+			fr_dict_enum_value_t const	*enumv;
+
+			for (enumv = fr_hash_table_iter_init(ext->value_by_name, &iter);
+			     enumv;
+			     enumv = fr_hash_table_iter_next(ext->value_by_name, &iter)) {
+				if (enumv->child_struct[0] && (enumv->child_struct[0]->dict == wctx->dict) &&
+				    (dict_image_collect_one(wctx, enumv->child_struct[0]) < 0)) return -1;
+			}
+		}
+	}
+
+	/*
+	 *	Stable sort by depth, then renumber.
+	 */
+	num = talloc_array_length(wctx->attrs);
+	found = talloc_array(wctx->by_da, fr_dict_attr_t const *, num);
+	if (unlikely(!found)) return -1;
+
+	for (depth = 0, j = 0; depth <= max_depth; depth++) {
+		for (i = 0; i < num; i++) {
+			dict_image_idx_t *idx;
+
+			if (wctx->attrs[i]->depth != depth) continue;
+
+			idx = fr_hash_table_find(wctx->by_da, &(dict_image_idx_t){ .da = wctx->attrs[i] });
+			if (!fr_cond_assert(idx)) return -1;
+
+			idx->idx = j;
+			found[j++] = wctx->attrs[i];
+		}
+	}
+	fr_assert(j == num);
+
+	wctx->attrs = found;
+
+	return 0;
+}
+
+/*
+ *	Everything written here goes into a talloc'd dbuff which
+ *	only fails to extend if we're out of memory.
+ */
+#define IMAGE_IN(_in) do { if (unlikely(fr_dbuff_in(&wctx->dbuff, _in) <= 0)) return -1; } while (0)
+#define IMAGE_IN_MEMCPY(_in, _inlen) do { if (unlikely(fr_dbuff_in_memcpy(&wctx->dbuff, _in, _inlen) < 0)) return -1; } while (0)
+#define IMAGE_IN_STR(_in) do { if (unlikely(dict_image_in_str(wctx, _in) < 0)) return -1; } while (0)
+
+static int dict_image_in_str(dict_image_wctx_t *wctx, char const *str)
+{
+	size_t len = strlen(str);
+
+	if (len > UINT16_MAX) {
+		fr_strerror_printf("String \"%.32s...\" too long", str);
+		return -1;
+	}
+
+	IMAGE_IN((uint16_t) len);
+	IMAGE_IN_MEMCPY((uint8_t const *) str, len);
+
+	return 0;
+}
+
+static int dict_image_write_header(dict_image_wctx_t *wctx)
+{
+	IMAGE_IN_MEMCPY((uint8_t const *) DICT_IMAGE_MAGIC, sizeof(DICT_IMAGE_MAGIC) - 1);
+	IMAGE_IN((uint32_t) DICT_IMAGE_VERSION);
+	IMAGE_IN((uint64_t) RADIUSD_MAGIC_NUMBER);
+	IMAGE_IN((uint16_t) sizeof(fr_dict_attr_flags_t));
+	IMAGE_IN((uint16_t) sizeof(fr_value_box_datum_t));
+	IMAGE_IN((uint8_t) (wctx->dict == wctx->dict->gctx->internal));
+
+	return 0;
+}
+
+static int dict_image_write_sources(dict_image_wctx_t *wctx)
+{
+	size_t i;
+
+	IMAGE_IN((uint32_t) talloc_array_length(wctx->dict->src));
+	for (i = 0; i < talloc_array_length(wctx->dict->src); i++) {
+		fr_dict_src_t const *src = &wctx->dict->src[i];
+
+		IMAGE_IN_STR(src->filename);
+		IMAGE_IN((uint64_t) src->mtime);
+		IMAGE_IN((uint64_t) src->size);
+	}
+
+	return 0;
+}
+
+static int dict_image_write_protocol(dict_image_wctx_t *wctx)
+{
+	fr_dict_t const		*dict = wctx->dict;
+	fr_dict_attr_t const	*root = dict->root;
+
+	IMAGE_IN_STR(root->name);
+	IMAGE_IN((uint32_t) root->attr);
+	IMAGE_IN_MEMCPY((uint8_t const *) &root->flags, sizeof(root->flags));
+	IMAGE_IN((uint32_t) root->last_child_attr);
+	IMAGE_IN((uint8_t) dict->string_based);
+	IMAGE_IN((uint8_t) (dict->dl != NULL));
+	IMAGE_IN((uint32_t) dict->vsa_parent);
+
+	return 0;
+}
+
+static int dict_image_write_vendors(dict_image_wctx_t *wctx)
+{
+	fr_dict_t const		*dict = wctx->dict;
+	fr_dict_vendor_t const	*dv;
+	fr_hash_iter_t		iter;
+	int			pass;
+
+	IMAGE_IN((uint32_t) fr_hash_table_num_elements(dict->vendors_by_name));
+
+	/*
+	 *	The last name added for a PEN is the one it's
+	 *	printed as, so write the other names out first.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (dv = fr_hash_table_iter_init(dict->vendors_by_name, &iter);
+		     dv;
+		     dv = fr_hash_table_iter_next(dict->vendors_by_name, &iter)) {
+			bool primary = (fr_hash_table_find(dict->vendors_by_num, dv) == dv);
+
+			if (primary != (pass == 1)) continue;
+
+			IMAGE_IN_STR(dv->name);
+			IMAGE_IN((uint32_t) dv->pen);
+			IMAGE_IN((uint8_t) dv->type);
+			IMAGE_IN((uint8_t) dv->length);
+			IMAGE_IN((uint8_t) dv->continuation);
+		}
+	}
+
+	return 0;
+}
+
+static int dict_image_write_attrs(dict_image_wctx_t *wctx)
+{
+	size_t i;
+
+	IMAGE_IN((uint32_t) talloc_array_length(wctx->attrs));
+
+	/*
+	 *	The root is created from the protocol section.
+	 */
+	for (i = 1; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const *da = wctx->attrs[i];
+
+		IMAGE_IN(dict_image_idx(wctx, da->parent));
+		IMAGE_IN_STR(da->name);
+		IMAGE_IN((uint32_t) da->attr);
+		IMAGE_IN((uint8_t) da->type);
+		IMAGE_IN_MEMCPY((uint8_t const *) &da->flags, sizeof(da->flags));
+		IMAGE_IN((uint32_t) da->last_child_attr);
+		IMAGE_IN((uint8_t) (fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_REF) != NULL));
+	}
+
+	return 0;
+}
+
+/** Write a reference to an attribute which may be in another dictionary
+ *
+ * Attributes in other dictionaries are written as the protocol name, and
+ * the names of each attribute on the path from its root.
+ */
+static int dict_image_in_ref(dict_image_wctx_t *wctx, fr_dict_attr_t const *ref)
+{
+	fr_dict_attr_t const	*path[FR_DICT_MAX_TLV_STACK + 1];
+	fr_dict_attr_t const	*p;
+	unsigned int		depth = 0;
+
+	if (!ref) {
+		IMAGE_IN((uint8_t) DICT_IMAGE_REF_NONE);
+		return 0;
+	}
+
+	if (dict_image_idx(wctx, ref) != DICT_IMAGE_NONE) {
+		IMAGE_IN((uint8_t) DICT_IMAGE_REF_LOCAL);
+		IMAGE_IN(dict_image_idx(wctx, ref));
+		return 0;
+	}
+
+	for (p = ref; p->parent; p = p->parent) {
+		if (depth >= NUM_ELEMENTS(path)) {
+		invalid:
+			fr_strerror_printf("Can't write reference to \"%s\"", ref->name);
+			return -1;
+		}
+		path[depth++] = p;
+	}
+	if (!p->flags.is_root || (p->dict == wctx->dict)) goto invalid;
+
+	IMAGE_IN((uint8_t) DICT_IMAGE_REF_FOREIGN);
+	IMAGE_IN_STR(p->name);
+	IMAGE_IN((uint8_t) depth);
+	while (depth > 0) IMAGE_IN_STR(path[--depth]->name);
+
+	return 0;
+}
+
+static int dict_image_write_refs(dict_image_wctx_t *wctx)
+{
+	size_t		i;
+	uint32_t	num = 0;
+
+	for (i = 1; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const *da = wctx->attrs[i];
+
+		if (fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_REF) || (da->dict != wctx->dict)) num++;
+	}
+	IMAGE_IN(num);
+
+	for (i = 1; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const *da = wctx->attrs[i];
+
+		if (!fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_REF) && (da->dict == wctx->dict)) continue;
+
+		IMAGE_IN((uint32_t) i);
+		if (dict_image_in_ref(wctx, fr_dict_attr_ref(da)) < 0) return -1;
+
+		/*
+		 *	Groups referencing another protocol are
+		 *	owned by that protocol's dictionary.
+		 */
+		if (da->dict != wctx->dict) {
+			IMAGE_IN((uint8_t) 1);
+			IMAGE_IN_STR(fr_dict_root(da->dict)->name);
+		} else {
+			IMAGE_IN((uint8_t) 0);
+		}
+	}
+
+	return 0;
+}
+
+static int dict_image_write_children(dict_image_wctx_t *wctx)
+{
+	size_t		i, j;
+	uint32_t	num = 0;
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		if ((wctx->attrs[i] != wctx->skip) &&
+		    fr_dict_attr_ext(wctx->attrs[i], FR_DICT_ATTR_EXT_CHILDREN) &&
+		    dict_attr_children(wctx->attrs[i])) num++;
+	}
+	IMAGE_IN(num);
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const	*da = wctx->attrs[i];
+		fr_dict_attr_t const	**children;
+		fr_dict_attr_t const	*child;
+		uint32_t		count = 0;
+
+		if ((da == wctx->skip) || !fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_CHILDREN)) continue;
+
+		children = dict_attr_children(da);
+		if (!children) continue;
+
+		for (j = 0; j <= UINT8_MAX; j++) for (child = children[j]; child; child = child->next) count++;
+
+		IMAGE_IN((uint32_t) i);
+		IMAGE_IN(count);
+
+		/*
+		 *	Bin order matters, it decides which of
+		 *	several attributes with the same number
+		 *	is found first.
+		 */
+		for (j = 0; j <= UINT8_MAX; j++) for (child = children[j]; child; child = child->next) {
+			IMAGE_IN(dict_image_idx(wctx, child));
+		}
+	}
+
+	return 0;
+}
+
+static int dict_image_write_namespaces(dict_image_wctx_t *wctx)
+{
+	size_t		i;
+	uint32_t	num = 0;
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_ext_namespace_t *ns = fr_dict_attr_ext(wctx->attrs[i], FR_DICT_ATTR_EXT_NAMESPACE);
+
+		if ((wctx->attrs[i] != wctx->skip) && ns && ns->namespace &&
+		    fr_hash_table_num_elements(ns->namespace)) num++;
+	}
+	IMAGE_IN(num);
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_ext_namespace_t	*ns = fr_dict_attr_ext(wctx->attrs[i], FR_DICT_ATTR_EXT_NAMESPACE);
+		fr_dict_attr_t const		*child;
+		fr_hash_iter_t			iter;
+
+		if ((wctx->attrs[i] == wctx->skip) || !ns || !ns->namespace ||
+		    !fr_hash_table_num_elements(ns->namespace)) continue;
+
+		IMAGE_IN((uint32_t) i);
+		IMAGE_IN(fr_hash_table_num_elements(ns->namespace));
+
+		for (child = fr_hash_table_iter_init(ns->namespace, &iter);
+		     child;
+		     child = fr_hash_table_iter_next(ns->namespace, &iter)) {
+			IMAGE_IN(dict_image_idx(wctx, child));
+		}
+	}
+
+	return 0;
+}
+
+static int dict_image_write_enums(dict_image_wctx_t *wctx)
+{
+	size_t		i;
+	uint32_t	num = 0;
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_ext_enumv_t *ext = fr_dict_attr_ext(wctx->attrs[i], FR_DICT_ATTR_EXT_ENUMV);
+
+		if (ext && ext->value_by_name && fr_hash_table_num_elements(ext->value_by_name)) num++;
+	}
+	IMAGE_IN(num);
+
+	for (i = 0; i < talloc_array_length(wctx->attrs); i++) {
+		fr_dict_attr_t const		*da = wctx->attrs[i];
+		fr_dict_attr_ext_enumv_t	*ext = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_ENUMV);
+		fr_dict_enum_value_t const	*enumv;
+		fr_hash_iter_t			iter;
+		int				pass;
+
+		if (!ext || !ext->value_by_name || !fr_hash_table_num_elements(ext->value_by_name)) continue;
+
+		IMAGE_IN((uint32_t) i);
+		IMAGE_IN(fr_hash_table_num_elements(ext->value_by_name));
+
+		/*
+		 *	As with vendors, the name a value is printed
+		 *	as goes last.
+		 */
+		for (pass = 0; pass < 2; pass++) {
+			for (enumv = fr_hash_table_iter_init(ext->value_by_name, &iter);
+			     enumv;
+			     enumv = fr_hash_table_iter_next(ext->value_by_name, &iter)) {
+				bool		primary = (fr_hash_table_find(ext->name_by_value, enumv) == enumv);
+				uint32_t	child_struct = DICT_IMAGE_NONE;
+
+				if (primary != (pass == 1)) continue;
+
+				if (fr_dict_attr_is_key_field(da) && enumv->child_struct[0]) {
+					child_struct = dict_image_idx(wctx, enumv->child_struct[0]);
+					if (child_struct == DICT_IMAGE_NONE) {
+						fr_strerror_printf("Can't write child structure of %s.%s",
+								   da->name, enumv->name);
+						return -1;
+					}
+				}
+
+				IMAGE_IN_STR(enumv->name);
+				IMAGE_IN((uint8_t) primary);
+				IMAGE_IN(child_struct);
+
+				switch (enumv->value->type) {
+				case FR_TYPE_FIXED_SIZE:
+					IMAGE_IN((uint32_t) sizeof(enumv->value->datum));
+					IMAGE_IN_MEMCPY((uint8_t const *) &enumv->value->datum,
+							sizeof(enumv->value->datum));
+					break;
+
+				case FR_TYPE_OCTETS:
+					IMAGE_IN((uint32_t) enumv->value->vb_length);
+					IMAGE_IN_MEMCPY(enumv->value->vb_octets, enumv->value->vb_length);
+					break;
+
+				default:
+					fr_strerror_printf("Can't write %s VALUE %s.%s",
+							   fr_type_to_str(enumv->value->type), da->name, enumv->name);
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/** Write a binary image of a dictionary
+ *
+ * Only dictionaries loaded from files with #fr_dict_protocol_afrom_file or
+ * #fr_dict_internal_afrom_file, and not modified since, can be written.
+ *
+ * The internal dictionary is written without the children of "Proto",
+ * which are added as each protocol dictionary is loaded.
+ *
+ * @param[in] dict	to write.
+ * @param[in] filename	to write the image to.  If NULL, the image is written
+ *			to the default location the dictionary loaders check,
+ *			next to the dictionary's main file.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_image_write(fr_dict_t const *dict, char const *filename)
+{
+	dict_image_wctx_t	wctx = { .dict = dict };
+	TALLOC_CTX		*tmp_ctx;
+	char			*path, *tmp;
+	char const		*p;
+	int			fd, ret = -1;
+	size_t			len;
+	uint8_t const		*data;
+
+	if (!dict->src || !talloc_array_length(dict->src)) {
+		fr_strerror_printf("Dictionary \"%s\" was not loaded from files, or has been modified since",
+				   fr_dict_root(dict)->name);
+		return -1;
+	}
+
+	tmp_ctx = talloc_init_const("dict_image_write");
+	if (unlikely(!tmp_ctx)) return -1;
+
+	if (filename) {
+		path = talloc_typed_strdup(tmp_ctx, filename);
+	} else {
+		p = strrchr(dict->src[0].filename, FR_DIR_SEP);
+		path = talloc_typed_asprintf(tmp_ctx, "%.*s%s",
+					     p ? (int) (p + 1 - dict->src[0].filename) : 0, dict->src[0].filename,
+					     FR_DICTIONARY_IMAGE_FILE);
+	}
+	if (!path) goto oom;
+
+	if (dict == dict->gctx->internal) wctx.skip = dict->gctx->attr_protocol_encapsulation;
+
+	wctx.by_da = fr_hash_table_alloc(tmp_ctx, dict_image_idx_hash, dict_image_idx_cmp, NULL);
+	if (!wctx.by_da) goto oom;
+
+	fr_dbuff_init_talloc(tmp_ctx, &wctx.dbuff, &wctx.tctx, 64 * 1024, SIZE_MAX);
+
+	if ((dict_image_collect(&wctx) < 0) ||
+	    (dict_image_write_header(&wctx) < 0) ||
+	    (dict_image_write_sources(&wctx) < 0) ||
+	    (dict_image_write_protocol(&wctx) < 0) ||
+	    (dict_image_write_vendors(&wctx) < 0) ||
+	    (dict_image_write_attrs(&wctx) < 0) ||
+	    (dict_image_write_refs(&wctx) < 0) ||
+	    (dict_image_write_children(&wctx) < 0) ||
+	    (dict_image_write_namespaces(&wctx) < 0) ||
+	    (dict_image_write_enums(&wctx) < 0)) {
+		fr_strerror_printf_push("Failed building image of dictionary \"%s\"", fr_dict_root(dict)->name);
+		goto finish;
+	}
+
+	/*
+	 *	Write to a temporary file and rename it into place,
+	 *	so a concurrent load never sees half an image.
+	 */
+	tmp = talloc_asprintf(tmp_ctx, "%s.%u", path, (unsigned int) getpid());
+	if (!tmp) {
+	oom:
+		fr_strerror_const("Out of memory");
+		goto finish;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+
+	data = fr_dbuff_start(&wctx.dbuff);
+	len = fr_dbuff_used(&wctx.dbuff);
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, data, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+			close(fd);
+			unlink(tmp);
+			goto finish;
+		}
+		data += slen;
+		len -= slen;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		fr_strerror_printf("Failed renaming \"%s\" to \"%s\": %s", tmp, path, fr_syserror(errno));
+		unlink(tmp);
+		goto finish;
+	}
+
+	ret = 0;
+
+finish:
+	talloc_free(tmp_ctx);
+
+	return ret;
+}
+
+/** State for loading an image
+ *
+ */
+typedef struct {
+	char const		*filename;		//!< Of the image, for errors and dependents.
+	fr_dbuff_t		dbuff;			//!< Over the mapped image.
+	bool			internal;		//!< We're loading the internal dictionary.
+	fr_dict_t		*dict;			//!< Being built.
+	fr_dict_src_t		*src;			//!< Read from the image.
+	fr_dict_attr_t		**attrs;		//!< By image index.
+} dict_image_rctx_t;
+
+/*
+ *	Any failure reading the image means we fall back to the
+ *	text files, which produce a better error if there's a real
+ *	problem.  So the errors here are terse.
+ */
+#define IMAGE_OUT(_out) do { if (unlikely(fr_dbuff_out(_out, &rctx->dbuff) <= 0)) goto truncated; } while (0)
+#define IMAGE_OUT_STR(_out) do { if (unlikely(dict_image_out_str(_out, sizeof(_out), &rctx->dbuff) < 0)) goto truncated; } while (0)
+#define IMAGE_OUT_IDX(_out) do { \
+	IMAGE_OUT(&_out); \
+	if (unlikely(_out >= talloc_array_length(rctx->attrs))) goto invalid; \
+} while (0)
+
+static int dict_image_out_str(char *out, size_t outlen, fr_dbuff_t *dbuff)
+{
+	uint16_t len;
+
+	if (fr_dbuff_out(&len, dbuff) <= 0) return -1;
+	if (len >= outlen) return -1;
+	if (fr_dbuff_out_memcpy((uint8_t *) out, dbuff, len) < 0) return -1;
+	out[len] = '\0';
+
+	return 0;
+}
+
+static int dict_image_load_header(dict_image_rctx_t *rctx)
+{
+	uint8_t		magic[sizeof(DICT_IMAGE_MAGIC) - 1];
+	uint32_t	version;
+	uint64_t	lib_magic;
+	uint16_t	flags_size, datum_size;
+	uint8_t		internal;
+
+	if (fr_dbuff_out_memcpy(magic, &rctx->dbuff, sizeof(magic)) < 0) goto truncated;
+	if (memcmp(magic, DICT_IMAGE_MAGIC, sizeof(magic)) != 0) {
+		fr_strerror_const("Not a dictionary image");
+		return -1;
+	}
+
+	IMAGE_OUT(&version);
+	IMAGE_OUT(&lib_magic);
+	IMAGE_OUT(&flags_size);
+	IMAGE_OUT(&datum_size);
+	IMAGE_OUT(&internal);
+
+	if ((version != DICT_IMAGE_VERSION) || (lib_magic != RADIUSD_MAGIC_NUMBER) ||
+	    (flags_size != sizeof(fr_dict_attr_flags_t)) || (datum_size != sizeof(fr_value_box_datum_t))) {
+		fr_strerror_const("Image was written by a different version of the library");
+		return -1;
+	}
+
+	if (internal != rctx->internal) {
+		fr_strerror_const("Image is for the wrong type of dictionary");
+		return -1;
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+}
+
+/** Check the text files the image was built from haven't changed
+ *
+ */
+static int dict_image_load_sources(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+	if (!num) goto truncated;
+
+	rctx->src = talloc_array(NULL, fr_dict_src_t, num);
+	if (unlikely(!rctx->src)) return -1;
+
+	for (i = 0; i < num; i++) {
+		char		filename[PATH_MAX];
+		uint64_t	mtime, size;
+		struct stat	statbuf;
+
+		IMAGE_OUT_STR(filename);
+		IMAGE_OUT(&mtime);
+		IMAGE_OUT(&size);
+
+		if (stat(filename, &statbuf) < 0) {
+			fr_strerror_printf("Failed stating \"%s\": %s", filename, fr_syserror(errno));
+			return -1;
+		}
+
+		if (((uint64_t) statbuf.st_mtime != mtime) || ((uint64_t) statbuf.st_size != size)) {
+			fr_strerror_printf("\"%s\" has changed since the image was written", filename);
+			return -1;
+		}
+
+#ifdef S_IWOTH
+		if (dict_gctx->perm_check && ((statbuf.st_mode & S_IWOTH) != 0)) {
+			fr_strerror_printf("Dictionary is globally writable: %s", filename);
+			return -1;
+		}
+#endif
+
+		rctx->src[i] = (fr_dict_src_t){
+			.filename = talloc_typed_strdup(rctx->src, filename),
+			.mtime = mtime,
+			.size = size
+		};
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+}
+
+static int dict_image_load_protocol(dict_image_rctx_t *rctx)
+{
+	char			name[FR_DICT_PROTO_MAX_NAME_LEN + 1];
+	uint32_t		attr, last_child_attr, vsa_parent;
+	fr_dict_attr_flags_t	flags;
+	uint8_t			string_based, has_dl;
+	fr_dict_t		*dict;
+	fr_dict_attr_t		*root;
+
+	IMAGE_OUT_STR(name);
+	IMAGE_OUT(&attr);
+	if (fr_dbuff_out_memcpy((uint8_t *) &flags, &rctx->dbuff, sizeof(flags)) < 0) goto truncated;
+	IMAGE_OUT(&last_child_attr);
+	IMAGE_OUT(&string_based);
+	IMAGE_OUT(&has_dl);
+	IMAGE_OUT(&vsa_parent);
+
+	/*
+	 *	Let the text loader deal with any conflicts.
+	 */
+	if (!rctx->internal && (dict_by_protocol_name(name) || dict_by_protocol_num(attr))) {
+		fr_strerror_printf("Protocol \"%s\" already exists", name);
+		return -1;
+	}
+
+	dict = rctx->dict = dict_alloc(dict_gctx);
+	if (unlikely(!dict)) return -1;
+
+	if (!rctx->internal && (dict_dlopen(dict, name) < 0) && has_dl) return -1;
+
+	if (dict_root_set(dict, name, attr) < 0) return -1;
+
+	if (!rctx->internal && (dict_protocol_add(dict) < 0)) return -1;
+
+	root = UNCONST(fr_dict_attr_t *, dict->root);
+	root->flags = flags;
+	root->last_child_attr = last_child_attr;
+	dict->string_based = string_based;
+	dict->vsa_parent = vsa_parent;
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+}
+
+static int dict_image_load_vendors(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+
+	for (i = 0; i < num; i++) {
+		char			name[FR_DICT_VENDOR_MAX_NAME_LEN + 1];
+		uint32_t		pen;
+		uint8_t			type, length, continuation;
+		fr_dict_vendor_t	*dv;
+
+		IMAGE_OUT_STR(name);
+		IMAGE_OUT(&pen);
+		IMAGE_OUT(&type);
+		IMAGE_OUT(&length);
+		IMAGE_OUT(&continuation);
+
+		if (dict_vendor_add(rctx->dict, name, pen) < 0) return -1;
+
+		dv = UNCONST(fr_dict_vendor_t *, fr_dict_vendor_by_name(rctx->dict, name));
+		if (!dv) return -1;
+
+		dv->type = type;
+		dv->length = length;
+		dv->continuation = continuation;
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+}
+
+static int dict_image_load_attrs(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+	if (!num) goto truncated;
+
+	rctx->attrs = talloc_zero_array(NULL, fr_dict_attr_t *, num);
+	if (unlikely(!rctx->attrs)) return -1;
+
+	rctx->attrs[0] = UNCONST(fr_dict_attr_t *, rctx->dict->root);
+
+	for (i = 1; i < num; i++) {
+		char			name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+		uint32_t		parent, attr, last_child_attr;
+		uint8_t			type, has_ref;
+		fr_dict_attr_flags_t	flags;
+		fr_dict_attr_t		*da;
+
+		IMAGE_OUT(&parent);
+		IMAGE_OUT_STR(name);
+		IMAGE_OUT(&attr);
+		IMAGE_OUT(&type);
+		if (fr_dbuff_out_memcpy((uint8_t *) &flags, &rctx->dbuff, sizeof(flags)) < 0) goto truncated;
+		IMAGE_OUT(&last_child_attr);
+		IMAGE_OUT(&has_ref);
+
+		if ((parent >= i) || (type == FR_TYPE_NULL) || (type >= FR_TYPE_MAX)) goto invalid;
+
+		/*
+		 *	Groups always get a ref extension.  Anything
+		 *	else gets a placeholder, which is replaced
+		 *	once all the attributes exist.
+		 */
+		da = dict_attr_alloc(rctx->dict->pool, rctx->attrs[parent], name, attr, type,
+				     &(dict_attr_args_t){
+					.flags = &flags,
+					.ref = (has_ref && (type != FR_TYPE_GROUP)) ? rctx->attrs[parent] : NULL
+				     });
+		if (unlikely(!da)) return -1;
+
+		da->last_child_attr = last_child_attr;
+		rctx->attrs[i] = da;
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+
+invalid:
+	fr_strerror_const("Invalid attribute in image");
+	return -1;
+}
+
+/** Find or load another protocol dictionary referenced by this one
+ *
+ */
+static fr_dict_t *dict_image_foreign_dict(dict_image_rctx_t *rctx, char const *proto)
+{
+	fr_dict_t *dict;
+
+	dict = dict_by_protocol_name(proto);
+	if (dict) return dict;
+
+	/*
+	 *	The internal dictionary is always loaded first, so
+	 *	it can't refer to anything else.
+	 */
+	if (rctx->internal) {
+		fr_strerror_printf("Internal dictionary can't refer to \"%s\"", proto);
+		return NULL;
+	}
+
+	if (fr_dict_protocol_afrom_file(&dict, proto, NULL, rctx->filename) < 0) return NULL;
+
+	return dict;
+}
+
+static int dict_image_load_refs(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+
+	for (i = 0; i < num; i++) {
+		char			name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+		uint32_t		idx, ref_idx;
+		uint8_t			kind, depth, foreign;
+		fr_dict_attr_t		*da;
+		fr_dict_attr_t const	*ref = NULL;
+
+		IMAGE_OUT_IDX(idx);
+		if (!idx) goto invalid;
+		da = rctx->attrs[idx];
+
+		IMAGE_OUT(&kind);
+		switch (kind) {
+		case DICT_IMAGE_REF_NONE:
+			break;
+
+		case DICT_IMAGE_REF_LOCAL:
+			IMAGE_OUT_IDX(ref_idx);
+			ref = rctx->attrs[ref_idx];
+			break;
+
+		case DICT_IMAGE_REF_FOREIGN:
+		{
+			fr_dict_t *other;
+
+			IMAGE_OUT_STR(name);
+			other = dict_image_foreign_dict(rctx, name);
+			if (!other) return -1;
+
+			ref = other->root;
+			IMAGE_OUT(&depth);
+			while (depth-- > 0) {
+				IMAGE_OUT_STR(name);
+
+				ref = dict_attr_by_name(NULL, ref, name);
+				if (!ref) {
+					fr_strerror_printf("No attribute \"%s\" in protocol \"%s\"",
+							   name, fr_dict_root(other)->name);
+					return -1;
+				}
+			}
+		}
+			break;
+
+		default:
+			goto invalid;
+		}
+
+		if (fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_REF) && (dict_attr_ref_set(da, ref) < 0)) return -1;
+
+		IMAGE_OUT(&foreign);
+		if (foreign) {
+			fr_dict_t *other;
+
+			IMAGE_OUT_STR(name);
+			other = dict_image_foreign_dict(rctx, name);
+			if (!other) return -1;
+
+			da->dict = other;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+
+invalid:
+	fr_strerror_const("Invalid reference in image");
+	return -1;
+}
+
+static int dict_image_load_children(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+
+	for (i = 0; i < num; i++) {
+		uint32_t		idx, count, j;
+		fr_dict_attr_t		*parent;
+		fr_dict_attr_t const	**children;
+
+		IMAGE_OUT_IDX(idx);
+		IMAGE_OUT(&count);
+		parent = rctx->attrs[idx];
+
+		if (!fr_dict_attr_ext(parent, FR_DICT_ATTR_EXT_CHILDREN)) goto invalid;
+
+		children = talloc_zero_array(parent, fr_dict_attr_t const *, UINT8_MAX + 1);
+		if (unlikely(!children)) return -1;
+		if (dict_attr_children_set(parent, children) < 0) return -1;
+
+		/*
+		 *	Rebuild the bins exactly as they were, rather
+		 *	than going through dict_attr_child_add(), which
+		 *	would need the rest of the tree to decide the
+		 *	order.
+		 */
+		for (j = 0; j < count; j++) {
+			uint32_t		child_idx;
+			fr_dict_attr_t		*child;
+			fr_dict_attr_t const	**bin;
+
+			IMAGE_OUT_IDX(child_idx);
+			child = rctx->attrs[child_idx];
+			if (child->parent != parent) goto invalid;
+
+			for (bin = &children[child->attr & 0xff]; *bin; bin = UNCONST(fr_dict_attr_t const **, &(*bin)->next));
+			child->next = NULL;
+			*bin = child;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+
+invalid:
+	fr_strerror_const("Invalid child in image");
+	return -1;
+}
+
+static int dict_image_load_namespaces(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+
+	for (i = 0; i < num; i++) {
+		uint32_t			idx, count, j;
+		fr_dict_attr_ext_namespace_t	*ns;
+
+		IMAGE_OUT_IDX(idx);
+		IMAGE_OUT(&count);
+
+		ns = fr_dict_attr_ext(rctx->attrs[idx], FR_DICT_ATTR_EXT_NAMESPACE);
+		if (!ns || !ns->namespace) goto invalid;
+
+		for (j = 0; j < count; j++) {
+			uint32_t child_idx;
+
+			IMAGE_OUT_IDX(child_idx);
+			if (!fr_hash_table_insert(ns->namespace, rctx->attrs[child_idx])) goto invalid;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+
+invalid:
+	fr_strerror_const("Invalid namespace in image");
+	return -1;
+}
+
+static int dict_image_load_enums(dict_image_rctx_t *rctx)
+{
+	uint32_t	num, i;
+
+	IMAGE_OUT(&num);
+
+	for (i = 0; i < num; i++) {
+		uint32_t	idx, count, j;
+		fr_dict_attr_t	*da;
+
+		IMAGE_OUT_IDX(idx);
+		IMAGE_OUT(&count);
+		da = rctx->attrs[idx];
+
+		for (j = 0; j < count; j++) {
+			char			name[FR_DICT_ENUM_MAX_NAME_LEN + 1];
+			uint8_t			primary;
+			uint32_t		child_struct, len;
+			fr_value_box_t		box;
+
+			IMAGE_OUT_STR(name);
+			IMAGE_OUT(&primary);
+			IMAGE_OUT(&child_struct);
+			IMAGE_OUT(&len);
+
+			if (fr_dbuff_remaining(&rctx->dbuff) < len) goto truncated;
+
+			fr_value_box_init(&box, da->type, NULL, false);
+			switch (da->type) {
+			case FR_TYPE_FIXED_SIZE:
+				if (len != sizeof(box.datum)) goto invalid;
+				memcpy(&box.datum, fr_dbuff_current(&rctx->dbuff), len);
+				break;
+
+			case FR_TYPE_OCTETS:
+				fr_value_box_memdup_shallow(&box, NULL, fr_dbuff_current(&rctx->dbuff), len, false);
+				break;
+
+			default:
+				goto invalid;
+			}
+			fr_dbuff_advance(&rctx->dbuff, len);
+
+			if ((child_struct != DICT_IMAGE_NONE) && (child_struct >= talloc_array_length(rctx->attrs))) {
+				goto invalid;
+			}
+
+			if (dict_attr_enum_add_name(da, name, &box, false, primary,
+						    (child_struct == DICT_IMAGE_NONE) ?
+						    NULL : rctx->attrs[child_struct]) < 0) return -1;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Image truncated");
+	return -1;
+
+invalid:
+	fr_strerror_const("Invalid VALUE in image");
+	return -1;
+}
+
+/** Load a dictionary from a binary image, if there's a usable one
+ *
+ * Looks for an image written by #fr_dict_image_write in dir_name.  If one
+ * exists, was written by this build of the library, and none of the files
+ * it was built from have changed, a new dictionary is created from it.
+ *
+ * @note On success the new dictionary has no dependents, and protocol
+ *	 dictionaries are not marked as autoloaded.  That's left to the caller,
+ *	 exactly as when loading from text files.
+ *
+ * @param[out] out	Where to write the new dictionary.  NULL if the image
+ *			wasn't usable, in which case the reason is available
+ *			from fr_strerror().
+ * @param[in] dir_name	Dictionary directory to look for an image in.
+ * @param[in] internal	Whether this is the internal dictionary.  Protocol
+ *			dictionaries are registered as protocols.
+ */
+void dict_image_load(fr_dict_t **out, char const *dir_name, bool internal)
+{
+	dict_image_rctx_t	rctx = { .internal = internal };
+	char			filename[PATH_MAX];
+	struct stat		statbuf;
+	int			fd;
+	void			*map;
+
+	*out = NULL;
+
+	snprintf(filename, sizeof(filename), "%s%c%s", dir_name, FR_DIR_SEP, FR_DICTIONARY_IMAGE_FILE);
+	rctx.filename = filename;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return;
+	}
+
+	if (fstat(fd, &statbuf) < 0) {
+		fr_strerror_printf("Failed stating \"%s\": %s", filename, fr_syserror(errno));
+	error:
+		close(fd);
+		return;
+	}
+
+	if (!S_ISREG(statbuf.st_mode) || (statbuf.st_size == 0)) {
+		fr_strerror_printf("\"%s\" is not a dictionary image", filename);
+		goto error;
+	}
+
+#ifdef S_IWOTH
+	if (dict_gctx->perm_check && ((statbuf.st_mode & S_IWOTH) != 0)) {
+		fr_strerror_printf("Dictionary image is globally writable: %s", filename);
+		goto error;
+	}
+#endif
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping \"%s\": %s", filename, fr_syserror(errno));
+		return;
+	}
+
+	fr_dbuff_init(&rctx.dbuff, (uint8_t const *) map, (size_t) statbuf.st_size);
+
+	if ((dict_image_load_header(&rctx) < 0) ||
+	    (dict_image_load_sources(&rctx) < 0) ||
+	    (dict_image_load_protocol(&rctx) < 0) ||
+	    (dict_image_load_vendors(&rctx) < 0) ||
+	    (dict_image_load_attrs(&rctx) < 0) ||
+	    (dict_image_load_refs(&rctx) < 0) ||
+	    (dict_image_load_children(&rctx) < 0) ||
+	    (dict_image_load_namespaces(&rctx) < 0) ||
+	    (dict_image_load_enums(&rctx) < 0)) {
+		fr_strerror_printf_push("Ignoring dictionary image \"%s\"", filename);
+	fail:
+		/*
+		 *	Registering the protocol took a reference.
+		 */
+		if (rctx.dict && rctx.dict->in_protocol_by_name) (void) dict_dependent_remove(rctx.dict, "global");
+		talloc_free(rctx.dict);
+		talloc_free(rctx.src);
+		goto finish;
+	}
+
+	if (fr_dbuff_remaining(&rctx.dbuff) != 0) {
+		fr_strerror_printf("Ignoring dictionary image \"%s\": Trailing garbage", filename);
+		goto fail;
+	}
+
+	rctx.dict->src = talloc_steal(rctx.dict, rctx.src);
+	*out = rctx.dict;
+
+finish:
+	talloc_free(rctx.attrs);
+	munmap(map, statbuf.st_size);
+}
@@ -0,0 +1,370 @@
+/** Tests for binary dictionary images
+ *
+ * @file src/lib/util/dict_image_tests.c
+ *
+ * @copyright 2026 Network RADIUS SAS (legal@networkradius.com)
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#	define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static TALLOC_CTX	*autofree;
+static fr_dict_gctx_t	*text_gctx;		//!< Dictionaries loaded from the text files.
+static fr_dict_t	*text_internal;
+static fr_dict_t	*text_radius;
+static fr_dict_t	*image_internal;	//!< Loaded alongside protocol images.
+static char		image_dir[PATH_MAX];
+static char		image_file[PATH_MAX + sizeof(FR_DICTIONARY_IMAGE_FILE) + 1];
+
+static void test_free(void)
+{
+	if (text_radius) fr_dict_free(&text_radius, __FILE__);
+	fr_dict_free(&text_internal, __FILE__);
+}
+
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("dict_image_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	text_gctx = fr_dict_global_ctx_init(autofree, false, "share/dictionary");
+	if (!text_gctx) goto error;
+
+	if (fr_dict_internal_afrom_file(&text_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) goto error;
+
+	/*
+	 *	Runs before the autofree context is freed.
+	 */
+	atexit(test_free);
+}
+
+/** Load the RADIUS dictionary from the text files
+ *
+ * Loading a protocol adds to the internal dictionary, so this is only
+ * done by the tests which need it.
+ */
+static void text_radius_load(void)
+{
+	if (text_radius) return;
+
+	TEST_ASSERT(fr_dict_protocol_afrom_file(&text_radius, "radius", NULL, __FILE__) == 0);
+	TEST_MSG("%s", fr_strerror());
+}
+
+/** Create a temporary directory for each test to write its image into
+ *
+ */
+static void image_dir_alloc(void)
+{
+	snprintf(image_dir, sizeof(image_dir), "/tmp/dict_image_tests.XXXXXX");
+	TEST_ASSERT(mkdtemp(image_dir) != NULL);
+
+	snprintf(image_file, sizeof(image_file), "%s/%s", image_dir, FR_DICTIONARY_IMAGE_FILE);
+}
+
+/** Load an image from image_dir using a fresh global context
+ *
+ * The image loader refuses to register a protocol that already exists,
+ * so each load gets a context of its own, with the internal dictionary
+ * loaded from the text files if we're loading a protocol.
+ */
+static fr_dict_gctx_t *image_gctx_alloc(void)
+{
+	fr_dict_gctx_t	*gctx;
+
+	gctx = fr_dict_global_ctx_init(autofree, false, "share/dictionary");
+	TEST_ASSERT(gctx != NULL);
+
+	fr_dict_global_ctx_set(gctx);
+	TEST_ASSERT(fr_dict_internal_afrom_file(&image_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) == 0);
+
+	return gctx;
+}
+
+static void image_gctx_free(fr_dict_gctx_t *gctx)
+{
+	if (image_internal) {
+		fr_dict_free(&image_internal, __FILE__);
+		image_internal = NULL;
+	}
+
+	TEST_CHECK(fr_dict_global_ctx_free(gctx) == 0);
+	TEST_MSG("%s", fr_strerror());
+
+	fr_dict_global_ctx_set(text_gctx);
+}
+
+static void image_remove(void)
+{
+	(void) unlink(image_file);
+	(void) rmdir(image_dir);
+}
+
+/** Check two attributes, their enumeration values and all their children match
+ *
+ */
+static void attr_cmp(fr_dict_attr_t const *a, fr_dict_attr_t const *b)
+{
+	fr_dict_attr_t const		*child_a = NULL, *child_b, *ref_a, *ref_b;
+	fr_dict_attr_ext_enumv_t const	*enumv_a, *enumv_b;
+
+	TEST_CHECK(strcmp(a->name, b->name) == 0);
+	TEST_MSG("Expected \"%s\", got \"%s\"", a->name, b->name);
+
+	TEST_CHECK(a->attr == b->attr);
+	TEST_MSG("%s: expected number %u, got %u", a->name, a->attr, b->attr);
+
+	TEST_CHECK(a->type == b->type);
+	TEST_MSG("%s: expected type %s, got %s", a->name, fr_type_to_str(a->type), fr_type_to_str(b->type));
+
+	TEST_CHECK(a->depth == b->depth);
+	TEST_MSG("%s: expected depth %u, got %u", a->name, a->depth, b->depth);
+
+	TEST_CHECK(memcmp(&a->flags, &b->flags, sizeof(a->flags)) == 0);
+	TEST_MSG("%s: flags differ", a->name);
+
+	enumv_a = fr_dict_attr_ext(a, FR_DICT_ATTR_EXT_ENUMV);
+	enumv_b = fr_dict_attr_ext(b, FR_DICT_ATTR_EXT_ENUMV);
+	if (enumv_a && enumv_a->value_by_name) {
+		fr_hash_iter_t		iter;
+		fr_dict_enum_value_t	*ev;
+
+		TEST_ASSERT(enumv_b && enumv_b->value_by_name);
+		TEST_CHECK(fr_hash_table_num_elements(enumv_a->value_by_name) ==
+			   fr_hash_table_num_elements(enumv_b->value_by_name));
+		TEST_MSG("%s: number of VALUEs differ", a->name);
+
+		for (ev = fr_hash_table_iter_init(enumv_a->value_by_name, &iter);
+		     ev;
+		     ev = fr_hash_table_iter_next(enumv_a->value_by_name, &iter)) {
+			fr_dict_enum_value_t *found = fr_dict_enum_by_name(b, ev->name, -1);
+
+			TEST_CHECK(found != NULL);
+			TEST_MSG("%s: missing VALUE %s", a->name, ev->name);
+			if (!found) continue;
+
+			TEST_CHECK(fr_value_box_cmp(ev->value, found->value) == 0);
+			TEST_MSG("%s: VALUE %s differs", a->name, ev->name);
+		}
+	} else {
+		TEST_CHECK(!enumv_b || !enumv_b->value_by_name);
+		TEST_MSG("%s: unexpected VALUEs", a->name);
+	}
+
+	/*
+	 *	Iterating over the children follows references, so
+	 *	check where they point instead of recursing.
+	 */
+	ref_a = fr_dict_attr_ref(a);
+	ref_b = fr_dict_attr_ref(b);
+	if (ref_a || ref_b) {
+		TEST_ASSERT(ref_a && ref_b);
+		TEST_CHECK(strcmp(ref_a->name, ref_b->name) == 0);
+		TEST_CHECK(strcmp(fr_dict_root(ref_a->dict)->name, fr_dict_root(ref_b->dict)->name) == 0);
+		TEST_MSG("%s: expected reference to %s.%s, got %s.%s", a->name,
+			 fr_dict_root(ref_a->dict)->name, ref_a->name,
+			 fr_dict_root(ref_b->dict)->name, ref_b->name);
+		return;
+	}
+
+	/*
+	 *	Several children may share a number, so walk both
+	 *	lists together.  The order matters, as the first
+	 *	child in each bin is the one the decoders find.
+	 */
+	child_b = NULL;
+	while ((child_a = fr_dict_attr_iterate_children(a, &child_a))) {
+		child_b = fr_dict_attr_iterate_children(b, &child_b);
+		TEST_CHECK(child_b != NULL);
+		TEST_MSG("%s: missing child %s", a->name, child_a->name);
+		if (!child_b) return;
+
+		attr_cmp(child_a, child_b);
+	}
+
+	child_b = fr_dict_attr_iterate_children(b, &child_b);
+	TEST_CHECK(child_b == NULL);
+	TEST_MSG("%s: unexpected child %s", a->name, child_b ? child_b->name : "");
+}
+
+static void test_internal_round_trip(void)
+{
+	fr_dict_gctx_t	*gctx;
+	fr_dict_t	*image;
+
+	image_dir_alloc();
+
+	TEST_CASE("Write image of the internal dictionary");
+	TEST_CHECK(fr_dict_image_write(text_internal, image_file) == 0);
+	TEST_MSG("%s", fr_strerror());
+
+	gctx = fr_dict_global_ctx_init(autofree, false, "share/dictionary");
+	TEST_ASSERT(gctx != NULL);
+	fr_dict_global_ctx_set(gctx);
+
+	TEST_CASE("Load image of the internal dictionary");
+	dict_image_load(&image, image_dir, true);
+	TEST_CHECK(image != NULL);
+	TEST_MSG("%s", fr_strerror());
+	if (image) {
+		TEST_CASE("Compare against the text dictionary");
+		attr_cmp(fr_dict_root(text_internal), fr_dict_root(image));
+		talloc_free(image);
+	}
+
+	image_gctx_free(gctx);
+	image_remove();
+}
+
+static void test_protocol_round_trip(void)
+{
+	fr_dict_gctx_t	*gctx;
+	fr_dict_t	*image;
+
+	image_dir_alloc();
+	text_radius_load();
+
+	TEST_CASE("Write image of the RADIUS dictionary");
+	TEST_CHECK(fr_dict_image_write(text_radius, image_file) == 0);
+	TEST_MSG("%s", fr_strerror());
+
+	gctx = image_gctx_alloc();
+
+	TEST_CASE("Load image of the RADIUS dictionary");
+	dict_image_load(&image, image_dir, false);
+	TEST_CHECK(image != NULL);
+	TEST_MSG("%s", fr_strerror());
+	if (image) {
+		TEST_CASE("Compare against the text dictionary");
+		attr_cmp(fr_dict_root(text_radius), fr_dict_root(image));
+		TEST_CHECK(fr_dict_by_protocol_name("radius") == image);
+	}
+
+	image_gctx_free(gctx);
+	image_remove();
+}
+
+static void image_rewrite(uint8_t const *data, size_t len)
+{
+	int fd;
+
+	fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(write(fd, data, len) == (ssize_t) len);
+	close(fd);
+}
+
+static void image_reject(char const *what)
+{
+	fr_dict_t *image;
+
+	fr_strerror_clear();
+	dict_image_load(&image, image_dir, true);
+	TEST_CHECK(image == NULL);
+	TEST_MSG("%s image was accepted", what);
+	TEST_CHECK(fr_strerror_peek() != NULL);
+	TEST_MSG("%s image was rejected without an error", what);
+	talloc_free(image);
+}
+
+static void test_corrupt_image(void)
+{
+	fr_dict_gctx_t	*gctx;
+	uint8_t		*data, *p;
+	size_t		len, i;
+	int		fd;
+	struct stat	statbuf;
+
+	image_dir_alloc();
+
+	TEST_CHECK(fr_dict_image_write(text_internal, image_file) == 0);
+	TEST_MSG("%s", fr_strerror());
+
+	fd = open(image_file, O_RDONLY);
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(fstat(fd, &statbuf) == 0);
+	len = statbuf.st_size;
+
+	data = talloc_array(autofree, uint8_t, len + 1);
+	TEST_ASSERT(read(fd, data, len) == (ssize_t) len);
+	close(fd);
+
+	gctx = fr_dict_global_ctx_init(autofree, false, "share/dictionary");
+	TEST_ASSERT(gctx != NULL);
+	fr_dict_global_ctx_set(gctx);
+
+	TEST_CASE("Reject empty image");
+	image_rewrite(data, 0);
+	image_reject("Empty");
+
+	TEST_CASE("Reject truncated images");
+	for (i = 1; i < len; i += (i < 64) ? 1 : (len / 64) + 1) {
+		image_rewrite(data, i);
+		image_reject("Truncated");
+	}
+	image_rewrite(data, len - 1);
+	image_reject("Truncated");
+
+	TEST_CASE("Reject image with trailing garbage");
+	data[len] = 0xff;
+	image_rewrite(data, len + 1);
+	image_reject("Padded");
+
+	TEST_CASE("Reject image with bad magic");
+	p = talloc_memdup(autofree, data, len);
+	p[0] ^= 0xff;
+	image_rewrite(p, len);
+	image_reject("Bad magic");
+	talloc_free(p);
+
+	TEST_CASE("Reject protocol image when loading the internal dictionary");
+	fr_dict_global_ctx_set(text_gctx);
+	text_radius_load();
+	fr_dict_global_ctx_set(gctx);
+	TEST_CHECK(fr_dict_image_write(text_radius, image_file) == 0);
+	image_reject("Protocol");
+
+	TEST_CASE("Accept the original image");
+	{
+		fr_dict_t *image;
+
+		image_rewrite(data, len);
+		dict_image_load(&image, image_dir, true);
+		TEST_CHECK(image != NULL);
+		TEST_MSG("%s", fr_strerror());
+		talloc_free(image);
+	}
+
+	talloc_free(data);
+	image_gctx_free(gctx);
+	image_remove();
+}
+
+TEST_LIST = {
+	{ "internal_round_trip",	test_internal_round_trip },
+	{ "protocol_round_trip",	test_protocol_round_trip },
+	{ "corrupt_image",		test_corrupt_image },
+
+	{ NULL }
+};
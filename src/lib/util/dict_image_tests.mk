@@ -0,0 +1,8 @@
+TARGET      	:= dict_image_tests$(E)
+SOURCES    	:= dict_image_tests.c
+
+TGT_LDLIBS  	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS 	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS 	:= libfreeradius-util$(L)
+
+TGT_INSTALLDIR	:=
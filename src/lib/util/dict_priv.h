@@ -37,6 +37,12 @@ extern "C" {
 #define DICT_POOL_SIZE		(1024 * 1024 * 2)
 #define DICT_FIXUP_POOL_SIZE	(1024)
 
+/*
+ *	Limits for the direct index of children built when a dictionary is frozen.
+ */
+#define DICT_CHILDREN_DENSE_MAX		(1024)	//!< Don't index children with numbers higher than this.
+#define DICT_CHILDREN_DENSE_RATIO	(4)	//!< Maximum number of slots per child.
+
 /** Set the internal dictionary if none was provided
  *
  * @param _dict		Dict pointer to check/set.
@@ -62,6 +68,17 @@ typedef struct {
 	char const	        *dependent;		//!< File holding the reference.
 } fr_dict_dependent_t;
 
+/** A text file a dictionary was read from
+ *
+ * Recorded so binary images of the dictionary can be checked against
+ * the files they were built from.
+ */
+typedef struct {
+	char const		*filename;		//!< Path of the file.
+	time_t			mtime;			//!< Modification time when it was read.
+	off_t			size;			//!< Size when it was read.
+} fr_dict_src_t;
+
 /** Vendors and attribute names
  *
  * It's very likely that the same vendors will operate in multiple
@@ -112,6 +129,9 @@ struct fr_dict {
 	fr_dict_attr_t		**fixups;		//!< Attributes that need fixing up.
 
 	fr_rb_tree_t		*dependents;		//!< Which files are using this dictionary.
+
+	fr_dict_src_t		*src;			//!< Files this dictionary was read from.  NULL if it
+							///< wasn't read from files, or has been modified since.
 };
 
 struct fr_dict_gctx_s {
@@ -157,6 +177,10 @@ fr_dict_t		*dict_alloc(TALLOC_CTX *ctx);
 
 int			dict_dlopen(fr_dict_t *dict, char const *name);
 
+int			dict_root_set(fr_dict_t *dict, char const *name, unsigned int proto_number);
+
+void			dict_image_load(fr_dict_t **out, char const *dir_name, bool internal);
+
 fr_dict_attr_t 		*dict_attr_alloc_null(TALLOC_CTX *ctx);
 
 /** Optional arguments for initialising/allocating attributes
@@ -186,6 +210,8 @@ int			dict_attr_acopy_enumv(fr_dict_attr_t *dst, fr_dict_attr_t const *src);
 
 int			dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child);
 
+void			dict_attr_children_dense_build(fr_dict_attr_t const *da);
+
 int			dict_protocol_add(fr_dict_t *dict);
 
 int			dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num);
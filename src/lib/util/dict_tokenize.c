@@ -69,6 +69,8 @@ typedef struct {
 	fr_dict_attr_t const   	*relative_attr;		//!< for ".82" instead of "1.2.3.82".
 							///< only for parents of type "tlv"
 	dict_fixup_ctx_t	fixup;
+
+	fr_dict_src_t		*src;			//!< Files read so far, if we're recording them.
 } dict_tokenize_ctx_t;
 
 #define CURRENT_FRAME(_dctx)	(&(_dctx)->stack[(_dctx)->stack_depth])
@@ -157,7 +159,7 @@ static int dict_read_sscanf_i(unsigned int *pvalue, char const *str)
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int dict_root_set(fr_dict_t *dict, char const *name, unsigned int proto_number)
+int dict_root_set(fr_dict_t *dict, char const *name, unsigned int proto_number)
 {
 	fr_dict_attr_t *da;
 
@@ -2186,6 +2188,24 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 */
 	fr_rand_seed(&statbuf, sizeof(statbuf));
 
+	if (ctx->src) {
+		size_t		num = talloc_array_length(ctx->src);
+		char		path[PATH_MAX];
+		fr_dict_src_t	*src;
+
+		src = talloc_realloc(NULL, ctx->src, fr_dict_src_t, num + 1);
+		if (!src) {
+			fr_strerror_const("Out of memory");
+			goto perm_error;
+		}
+		ctx->src = src;
+		ctx->src[num] = (fr_dict_src_t){
+			.filename = talloc_typed_strdup(ctx->src, realpath(fn, path) ? path : fn),
+			.mtime = statbuf.st_mtime,
+			.size = statbuf.st_size
+		};
+	}
+
 	memset(&base_flags, 0, sizeof(base_flags));
 
 	while (fgets(buf, sizeof(buf), fp) != NULL) {
@@ -2766,9 +2786,22 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	return 0;
 }
 
+/** Parse a dictionary file, and any files it includes
+ *
+ * @param[in] dict	to start in the context of.
+ * @param[in] dir_name	Directory containing the dictionary we're loading.
+ * @param[in] filename	we're parsing.
+ * @param[in] src_file	The including file.
+ * @param[in] src_line	Line on which the $INCLUDE or $NCLUDE- statement was found.
+ * @param[out] src	If not NULL, where to write a talloced array of the
+ *			files that were read.
+ * @return
+ *	- 0 on success.
+ *	- <0 on failure.
+ */
 static int dict_from_file(fr_dict_t *dict,
 			  char const *dir_name, char const *filename,
-			  char const *src_file, int src_line)
+			  char const *src_file, int src_line, fr_dict_src_t **src)
 {
 	int ret;
 	dict_tokenize_ctx_t ctx;
@@ -2779,10 +2812,20 @@ static int dict_from_file(fr_dict_t *dict,
 	ctx.stack[0].dict = dict;
 	ctx.stack[0].da = dict->root;
 	ctx.stack[0].nest = NEST_ROOT;
+	if (src) {
+		ctx.src = talloc_array(NULL, fr_dict_src_t, 0);
+		if (!ctx.src) {
+			fr_strerror_const("Out of memory");
+			talloc_free(ctx.fixup.pool);
+			return -1;
+		}
+	}
 
 	ret = _dict_from_file(&ctx, dir_name, filename, src_file, src_line);
 	if (ret < 0) {
+	error:
 		talloc_free(ctx.fixup.pool);
+		talloc_free(ctx.src);
 		return ret;
 	}
 
@@ -2793,7 +2836,12 @@ static int dict_from_file(fr_dict_t *dict,
 	 *	Fixups should have been applied already to any protocol
 	 *	dictionaries.
 	 */
-	return dict_finalise(&ctx);
+	ret = dict_finalise(&ctx);
+	if (ret < 0) goto error;
+
+	if (src) *src = ctx.src;
+
+	return 0;
 }
 
 /** (Re-)Initialize the special internal dictionary
@@ -2813,13 +2861,15 @@ static int dict_from_file(fr_dict_t *dict,
  */
 int fr_dict_internal_afrom_file(fr_dict_t **out, char const *dict_subdir, char const *dependent)
 {
-	fr_dict_t		*dict;
+	fr_dict_t		*dict = NULL;
 	char			*dict_path = NULL;
 	size_t			i;
 	fr_dict_attr_flags_t	flags = { .internal = true };
 	char			*type_name;
 	fr_dict_attr_t		*cast_base;
 	fr_value_box_t		box = FR_VALUE_BOX_INITIALISER_NULL(box);
+	fr_dict_src_t		*src = NULL;
+	bool			from_image = false;
 
 	if (unlikely(!dict_gctx)) {
 		fr_strerror_const("fr_dict_global_ctx_init() must be called before loading dictionary files");
@@ -2839,22 +2889,37 @@ int fr_dict_internal_afrom_file(fr_dict_t **out, char const *dict_subdir, char c
 		    talloc_asprintf(NULL, "%s%c%s", fr_dict_global_ctx_dir(), FR_DIR_SEP, dict_subdir) :
 		    talloc_strdup(NULL, fr_dict_global_ctx_dir());
 
+	/*
+	 *	Use a binary image of the dictionary if there's an
+	 *	up to date one.  Images already contain the cast
+	 *	attributes.
+	 */
+	if (dict_path) {
+		dict_image_load(&dict, dict_path, true);
+		from_image = (dict != NULL);
+	}
+
 	fr_strerror_clear();	/* Ensure we don't report spurious errors */
 
-	dict = dict_alloc(dict_gctx);
-	if (!dict) {
-	error:
-		if (!dict_gctx->internal) talloc_free(dict);
-		talloc_free(dict_path);
-		return -1;
-	}
+	if (!from_image) {
+		dict = dict_alloc(dict_gctx);
+		if (!dict) {
+		error:
+			if (!dict_gctx->internal) talloc_free(dict);
+			talloc_free(dict_path);
+			return -1;
+		}
 
-	/*
-	 *	Set the root name of the dictionary
-	 */
-	if (dict_root_set(dict, "internal", 0) < 0) goto error;
+		/*
+		 *	Set the root name of the dictionary
+		 */
+		if (dict_root_set(dict, "internal", 0) < 0) goto error;
 
-	if (dict_path && dict_from_file(dict, dict_path, FR_DICTIONARY_FILE, NULL, 0) < 0) goto error;
+		if (dict_path) {
+			if (dict_from_file(dict, dict_path, FR_DICTIONARY_FILE, NULL, 0, &src) < 0) goto error;
+			dict->src = talloc_steal(dict, src);
+		}
+	}
 
 	TALLOC_FREE(dict_path);
 
@@ -2871,6 +2936,8 @@ int fr_dict_internal_afrom_file(fr_dict_t **out, char const *dict_subdir, char c
 	 */
 	(void) dict_dlopen(dict, "internal");
 
+	if (from_image) goto done;
+
 	cast_base = dict_attr_child_by_num(dict->root, FR_CAST_BASE);
 	if (!cast_base) {
 		fr_strerror_printf("Failed to find 'Cast-Base' in internal dictionary");
@@ -2930,6 +2997,7 @@ int fr_dict_internal_afrom_file(fr_dict_t **out, char const *dict_subdir, char c
 		}
 	}
 
+done:
 	*out = dict;
 
 	return 0;
@@ -2951,7 +3019,8 @@ int fr_dict_internal_afrom_file(fr_dict_t **out, char const *dict_subdir, char c
 int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char const *proto_dir, char const *dependent)
 {
 	char		*dict_dir = NULL;
-	fr_dict_t	*dict;
+	fr_dict_t	*dict, *image = NULL;
+	fr_dict_src_t	*src = NULL;
 
 	*out = NULL;
 
@@ -2982,6 +3051,13 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 		dict_dir = talloc_asprintf(NULL, "%s%c%s", fr_dict_global_ctx_dir(), FR_DIR_SEP, proto_dir);
 	}
 
+	/*
+	 *	Use a binary image of the dictionary if there's an
+	 *	up to date one, and we're not adding to a dictionary
+	 *	which has already been defined.
+	 */
+	if (!dict) dict_image_load(&image, dict_dir, false);
+
 	fr_strerror_clear();	/* Ensure we don't report spurious errors */
 
 	/*
@@ -2992,9 +3068,14 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 	 *	This allows a single file to provide definitions
 	 *	for multiple protocols, which'll probably be useful
 	 *	at some point.
+	 *
+	 *	The files are only recorded if they define the
+	 *	whole dictionary.
 	 */
-	if (dict_from_file(dict_gctx->internal, dict_dir, FR_DICTIONARY_FILE, NULL, 0) < 0) {
+	if (!image &&
+	    (dict_from_file(dict_gctx->internal, dict_dir, FR_DICTIONARY_FILE, NULL, 0, dict ? NULL : &src) < 0)) {
 	error:
+		talloc_free(src);
 		talloc_free(dict_dir);
 		return -1;
 	}
@@ -3008,6 +3089,8 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 		goto error;
 	}
 
+	if (src) dict->src = talloc_steal(dict, src);
+
 	talloc_free(dict_dir);
 
 	/*
@@ -3082,7 +3165,13 @@ int fr_dict_read(fr_dict_t *dict, char const *dir, char const *filename)
 		return -1;
 	}
 
-	return dict_from_file(dict, dir, filename, NULL, 0);
+	/*
+	 *	The dictionary no longer matches its files, so
+	 *	can't be written out as an image.
+	 */
+	TALLOC_FREE(dict->src);
+
+	return dict_from_file(dict, dir, filename, NULL, 0, NULL);
 }
 
 /*
@@ -3110,6 +3199,8 @@ int fr_dict_parse_str(fr_dict_t *dict, char *buf, fr_dict_attr_t const *parent)
 
 	if (dict_fixup_init(NULL, &ctx.fixup) < 0) return -1;
 
+	TALLOC_FREE(dict->src);
+
 	if (strcasecmp(argv[0], "VALUE") == 0) {
 		if (argc < 4) {
 			fr_strerror_printf("VALUE needs at least 4 arguments, got %i", argc);
@@ -1082,6 +1082,20 @@ int dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child)
 	 */
 	if (!parent->flags.is_root && parent->flags.name_only && (parent->type != FR_TYPE_STRUCT)) return 0;
 
+	/*
+	 *	Any direct index is now out of date.  The bins are
+	 *	authoritative, so we just go back to using them.
+	 */
+	{
+		fr_dict_attr_ext_children_t *ext;
+
+		ext = fr_dict_attr_ext(parent, FR_DICT_ATTR_EXT_CHILDREN);
+		if (ext && ext->dense) {
+			TALLOC_FREE(ext->dense);
+			ext->dense_len = 0;
+		}
+	}
+
 	/*
 	 *	We only allocate the pointer array *if* the parent has children.
 	 */
@@ -2862,6 +2876,7 @@ fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsigned in
 	fr_dict_attr_t const *bin;
 	fr_dict_attr_t const **children;
 	fr_dict_attr_t const *ref;
+	fr_dict_attr_ext_children_t *ext;
 
 	DA_VERIFY(parent);
 
@@ -2871,6 +2886,23 @@ fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsigned in
 	ref = fr_dict_attr_ref(parent);
 	if (ref) parent = ref;
 
+	/*
+	 *	If the dictionary has been frozen, and the children
+	 *	are dense, then the lookup is a simple array index.
+	 *	The index covers every child, so anything past the
+	 *	end of it doesn't exist.
+	 */
+	ext = fr_dict_attr_ext(parent, FR_DICT_ATTR_EXT_CHILDREN);
+	if (ext && ext->dense) {
+		fr_dict_attr_t *out;
+
+		if (attr >= ext->dense_len) return NULL;
+
+		memcpy(&out, &ext->dense[attr], sizeof(out));
+
+		return out;
+	}
+
 	children = dict_attr_children(parent);
 	if (!children) return NULL;
 
@@ -2896,6 +2928,69 @@ fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsigned in
 	return NULL;
 }
 
+/** Build a direct index of children by number, for an attribute and all of its descendents
+ *
+ * The bins in the children array are a hash keyed on the low 8 bits of the
+ * attribute number.  For parents like the RADIUS root, or large vendor trees,
+ * the numbers are small and dense, and an array indexed by the number is
+ * faster.  The bins are left alone, and are still used for iteration.
+ *
+ * Children are only indexed if the highest number is no more than
+ * #DICT_CHILDREN_DENSE_MAX, and there are at most #DICT_CHILDREN_DENSE_RATIO
+ * slots for each child.  Otherwise lookups fall back to the bins.
+ *
+ * This should only be called once the dictionary is frozen.  Adding a child
+ * to the attribute afterwards discards its index.
+ *
+ * @param[in] da	to build the index for.
+ */
+void dict_attr_children_dense_build(fr_dict_attr_t const *da)
+{
+	fr_dict_attr_ext_children_t	*ext;
+	fr_dict_attr_t const		**dense;
+	fr_dict_attr_t const		*child;
+	unsigned int			i, num = 0, max = 0;
+
+	if (fr_dict_attr_ref(da)) return;
+
+	ext = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_CHILDREN);
+	if (!ext || !ext->children) return;
+
+	for (i = 0; i < talloc_array_length(ext->children); i++) {
+		for (child = ext->children[i]; child; child = child->next) {
+			dict_attr_children_dense_build(child);
+
+			num++;
+			if (child->attr > max) max = child->attr;
+		}
+	}
+
+	TALLOC_FREE(ext->dense);
+	ext->dense_len = 0;
+
+	if (!num || (max > DICT_CHILDREN_DENSE_MAX) || ((max + 1) > (num * DICT_CHILDREN_DENSE_RATIO))) return;
+
+	/*
+	 *	Out of memory isn't fatal, lookups just use the bins.
+	 */
+	dense = talloc_zero_array(da, fr_dict_attr_t const *, max + 1);
+	if (!dense) return;
+
+	/*
+	 *	Where there are multiple children with the same number,
+	 *	the first one in the bin wins.  That's the same one
+	 *	dict_attr_child_by_num() would find by walking the bin.
+	 */
+	for (i = 0; i < talloc_array_length(ext->children); i++) {
+		for (child = ext->children[i]; child; child = child->next) {
+			if (!dense[child->attr]) dense[child->attr] = child;
+		}
+	}
+
+	ext->dense = dense;
+	ext->dense_len = max + 1;
+}
+
 /** Check if a child attribute exists in a parent using an attribute number
  *
  * @param[in] parent		to check for child in.
@@ -44,6 +44,29 @@ RCSID("$Id$")
 #include <sys/wait.h>
 #include <pthread.h>
 
+/*
+ *	On Linux, libkqueue emulates every filter on top of epoll, and
+ *	adds a fair amount of overhead to each kevent() call.  So we
+ *	register socket and pipe I/O directly with epoll, and use an
+ *	eventfd for user events.  Only the filters which have no native
+ *	equivalent (EVFILT_VNODE, EVFILT_PROC) go through libkqueue,
+ *	whose descriptor is itself watched by our epoll instance.
+ *
+ *	Build with -DWITHOUT_EPOLL, or set FR_EVENT_BACKEND=kqueue in
+ *	the environment, to use kqueue for everything.
+ */
+#if defined(__linux__) && !defined(WITHOUT_EPOLL)
+#  define WITH_EPOLL 1
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#  include <sys/ioctl.h>
+#  if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#    if __GLIBC_PREREQ(2, 35)
+#      define HAVE_EPOLL_PWAIT2 1
+#    endif
+#  endif
+#endif
+
 #ifdef NDEBUG
 /*
  *	Turn off documentation warnings as file/line
@@ -319,6 +342,11 @@ struct fr_event_fd {
 
 	fr_dlist_t		entry;			//!< Entry in free list.
 
+#ifdef WITH_EPOLL
+	bool			epoll;			//!< Registered with epoll instead of kqueue.
+	uint32_t		epoll_events;		//!< Events currently registered with epoll.
+#endif
+
 #ifndef NDEBUG
 	uintptr_t		armour;			//!< protection flag from being deleted.
 #endif
@@ -381,6 +409,14 @@ struct fr_event_user_s {
 	fr_event_user_cb_t 	callback;		//!< The callback to call.
 	void			*uctx;			//!< Context for the callback.
 
+#ifdef WITH_EPOLL
+	fr_dlist_t		entry;			//!< Entry in the list of user events.
+	atomic_bool		triggered;		//!< Set by fr_event_user_trigger, cleared when
+							///< the callback is run.
+	bool			pending;		//!< Triggered before the eventfd was read, so the
+							///< callback is run on this pass.
+#endif
+
 #ifndef NDEBUG
 	char const		*file;			//!< Source file this event was last updated in.
 	int			line;			//!< Line this event was last updated on.
@@ -433,6 +469,14 @@ struct fr_event_list {
 
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
 
+#ifdef WITH_EPOLL
+	int			epfd;			//!< epoll instance, or -1 if we're only using kqueue.
+	int			user_fd;		//!< eventfd used to signal user events.
+	bool			no_pwait2;		//!< Kernel doesn't support epoll_pwait2().
+	fr_dlist_head_t		user_events;		//!< All registered user events.
+	struct epoll_event	ep_events[FR_EV_BATCH_FDS];
+#endif
+
 	bool			in_handler;		//!< Deletes should be deferred until after the
 							///< handlers complete.
 
@@ -850,6 +894,72 @@ static int fr_event_fd_type_set(fr_event_fd_t *ef, int fd)
 	return 0;
 }
 
+#ifdef WITH_EPOLL
+/** Synchronise the epoll registration of an fd with its active I/O functions
+ *
+ * @param[in] el	the event is registered with.
+ * @param[in] ef	to update.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set by epoll_ctl().
+ */
+static int event_epoll_update(fr_event_list_t *el, fr_event_fd_t *ef)
+{
+	struct epoll_event	ev = { .data.ptr = ef };
+	int			op;
+
+	if (ef->active.io.read && (ef->active.io.read != fr_event_fd_noop)) ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (ef->active.io.write && (ef->active.io.write != fr_event_fd_noop)) ev.events |= EPOLLOUT;
+
+	if (ev.events == ef->epoll_events) return 0;
+
+	if (!ef->epoll_events) {
+		op = EPOLL_CTL_ADD;
+	} else if (!ev.events) {
+		op = EPOLL_CTL_DEL;
+	} else {
+		op = EPOLL_CTL_MOD;
+	}
+
+	if (epoll_ctl(el->epfd, op, ef->fd, &ev) < 0) return -1;
+	ef->epoll_events = ev.events;
+
+	return 0;
+}
+#endif
+
+/** Apply an evset built by #fr_event_build_evset
+ *
+ * I/O filters are applied with epoll_ctl() when the event list has an
+ * epoll instance, everything else goes through kevent().
+ *
+ * @param[in] el	the event is registered with.
+ * @param[in] ef	the evset was built for.
+ * @param[in] evset	to apply.
+ * @param[in] count	number of changes in the evset.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set.
+ */
+static int event_fd_apply(fr_event_list_t *el, fr_event_fd_t *ef, struct kevent evset[], int count)
+{
+#ifdef WITH_EPOLL
+	if (ef->epoll) {
+		if (event_epoll_update(el, ef) == 0) return 0;
+
+		/*
+		 *	Regular files can't be watched with epoll, but
+		 *	libkqueue will fake it for us.
+		 */
+		if ((errno != EPERM) || ef->epoll_events) return -1;
+		ef->epoll = false;
+	}
+#endif
+	if (!count) return 0;
+
+	return kevent(el->kq, evset, count, NULL, 0, NULL);
+}
+
 /** Remove a file descriptor from the event loop and rbtree but don't explicitly free it
  *
  *
@@ -885,7 +995,7 @@ static int _event_fd_delete(fr_event_fd_t *ef)
 			/*
 			 *	If this fails, assert on debug builds.
 			 */
-			ret = kevent(el->kq, evset, count, NULL, 0, NULL);
+			ret = event_fd_apply(el, ef, evset, count);
 			if (!fr_cond_assert_msg(ret >= 0,
 						"FD %i was closed without being removed from the KQ: %s",
 						ef->fd, fr_syserror(errno))) {
@@ -1047,7 +1157,7 @@ int _fr_event_filter_update(NDEBUG_LOCATION_ARGS
 		return -1;
 	}
 
-	if (count && unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0)) {
+	if (count && unlikely(event_fd_apply(el, ef, evset, count) < 0)) {
 		fr_strerror_printf("Failed updating filters for FD %i: %s", ef->fd, fr_syserror(errno));
 		goto error;
 	}
@@ -1151,10 +1261,13 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 		ef->map = &filter_maps[filter];
 		if (ef->map->idx_type == FR_EVENT_FUNC_IDX_NONE) goto not_supported;
 
+#ifdef WITH_EPOLL
+		ef->epoll = (el->epfd >= 0) && (filter == FR_EVENT_FILTER_IO);
+#endif
 		count = fr_event_build_evset(el, evset, sizeof(evset)/sizeof(*evset),
 					     &ef->active, ef, funcs, &ef->active);
 		if (count < 0) goto free;
-		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
+		if (count && (unlikely(event_fd_apply(el, ef, evset, count) < 0))) {
 			fr_strerror_printf("Failed inserting filters for FD %i: %s", fd, fr_syserror(errno));
 			goto free;
 		}
@@ -1186,7 +1299,7 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 			memcpy(&ef->active, &active, sizeof(ef->active));
 			return -1;
 		}
-		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
+		if (count && (unlikely(event_fd_apply(el, ef, evset, count) < 0))) {
 			fr_strerror_printf("Failed modifying filters for FD %i: %s", fd, fr_syserror(errno));
 			goto error;
 		}
@@ -2132,6 +2245,13 @@ force:
  */
 static int _event_user_delete(fr_event_user_t *ev)
 {
+#ifdef WITH_EPOLL
+	if (ev->is_registered && (ev->el->epfd >= 0)) {
+		fr_dlist_remove(&ev->el->user_events, ev);
+		ev->is_registered = false;
+		return 0;
+	}
+#endif
 	if (ev->is_registered) {
 		struct kevent evset;
 
@@ -2164,6 +2284,53 @@ void event_user_eval(fr_event_list_t *el, struct kevent *kev)
 	ev->callback(el, ev->uctx);
 }
 
+#ifdef WITH_EPOLL
+/** Run the callbacks for any user events which have been triggered
+ *
+ * Like EVFILT_USER with EV_DISPATCH, each trigger results in at most
+ * one call to the callback, and events which are triggered by the
+ * callbacks are left for the next call to fr_event_corral().  Otherwise
+ * an event which triggers itself, or two events which trigger each other,
+ * would stop file descriptors and timers from ever being serviced.
+ */
+static void event_user_eval_epoll(fr_event_list_t *el)
+{
+	fr_event_user_t	*ev;
+	eventfd_t	value;
+
+	(void) eventfd_read(el->user_fd, &value);
+
+	/*
+	 *	Take the events which have been triggered so far.
+	 *	Triggering an event writes to the eventfd again, so
+	 *	anything triggered after this wakes up the next
+	 *	call to epoll_wait().
+	 */
+	for (ev = fr_dlist_head(&el->user_events);
+	     ev != NULL;
+	     ev = fr_dlist_next(&el->user_events, ev)) {
+		ev->pending = atomic_exchange(&ev->triggered, false);
+	}
+
+	/*
+	 *	Callbacks may free any of the user events,
+	 *	so start from the head of the list after
+	 *	each one is run.
+	 */
+	for (;;) {
+		for (ev = fr_dlist_head(&el->user_events);
+		     ev != NULL;
+		     ev = fr_dlist_next(&el->user_events, ev)) {
+			if (ev->pending) break;
+		}
+		if (!ev) break;
+
+		ev->pending = false;
+		ev->callback(el, ev->uctx);
+	}
+}
+#endif
+
 /** Add a user callback to the event list.
  *
  * @param[in] ctx	to allocate the event in.
@@ -2198,6 +2365,24 @@ int _fr_event_user_insert(NDEBUG_LOCATION_ARGS
 #endif
 	};
 
+#ifdef WITH_EPOLL
+	if (el->epfd >= 0) {
+		atomic_init(&ev->triggered, false);
+		fr_dlist_insert_tail(&el->user_events, ev);
+		ev->is_registered = true;
+		talloc_set_destructor(ev, _event_user_delete);
+
+		if (trigger && unlikely(fr_event_user_trigger(el, ev) < 0)) {
+			talloc_free(ev);
+			return -1;
+		}
+
+		if (ev_p) *ev_p = ev;
+
+		return 0;
+	}
+#endif
+
 	EV_SET(&evset, (uintptr_t)ev,
 	       EVFILT_USER, EV_ADD | EV_DISPATCH, (trigger * NOTE_TRIGGER), 0, ev);
 
@@ -2226,6 +2411,19 @@ int fr_event_user_trigger(fr_event_list_t *el, fr_event_user_t *ev)
 {
 	struct kevent evset;
 
+#ifdef WITH_EPOLL
+	if (el->epfd >= 0) {
+		atomic_store(&ev->triggered, true);
+
+		if (unlikely(eventfd_write(el->user_fd, 1) < 0)) {
+			fr_strerror_printf("Failed triggering user event - eventfd %s", fr_syserror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+#endif
+
 	EV_SET(&evset, (uintptr_t)ev, EVFILT_USER, EV_ENABLE, NOTE_TRIGGER, 0, NULL);
 
 	if (unlikely(kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0)) {
@@ -2394,6 +2592,45 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 	return 1;
 }
 
+#ifdef WITH_EPOLL
+/** Wait for events on the epoll instance
+ *
+ * @param[in] el	to wait on.
+ * @param[in] ts_wake	How long to wait for, or NULL to wait forever.
+ * @return
+ *	- >= 0 the number of events written to el->ep_events.
+ *	- -1 on error, with errno set.
+ */
+static int event_epoll_wait(fr_event_list_t *el, struct timespec const *ts_wake)
+{
+	int64_t	timeout;
+
+#ifdef HAVE_EPOLL_PWAIT2
+	if (!el->no_pwait2) {
+		int ret;
+
+		ret = epoll_pwait2(el->epfd, el->ep_events, FR_EV_BATCH_FDS, ts_wake, NULL);
+		if ((ret >= 0) || (errno != ENOSYS)) return ret;
+
+		el->no_pwait2 = true;
+	}
+#endif
+
+	if (!ts_wake) {
+		timeout = -1;
+	} else {
+		/*
+		 *	Round up, so we don't wake up just before
+		 *	a timer is due, and spin until it is.
+		 */
+		timeout = (ts_wake->tv_sec * 1000) + ((ts_wake->tv_nsec + 999999) / 1000000);
+		if (timeout > INT_MAX) timeout = INT_MAX;
+	}
+
+	return epoll_wait(el->epfd, el->ep_events, FR_EV_BATCH_FDS, (int)timeout);
+}
+#endif
+
 /** Gather outstanding timer and file descriptor events
  *
  * @param[in] el	to process events for.
@@ -2488,6 +2725,11 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	that occurred since this function was last called
 	 *	or wait for the next timer event.
 	 */
+#ifdef WITH_EPOLL
+	if (el->epfd >= 0) {
+		num_fd_events = event_epoll_wait(el, ts_wake);
+	} else
+#endif
 	num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
 
 	/*
@@ -2497,7 +2739,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 		if (errno == EINTR) {
 			return 0;
 		} else {
-			fr_strerror_printf("Failed calling kevent: %s", fr_syserror(errno));
+			fr_strerror_printf("Failed waiting for events: %s", fr_syserror(errno));
 			return -1;
 		}
 	}
@@ -2534,125 +2776,229 @@ void event_callback(fr_event_list_t *el, fr_event_fd_t *ef, int *filter, int fla
 	}
 }
 
-/** Service any outstanding timer or file descriptor events
+/** Service a single kevent
  *
- * @param[in] el containing events to service.
+ * @param[in] el	the kevent was retrieved from.
+ * @param[in] kev	to service.
  */
-void fr_event_service(fr_event_list_t *el)
+static inline CC_HINT(always_inline)
+void event_kevent_service(fr_event_list_t *el, struct kevent *kev)
 {
-	int			i;
-	fr_event_post_t		*post;
-	fr_time_t		when;
-	fr_event_timer_t	*ev;
-
-	if (unlikely(el->exit)) return;
+	/*
+	 *	Process any user events
+	 */
+	switch (kev->filter) {
+	case EVFILT_USER:
+		event_user_eval(el, kev);
+		return;
 
-	EVENT_DEBUG("%p - %s - Servicing %u FD events", el, __FUNCTION__, el->num_fd_events);
+	/*
+	 *	Process proc events
+	 */
+	case EVFILT_PROC:
+		event_pid_eval(el, kev);
+		return;
 
 	/*
-	 *	Run all of the file descriptor events.
+	 *	Process various types of file descriptor events
 	 */
-	el->in_handler = true;
-	for (i = 0; i < el->num_fd_events; i++) {
-		/*
-		 *	Process any user events
-		 */
-		switch (el->events[i].filter) {
-		case EVFILT_USER:
-			event_user_eval(el, &el->events[i]);
-			continue;
+	default:
+	{
+		fr_event_fd_t		*ef = talloc_get_type_abort(kev->udata, fr_event_fd_t);
+		int			fd_errno = 0;
+
+		int			fflags = kev->fflags;	/* mutable */
+		int			filter = kev->filter;
+		int			flags = kev->flags;
+
+		if (!ef->is_registered) return;	/* Was deleted between corral and service */
+
+		if (unlikely(flags & EV_ERROR)) {
+			fd_errno = kev->data;
+		ev_error:
+			/*
+			 *      Call the error handler, but only if the socket hasn't been deleted at EOF
+			 *	below.
+			 */
+			if (ef->is_registered && ef->error) ef->error(el, ef->fd, flags, fd_errno, ef->uctx);
+			TALLOC_FREE(ef);
+			return;
+		}
 
 		/*
-		 *	Process proc events
+		 *      EOF can indicate we've actually reached
+		 *      the end of a file, but for sockets it usually
+		 *      indicates the other end of the connection
+		 *      has gone away.
 		 */
-		case EVFILT_PROC:
-			event_pid_eval(el, &el->events[i]);
-			continue;
+		if (flags & EV_EOF) {
+			/*
+			 *	This is fine, the callback will get notified
+			 *	via the flags field.
+			 */
+			if (ef->type == FR_EVENT_FD_FILE) goto service;
+#if defined(__linux__) && defined(SO_GET_FILTER)
+			/*
+			 *      There seems to be an issue with the
+			 *      ioctl(...SIOCNQ...) call libkqueue
+			 *      uses to determine the number of bytes
+			 *	readable.  When ioctl returns, the number
+			 *	of bytes available is set to zero, which
+			 *	libkqueue interprets as EOF.
+			 *
+			 *      As a workaround, if we're not reading
+			 *	a file, and are operating on a raw socket
+			 *	with a packet filter attached, we ignore
+			 *	the EOF flag and continue.
+			 */
+			if ((ef->sock_type == SOCK_RAW) && (ef->type == FR_EVENT_FD_PCAP)) goto service;
+#endif
+
+			/*
+			 *	If we see an EV_EOF flag that means the
+			 *	read side of the socket has been closed
+			 *	but there may still be pending data.
+			 *
+			 *	Dispatch the read event and then error.
+			 */
+			if ((kev->filter == EVFILT_READ) && (kev->data > 0)) {
+				event_callback(el, ef, &filter, flags, &fflags);
+			}
+
+			fd_errno = kev->fflags;
+
+			goto ev_error;
+		}
+
+	service:
+#ifndef NDEBUG
+		EVENT_DEBUG("Running event for fd %d, from %s[%d]", ef->fd, ef->file, ef->line);
+#endif
 
 		/*
-		 *	Process various types of file descriptor events
+		 *	Service the event_fd events
 		 */
-		default:
-		{
-			fr_event_fd_t		*ef = talloc_get_type_abort(el->events[i].udata, fr_event_fd_t);
-			int			fd_errno = 0;
+		event_callback(el, ef, &filter, flags, &fflags);
+	}
+	}
+}
 
-			int			fflags = el->events[i].fflags;	/* mutable */
-			int			filter = el->events[i].filter;
-			int			flags = el->events[i].flags;
+#ifdef WITH_EPOLL
+/** Service a single epoll event
+ *
+ * epoll events are mapped onto the same flags kevent() would produce,
+ * so callbacks see identical behaviour regardless of the backend.
+ *
+ * @param[in] el	the event was retrieved from.
+ * @param[in] ep	to service.
+ */
+static inline CC_HINT(always_inline)
+void event_epoll_service(fr_event_list_t *el, struct epoll_event *ep)
+{
+	fr_event_fd_t	*ef;
+	int		flags = 0;
+	int		fd_errno = 0;
+	int		filter;
+	int		fflags = 0;
 
-			if (!ef->is_registered) continue;	/* Was deleted between corral and service */
+	/*
+	 *	The eventfd for user events
+	 */
+	if (ep->data.ptr == &el->user_fd) {
+		event_user_eval_epoll(el);
+		return;
+	}
 
-			if (unlikely(flags & EV_ERROR)) {
-				fd_errno = el->events[i].data;
-			ev_error:
-				/*
-				 *      Call the error handler, but only if the socket hasn't been deleted at EOF
-				 *	below.
-				 */
-				if (ef->is_registered && ef->error) ef->error(el, ef->fd, flags, fd_errno, ef->uctx);
-				TALLOC_FREE(ef);
-				continue;
-			}
+	/*
+	 *	libkqueue has events pending for the filters
+	 *	it's handling for us.
+	 */
+	if (ep->data.ptr == &el->kq) {
+		int i, num;
 
-			/*
-			 *      EOF can indicate we've actually reached
-			 *      the end of a file, but for sockets it usually
-			 *      indicates the other end of the connection
-			 *      has gone away.
-			 */
-			if (flags & EV_EOF) {
-				/*
-				 *	This is fine, the callback will get notified
-				 *	via the flags field.
-				 */
-				if (ef->type == FR_EVENT_FD_FILE) goto service;
-#if defined(__linux__) && defined(SO_GET_FILTER)
-				/*
-				 *      There seems to be an issue with the
-				 *      ioctl(...SIOCNQ...) call libkqueue
-				 *      uses to determine the number of bytes
-				 *	readable.  When ioctl returns, the number
-				 *	of bytes available is set to zero, which
-				 *	libkqueue interprets as EOF.
-				 *
-				 *      As a workaround, if we're not reading
-				 *	a file, and are operating on a raw socket
-				 *	with a packet filter attached, we ignore
-				 *	the EOF flag and continue.
-				 */
-				if ((ef->sock_type == SOCK_RAW) && (ef->type == FR_EVENT_FD_PCAP)) goto service;
-#endif
+		num = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, &(struct timespec){});
+		for (i = 0; i < num; i++) event_kevent_service(el, &el->events[i]);
+		return;
+	}
 
-				/*
-				 *	If we see an EV_EOF flag that means the
-				 *	read side of the socket has been closed
-				 *	but there may still be pending data.
-				 *
-				 *	Dispatch the read event and then error.
-				 */
-				if ((el->events[i].filter == EVFILT_READ) && (el->events[i].data > 0)) {
-					event_callback(el, ef, &filter, flags, &fflags);
-				}
+	ef = talloc_get_type_abort(ep->data.ptr, fr_event_fd_t);
+	if (!ef->is_registered) return;	/* Was deleted between corral and service */
 
-				fd_errno = el->events[i].fflags;
+	if (ep->events & EPOLLERR) {
+		socklen_t len = sizeof(fd_errno);
 
-				goto ev_error;
-			}
+		flags |= EV_EOF;
+		(void) getsockopt(ef->fd, SOL_SOCKET, SO_ERROR, &fd_errno, &len);
+	}
+	if (ep->events & (EPOLLHUP | EPOLLRDHUP)) flags |= EV_EOF;
+
+	/*
+	 *	Same EOF handling as event_kevent_service.  Pending
+	 *	data is dispatched to the read callback before the
+	 *	error callback is called.
+	 */
+	if ((flags & EV_EOF) && (ef->type != FR_EVENT_FD_FILE) &&
+	    !((ef->sock_type == SOCK_RAW) && (ef->type == FR_EVENT_FD_PCAP))) {
+		int available = 0;
+
+		if ((ep->events & EPOLLIN) && (ioctl(ef->fd, FIONREAD, &available) == 0) && (available > 0)) {
+			ef->active.io.read(el, ef->fd, flags, ef->uctx);
+		}
+
+		if (ef->is_registered && ef->error) ef->error(el, ef->fd, flags, fd_errno, ef->uctx);
+		TALLOC_FREE(ef);
+		return;
+	}
 
-		service:
 #ifndef NDEBUG
-			EVENT_DEBUG("Running event for fd %d, from %s[%d]", ef->fd, ef->file, ef->line);
+	EVENT_DEBUG("Running event for fd %d, from %s[%d]", ef->fd, ef->file, ef->line);
 #endif
 
-			/*
-			 *	Service the event_fd events
-			 */
-			event_callback(el, ef, &filter, flags, &fflags);
-		}
-		}
+	/*
+	 *	Both callbacks are told about EOF, inactive
+	 *	callbacks are set to fr_event_fd_noop.
+	 */
+	if ((ep->events & EPOLLIN) || (flags & EV_EOF)) {
+		filter = EVFILT_READ;
+		event_callback(el, ef, &filter, flags, &fflags);
 	}
 
+	/*
+	 *	The read callback may have removed the fd.
+	 */
+	if (((ep->events & EPOLLOUT) || (flags & EV_EOF)) && ef->is_registered) {
+		filter = EVFILT_WRITE;
+		event_callback(el, ef, &filter, flags, &fflags);
+	}
+}
+#endif
+
+/** Service any outstanding timer or file descriptor events
+ *
+ * @param[in] el containing events to service.
+ */
+void fr_event_service(fr_event_list_t *el)
+{
+	int			i;
+	fr_event_post_t		*post;
+	fr_time_t		when;
+	fr_event_timer_t	*ev;
+
+	if (unlikely(el->exit)) return;
+
+	EVENT_DEBUG("%p - %s - Servicing %u FD events", el, __FUNCTION__, el->num_fd_events);
+
+	/*
+	 *	Run all of the file descriptor events.
+	 */
+	el->in_handler = true;
+#ifdef WITH_EPOLL
+	if (el->epfd >= 0) {
+		for (i = 0; i < el->num_fd_events; i++) event_epoll_service(el, &el->ep_events[i]);
+	} else
+#endif
+	for (i = 0; i < el->num_fd_events; i++) event_kevent_service(el, &el->events[i]);
+
 	/*
 	 *	Process any deferred frees performed
 	 *	by the I/O handlers.
@@ -2794,6 +3140,10 @@ static int _event_list_free(fr_event_list_t *el)
 	talloc_free_children(el);
 
 	if (el->kq >= 0) close(el->kq);
+#ifdef WITH_EPOLL
+	if (el->epfd >= 0) close(el->epfd);
+	if (el->user_fd >= 0) close(el->user_fd);
+#endif
 
 	return 0;
 }
@@ -2817,6 +3167,63 @@ static int _event_build_indexes(UNUSED void *uctx)
 	return 0;
 }
 
+#ifdef WITH_EPOLL
+static bool event_use_epoll = true;
+
+/** Determine whether event lists should use epoll
+ *
+ * Setting FR_EVENT_BACKEND=kqueue in the environment routes all events
+ * through kqueue.  This is mainly useful for debugging.
+ */
+static int _event_backend_init(UNUSED void *uctx)
+{
+	char const *backend;
+
+	backend = getenv("FR_EVENT_BACKEND");
+	if (!backend || (strcmp(backend, "epoll") == 0)) return 0;
+
+	if (strcmp(backend, "kqueue") != 0) {
+		fr_strerror_printf("Invalid FR_EVENT_BACKEND \"%s\", expected \"epoll\" or \"kqueue\"", backend);
+		return -1;
+	}
+	event_use_epoll = false;
+
+	return 0;
+}
+
+/** Create an epoll instance for the event list
+ *
+ * The kqueue descriptor and the user event eventfd are both watched by
+ * the epoll instance.  If any of this fails, we close everything and
+ * the event list falls back to using kqueue for all events.
+ */
+static void event_epoll_init(fr_event_list_t *el)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (el->epfd < 0) return;
+
+	el->user_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (el->user_fd < 0) goto error;
+
+	ev.data.ptr = &el->user_fd;
+	if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->user_fd, &ev) < 0) goto error;
+
+	ev.data.ptr = &el->kq;
+	if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->kq, &ev) < 0) {
+	error:
+		if (el->user_fd >= 0) close(el->user_fd);
+		close(el->epfd);
+		el->user_fd = -1;
+		el->epfd = -1;
+		return;
+	}
+
+	fr_dlist_init(&el->user_events, fr_event_user_t, entry);
+}
+#endif
+
 #ifdef EVFILT_LIBKQUEUE
 /** kqueue logging wrapper function
  *
@@ -2902,6 +3309,10 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 #ifdef EVFILT_LIBKQUEUE
 	fr_atexit_global_once_ret(&ret, _event_kqueue_logging, _event_kqueue_logging_stop, NULL);
 #endif
+#ifdef WITH_EPOLL
+	fr_atexit_global_once_ret(&ret, _event_backend_init, NULL, NULL);
+	if (ret < 0) return NULL;
+#endif
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
@@ -2910,6 +3321,10 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 	}
 	el->time = fr_time;
 	el->kq = -1;	/* So destructor can be used before kqueue() provides us with fd */
+#ifdef WITH_EPOLL
+	el->epfd = -1;
+	el->user_fd = -1;
+#endif
 	talloc_set_destructor(el, _event_list_free);
 
 	el->times = fr_lst_talloc_alloc(el, fr_event_timer_cmp, fr_event_timer_t, lst_id, 0);
@@ -2948,6 +3363,10 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 		goto error;
 	}
 
+#ifdef WITH_EPOLL
+	if (event_use_epoll) event_epoll_init(el);
+#endif
+
 #ifdef WITH_EVENT_DEBUG
 	fr_event_timer_in(el, el, &el->report, fr_time_delta_from_sec(EVENT_REPORT_FREQ), fr_event_report, NULL);
 #endif
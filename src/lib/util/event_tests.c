@@ -0,0 +1,258 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for user events, and their interaction with fd and timer events
+ *
+ * On Linux these run on the epoll backend, where user events are
+ * signalled through an eventfd.
+ *
+ * @file src/lib/util/event_tests.c
+ *
+ * @copyright 2026 Network RADIUS SAS (legal@networkradius.com)
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <unistd.h>
+
+/** State for a user event
+ *
+ */
+typedef struct test_user_s test_user_t;
+struct test_user_s {
+	fr_event_user_t		*ev;
+	int			calls;		//!< How many times the callback has been run.
+	test_user_t		*trigger;	//!< Event to trigger from the callback.
+	test_user_t		*free;		//!< Event to free from the callback.
+};
+
+/** State for the fd and timer events which must still be serviced
+ *
+ */
+typedef struct {
+	int			fd[2];
+	bool			fd_read;
+	bool			timer_fired;
+	fr_event_timer_t const	*ev_timer;
+} test_other_t;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	/*
+	 *	The default on Linux, but the environment may
+	 *	have asked for kqueue.
+	 */
+	setenv("FR_EVENT_BACKEND", "epoll", 1);
+}
+
+static void _test_user(fr_event_list_t *el, void *uctx)
+{
+	test_user_t *user = uctx;
+
+	user->calls++;
+
+	if (user->free) {
+		TALLOC_FREE(user->free->ev);
+		user->free = NULL;
+	}
+
+	if (user->trigger) TEST_CHECK(fr_event_user_trigger(el, user->trigger->ev) == 0);
+}
+
+static void _test_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	test_other_t	*other = uctx;
+	char		buff[16];
+
+	TEST_CHECK(read(fd, buff, sizeof(buff)) > 0);
+	other->fd_read = true;
+}
+
+static void _test_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	test_other_t *other = uctx;
+
+	other->timer_fired = true;
+}
+
+static fr_event_list_t *test_el_alloc(void)
+{
+	fr_event_list_t *el;
+
+	el = fr_event_list_alloc(NULL, NULL, NULL);
+	if (!el) fr_perror("event_tests");
+	TEST_ASSERT(el != NULL);
+
+	return el;
+}
+
+static void test_user_insert(fr_event_list_t *el, test_user_t *user, bool trigger)
+{
+	TEST_ASSERT(fr_event_user_insert(el, el, &user->ev, trigger, _test_user, user) == 0);
+}
+
+/** Make the pipe readable, and add a timer which is already due
+ *
+ */
+static void test_other_insert(fr_event_list_t *el, test_other_t *other)
+{
+	TEST_ASSERT(pipe(other->fd) == 0);
+	TEST_CHECK(write(other->fd[1], "x", 1) == 1);
+
+	TEST_ASSERT(fr_event_fd_insert(el, el, other->fd[0], _test_read, NULL, NULL, other) == 0);
+	TEST_ASSERT(fr_event_timer_in(el, el, &other->ev_timer, fr_time_delta_wrap(0), _test_timer, other) == 0);
+}
+
+static void test_other_free(fr_event_list_t *el, test_other_t *other)
+{
+	fr_event_fd_delete(el, other->fd[0], FR_EVENT_FILTER_IO);
+	close(other->fd[0]);
+	close(other->fd[1]);
+}
+
+/** Run one pass of the event loop, without waiting
+ *
+ */
+static void test_loop_once(fr_event_list_t *el)
+{
+	TEST_CHECK(fr_event_corral(el, fr_time(), false) >= 0);
+	fr_event_service(el);
+}
+
+static void test_user_trigger(void)
+{
+	fr_event_list_t	*el = test_el_alloc();
+	test_user_t	user = {};
+
+	test_user_insert(el, &user, false);
+
+	TEST_CASE("Events which haven't been triggered aren't run");
+	test_loop_once(el);
+	TEST_CHECK_RET(user.calls, 0);
+
+	TEST_CASE("Triggering an event twice before it's run, runs it once");
+	TEST_CHECK(fr_event_user_trigger(el, user.ev) == 0);
+	TEST_CHECK(fr_event_user_trigger(el, user.ev) == 0);
+	test_loop_once(el);
+	TEST_CHECK_RET(user.calls, 1);
+
+	test_loop_once(el);
+	TEST_CHECK_RET(user.calls, 1);
+
+	TEST_CASE("Events triggered when they're inserted are run");
+	talloc_free(user.ev);
+	user = (test_user_t){};
+	test_user_insert(el, &user, true);
+	test_loop_once(el);
+	TEST_CHECK_RET(user.calls, 1);
+
+	talloc_free(el);
+}
+
+static void test_user_retrigger_self(void)
+{
+	fr_event_list_t	*el = test_el_alloc();
+	test_user_t	user = {};
+	test_other_t	other = {};
+	int		i;
+
+	test_user_insert(el, &user, true);
+	user.trigger = &user;
+	test_other_insert(el, &other);
+
+	TEST_CASE("An event which triggers itself is run once per pass");
+	for (i = 1; i <= 4; i++) {
+		test_loop_once(el);
+		TEST_CHECK_RET(user.calls, i);
+	}
+
+	TEST_CASE("File descriptors and timers are still serviced");
+	TEST_CHECK(other.fd_read);
+	TEST_CHECK(other.timer_fired);
+
+	test_other_free(el, &other);
+	talloc_free(el);
+}
+
+static void test_user_retrigger_pair(void)
+{
+	fr_event_list_t	*el = test_el_alloc();
+	test_user_t	a = {}, b = {};
+	test_other_t	other = {};
+	int		i;
+
+	test_user_insert(el, &a, true);
+	test_user_insert(el, &b, false);
+	a.trigger = &b;
+	b.trigger = &a;
+	test_other_insert(el, &other);
+
+	TEST_CASE("Events which trigger each other take turns, one per pass");
+	for (i = 1; i <= 4; i++) {
+		test_loop_once(el);
+		TEST_CHECK_RET(a.calls + b.calls, i);
+	}
+	TEST_CHECK_RET(a.calls, 2);
+	TEST_CHECK_RET(b.calls, 2);
+
+	TEST_CASE("File descriptors and timers are still serviced");
+	TEST_CHECK(other.fd_read);
+	TEST_CHECK(other.timer_fired);
+
+	test_other_free(el, &other);
+	talloc_free(el);
+}
+
+static void test_user_free(void)
+{
+	fr_event_list_t	*el = test_el_alloc();
+	test_user_t	a = {}, b = {};
+
+	test_user_insert(el, &a, true);
+	test_user_insert(el, &b, true);
+
+	TEST_CASE("A callback can free another triggered event");
+	a.free = &b;
+	test_loop_once(el);
+	TEST_CHECK_RET(a.calls, 1);
+	TEST_CHECK_RET(b.calls, 0);
+	TEST_CHECK(b.ev == NULL);
+
+	talloc_free(el);
+}
+
+TEST_LIST = {
+	{ "user_trigger",		test_user_trigger },
+	{ "user_retrigger_self",	test_user_retrigger_self },
+	{ "user_retrigger_pair",	test_user_retrigger_pair },
+	{ "user_free",			test_user_free },
+
+	{ NULL }
+};
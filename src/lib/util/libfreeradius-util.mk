@@ -23,6 +23,7 @@ SOURCES		:= \
 		   decode.c \
 		   dict_ext.c \
 		   dict_fixup.c \
+		   dict_image.c \
 		   dict_print.c \
 		   dict_test.c \
 		   dict_tokenize.c \
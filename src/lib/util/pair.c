@@ -57,6 +57,163 @@ void fr_pair_list_init(fr_pair_list_t *list)
 	list->verified = true;
 #endif
 	list->is_child = false;
+	list->is_indexed = false;
+	list->index = NULL;
+}
+
+/*
+ *	The index maps a da to the first pair in the list which has
+ *	that da.  The da is the first field of fr_pair_t, so a pointer
+ *	to a pair is also a pointer to its da.  That lets us look up
+ *	pairs using a pointer to a da, without faking up a pair.
+ */
+static_assert(offsetof(fr_pair_t, da) == 0, "fr_pair_t.da must be the first field for the pair list index");
+
+static uint32_t pair_index_hash(void const *data)
+{
+	fr_dict_attr_t const * const *da = data;
+
+	return fr_hash(da, sizeof(*da));
+}
+
+static int8_t pair_index_cmp(void const *a, void const *b)
+{
+	fr_dict_attr_t const * const *da_a = a;
+	fr_dict_attr_t const * const *da_b = b;
+
+	return CMP(*da_a, *da_b);
+}
+
+/** Index a pair list, so that lookups by da are O(1)
+ *
+ * The index is only built once the list has #FR_PAIR_LIST_INDEX_THRESHOLD
+ * pairs, and a lookup is done.  Structural pairs added to the list
+ * have their children indexed, too.
+ *
+ * @note The index is built lazily by functions which take a const
+ *	list.  Only enable it on lists which are used by one thread,
+ *	such as the lists in a request.
+ *
+ * @param[in] list	to index.  Must be the children of a pair, as the
+ *			index is parented by that pair.
+ */
+void fr_pair_list_index_enable(fr_pair_list_t *list)
+{
+	fr_assert(list->is_child);
+
+	list->is_indexed = list->is_child;
+}
+
+/** Throw away the index for a list
+ *
+ * It will be rebuilt on the next lookup.
+ */
+void _fr_pair_list_index_clear(fr_pair_list_t *list)
+{
+	TALLOC_FREE(list->index);
+}
+
+/** Return the index for a list, building it if the list is large enough
+ *
+ */
+static fr_hash_table_t *pair_list_index(fr_pair_list_t const *list)
+{
+	fr_pair_list_t	*my_list = UNCONST(fr_pair_list_t *, list);
+	fr_hash_table_t	*index;
+	fr_pair_t	*vp = NULL;
+
+	if (list->index) return list->index;
+
+	if (!list->is_indexed || (fr_pair_list_num_elements(list) < FR_PAIR_LIST_INDEX_THRESHOLD)) return NULL;
+
+	index = fr_hash_table_alloc(fr_pair_list_parent(list), pair_index_hash, pair_index_cmp, NULL);
+	if (unlikely(!index)) return NULL;
+
+	while ((vp = fr_pair_list_next(list, vp))) {
+		if (fr_hash_table_find(index, vp)) continue;
+
+		if (unlikely(!fr_hash_table_insert(index, vp))) {
+			talloc_free(index);
+			return NULL;
+		}
+	}
+
+	my_list->index = index;
+	return index;
+}
+
+/** Update the index after a pair has been added to a list
+ *
+ * @param[in] list	the pair was added to.
+ * @param[in] vp	which was added.
+ * @param[in] pos	the pair vp was inserted next to, or NULL if vp was added
+ *			at the head or tail of the list.
+ * @param[in] before	whether vp was inserted before pos (or at the head of the list).
+ */
+static inline CC_HINT(always_inline) void pair_list_index_add(fr_pair_list_t *list, fr_pair_t *vp,
+							       fr_pair_t const *pos, bool before)
+{
+	fr_pair_t	*first;
+
+	if (!list->is_indexed) return;
+
+	if (fr_type_is_structural(vp->vp_type)) vp->vp_group.is_indexed = true;
+
+	if (!list->index) return;
+
+	first = fr_hash_table_find(list->index, vp);
+	if (!first) {
+		if (unlikely(!fr_hash_table_insert(list->index, vp))) _fr_pair_list_index_clear(list);
+		return;
+	}
+
+	/*
+	 *	Appending, or inserting after a pair with the same da,
+	 *	never changes the first pair.
+	 */
+	if (!before) {
+		if (!pos || (pos->da == vp->da)) return;
+
+	/*
+	 *	Prepending, or inserting before the current first pair,
+	 *	makes vp the first pair.
+	 */
+	} else if (!pos || (pos == first)) {
+		(void) fr_hash_table_replace(NULL, list->index, vp);
+		return;
+
+	/*
+	 *	Inserting before some later pair with the same da.
+	 */
+	} else if (pos->da == vp->da) {
+		return;
+	}
+
+	/*
+	 *	We don't know if vp is before or after the first pair,
+	 *	and finding out is as expensive as rebuilding the index.
+	 */
+	_fr_pair_list_index_clear(list);
+}
+
+/** Update the index before a pair is removed from a list
+ *
+ */
+void _fr_pair_list_index_remove(fr_pair_list_t *list, fr_pair_t *vp)
+{
+	fr_pair_t *next;
+
+	if (fr_hash_table_find(list->index, vp) != vp) return;
+
+	next = vp;
+	while ((next = fr_pair_list_next(list, next))) {
+		if (next->da != vp->da) continue;
+
+		(void) fr_hash_table_replace(NULL, list->index, next);
+		return;
+	}
+
+	(void) fr_hash_table_delete(list->index, vp);
 }
 
 /** Free a fr_pair_t
@@ -325,6 +482,15 @@ int fr_pair_reinit_from_da(fr_pair_list_t *list, fr_pair_t *vp, fr_dict_attr_t c
 		fr_value_box_init(&vp->data, da->type, da, false);
 	}
 
+	/*
+	 *	The index is keyed by da, so it can't follow the change.
+	 */
+	{
+		fr_pair_list_t *parent = fr_pair_parent_list(vp);
+
+		if (parent && parent->index) _fr_pair_list_index_clear(parent);
+	}
+
 	to_free = vp->da;
 	vp->da = da;
 
@@ -688,12 +854,15 @@ unsigned int fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t cons
  */
 fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_pair_t const *prev, fr_dict_attr_t const *da)
 {
-	fr_pair_t *vp = UNCONST(fr_pair_t *, prev);
+	fr_pair_t	*vp = UNCONST(fr_pair_t *, prev);
+	fr_hash_table_t	*index;
 
 	if (fr_pair_list_empty(list)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	if (!prev && (index = pair_list_index(list))) return fr_hash_table_find(index, &da);
+
 	while ((vp = fr_pair_list_next(list, vp))) if (da == vp->da) return vp;
 
 	return NULL;
@@ -712,12 +881,23 @@ fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_pair_t const *prev,
  */
 fr_pair_t *fr_pair_find_by_da_idx(fr_pair_list_t const *list, fr_dict_attr_t const *da, unsigned int idx)
 {
-	fr_pair_t *vp = NULL;
+	fr_pair_t	*vp = NULL;
+	fr_hash_table_t	*index;
 
 	if (fr_pair_list_empty(list)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	/*
+	 *	Skip straight to the first matching pair.
+	 */
+	if ((index = pair_list_index(list))) {
+		vp = fr_hash_table_find(index, &da);
+		if (!vp) return NULL;
+		if (idx == 0) return vp;
+		idx--;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) {
 		if (da != vp->da) continue;
 
@@ -954,6 +1134,16 @@ static int _pair_list_dcursor_insert(fr_dlist_head_t *list, void *to_insert, UNU
 	 */
 	fr_pair_order_list_set_head(tlist, vp);
 
+	/*
+	 *	We don't know where the cursor is putting the pair.
+	 */
+	{
+		fr_pair_list_t *pair_list = fr_pair_parent_list(vp);
+
+		if (pair_list->index && fr_hash_table_find(pair_list->index, vp)) _fr_pair_list_index_clear(pair_list);
+		pair_list_index_add(pair_list, vp, NULL, false);
+	}
+
 	PAIR_VERIFY(vp);
 
 	return 0;
@@ -986,6 +1176,12 @@ static int _pair_list_dcursor_remove(NDEBUG_UNUSED fr_dlist_head_t *list, void *
 	parent = fr_pair_parent_list(vp);
 #endif
 
+	/*
+	 *	The cursor is about to remove the pair itself, so
+	 *	update the index while the pair is still in the list.
+	 */
+	if ((&parent->order.head.dlist_head == list) && parent->index) _fr_pair_list_index_remove(parent, vp);
+
 	/*
 	 *	Mark the pair as removed from the list.
 	 */
@@ -1295,6 +1491,7 @@ int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_pair_order_list_insert_head(&list->order, to_add);
+	pair_list_index_add(list, to_add, NULL, true);
 
 	return 0;
 }
@@ -1326,6 +1523,7 @@ int fr_pair_append(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_pair_order_list_insert_tail(&list->order, to_add);
+	pair_list_index_add(list, to_add, NULL, false);
 
 	return 0;
 }
@@ -1359,6 +1557,7 @@ int fr_pair_insert_after(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_add
 	}
 
 	fr_pair_order_list_insert_after(&list->order, pos, to_add);
+	pair_list_index_add(list, to_add, pos, false);
 
 	return 0;
 }
@@ -1393,6 +1592,7 @@ int fr_pair_insert_before(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_ad
 	}
 
 	fr_pair_order_list_insert_before(&list->order, pos, to_add);
+	pair_list_index_add(list, to_add, pos, true);
 
 	return 0;
 }
@@ -1936,24 +2136,20 @@ int fr_pair_cmp(fr_pair_t const *a, fr_pair_t const *b)
 
 			if (!fr_cond_assert(a->vp_type == FR_TYPE_STRING)) return -1;
 
-			slen = regex_compile(NULL, &preg, a->vp_strvalue, talloc_array_length(a->vp_strvalue) - 1,
-					     NULL, false, true);
+			slen = regex_compile_cached(&preg, a->vp_strvalue, talloc_array_length(a->vp_strvalue) - 1,
+						    NULL, false);
 			if (slen <= 0) {
 				fr_strerror_printf_push("Error at offset %zu compiling regex for %s", -slen,
 							a->da->name);
 				return -1;
 			}
 			fr_pair_aprint(NULL, &value, NULL, b);
-			if (!value) {
-				talloc_free(preg);
-				return -1;
-			}
+			if (!value) return -1;
 
 			/*
 			 *	Don't care about substring matches, oh well...
 			 */
 			slen = regex_exec(preg, value, talloc_array_length(value) - 1, NULL);
-			talloc_free(preg);
 			talloc_free(value);
 
 			if (slen < 0) return -1;
@@ -2274,6 +2470,7 @@ int fr_pair_list_copy(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t const
 
 		new_vp = fr_pair_copy(ctx, vp);
 		if (!new_vp) {
+			if (to->index) _fr_pair_list_index_clear(to);
 			fr_pair_order_list_talloc_free_to_tail(&to->order, first_added);
 			return -1;
 		}
@@ -2373,6 +2570,7 @@ int fr_pair_list_copy_by_da(TALLOC_CTX *ctx, fr_pair_list_t *to,
 		cnt++;
 		new_vp = fr_pair_copy(ctx, vp);
 		if (!new_vp) {
+			if (to->index) _fr_pair_list_index_clear(to);
 			fr_pair_order_list_talloc_free_to_tail(&to->order, first_added);
 			return -1;
 		}
@@ -26,6 +26,7 @@ RCSIDH(dpair_h, "$Id$")
 #include <freeradius-devel/build.h>
 #include <freeradius-devel/missing.h>
 #include <freeradius-devel/util/dcursor.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/value.h>
 #include <freeradius-devel/util/tlist.h>
 
@@ -49,10 +50,21 @@ typedef struct value_pair_s fr_pair_t;
 
 FR_TLIST_TYPES(fr_pair_order_list)
 
+/** Number of pairs a list must have before we build an index for it
+ *
+ * Below this, walking the list is faster than hashing.  See
+ * pair_list_perf_test.c for where the two cross over.
+ */
+#define FR_PAIR_LIST_INDEX_THRESHOLD	(16)
+
 typedef struct {
         FR_TLIST_HEAD(fr_pair_order_list)	order;			//!< Maintains the relative order of pairs in a list.
 
 	bool				 _CONST is_child;		//!< is a child of a VP
+	bool				 _CONST is_indexed;		//!< look up pairs by da using an index.
+	fr_hash_table_t			* _CONST index;			//!< of the first pair for each da.  Built
+									///< on demand, and dropped whenever it
+									///< can't be cheaply kept in sync.
 
 #ifdef WITH_VERIFY_PTR
 	unsigned int		verified : 1;				//!< hack to avoid O(N^3) issues
@@ -435,6 +447,17 @@ do { \
 /** @hidecallergraph */
 void fr_pair_list_init(fr_pair_list_t *head) CC_HINT(nonnull);
 
+void fr_pair_list_index_enable(fr_pair_list_t *list) CC_HINT(nonnull);
+
+#ifdef _PAIR_PRIVATE
+/*
+ *	Index maintenance, for pair.c and pair_inline.c only.
+ */
+void _fr_pair_list_index_remove(fr_pair_list_t *list, fr_pair_t *vp) CC_HINT(nonnull);
+
+void _fr_pair_list_index_clear(fr_pair_list_t *list) CC_HINT(nonnull);
+#endif
+
 void fr_pair_init_null(fr_pair_t *vp) CC_HINT(nonnull);
 
 /* Allocation and management */
@@ -103,6 +103,8 @@ _INLINE fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
 	list->verified = false;
 #endif
 
+	if (list->index) _fr_pair_list_index_remove(list, vp);
+
 	return fr_pair_order_list_remove(&list->order, vp);
 }
 
@@ -112,6 +114,8 @@ _INLINE fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
  */
 _INLINE void fr_pair_list_free(fr_pair_list_t *list)
 {
+	if (list->index) _fr_pair_list_index_clear(list);
+
 	fr_pair_order_list_talloc_free(&list->order);
 }
 
@@ -139,6 +143,8 @@ _INLINE bool fr_pair_list_empty(fr_pair_list_t const *list)
  */
 _INLINE void fr_pair_list_sort(fr_pair_list_t *list, fr_cmp_t cmp)
 {
+	if (list->index) _fr_pair_list_index_clear(list);
+
 	fr_pair_order_list_sort(&list->order, cmp);
 }
 
@@ -184,6 +190,9 @@ _INLINE void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
 #ifdef WITH_VERIFY_POINTER
 	dst->verified = false;
 #endif
+	if (dst->index) _fr_pair_list_index_clear(dst);
+	if (src->index) _fr_pair_list_index_clear(src);
+
 	fr_pair_order_list_move(&dst->order, &src->order);
 }
 
@@ -194,5 +203,8 @@ _INLINE void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
  */
 _INLINE void fr_pair_list_prepend(fr_pair_list_t *dst, fr_pair_list_t *src)
 {
+	if (dst->index) _fr_pair_list_index_clear(dst);
+	if (src->index) _fr_pair_list_index_clear(src);
+
 	fr_pair_order_list_move_head(&dst->order, &src->order);
 }
@@ -473,6 +473,59 @@ static void do_test_fr_pair_list_free(unsigned int len, unsigned int perc, unsig
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used) / (double)NSEC));
 }
 
+/** Time finding a pair which is pos pairs from the head of the list
+ *
+ * A linear search costs more the further down the list the pair is,
+ * whereas an indexed search costs the same wherever the pair is.  The
+ * positions where the linear search becomes slower than the indexed
+ * search show where FR_PAIR_LIST_INDEX_THRESHOLD should be.
+ */
+static void do_test_find_position(unsigned int pos, bool indexed, unsigned int reps)
+{
+	fr_pair_t		*group, *vp;
+	fr_pair_list_t		*test_vps;
+	unsigned int		i;
+	fr_time_t		start;
+	fr_time_delta_t		used;
+	fr_dict_attr_t const	*da;
+	size_t			len = talloc_array_length(source_vps_0);
+
+	group = fr_pair_afrom_da(autofree, fr_dict_attr_test_group);
+	TEST_ASSERT(group != NULL);
+	test_vps = &group->vp_group;
+	if (indexed) fr_pair_list_index_enable(test_vps);
+
+	/*
+	 *  source_vps_0 has no duplicates, so the first pair with
+	 *  each da is at the same position as in the source list.
+	 */
+	if (len > 64) len = 64;
+	TEST_ASSERT(pos < len);
+	for (i = 0; i < len; i++) fr_pair_append(test_vps, fr_pair_copy(group, source_vps_0[i]));
+
+	/*
+	 *  Build the index outside of the timing loop.
+	 */
+	da = source_vps_0[pos]->da;
+	vp = fr_pair_find_by_da(test_vps, NULL, da);
+	TEST_CHECK(vp && (vp->da == da));
+	TEST_CHECK((test_vps->index != NULL) == indexed);
+
+	start = fr_time();
+	for (i = 0; i < reps; i++) {
+		vp = fr_pair_find_by_da(test_vps, NULL, da);
+	}
+	used = fr_time_sub(fr_time(), start);
+	TEST_CHECK(vp && (vp->da == da));
+
+	talloc_free(group);
+	TEST_MSG_ALWAYS("repetitions=%d", reps);
+	TEST_MSG_ALWAYS("indexed=%s", indexed ? "yes" : "no");
+	TEST_MSG_ALWAYS("position=%d", pos);
+	TEST_MSG_ALWAYS("used=%"PRId64, fr_time_delta_unwrap(used));
+	TEST_MSG_ALWAYS("ns_per_find=%0.2lf", fr_time_delta_unwrap(used) / (double)reps);
+}
+
 #define test_func(_func, _count, _perc, _source_vps) \
 static void test_ ## _func ## _ ## _count ## _ ## _perc(void)\
 {\
@@ -498,6 +551,25 @@ all_test_funcs(fr_pair_find_by_da_idx)
 all_test_funcs(find_nth)
 all_test_funcs(fr_pair_list_free)
 
+#define test_position(_pos) \
+static void test_find_position_linear_ ## _pos(void)\
+{\
+	do_test_find_position(_pos, false, 1000000);\
+}\
+static void test_find_position_indexed_ ## _pos(void)\
+{\
+	do_test_find_position(_pos, true, 1000000);\
+}
+
+test_position(0)
+test_position(1)
+test_position(2)
+test_position(4)
+test_position(8)
+test_position(16)
+test_position(32)
+test_position(63)
+
 #define repetition_tests(_func, _perc) \
 	{ #_func "_20_" #_perc, test_ ## _func ## _20_ ## _perc},\
 	{ #_func "_40_" #_perc, test_ ## _func ## _40_ ## _perc},\
@@ -518,5 +590,18 @@ TEST_LIST = {
 	all_repetition_tests(find_nth)
 	all_repetition_tests(fr_pair_list_free)
 
+#define position_tests(_pos) \
+	{ "find_position_linear_" #_pos, test_find_position_linear_ ## _pos},\
+	{ "find_position_indexed_" #_pos, test_find_position_indexed_ ## _pos},
+
+	position_tests(0)
+	position_tests(1)
+	position_tests(2)
+	position_tests(4)
+	position_tests(8)
+	position_tests(16)
+	position_tests(32)
+	position_tests(63)
+
 	{ NULL }
 };
@@ -768,6 +768,105 @@ static void test_fr_pair_list_copy_by_ancestor(void)
 	fr_pair_list_free(&local_pairs);
 }
 
+static fr_dict_attr_t const **index_test_das[] = {
+	&fr_dict_attr_test_string, &fr_dict_attr_test_octets, &fr_dict_attr_test_ipv4_addr,
+	&fr_dict_attr_test_uint8, &fr_dict_attr_test_uint32, &fr_dict_attr_test_date
+};
+
+/** Check that indexed lookups return the same pairs as a walk of the list
+ *
+ */
+static void pair_list_index_check(fr_pair_list_t *list)
+{
+	size_t		i;
+	unsigned int	j;
+
+	for (i = 0; i < NUM_ELEMENTS(index_test_das); i++) {
+		fr_dict_attr_t const	*da = *index_test_das[i];
+		fr_pair_t		*vp = NULL, *found[3] = {};
+
+		for (j = 0; (vp = fr_pair_list_next(list, vp)) && (j < NUM_ELEMENTS(found));) {
+			if (vp->da == da) found[j++] = vp;
+		}
+
+		TEST_CHECK(fr_pair_find_by_da(list, NULL, da) == found[0]);
+		TEST_MSG("Expected first %s %p", da->name, found[0]);
+		TEST_CHECK(fr_pair_find_by_da_idx(list, da, 1) == found[1]);
+		TEST_CHECK(fr_pair_find_by_da_idx(list, da, 2) == found[2]);
+	}
+}
+
+static void test_fr_pair_list_index(void)
+{
+	fr_pair_t	*group, *vp, *pos;
+	fr_pair_list_t	*list;
+	fr_dcursor_t	cursor;
+	size_t		i;
+
+	TEST_CASE("Create an indexed list with more than FR_PAIR_LIST_INDEX_THRESHOLD pairs");
+	TEST_CHECK((group = fr_pair_afrom_da(autofree, fr_dict_attr_test_group)) != NULL);
+	list = &group->vp_group;
+	fr_pair_list_index_enable(list);
+
+	for (i = 0; i < (FR_PAIR_LIST_INDEX_THRESHOLD * 2); i++) {
+		TEST_CHECK(fr_pair_append_by_da(group, NULL, list,
+						*index_test_das[i % (NUM_ELEMENTS(index_test_das) - 1)]) == 0);
+	}
+	pair_list_index_check(list);
+	TEST_CHECK(list->index != NULL);
+
+	TEST_CASE("Prepend a duplicate, and append a new attribute");
+	TEST_CHECK(fr_pair_prepend_by_da(group, NULL, list, fr_dict_attr_test_uint8) == 0);
+	TEST_CHECK(fr_pair_append_by_da(group, NULL, list, fr_dict_attr_test_date) == 0);
+	pair_list_index_check(list);
+
+	TEST_CASE("Insert before and after pairs in the middle of the list");
+	pos = fr_pair_find_by_da_idx(list, fr_dict_attr_test_string, 2);
+	TEST_CHECK((vp = fr_pair_afrom_da(group, fr_dict_attr_test_octets)) != NULL);
+	TEST_CHECK(fr_pair_insert_before(list, pos, vp) == 0);
+	pair_list_index_check(list);
+
+	TEST_CHECK((vp = fr_pair_afrom_da(group, fr_dict_attr_test_date)) != NULL);
+	TEST_CHECK(fr_pair_insert_before(list, fr_pair_list_head(list), vp) == 0);
+	pair_list_index_check(list);
+
+	TEST_CHECK((vp = fr_pair_afrom_da(group, fr_dict_attr_test_string)) != NULL);
+	TEST_CHECK(fr_pair_insert_after(list, pos, vp) == 0);
+	pair_list_index_check(list);
+
+	TEST_CASE("Remove the first instance of an attribute");
+	vp = fr_pair_find_by_da(list, NULL, fr_dict_attr_test_ipv4_addr);
+	fr_pair_remove(list, vp);
+	talloc_free(vp);
+	pair_list_index_check(list);
+
+	TEST_CASE("Remove all instances of an attribute");
+	TEST_CHECK(fr_pair_delete_by_da(list, fr_dict_attr_test_date) > 0);
+	pair_list_index_check(list);
+
+	TEST_CASE("Remove and insert pairs with a cursor");
+	for (vp = fr_pair_dcursor_by_da_init(&cursor, list, fr_dict_attr_test_uint32);
+	     vp;
+	     vp = fr_dcursor_current(&cursor)) {
+		fr_dcursor_free_item(&cursor);
+	}
+	pair_list_index_check(list);
+
+	vp = fr_pair_dcursor_init(&cursor, list);
+	vp = fr_dcursor_next(&cursor);
+	TEST_CHECK((vp = fr_pair_afrom_da(group, fr_dict_attr_test_uint32)) != NULL);
+	TEST_CHECK(fr_dcursor_insert(&cursor, vp) == 0);
+	TEST_CHECK((vp = fr_pair_afrom_da(group, fr_dict_attr_test_string)) != NULL);
+	TEST_CHECK(fr_dcursor_insert(&cursor, vp) == 0);
+	pair_list_index_check(list);
+
+	TEST_CASE("Sort the list");
+	fr_pair_list_sort(list, fr_pair_cmp_by_da);
+	pair_list_index_check(list);
+
+	talloc_free(group);
+}
+
 static void test_fr_pair_list_sort(void)
 {
 	fr_dcursor_t	cursor;
@@ -1450,6 +1549,7 @@ TEST_LIST = {
 	{ "fr_pair_list_copy_by_da",              test_fr_pair_list_copy_by_da },
 	{ "fr_pair_list_copy_by_ancestor",        test_fr_pair_list_copy_by_ancestor },
 	{ "fr_pair_list_sort",                    test_fr_pair_list_sort },
+	{ "fr_pair_list_index",                   test_fr_pair_list_index },
 
 	/* Copy */
 	{ "fr_pair_value_copy",                   test_fr_pair_value_copy },
@@ -27,6 +27,12 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/regex.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+
+#ifndef FR_REGEX_CACHE_SIZE
+#  define FR_REGEX_CACHE_SIZE	(256)
+#endif
 
 #if defined(HAVE_REGEX_PCRE) || (defined(HAVE_REGEX_PCRE2) && defined(PCRE2_CONFIG_JIT))
 #ifndef FR_PCRE_JIT_STACK_MIN
@@ -1339,6 +1345,241 @@ ssize_t regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const *flags)
 
 	FR_SBUFF_SET_RETURN(sbuff, &our_sbuff);
 }
+
+/*
+ *########################################
+ *#          RUNTIME REGEX CACHE         #
+ *########################################
+ */
+
+/** A regular expression compiled at run time
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the LRU list.
+	regex_t			*preg;		//!< The compiled expression.  Parented by the cache.
+	uint64_t		uses;		//!< How many times the expression has been used.
+	uint8_t			flags;		//!< Flags the expression was compiled with.
+	size_t			len;		//!< Length of the pattern.
+	char			*pattern;	//!< Not \0 terminated, as patterns are binary safe.
+} fr_regex_cache_entry_t;
+
+/** Per-thread cache of regular expressions compiled at run time
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*ht;		//!< Of fr_regex_cache_entry_t, keyed by pattern and flags.
+	fr_dlist_head_t		lru;		//!< Most recently used first.
+} fr_regex_cache_t;
+
+/*
+ *	The POSIX regex_t is a system type, so we can't mark it.
+ */
+#if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
+#  define REGEX_SET_CACHED(_preg)	((_preg)->cached = true)
+#else
+#  define REGEX_SET_CACHED(_preg)
+#endif
+
+static _Thread_local fr_regex_cache_t *fr_regex_cache;
+static _Thread_local fr_regex_cache_stats_t fr_regex_cache_stats;
+
+/** Pack the flags which affect compilation into a single byte
+ *
+ */
+static inline CC_HINT(always_inline) uint8_t regex_cache_flags(fr_regex_flags_t const *flags, bool subcaptures)
+{
+	uint8_t out = subcaptures;
+
+	if (!flags) return out;
+
+	/* flags->global is implemented by the substitution function */
+	out |= flags->ignore_case << 1;
+	out |= flags->multiline << 2;
+	out |= flags->dot_all << 3;
+	out |= flags->unicode << 4;
+	out |= flags->extended << 5;
+
+	return out;
+}
+
+static uint32_t regex_cache_hash(void const *data)
+{
+	fr_regex_cache_entry_t const *a = data;
+
+	return fr_hash_update(&a->flags, sizeof(a->flags), fr_hash(a->pattern, a->len));
+}
+
+static int8_t regex_cache_cmp(void const *one, void const *two)
+{
+	fr_regex_cache_entry_t const *a = one;
+	fr_regex_cache_entry_t const *b = two;
+	int ret;
+
+	CMP_RETURN(a, b, flags);
+	CMP_RETURN(a, b, len);
+
+	ret = memcmp(a->pattern, b->pattern, a->len);
+	return CMP(ret, 0);
+}
+
+/** Remove an entry from the cache
+ *
+ * Requests which have captures from the expression hold a reference to
+ * it, in which case talloc_unlink() hands it over to them.
+ */
+static void regex_cache_entry_free(fr_regex_cache_t *cache, fr_regex_cache_entry_t *entry)
+{
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_unlink(cache, entry->preg);
+	talloc_free(entry);
+}
+
+static int _regex_cache_free(fr_regex_cache_t *cache)
+{
+	fr_regex_cache_entry_t *entry;
+
+	while ((entry = fr_dlist_head(&cache->lru))) regex_cache_entry_free(cache, entry);
+
+	return 0;
+}
+
+static int _regex_cache_free_on_exit(void *arg)
+{
+	return talloc_free(arg);
+}
+
+/** Compile a regular expression, or return a previously compiled copy of it
+ *
+ * Expressions built at run time (e.g. from attribute values) are
+ * often the same for many requests.  Each thread keeps an LRU cache of
+ * the ones it has compiled, keyed by the pattern and the flags.
+ *
+ * Expressions are compiled without JIT when they're first seen, as
+ * many are only ever used once.  If they're used again, they're JIT
+ * compiled.
+ *
+ * @note The compiled expression is owned by the cache, and MUST NOT be freed.
+ *	It's only valid until the next call to this function from the same thread.
+ *	Callers which need it for longer should use talloc_reference().
+ *
+ * @param[out] out		Where to write out a pointer to the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching. May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	fr_regex_cache_t	*cache = fr_regex_cache;
+	fr_regex_cache_entry_t	*entry, find;
+	regex_t			*preg;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	if (unlikely(!cache)) {
+		cache = talloc_zero(NULL, fr_regex_cache_t);
+		if (!cache) goto oom;
+		fr_dlist_talloc_init(&cache->lru, fr_regex_cache_entry_t, entry);
+
+		cache->ht = fr_hash_table_alloc(cache, regex_cache_hash, regex_cache_cmp, NULL);
+		if (!cache->ht) {
+			talloc_free(cache);
+			goto oom;
+		}
+		talloc_set_destructor(cache, _regex_cache_free);
+
+		fr_atexit_thread_local(fr_regex_cache, _regex_cache_free_on_exit, cache);
+		fr_regex_cache = cache;
+	}
+
+	find = (fr_regex_cache_entry_t) {
+		.flags = regex_cache_flags(flags, subcaptures),
+		.len = len,
+		.pattern = UNCONST(char *, pattern)
+	};
+
+	entry = fr_hash_table_find(cache->ht, &find);
+	if (entry) {
+		fr_regex_cache_stats.hits++;
+		entry->uses++;
+
+		fr_dlist_remove(&cache->lru, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+
+		/*
+		 *	It's being reused, so it's worth spending
+		 *	time to JIT compile it.  If that fails, we
+		 *	just keep using the interpreted version.
+		 */
+		if ((entry->uses == 2) && (regex_compile(cache, &preg, pattern, len, flags, subcaptures, false) > 0)) {
+			REGEX_SET_CACHED(preg);
+			talloc_unlink(cache, entry->preg);
+			entry->preg = preg;
+			fr_regex_cache_stats.jit++;
+		}
+
+		*out = entry->preg;
+		return len;
+	}
+
+	fr_regex_cache_stats.misses++;
+
+	slen = regex_compile(cache, &preg, pattern, len, flags, subcaptures, true);
+	if (slen <= 0) return slen;
+	REGEX_SET_CACHED(preg);
+
+	/*
+	 *	Make room for the new entry.
+	 */
+	if (fr_hash_table_num_elements(cache->ht) >= FR_REGEX_CACHE_SIZE) {
+		fr_regex_cache_entry_t *old = fr_dlist_tail(&cache->lru);
+
+		(void) fr_hash_table_delete(cache->ht, old);
+		regex_cache_entry_free(cache, old);
+		fr_regex_cache_stats.evictions++;
+	}
+
+	entry = talloc_zero(cache, fr_regex_cache_entry_t);
+	if (!entry) goto error;
+	entry->preg = preg;
+	entry->uses = 1;
+	entry->flags = find.flags;
+	entry->len = len;
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	if (!entry->pattern || !fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		goto error;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	fr_regex_cache_stats.entries = fr_hash_table_num_elements(cache->ht);
+
+	*out = preg;
+	return slen;
+
+error:
+	talloc_unlink(cache, preg);
+oom:
+	fr_strerror_const("Out of memory");
+	return 0;
+}
+
+/** Return the statistics for this thread's runtime regex cache
+ *
+ * The statistics are thread local, but the pointer remains valid for the
+ * life of the thread, so it can be read from other threads.
+ */
+fr_regex_cache_stats_t const *regex_cache_stats(void)
+{
+	return &fr_regex_cache_stats;
+}
 #endif
 
 /** Compare two boxes using an operator
@@ -1393,7 +1634,7 @@ int fr_regex_cmp_op(fr_token_t op, fr_value_box_t const *a, fr_value_box_t const
 		lhs_len = a->vb_length;
 	}
 
-	if (regex_compile(ctx, &regex, b->vb_strvalue, b->vb_length, NULL, false, true) < 0) {
+	if (regex_compile_cached(&regex, b->vb_strvalue, b->vb_length, NULL, false) <= 0) {
 		talloc_free(ctx);
 		return -1;
 	}
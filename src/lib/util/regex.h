@@ -69,6 +69,7 @@ typedef struct {
 	bool			precompiled;	//!< Whether this regex was precompiled,
 						///< or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the runtime regex cache.
 } regex_t;
 /*
  *######################################
@@ -114,6 +115,7 @@ typedef struct {
 
 	bool			precompiled;	//!< Whether this regex was precompiled, or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the runtime regex cache.
 } regex_t;
 /*
  *######################################
@@ -169,6 +171,17 @@ typedef struct {
 
 #define REGEX_FLAG_BUFF_SIZE	7
 
+/** Statistics for a thread's cache of regular expressions compiled at run time
+ *
+ */
+typedef struct {
+	uint64_t	hits;			//!< Expressions found in the cache.
+	uint64_t	misses;			//!< Expressions which had to be compiled.
+	uint64_t	evictions;		//!< Expressions removed to make space for others.
+	uint64_t	jit;			//!< Expressions which were JIT compiled when reused.
+	uint32_t	entries;		//!< Expressions currently in the cache.
+} fr_regex_cache_stats_t;
+
 ssize_t		regex_flags_parse(int *err, fr_regex_flags_t *out, fr_sbuff_t *in,
 				  fr_sbuff_term_t const *terminals, bool err_on_dup);
 
@@ -176,6 +189,10 @@ ssize_t		regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const *flags);
 
 	ssize_t		regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 			      fr_regex_flags_t const *flags, bool subcaptures, bool runtime);
+ssize_t		regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+				     fr_regex_flags_t const *flags, bool subcaptures);
+fr_regex_cache_stats_t const *regex_cache_stats(void);
+
 int		regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *regmatch) CC_HINT(nonnull(1,2));
 #ifdef HAVE_REGEX_PCRE2
 int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg, fr_regex_flags_t *flags,
@@ -1298,6 +1298,163 @@ void *fr_trie_match_by_key(fr_trie_t const *ft, void const *key, size_t keylen)
 	return trie_key_match(user->trie, key, 0, keylen, true);
 }
 
+/* PREFIX FUNCTIONS */
+
+typedef struct {
+	void		**out;		//!< User ctx of each prefix found.
+	size_t		*out_keylen;	//!< Length in bits of each prefix found.
+	int		max;		//!< Number of entries in out and out_keylen.
+	int		num;		//!< Number of prefixes found so far.
+} fr_trie_prefix_ctx_t;
+
+typedef void (*trie_key_prefixes_t)(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+				    fr_trie_prefix_ctx_t *pctx);
+
+static void trie_key_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			      fr_trie_prefix_ctx_t *pctx);
+
+static void trie_user_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			       fr_trie_prefix_ctx_t *pctx)
+{
+	fr_trie_user_t *user = (fr_trie_user_t *) trie;
+
+	/*
+	 *	Find the longer prefixes first.
+	 */
+	trie_key_prefixes(user->trie, key, start_bit, end_bit, pctx);
+
+	/*
+	 *	And then add ourselves, if there's room.
+	 */
+	if (pctx->num >= pctx->max) return;
+
+	pctx->out[pctx->num] = user->data;
+	if (pctx->out_keylen) pctx->out_keylen[pctx->num] = start_bit;
+	pctx->num++;
+}
+
+static void trie_node_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			       fr_trie_prefix_ctx_t *pctx)
+{
+	uint16_t chunk;
+	fr_trie_node_t *node = (fr_trie_node_t *) trie;
+
+	chunk = get_chunk(key, start_bit, node->bits);
+	if (!node->trie[chunk]) return;
+
+	trie_key_prefixes(node->trie[chunk], key, start_bit + node->bits, end_bit, pctx);
+}
+
+#ifdef WITH_PATH_COMPRESSION
+static void trie_path_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			       fr_trie_prefix_ctx_t *pctx)
+{
+	uint16_t chunk;
+	fr_trie_path_t *path = (fr_trie_path_t *) trie;
+
+	chunk = get_chunk(key, start_bit, path->bits);
+	if (chunk != path->chunk) return;
+
+	trie_key_prefixes(path->trie, key, start_bit + path->bits, end_bit, pctx);
+}
+#endif
+
+#ifdef WITH_NODE_COMPRESSION
+static void trie_comp_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			       fr_trie_prefix_ctx_t *pctx)
+{
+	int i;
+	uint16_t chunk;
+	fr_trie_comp_t *comp = (fr_trie_comp_t *) trie;
+
+	chunk = get_chunk(key, start_bit, comp->bits);
+
+	for (i = 0; i < comp->used; i++) {
+		if (comp->index[i] < chunk) continue;
+
+		if (comp->index[i] == chunk) {
+			trie_key_prefixes(comp->trie[i], key, start_bit + comp->bits, end_bit, pctx);
+		}
+
+		/*
+		 *	The edges are ordered smallest to largest.
+		 */
+		return;
+	}
+}
+#endif
+
+static trie_key_prefixes_t trie_prefixes_table[FR_TRIE_MAX] = {
+	[ FR_TRIE_USER ] = trie_user_prefixes,
+	[ FR_TRIE_NODE ] = trie_node_prefixes,
+#ifdef WITH_PATH_COMPRESSION
+	[ FR_TRIE_PATH ] = trie_path_prefixes,
+#endif
+#ifdef WITH_NODE_COMPRESSION
+	[ FR_TRIE_COMP ] = trie_comp_prefixes,
+#endif
+};
+
+/** Find all of the user ctx along the path of a key
+ *
+ *  This is the same descent as trie_key_match(), except that every
+ *  user ctx which is passed is recorded.  They're recorded on the way
+ *  back up, so the longest prefix is first.
+ */
+static void trie_key_prefixes(fr_trie_t *trie, uint8_t const *key, int start_bit, int end_bit,
+			      fr_trie_prefix_ctx_t *pctx)
+{
+	if (!trie) return;
+
+	/*
+	 *	We've run out of key, so nothing deeper can match.
+	 */
+	if ((start_bit + trie->bits) > end_bit) return;
+
+	TRIE_TYPE_CHECK(prefixes, );
+
+	trie_prefixes_table[trie->type](trie, key, start_bit, end_bit, pctx);
+}
+
+/** Lookup all prefixes of a key in a trie, and return their user ctx
+ *
+ *  This is the same as calling fr_trie_lookup_by_key() repeatedly, with
+ *  a shorter key each time, but it only walks the trie once.
+ *
+ *  If there are more than "max" matching prefixes, only the longest
+ *  "max" prefixes are returned.
+ *
+ * @param[in] ft		the trie
+ * @param[in] key		the key bytes
+ * @param[in] keylen		length in bits of the key
+ * @param[out] out		array of user ctx, ordered longest prefix to shortest.
+ * @param[out] out_keylen	array of prefix lengths in bits, matching "out".  May be NULL.
+ * @param[in] max		number of entries in "out" and "out_keylen".
+ * @return
+ *	- 0 if no prefixes were found.
+ *	- the number of entries written to "out".
+ */
+int fr_trie_lookup_all_prefixes(fr_trie_t const *ft, void const *key, size_t keylen,
+				void **out, size_t *out_keylen, int max)
+{
+	fr_trie_user_t *user;
+	fr_trie_prefix_ctx_t pctx = {
+		.out = out,
+		.out_keylen = out_keylen,
+		.max = max
+	};
+
+	if (keylen > MAX_KEY_BITS) return 0;
+
+	if (!ft->trie || (max <= 0)) return 0;
+
+	user = UNCONST(fr_trie_user_t *, ft);
+
+	trie_key_prefixes(user->trie, key, 0, keylen, &pctx);
+
+	return pctx.num;
+}
+
 /* INSERT FUNCTIONS */
 
 #ifdef TESTING
@@ -3153,6 +3310,40 @@ static int command_lookup(fr_trie_t *ft, UNUSED int argc, char **argv, char *out
 }
 
 
+/**  Look up all prefixes of a key, and return their user ctx data.
+ *
+ *  The output is "bits=data" for each prefix, longest first.
+ */
+static int command_prefixes(fr_trie_t *ft, UNUSED int argc, char **argv, char *out, size_t outlen)
+{
+	int bits, i, num;
+	void *answer[MAX_KEY_BITS + 1];
+	size_t answer_bits[MAX_KEY_BITS + 1];
+	char *key, *p, *end;
+
+	if (arg2key(argv[0], &key, &bits) < 0) {
+		return -1;
+	}
+
+	num = fr_trie_lookup_all_prefixes(ft, key, bits, answer, answer_bits, NUM_ELEMENTS(answer));
+	if (!num) {
+		strlcpy(out, "{}", outlen);
+		return 0;
+	}
+
+	p = out;
+	end = out + outlen;
+	*p = '\0';
+
+	for (i = 0; i < num; i++) {
+		p += snprintf(p, end - p, "%s%zu=%s", (i == 0) ? "" : ",", answer_bits[i], (char const *) answer[i]);
+		if (p >= end) return -1;
+	}
+
+	return 0;
+}
+
+
 /**  Remove a key from the trie.
  *
  *  The key has to match exactly.
@@ -3416,6 +3607,7 @@ static fr_trie_command_t commands[] = {
 	{ "insert",	command_insert,	2, 2, false },
 	{ "match",	command_match,	1, 1, true },
 	{ "lookup",	command_lookup,	1, 1, true },
+	{ "prefixes",	command_prefixes, 1, 1, true },
 	{ "remove",	command_remove,	1, 1, true },
 	{ "-remove",	command_try_to_remove, 1, 1, true },
 	{ "print",	command_print,	0, 0, true },
@@ -63,6 +63,9 @@ void		*fr_trie_lookup_by_key(fr_trie_t const *ft, void const *key, size_t keylen
 
 void		*fr_trie_match_by_key(fr_trie_t const *ft, void const *key, size_t keylen) CC_HINT(nonnull);
 
+int		fr_trie_lookup_all_prefixes(fr_trie_t const *ft, void const *key, size_t keylen,
+					    void **out, size_t *out_keylen, int max) CC_HINT(nonnull(1,2,4));
+
 void		*fr_trie_remove_by_key(fr_trie_t *ft, void const *key, size_t keylen) CC_HINT(nonnull);
 
 int		fr_trie_walk(fr_trie_t *ft, void *ctx, fr_trie_walk_t callback) CC_HINT(nonnull(1,3));
@@ -22,12 +22,17 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/udp.h>
 
+#ifdef __linux__
+#  include <linux/filter.h>
+#endif
+
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
 
 /** Send a packet via a UDP socket.
@@ -211,3 +216,446 @@ done:
 
 	return slen;
 }
+
+/** A batch of packets read from a socket with one recvmmsg() call
+ *
+ */
+struct udp_recv_batch_s {
+	unsigned int		num;		//!< Maximum number of packets read at once.
+	unsigned int		count;		//!< How many packets the last read returned.
+	unsigned int		next;		//!< Next packet to hand back to the caller.
+
+	size_t			packet_size;	//!< Maximum size of each packet.
+	int			sockfd;		//!< The socket the packets were read from.
+
+	struct mmsghdr		*msgvec;	//!< For recvmmsg().
+	udpfromto_mmsg_t	*info;		//!< Buffers and addresses for each packet.
+	uint8_t			*buffer;	//!< num * packet_size bytes of packet data.
+};
+
+/** Allocate a structure for reading batches of UDP packets
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of packets to read in one system call.
+ * @param[in] packet_size	maximum size of each packet.  Larger packets are truncated.
+ * @return
+ *	- A new batch on success.
+ *	- NULL on failure.
+ */
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size)
+{
+	udp_recv_batch_t	*batch;
+	unsigned int		i;
+
+	fr_assert(num > 0);
+	fr_assert(packet_size > 0);
+
+	batch = talloc_zero(ctx, udp_recv_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->packet_size = packet_size;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->info = talloc_zero_array(batch, udpfromto_mmsg_t, num);
+	batch->buffer = talloc_array(batch, uint8_t, num * packet_size);
+	if (!batch->msgvec || !batch->info || !batch->buffer) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->info[i].iov.iov_base = batch->buffer + (i * packet_size);
+		batch->info[i].iov.iov_len = packet_size;
+	}
+
+	return batch;
+}
+
+/** Read as many packets as are available (up to the batch size) with one system call
+ *
+ * Any packets which were previously read, but not yet returned by
+ * #udp_recv_batch_pop, are discarded.
+ *
+ * @param[in] batch	to read packets into.
+ * @param[in] sockfd	to read packets from.  Must not be a connected socket.
+ * @return
+ *	- >= 0 the number of packets read.
+ *	- < 0 on failure.
+ */
+int udp_recv_batch_read(udp_recv_batch_t *batch, int sockfd)
+{
+	int ret;
+
+	fr_assert_msg(batch->next == batch->count, "Discarding %u packets", batch->count - batch->next);
+
+	batch->count = batch->next = 0;
+	batch->sockfd = sockfd;
+
+	ret = recvmmsgfromto(sockfd, batch->msgvec, batch->info, batch->num, MSG_DONTWAIT);
+	if (ret < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+		return ret;
+	}
+
+	batch->count = ret;
+
+	return ret;
+}
+
+/** Return how many packets are still waiting to be returned by #udp_recv_batch_pop
+ *
+ */
+unsigned int udp_recv_batch_pending(udp_recv_batch_t const *batch)
+{
+	return batch->count - batch->next;
+}
+
+/** Return the next packet from a batch
+ *
+ * This function has the same semantics as #udp_recv, but reads the packet
+ * from memory instead of from the socket.
+ *
+ * @param[in] batch		to return the packet from.
+ * @param[out] socket_out	Information about the src/dst address of the packet
+ *				and the interface it was received on.
+ * @param[out] data		pointer where data will be written
+ * @param[in] data_len		length of data to read
+ * @param[out] when		the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there are no more packets in the batch.
+ *	- < 0 on failure.
+ */
+ssize_t udp_recv_batch_pop(udp_recv_batch_t *batch,
+			   fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when)
+{
+	udpfromto_mmsg_t	*info;
+	size_t			len;
+
+	if (batch->next == batch->count) return 0;
+
+	info = &batch->info[batch->next];
+	len = batch->msgvec[batch->next].msg_len;
+	batch->next++;
+
+	if (len > data_len) len = data_len;
+	memcpy(data, info->iov.iov_base, len);
+
+	*socket_out = (fr_socket_t){
+		.fd = batch->sockfd,
+		.proto = IPPROTO_UDP,
+		.inet = {
+			.ifindex = info->ifindex
+		}
+	};
+
+	if (fr_ipaddr_from_sockaddr(&socket_out->inet.src_ipaddr, &socket_out->inet.src_port,
+				    &info->from, info->from_len) < 0) {
+		fr_strerror_const_push("Failed converting src sockaddr to ipaddr");
+		return -1;
+	}
+	if (fr_ipaddr_from_sockaddr(&socket_out->inet.dst_ipaddr, &socket_out->inet.dst_port,
+				    &info->to, info->to_len) < 0) {
+		fr_strerror_const_push("Failed converting dst sockaddr to ipaddr");
+		return -1;
+	}
+
+	if (when) *when = info->when;
+
+	return len;
+}
+
+/** A batch of packets to be written to a socket with one sendmmsg() call
+ *
+ */
+struct udp_send_batch_s {
+	unsigned int		num;		//!< Maximum number of packets to queue.
+	unsigned int		count;		//!< Number of packets currently queued.
+
+	size_t			packet_size;	//!< Maximum size of each packet.
+	int			sockfd;		//!< The socket the packets will be written to.
+
+	fr_time_delta_t		max_delay;	//!< How long the first packet may wait before
+						///< the batch is written.
+	fr_time_t		first;		//!< When the first packet was queued.
+
+	struct mmsghdr		*msgvec;	//!< For sendmmsg().
+	udpfromto_mmsg_t	*info;		//!< Buffers and addresses for each packet.
+	uint8_t			*buffer;	//!< num * packet_size bytes of packet data.
+};
+
+/** Allocate a structure for writing batches of UDP packets
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of packets to write in one system call.
+ * @param[in] packet_size	maximum size of each packet.  Larger packets are written
+ *				immediately, without being queued.
+ * @param[in] max_delay		how long a packet may be queued before #udp_send_batch_ready
+ *				says that the batch should be written.  Zero means that
+ *				the batch is only written when it is full, or when the
+ *				caller explicitly calls #udp_send_batch_flush.
+ * @return
+ *	- A new batch on success.
+ *	- NULL on failure.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size,
+				       fr_time_delta_t max_delay)
+{
+	udp_send_batch_t	*batch;
+	unsigned int		i;
+
+	fr_assert(num > 0);
+	fr_assert(packet_size > 0);
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->packet_size = packet_size;
+	batch->max_delay = max_delay;
+	batch->sockfd = -1;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->info = talloc_zero_array(batch, udpfromto_mmsg_t, num);
+	batch->buffer = talloc_array(batch, uint8_t, num * packet_size);
+	if (!batch->msgvec || !batch->info || !batch->buffer) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->info[i].iov.iov_base = batch->buffer + (i * packet_size);
+	}
+
+	return batch;
+}
+
+/** Write all queued packets to the socket
+ *
+ * Packets which the kernel refuses to send are discarded, the same as
+ * if #udp_send had failed for them.  If the socket buffer is full, the
+ * packets which haven't been written stay queued, and the caller should
+ * call this function again once the socket is writable.
+ *
+ * @param[in] batch	to write.
+ * @return
+ *	- >= 0 the number of packets written.
+ *	- < 0 if any packet could not be written.  errno is EWOULDBLOCK if
+ *	  packets are still queued.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch)
+{
+	unsigned int	sent = 0, i = 0, j;
+	int		ret, error = 0;
+
+	while (i < batch->count) {
+		ret = sendmmsgfromto(batch->sockfd, &batch->msgvec[i], &batch->info[i], batch->count - i, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			error = errno;
+
+			/*
+			 *	The socket buffer is full, there's no
+			 *	point in trying to write any more packets.
+			 */
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) break;
+
+			/*
+			 *	Skip the packet which caused the error,
+			 *	and try the rest.
+			 */
+			i++;
+			continue;
+		}
+
+		sent += ret;
+		i += ret;
+	}
+
+	if ((error == EWOULDBLOCK) || (error == EAGAIN)) {
+		/*
+		 *	Move the packets which weren't written to the
+		 *	front of the batch.  Each entry owns a fixed
+		 *	slot in the buffer, so the data is copied, and
+		 *	the iov_base pointers stay where they are.
+		 */
+		for (j = 0; i < batch->count; i++, j++) {
+			void *iov_base = batch->info[j].iov.iov_base;
+
+			memcpy(iov_base, batch->info[i].iov.iov_base, batch->info[i].iov.iov_len);
+			batch->info[j] = batch->info[i];
+			batch->info[j].iov.iov_base = iov_base;
+		}
+		batch->count = j;
+
+		fr_strerror_printf("Failed writing %u of %u packets: %s",
+				   j, j + sent, fr_syserror(error));
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	if (error) fr_strerror_printf("Failed writing %u of %u packets: %s",
+				      batch->count - sent, batch->count, fr_syserror(error));
+
+	batch->count = 0;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return (int)sent;
+}
+
+/** Add a packet to a batch
+ *
+ * The packet data is copied, so the caller can free it as soon as this
+ * function returns.
+ *
+ * @param[in] batch	to add the packet to.
+ * @param[in] socket	the src/dst addresses of the packet.
+ *			The socket must not be connected.
+ * @param[in] data	to write.
+ * @param[in] data_len	length of data to write.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on failure.  errno is EWOULDBLOCK if queued packets couldn't
+ *	  be written to make room for this one.
+ */
+int udp_send_batch_add(udp_send_batch_t *batch, fr_socket_t const *socket, void *data, size_t data_len)
+{
+	udpfromto_mmsg_t	*info;
+
+	if (unlikely(socket->proto != IPPROTO_UDP)) {
+		fr_strerror_printf("Invalid proto type %u", socket->proto);
+		return -1;
+	}
+
+	/*
+	 *	Keep the packets in order.  If this one doesn't fit,
+	 *	or it's for a different socket, then write out
+	 *	everything which is already queued.
+	 */
+	if ((batch->count > 0) &&
+	    ((batch->count == batch->num) || (socket->fd != batch->sockfd) || (data_len > batch->packet_size))) {
+		(void) udp_send_batch_flush(batch);
+
+		/*
+		 *	The socket buffer is still full.  Don't queue
+		 *	this packet out of order, make the caller retry
+		 *	it once the socket is writable.
+		 */
+		if (batch->count > 0) {
+			errno = EWOULDBLOCK;
+			return -1;
+		}
+	}
+
+	if (data_len > batch->packet_size) return (udp_send(socket, UDP_FLAGS_NONE, data, data_len) < 0) ? -1 : 0;
+
+	info = &batch->info[batch->count];
+
+	if (fr_ipaddr_to_sockaddr(&info->to, &info->to_len,
+				  &socket->inet.dst_ipaddr, socket->inet.dst_port) < 0) return -1;
+	if (fr_ipaddr_to_sockaddr(&info->from, &info->from_len,
+				  &socket->inet.src_ipaddr, socket->inet.src_port) < 0) return -1;
+
+	info->ifindex = socket->inet.ifindex;
+	info->iov.iov_len = data_len;
+	memcpy(info->iov.iov_base, data, data_len);
+
+	if (batch->count == 0) {
+		batch->sockfd = socket->fd;
+		if (fr_time_delta_ispos(batch->max_delay)) batch->first = fr_time();
+	}
+	batch->count++;
+
+	return 0;
+}
+
+/** Return how many packets are queued
+ *
+ */
+unsigned int udp_send_batch_pending(udp_send_batch_t const *batch)
+{
+	return batch->count;
+}
+
+/** Check whether the batch should be written now
+ *
+ * @param[in] batch	to check.
+ * @return
+ *	- true if the batch is full, or the first packet has been queued
+ *	  for longer than max_delay.
+ *	- false otherwise.
+ */
+bool udp_send_batch_ready(udp_send_batch_t const *batch)
+{
+	if (batch->count == 0) return false;
+
+	if (batch->count == batch->num) return true;
+
+	if (!fr_time_delta_ispos(batch->max_delay)) return false;
+
+	return fr_time_delta_gteq(fr_time_sub(fr_time(), batch->first), batch->max_delay);
+}
+
+/** Steer packets in a SO_REUSEPORT group by source IP address
+ *
+ * Attaches a classic BPF program to the reuseport group which sockfd
+ * belongs to.  The program selects socket (src_ipaddr % num), where
+ * sockets are numbered in the order they were bound.  Packets from a
+ * given client therefore always arrive at the same socket, no matter
+ * which source port they use.
+ *
+ * @param[in] sockfd	any bound socket in the group.
+ * @param[in] af	address family of the group, AF_INET or AF_INET6.
+ * @param[in] num	number of sockets in the group.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the platform doesn't support steering.
+ */
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+int udp_reuseport_steer_by_src(int sockfd, int af, unsigned int num)
+{
+	/*
+	 *	For IPv6 we use the low 32 bits of the address.
+	 */
+	struct sock_filter	code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + ((af == AF_INET6) ? 20 : 12)),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog	prog = {
+		.len = NUM_ELEMENTS(code),
+		.filter = code,
+	};
+
+	if ((af != AF_INET) && (af != AF_INET6)) {
+		fr_strerror_printf("Unsupported address family %i", af);
+		return -1;
+	}
+
+	if (num == 0) {
+		fr_strerror_const("Number of sockets must be greater than zero");
+		return -1;
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching reuseport filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int udp_reuseport_steer_by_src(UNUSED int sockfd, UNUSED int af, UNUSED unsigned int num)
+{
+	fr_strerror_const("Steering packets in a reuseport group is not supported on this platform");
+	return -1;
+}
+#endif
@@ -33,6 +33,7 @@ extern "C" {
 #include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/udpfromto.h>
+#include <freeradius-devel/util/talloc.h>
 
 #define UDP_FLAGS_NONE		(0)
 #define UDP_FLAGS_CONNECTED	(1 << 0)
@@ -47,6 +48,32 @@ ssize_t udp_recv_peek(int sockfd, void *data, size_t data_len, int flags, fr_ipa
 ssize_t udp_recv(int sockfd, int flags,
 		 fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when);
 
+typedef struct udp_recv_batch_s udp_recv_batch_t;
+
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size);
+
+int udp_recv_batch_read(udp_recv_batch_t *batch, int sockfd);
+
+unsigned int udp_recv_batch_pending(udp_recv_batch_t const *batch);
+
+ssize_t udp_recv_batch_pop(udp_recv_batch_t *batch,
+			   fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when);
+
+typedef struct udp_send_batch_s udp_send_batch_t;
+
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size,
+				       fr_time_delta_t max_delay);
+
+int udp_send_batch_add(udp_send_batch_t *batch, fr_socket_t const *socket, void *data, size_t data_len);
+
+int udp_send_batch_flush(udp_send_batch_t *batch);
+
+unsigned int udp_send_batch_pending(udp_send_batch_t const *batch);
+
+bool udp_send_batch_ready(udp_send_batch_t const *batch);
+
+int udp_reuseport_steer_by_src(int sockfd, int af, unsigned int num);
+
 #ifdef __cplusplus
 }
 #endif
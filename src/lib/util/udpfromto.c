@@ -156,6 +156,79 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Process the control messages returned by recvmsg()
+ *
+ * @param[in] msgh	as filled in by recvmsg().
+ * @param[out] ifindex	The interface which received the datagram (may be NULL).
+ * @param[out] to	Destination address.  Must be initialised with the local
+ *			address of the socket.
+ * @param[out] to_len	Length of the destination address.
+ * @param[out] when	the packet was received (may be NULL).
+ */
+static void recvfromto_cmsg(struct msghdr *msgh, int *ifindex,
+			    struct sockaddr *to, socklen_t *to_len, fr_time_t *when)
+{
+	struct cmsghdr		*cmsg;
+
+/*
+ *	Needed for emscripten, seems to be an issue in CMSG_NXTHDR
+ */
+DIAG_OFF(sign-compare)
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+DIAG_ON(sign-compare)
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (ifindex) *ifindex = i->ipi_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (ifindex) *ifindex = i->ipi6_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
+		}
+#endif
+	}
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -190,7 +263,6 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       fr_time_t *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
 	char			cbuf[256];
 	int			ret;
@@ -296,133 +368,168 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	if (ifindex) *ifindex = 0;
 	if (when) *when = fr_time_wrap(0);
 
-/*
- *	Needed for emscripten, seems to be an issue in CMSG_NXTHDR
- */
-DIAG_OFF(sign-compare)
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-DIAG_ON(sign-compare)
+	recvfromto_cmsg(&msgh, ifindex, to, to_len, when);
 
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+	if (when && fr_time_eq(*when, fr_time_wrap(0))) *when = fr_time();
 
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
+	return ret;
+}
 
-			if (ifindex) *ifindex = i->ipi_ifindex;
+/** Read multiple packets from a file descriptor with one system call
+ *
+ * This is the recvmmsg() equivalent of #recvfromto.  The caller sets up
+ * info[i].iov to point to the buffer for each datagram, and this function
+ * takes care of the rest of the msghdr structures.
+ *
+ * The local address of the socket is looked up once per call, instead of
+ * once per packet.  If the kernel doesn't provide a timestamp for a packet,
+ * all packets in the batch get the same time.
+ *
+ * @param[in] fd	The file descriptor to read from.
+ * @param[in] msgvec	Array of vlen mmsghdr structures.  Will be initialised
+ *			by this function.
+ * @param[in,out] info	Array of vlen structures describing where to write each
+ *			packet, and which receive the address information for each
+ *			packet.
+ * @param[in] vlen	Maximum number of packets to read.
+ * @param[in] flags	passed unmolested to recvmmsg.
+ * @return
+ *	- >= 0 the number of packets read.  msgvec[i].msg_len contains the length of each packet.
+ *	- -1 on failure.
+ */
+int recvmmsgfromto(int fd, struct mmsghdr *msgvec, udpfromto_mmsg_t *info, unsigned int vlen, int flags)
+{
+	struct sockaddr_storage	si;
+	socklen_t		si_len = sizeof(si);
+	unsigned int		i;
+	int			ret;
+	fr_time_t		now = fr_time_wrap(0);
 
-			break;
-		}
+#ifdef STATIC_ANALYZER
+	memset(&si, 0, sizeof(si));
 #endif
 
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in *)to)->sin_addr = *i;
+	/*
+	 *	recvmsg doesn't provide sin_port so we have to
+	 *	retrieve it using getsockname().
+	 */
+	if (getsockname(fd, (struct sockaddr *)&si, &si_len) < 0) return -1;
 
-			*to_len = sizeof(struct sockaddr_in);
+	if ((si.ss_family != AF_INET) && (si.ss_family != AF_INET6)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-			break;
-		}
-#endif
+	for (i = 0; i < vlen; i++) {
+		struct msghdr *msgh = &msgvec[i].msg_hdr;
 
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		info[i].from_len = sizeof(info[i].from);
 
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
+		memset(msgh, 0, sizeof(*msgh));
+		msgh->msg_name = &info[i].from;
+		msgh->msg_namelen = info[i].from_len;
+		msgh->msg_iov = &info[i].iov;
+		msgh->msg_iovlen = 1;
+		msgh->msg_control = info[i].cbuf;
+		msgh->msg_controllen = sizeof(info[i].cbuf);
+		msgvec[i].msg_len = 0;
+	}
 
-			if (ifindex) *ifindex = i->ipi6_ifindex;
+#ifdef HAVE_RECVMMSG
+	ret = recvmmsg(fd, msgvec, vlen, flags, NULL);
+	if (ret <= 0) return ret;
+#else
+	/*
+	 *	No recvmmsg(), so emulate it.  Only the first read may
+	 *	block, and we stop at the first read which returns no data.
+	 */
+	for (ret = 0; (unsigned int)ret < vlen; ret++) {
+		ssize_t slen;
 
+		slen = recvmsg(fd, &msgvec[ret].msg_hdr, (ret == 0) ? flags : (flags | MSG_DONTWAIT));
+		if (slen < 0) {
+			if (ret == 0) return -1;
 			break;
 		}
+		msgvec[ret].msg_len = slen;
+	}
 #endif
 
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
+	for (i = 0; i < (unsigned int)ret; i++) {
+		/*
+		 *	Initialize the 'to' address.  It may be INADDR_ANY here,
+		 *	with a more specific address given by the control
+		 *	messages.
+		 */
+		memcpy(&info[i].to, &si, si_len);
+		info[i].to_len = si_len;
+		info[i].from_len = msgvec[i].msg_hdr.msg_namelen;
+		info[i].ifindex = 0;
+		info[i].when = fr_time_wrap(0);
+
+		recvfromto_cmsg(&msgvec[i].msg_hdr, &info[i].ifindex,
+				(struct sockaddr *)&info[i].to, &info[i].to_len, &info[i].when);
+
+		if (fr_time_eq(info[i].when, fr_time_wrap(0))) {
+			if (fr_time_eq(now, fr_time_wrap(0))) now = fr_time();
+			info[i].when = now;
 		}
-#endif
 	}
 
-	if (when && fr_time_eq(*when, fr_time_wrap(0))) *when = fr_time();
-
 	return ret;
 }
 
-/** Send packet via a file descriptor, setting the src address and outbound interface
+#ifdef __FreeBSD__
+/** Check whether a socket is bound to a specific address
  *
- * Abstracts away the complexity of using the complexity of using sendmsg().
+ * FreeBSD is extra pedantic about the use of IP_SENDSRCADDR,
+ * and sendmsg will fail with EINVAL if IP_SENDSRCADDR is used
+ * with a socket which is bound to something other than
+ * INADDR_ANY
  *
- * @param[in] fd	The file descriptor to write to.
- * @param[in] buf	Where to read datagram data from.
- * @param[in] len	of datagram data.
- * @param[in] flags	passed unmolested to sendmsg.
- * @param[in] ifindex	The interface on which to send the datagram.
- *			If automatic interface selection is desired, value should be 0.
- * @param[in] from	The source address.
- * @param[in] from_len	Length of the structure pointed to by from.
- * @param[in] to	The destination address.
- * @param[in] to_len	Length of the structure pointed to by to.
+ * @param[in] fd	to check.
  * @return
- *	- 0 on success.
+ *	- 1 if the socket is bound to a specific address.
+ *	- 0 if the socket is bound to INADDR_ANY or ::.
  *	- -1 on failure.
  */
-int sendfromto(int fd, void *buf, size_t len, int flags,
-	       int ifindex,
-	       struct sockaddr *from, socklen_t from_len,
-	       struct sockaddr *to, socklen_t to_len)
+static int sendfromto_bound_specific(int fd)
 {
-	struct msghdr	msgh;
-	struct iovec	iov;
-	char		cbuf[256];
-
-	/*
-	 *	Unknown address family, die.
-	 */
-	if (from && (from->sa_family != AF_INET) && (from->sa_family != AF_INET6)) {
-		errno = EINVAL;
-		return -1;
-	}
-
-#ifdef __FreeBSD__
-	/*
-	 *	FreeBSD is extra pedantic about the use of IP_SENDSRCADDR,
-	 *	and sendmsg will fail with EINVAL if IP_SENDSRCADDR is used
-	 *	with a socket which is bound to something other than
-	 *	INADDR_ANY
-	 */
-	struct sockaddr bound;
+	struct sockaddr_storage bound;
 	socklen_t bound_len = sizeof(bound);
 
-	if (getsockname(fd, &bound, &bound_len) < 0) {
+	if (getsockname(fd, (struct sockaddr *) &bound, &bound_len) < 0) {
 		return -1;
 	}
 
-	switch (bound.sa_family) {
+	switch (bound.ss_family) {
 	case AF_INET:
-		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) {
-			from = NULL;
-		}
+		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) return 1;
 		break;
 
 	case AF_INET6:
-		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) {
-			from = NULL;
-		}
+		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) return 1;
 		break;
 	}
+
+	return 0;
+}
 #endif	/* !__FreeBSD__ */
 
+/** Add the control messages which set the source address and interface of an outgoing packet
+ *
+ * If no control messages are needed, msgh->msg_control is left as NULL.
+ *
+ * @param[in] msgh	to add the control messages to.
+ * @param[in] cbuf	buffer for the control messages.
+ * @param[in] cbuf_len	length of cbuf.
+ * @param[in] ifindex	The interface on which to send the datagram.
+ * @param[in] from	The source address.
+ * @param[in] from_len	Length of the structure pointed to by from.
+ */
+static void sendfromto_cmsg(struct msghdr *msgh, char *cbuf, size_t cbuf_len,
+			    int ifindex, struct sockaddr *from, socklen_t from_len)
+{
 	/*
 	 *	If the sendmsg() flags aren't defined, fall back to
 	 *	using sendto().  These flags are defined on FreeBSD,
@@ -438,7 +545,8 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 #  endif
 
 	/*
-	 *	No "from" or "from" is 0.0.0.0 or ::/0, just use regular sendto.
+	 *	No "from" or "from" is 0.0.0.0 or ::/0, don't add any
+	 *	control messages.
 	 */
 	if (!from || (from_len == 0) ||
 		(from->sa_family == AF_INET &&
@@ -446,19 +554,9 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		(from->sa_family == AF_INET6 &&
 			IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) from)->sin6_addr))
 	)
-		return sendto(fd, buf, len, flags, to, to_len);
-
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
+		return;
 
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = to_len;
+	memset(cbuf, 0, cbuf_len);
 
 # if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 	if (from->sa_family == AF_INET) {
@@ -468,10 +566,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -485,10 +583,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -506,10 +604,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -520,10 +618,140 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		pkt->ipi6_ifindex = ifindex;
 	}
 #  endif	/* IPV6_PKTINFO */
+}
+
+/** Send packet via a file descriptor, setting the src address and outbound interface
+ *
+ * Abstracts away the complexity of using the complexity of using sendmsg().
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in] buf	Where to read datagram data from.
+ * @param[in] len	of datagram data.
+ * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] ifindex	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ * @param[in] from	The source address.
+ * @param[in] from_len	Length of the structure pointed to by from.
+ * @param[in] to	The destination address.
+ * @param[in] to_len	Length of the structure pointed to by to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sendfromto(int fd, void *buf, size_t len, int flags,
+	       int ifindex,
+	       struct sockaddr *from, socklen_t from_len,
+	       struct sockaddr *to, socklen_t to_len)
+{
+	struct msghdr	msgh;
+	struct iovec	iov;
+	char		cbuf[256];
+
+	/*
+	 *	Unknown address family, die.
+	 */
+	if (from && (from->sa_family != AF_INET) && (from->sa_family != AF_INET6)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef __FreeBSD__
+	switch (sendfromto_bound_specific(fd)) {
+	case -1:
+		return -1;
+
+	case 1:
+		from = NULL;
+		break;
+
+	default:
+		break;
+	}
+#endif	/* !__FreeBSD__ */
+
+	/* Set up control buffer iov and msgh structures. */
+	memset(&msgh, 0, sizeof(msgh));
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = to_len;
+
+	sendfromto_cmsg(&msgh, cbuf, sizeof(cbuf), ifindex, from, from_len);
+
+	/*
+	 *	No source address to set, just use regular sendto.
+	 */
+	if (!msgh.msg_control) return sendto(fd, buf, len, flags, to, to_len);
 
 	return sendmsg(fd, &msgh, flags);
 }
 
+/** Send multiple packets via a file descriptor with one system call
+ *
+ * This is the sendmmsg() equivalent of #sendfromto.  For each packet, the
+ * caller fills in info[i].iov, info[i].from (the source address, which may
+ * be zero length), info[i].to (the destination address) and info[i].ifindex.
+ * This function takes care of setting up the msghdr structures.
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in] msgvec	Array of vlen mmsghdr structures.  Will be initialised
+ *			by this function.
+ * @param[in] info	Array of vlen structures describing each packet.
+ * @param[in] vlen	Number of packets to send.
+ * @param[in] flags	passed unmolested to sendmmsg.
+ * @return
+ *	- >= 0 the number of packets sent.
+ *	- -1 on failure.
+ */
+int sendmmsgfromto(int fd, struct mmsghdr *msgvec, udpfromto_mmsg_t *info, unsigned int vlen, int flags)
+{
+	unsigned int	i;
+	bool		use_from = true;
+
+#ifdef __FreeBSD__
+	switch (sendfromto_bound_specific(fd)) {
+	case -1:
+		return -1;
+
+	case 1:
+		use_from = false;
+		break;
+
+	default:
+		break;
+	}
+#endif	/* !__FreeBSD__ */
+
+	for (i = 0; i < vlen; i++) {
+		struct msghdr	*msgh = &msgvec[i].msg_hdr;
+		struct sockaddr	*from = (struct sockaddr *) &info[i].from;
+
+		/*
+		 *	Unknown address family, die.
+		 */
+		if ((info[i].from_len > 0) && (from->sa_family != AF_INET) && (from->sa_family != AF_INET6)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		memset(msgh, 0, sizeof(*msgh));
+		msgh->msg_iov = &info[i].iov;
+		msgh->msg_iovlen = 1;
+		msgh->msg_name = &info[i].to;
+		msgh->msg_namelen = info[i].to_len;
+		msgvec[i].msg_len = 0;
+
+		if (use_from) sendfromto_cmsg(msgh, info[i].cbuf, sizeof(info[i].cbuf),
+					      info[i].ifindex, from, info[i].from_len);
+	}
+
+	return sendmmsg(fd, msgvec, vlen, flags);
+}
+
 
 #ifdef TESTING
 /*
@@ -37,6 +37,28 @@ extern "C" {
 #include <stddef.h>
 #include <stdlib.h>
 
+#ifdef HAVE_SYS_UIO_H
+#  include <sys/uio.h>
+#endif
+
+/** Per-packet buffers and address information for recvmmsgfromto() and sendmmsgfromto()
+ *
+ */
+typedef struct {
+	struct iovec		iov;		//!< Where the packet data is read from / written to.
+						///< Set by the caller.
+
+	struct sockaddr_storage	from;		//!< Source address of the packet.
+	socklen_t		from_len;	//!< Length of the source address.
+	struct sockaddr_storage	to;		//!< Destination address of the packet.
+	socklen_t		to_len;		//!< Length of the destination address.
+	int			ifindex;	//!< Interface the packet was received on,
+						///< or should be sent on.
+	fr_time_t		when;		//!< When the packet was received.
+
+	char			cbuf[256];	//!< Control messages (IP_PKTINFO, SO_TIMESTAMP).
+} udpfromto_mmsg_t;
+
 int	udpfromto_init(int s);
 
 int	recvfromto(int s, void *buf, size_t len, int flags,
@@ -45,10 +67,14 @@ int	recvfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *to, socklen_t *tolen,
 		   fr_time_t *when);
 
+int	recvmmsgfromto(int fd, struct mmsghdr *msgvec, udpfromto_mmsg_t *info, unsigned int vlen, int flags);
+
 int	sendfromto(int s, void *buf, size_t len, int flags,
 		   int ifindex,
 		   struct sockaddr *from, socklen_t fromlen,
 		   struct sockaddr *to, socklen_t tolen);
+
+int	sendmmsgfromto(int fd, struct mmsghdr *msgvec, udpfromto_mmsg_t *info, unsigned int vlen, int flags);
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,8 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*batch;			//!< for reading multiple packets at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv4_udp_thread_t;
 
@@ -57,6 +59,8 @@ typedef struct {
 
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 
+	uint32_t			recv_batch;		//!< How many packets to read with one system call.
+
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
@@ -96,6 +100,7 @@ static const CONF_PARSER udp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_dhcpv4_udp_t, port) },
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_dhcpv4_udp_t, recv_buff) },
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_dhcpv4_udp_t, recv_batch), .dflt = "1" },
 
 	{ FR_CONF_OFFSET("broadcast", FR_TYPE_BOOL, proto_dhcpv4_udp_t, broadcast) } ,
 
@@ -153,7 +158,17 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (thread->batch) {
+		if (!udp_recv_batch_pending(thread->batch) &&
+		    (udp_recv_batch_read(thread->batch, thread->sockfd) < 0)) {
+			RATE_LIMIT_GLOBAL(PERROR, "Read error");
+			return -1;
+		}
+
+		data_size = udp_recv_batch_pop(thread->batch, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
 		return data_size;
@@ -201,6 +216,20 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+static unsigned int mod_read_batch(fr_listen_t *li, bool refill)
+{
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	/*
+	 *	Errors are returned by the next call to mod_read().
+	 */
+	if (refill && !udp_recv_batch_pending(thread->batch)) (void) udp_recv_batch_read(thread->batch, thread->sockfd);
+
+	return udp_recv_batch_pending(thread->batch);
+}
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -558,6 +587,19 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Connected sockets are set up via mod_fd_set(), and
+	 *	always read one packet at a time.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			ERROR("Failed allocating receive batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dhcpv4_udp,
@@ -714,6 +756,9 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, MIN_PACKET_SIZE);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -827,6 +872,7 @@ fr_app_io_t proto_dhcpv4_udp = {
 
 	.open			= mod_open,
 	.read			= mod_read,
+	.read_batch		= mod_read_batch,
 	.write			= mod_write,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
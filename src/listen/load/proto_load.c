@@ -176,9 +176,15 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 
 /*
  *	We don't need to encode any of the replies.  We just go "yeah, it's fine".
+ *
+ *	Unless the app_io wants to see something of the reply.
  */
-static ssize_t mod_encode(UNUSED void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
+static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
 {
+	proto_load_t const	*inst = talloc_get_type_abort_const(instance, proto_load_t);
+
+	if (inst->io.app_io->encode) return inst->io.app_io->encode(inst->io.app_io_instance, request, buffer, buffer_len);
+
 	if (buffer_len < 1) return -1;
 
 	*buffer = request->reply->code;
@@ -37,6 +37,42 @@ extern fr_app_io_t proto_load_step;
 
 typedef struct proto_load_step_s proto_load_step_t;
 
+/** What mod_read() passes to mod_decode(), and mod_encode() passes back to mod_write()
+ *
+ *  Any State for the next round of the conversation follows the header.
+ */
+typedef struct {
+	uint16_t			scenario;		//!< index into proto_load_step_t.scenario
+	uint16_t			round;			//!< of the conversation, starting from zero
+	uint32_t			nas;			//!< index of the NAS sending the packet
+} proto_load_step_hdr_t;
+
+/** A conversation which is waiting to send its next packet
+ *
+ */
+typedef struct {
+	fr_dlist_t			entry;			//!< in the thread list
+	proto_load_step_hdr_t		hdr;			//!< for the next packet
+	uint8_t				*state;			//!< from the last reply
+	size_t				state_len;
+} proto_load_step_next_t;
+
+/** A weighted set of packets to send
+ *
+ *  Each filename is one round of a conversation.  When the reply to
+ *  one round contains a State attribute, the next round is sent with
+ *  that State.
+ */
+typedef struct {
+	char const			**filename;		//!< input packet for each round
+	uint32_t			weight;			//!< how often this scenario is picked
+	uint32_t			num_nas;		//!< how many NASes the packets come from
+	fr_ipaddr_t			nas_ipaddr;		//!< address of the first NAS
+
+	fr_pair_list_t			*pair_list;		//!< input packet for each round
+	uint32_t			*code;			//!< packet code for each round
+} proto_load_step_scenario_t;
+
 typedef struct {
 	fr_event_list_t			*el;			//!< event list
 	fr_network_t			*nr;			//!< network handler
@@ -53,8 +89,13 @@ typedef struct {
 	fr_stats_t			stats;			//!< statistics for this socket
 
 	int				fd;			//!< for CSV files
+	int				json_fd;		//!< for JSON files
 	fr_event_timer_t const		*ev;			//!< for writing statistics
 
+	fr_dlist_head_t			next;			//!< conversations waiting to send their next packet
+	proto_load_step_next_t		*pending;		//!< the packet mod_read() should send
+	fr_event_timer_t const		*next_ev;		//!< for sending the next packets
+
 	fr_listen_t			*parent;		//!< master IO handler
 } proto_load_step_thread_t;
 
@@ -64,9 +105,13 @@ struct proto_load_step_s {
 	CONF_SECTION			*cs;			//!< our configuration
 
 	char const     			*filename;		//!< where to read input packet from
-	fr_pair_list_t			pair_list;		//!< for input packet
 
-	int				code;
+	proto_load_step_scenario_t	**scenario;		//!< what packets to send
+	uint32_t			total_weight;		//!< of all scenarios
+
+	fr_dict_attr_t const		*attr_state;		//!< for conversations
+	fr_dict_attr_t const		*attr_nas_ip_address;	//!< for spreading packets across NASes
+
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes
 
 	fr_client_t			*client;		//!< static client
@@ -74,12 +119,26 @@ struct proto_load_step_s {
 	fr_load_config_t		load;			//!< load configuration
 	bool				repeat;			//!, do we repeat the load generation
 	char const     			*csv;			//!< where to write CSV stats
+	char const     			*json;			//!< where to write JSON stats
 };
 
+static const CONF_PARSER scenario_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_MULTI | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, proto_load_step_scenario_t, filename) },
+	{ FR_CONF_OFFSET("weight", FR_TYPE_UINT32, proto_load_step_scenario_t, weight), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("nas_ipaddr", FR_TYPE_IPV4_ADDR, proto_load_step_scenario_t, nas_ipaddr) },
+	{ FR_CONF_OFFSET("num_nas", FR_TYPE_UINT32, proto_load_step_scenario_t, num_nas), .dflt = "1" },
+
+	CONF_PARSER_TERMINATOR
+};
 
 static const CONF_PARSER load_listen_config[] = {
-	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, proto_load_step_t, filename) },
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_NOT_EMPTY, proto_load_step_t, filename) },
+	{ FR_CONF_SUBSECTION_ALLOC("scenario", FR_TYPE_SUBSECTION | FR_TYPE_MULTI | FR_TYPE_OK_MISSING,
+				   proto_load_step_t, scenario, scenario_config) },
+
 	{ FR_CONF_OFFSET("csv", FR_TYPE_STRING, proto_load_step_t, csv) },
+	{ FR_CONF_OFFSET("json", FR_TYPE_STRING, proto_load_step_t, json) },
 
 	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_load_step_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
@@ -100,6 +159,10 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	proto_load_step_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_load_step_t);
 	proto_load_step_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_step_thread_t);
 	fr_io_address_t			*address, **address_p;
+	proto_load_step_scenario_t const *scenario;
+	proto_load_step_hdr_t		hdr;
+	uint8_t const			*state = NULL;
+	size_t				state_len = 0;
 
 	if (thread->done) return -1;
 
@@ -137,27 +200,113 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 
 	*recv_time_p = thread->recv_time;
 
-	if (buffer_len < 1) {
+	/*
+	 *	Either continue a conversation, or start a new one.
+	 */
+	if (thread->pending) {
+		hdr = thread->pending->hdr;
+		state = thread->pending->state;
+		state_len = thread->pending->state_len;
+
+	} else {
+		uint32_t weight = fr_rand() % inst->total_weight;
+
+		memset(&hdr, 0, sizeof(hdr));
+
+		while (weight >= inst->scenario[hdr.scenario]->weight) {
+			weight -= inst->scenario[hdr.scenario]->weight;
+			hdr.scenario++;
+		}
+
+		if (inst->scenario[hdr.scenario]->num_nas > 1) hdr.nas = fr_rand() % inst->scenario[hdr.scenario]->num_nas;
+	}
+	scenario = inst->scenario[hdr.scenario];
+
+	/*
+	 *	Each NAS gets its own source address.
+	 */
+	if (scenario->nas_ipaddr.af == AF_INET) {
+		address->socket.inet.src_ipaddr = scenario->nas_ipaddr;
+		address->socket.inet.src_ipaddr.addr.v4.s_addr = htonl(ntohl(scenario->nas_ipaddr.addr.v4.s_addr) + hdr.nas);
+	}
+
+	if (buffer_len < (sizeof(hdr) + state_len)) {
 		DEBUG2("proto_load_step read buffer is too small for input packet");
 		return 0;
 	}
 
-	buffer[0] = 0;
+	memcpy(buffer, &hdr, sizeof(hdr));
+	if (state_len) memcpy(buffer + sizeof(hdr), state, state_len);
 
 	/*
 	 *	Print out what we received.
 	 */
-	DEBUG2("proto_load_step - reading packet for %s",
-	       thread->name);
+	DEBUG2("proto_load_step - reading packet for %s, round %u of %s",
+	       thread->name, (unsigned int) hdr.round + 1, scenario->filename[0]);
+
+	return sizeof(hdr) + state_len;
+}
+
+/** Send the next packet of any conversations which got a reply
+ *
+ */
+static void load_step_send_next(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	proto_load_step_thread_t	*thread = talloc_get_type_abort(uctx, proto_load_step_thread_t);
+	proto_load_step_next_t		*next;
 
-	return 1;
+	while ((next = fr_dlist_head(&thread->next)) != NULL) {
+		fr_dlist_remove(&thread->next, next);
+
+		thread->pending = next;
+		thread->recv_time = now;
+
+		fr_network_listen_read(thread->nr, thread->parent);
+
+		thread->pending = NULL;
+		talloc_free(next);
+	}
+}
+
+/** Queue the next round of a conversation
+ *
+ *  We're called from the write path, so the packet is sent from a
+ *  timer, and not from here.
+ */
+static int load_step_next(proto_load_step_thread_t *thread, proto_load_step_hdr_t const *hdr,
+			  uint8_t const *state, size_t state_len)
+{
+	proto_load_step_next_t *next;
+
+	next = talloc_zero(thread, proto_load_step_next_t);
+	if (!next) return -1;
+
+	next->hdr = *hdr;
+	next->hdr.round++;
+	next->state = talloc_memdup(next, state, state_len);
+	if (!next->state) {
+		talloc_free(next);
+		return -1;
+	}
+	next->state_len = state_len;
+
+	if (!thread->next_ev &&
+	    (fr_event_timer_in(thread, thread->el, &thread->next_ev, fr_time_delta_wrap(0),
+			       load_step_send_next, thread) < 0)) {
+		talloc_free(next);
+		return -1;
+	}
+
+	fr_dlist_insert_tail(&thread->next, next);
+	return 0;
 }
 
 
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t request_time,
-			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
 	proto_load_step_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_step_thread_t);
+	proto_load_step_hdr_t		hdr;
 	fr_load_reply_t state;
 
 	/*
@@ -167,6 +316,20 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 */
 	thread->stats.total_responses++;
 
+	/*
+	 *	The reply has a State, so there's another round of
+	 *	the conversation to send.  The conversation is still
+	 *	outstanding as far as the load generator is concerned.
+	 */
+	if (buffer_len > sizeof(hdr)) {
+		memcpy(&hdr, buffer, sizeof(hdr));
+
+		if (load_step_next(thread, &hdr, buffer + sizeof(hdr), buffer_len - sizeof(hdr)) == 0) {
+			fr_load_generator_have_partial_reply(thread->l, request_time);
+			return buffer_len;
+		}
+	}
+
 	/*
 	 *	Tell the load generatopr subsystem that we have a
 	 *	reply.  Then if the load test is done, exit the
@@ -200,7 +363,7 @@ static int mod_open(fr_listen_t *li)
 	 *	We never read or write to this file, but we need a
 	 *	readable FD in order to bootstrap the process.
 	 */
-	li->fd = open(inst->filename, O_RDONLY);
+	li->fd = open(inst->scenario[0]->filename[0], O_RDONLY);
 
 	memset(&ipaddr, 0, sizeof(ipaddr));
 	ipaddr.af = AF_INET;
@@ -208,7 +371,7 @@ static int mod_open(fr_listen_t *li)
 
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
-	thread->name = talloc_typed_asprintf(thread, "load_step from filename %s", inst->filename);
+	thread->name = talloc_typed_asprintf(thread, "load_step from filename %s", inst->scenario[0]->filename[0]);
 	thread->parent = talloc_parent(li);
 
 	return 0;
@@ -242,9 +405,18 @@ static void write_stats(fr_event_list_t *el, fr_time_t now, void *uctx)
 
 	(void) fr_event_timer_in(thread, el, &thread->ev, fr_time_delta_from_sec(1), write_stats, thread);
 
-	len = fr_load_generator_stats_sprint(thread->l, now, buffer, sizeof(buffer));
-	if (write(thread->fd, buffer, len) < 0) {
-		DEBUG("Failed writing to %s - %s", thread->inst->csv, fr_syserror(errno));
+	if (thread->fd >= 0) {
+		len = fr_load_generator_stats_sprint(thread->l, now, buffer, sizeof(buffer));
+		if (write(thread->fd, buffer, len) < 0) {
+			DEBUG("Failed writing to %s - %s", thread->inst->csv, fr_syserror(errno));
+		}
+	}
+
+	if (thread->json_fd >= 0) {
+		len = fr_load_generator_stats_json_sprint(thread->l, now, buffer, sizeof(buffer));
+		if (write(thread->json_fd, buffer, len) < 0) {
+			DEBUG("Failed writing to %s - %s", thread->inst->json, fr_syserror(errno));
+		}
 	}
 }
 
@@ -252,11 +424,22 @@ static void write_stats(fr_event_list_t *el, fr_time_t now, void *uctx)
 /** Decode the packet
  *
  */
-static int mod_decode(void const *instance, request_t *request, UNUSED uint8_t *const data, UNUSED size_t data_len)
+static int mod_decode(void const *instance, request_t *request, uint8_t *const data, size_t data_len)
 {
 	proto_load_step_t const	*inst = talloc_get_type_abort_const(instance, proto_load_step_t);
 	fr_io_track_t const	*track = talloc_get_type_abort_const(request->async->packet_ctx, fr_io_track_t);
 	fr_io_address_t const  	*address = track->address;
+	proto_load_step_scenario_t const *scenario;
+	proto_load_step_hdr_t	hdr;
+	fr_pair_t		*vp;
+
+	if (data_len < sizeof(hdr)) return -1;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.scenario >= talloc_array_length(inst->scenario)) return -1;
+
+	scenario = inst->scenario[hdr.scenario];
+	if (hdr.round >= talloc_array_length(scenario->filename)) return -1;
 
 	/*
 	 *	Set the request dictionary so that we can do
@@ -268,20 +451,35 @@ static int mod_decode(void const *instance, request_t *request, UNUSED uint8_t *
 	/*
 	 *	Hacks for now until we have a lower-level decode routine.
 	 */
-	if (inst->code) request->packet->code = inst->code;
+	if (scenario->code[hdr.round]) request->packet->code = scenario->code[hdr.round];
 	request->packet->id = fr_rand() & 0xff;
 	request->reply->id = request->packet->id;
 	memset(request->packet->vector, 0, sizeof(request->packet->vector));
 
-	request->packet->data = talloc_zero_array(request->packet, uint8_t, 1);
-	request->packet->data_len = 1;
+	/*
+	 *	Keep the header, so that mod_encode() can tell
+	 *	mod_write() which conversation the reply is for.
+	 */
+	request->packet->data = talloc_memdup(request->packet, data, data_len);
+	request->packet->data_len = data_len;
 
 	/*
 	 *	Note that we don't set a limit on max_attributes here.
 	 *	That MUST be set and checked in the underlying
 	 *	transport, via a call to fr_radius_ok().
 	 */
-	(void) fr_pair_list_copy(request->request_ctx, &request->request_pairs, &inst->pair_list);
+	(void) fr_pair_list_copy(request->request_ctx, &request->request_pairs, &scenario->pair_list[hdr.round]);
+
+	if ((data_len > sizeof(hdr)) &&
+	    (fr_pair_find_or_append_by_da(request->request_ctx, &vp, &request->request_pairs, inst->attr_state) >= 0)) {
+		(void) fr_pair_value_memdup(vp, data + sizeof(hdr), data_len - sizeof(hdr), true);
+	}
+
+	if ((scenario->nas_ipaddr.af == AF_INET) && inst->attr_nas_ip_address &&
+	    (fr_pair_find_or_append_by_da(request->request_ctx, &vp, &request->request_pairs,
+					  inst->attr_nas_ip_address) >= 0)) {
+		vp->vp_ipv4addr = address->socket.inet.src_ipaddr.addr.v4.s_addr;
+	}
 
 	/*
 	 *	Set the rest of the fields.
@@ -296,6 +494,32 @@ static int mod_decode(void const *instance, request_t *request, UNUSED uint8_t *
 	return 0;
 }
 
+/** Encode the reply
+ *
+ *  We don't need the reply itself.  We just tell mod_write() which
+ *  conversation the reply is for, along with the State if there is
+ *  another round to send.
+ */
+static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
+{
+	proto_load_step_t const	*inst = talloc_get_type_abort_const(instance, proto_load_step_t);
+	proto_load_step_hdr_t	hdr;
+	fr_pair_t		*vp;
+
+	if ((buffer_len < sizeof(hdr)) || (request->packet->data_len < sizeof(hdr))) return -1;
+
+	memcpy(&hdr, request->packet->data, sizeof(hdr));
+	memcpy(buffer, &hdr, sizeof(hdr));
+
+	if ((hdr.round + 1U) >= talloc_array_length(inst->scenario[hdr.scenario]->filename)) return sizeof(hdr);
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, inst->attr_state);
+	if (!vp || !vp->vp_length || (vp->vp_length > (buffer_len - sizeof(hdr)))) return sizeof(hdr);
+
+	memcpy(buffer + sizeof(hdr), vp->vp_octets, vp->vp_length);
+	return sizeof(hdr) + vp->vp_length;
+}
+
 /** Set the event list for a new socket
  *
  * @param[in] li the listener
@@ -313,26 +537,34 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	thread->nr = nr;
 	thread->inst = inst;
 	thread->load = inst->load;
+	thread->fd = thread->json_fd = -1;
+	fr_dlist_talloc_init(&thread->next, proto_load_step_next_t, entry);
 
 	thread->l = fr_load_generator_create(thread, el, &thread->load, mod_generate, li);
 	if (!thread->l) return;
 
 	(void) fr_load_generator_start(thread->l);
 
-	if (!inst->csv) return;
+	if (inst->csv) {
+		thread->fd = open(inst->csv, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (thread->fd < 0) {
+			ERROR("Failed opening %s - %s", inst->csv, fr_syserror(errno));
+		} else {
+			len = fr_load_generator_stats_sprint(thread->l, fr_time(), buffer, sizeof(buffer));
+			if (write(thread->fd, buffer, len) < 0) {
+				DEBUG("Failed writing to %s - %s", thread->inst->csv, fr_syserror(errno));
+			}
+		}
+	}
 
-	thread->fd = open(inst->csv, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
-	if (thread->fd < 0) {
-		ERROR("Failed opening %s - %s", inst->csv, fr_syserror(errno));
-		return;
+	if (inst->json) {
+		thread->json_fd = open(inst->json, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (thread->json_fd < 0) ERROR("Failed opening %s - %s", inst->json, fr_syserror(errno));
 	}
 
-	(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_sec(1), write_stats, thread);
+	if ((thread->fd < 0) && (thread->json_fd < 0)) return;
 
-	len = fr_load_generator_stats_sprint(thread->l, fr_time(), buffer, sizeof(buffer));
-	if (write(thread->fd, buffer, len) < 0) {
-		DEBUG("Failed writing to %s - %s", thread->inst->csv, fr_syserror(errno));
-	}
+	(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_sec(1), write_stats, thread);
 }
 
 static char const *mod_name(fr_listen_t *li)
@@ -348,6 +580,7 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	proto_load_step_t	*inst = talloc_get_type_abort(mctx->inst->data, proto_load_step_t);
 	CONF_SECTION		*conf = mctx->inst->conf;
 	dl_module_inst_t const	*dl_inst;
+	size_t			i;
 
 	/*
 	 *	Find the dl_module_inst_t holding our instance data
@@ -379,6 +612,53 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, >=, 1);
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, <, 100000);
 
+	/*
+	 *	A plain "filename" is the same as one scenario which
+	 *	sends one packet.
+	 */
+	if (inst->filename) {
+		proto_load_step_scenario_t *scenario;
+
+		if (inst->scenario) {
+			cf_log_err(conf, "Cannot use both 'filename' and 'scenario'");
+			return -1;
+		}
+
+		MEM(inst->scenario = talloc_array(inst, proto_load_step_scenario_t *, 1));
+		MEM(inst->scenario[0] = scenario = talloc_zero(inst->scenario, proto_load_step_scenario_t));
+		MEM(scenario->filename = talloc_array(scenario, char const *, 1));
+		scenario->filename[0] = inst->filename;
+		scenario->weight = 1;
+		scenario->num_nas = 1;
+
+	} else if (!inst->scenario) {
+		cf_log_err(conf, "Must set 'filename', or define one or more 'scenario' sections");
+		return -1;
+	}
+
+	if (talloc_array_length(inst->scenario) > UINT16_MAX) {
+		cf_log_err(conf, "Too many 'scenario' sections");
+		return -1;
+	}
+
+	inst->total_weight = 0;
+	for (i = 0; i < talloc_array_length(inst->scenario); i++) {
+		proto_load_step_scenario_t *scenario = inst->scenario[i];
+
+		FR_INTEGER_BOUND_CHECK("weight", scenario->weight, >=, 1);
+		FR_INTEGER_BOUND_CHECK("weight", scenario->weight, <=, 1000000);
+
+		FR_INTEGER_BOUND_CHECK("num_nas", scenario->num_nas, >=, 1);
+		FR_INTEGER_BOUND_CHECK("num_nas", scenario->num_nas, <=, 65536);
+
+		if (talloc_array_length(scenario->filename) > UINT16_MAX) {
+			cf_log_err(conf, "Too many 'filename' entries in 'scenario'");
+			return -1;
+		}
+
+		inst->total_weight += scenario->weight;
+	}
+
 	return 0;
 }
 
@@ -396,42 +676,64 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	CONF_SECTION		*conf = mctx->inst->conf;
 	fr_client_t		*client;
 	fr_pair_t		*vp;
+	size_t			i, j;
 
-	fr_pair_list_init(&inst->pair_list);
 	inst->client = client = talloc_zero(inst, fr_client_t);
 	if (!inst->client) return 0;
 
 	client->ipaddr.af = AF_INET;
 	client->src_ipaddr = client->ipaddr;
 
-	client->longname = client->shortname = inst->filename;
+	client->longname = client->shortname = inst->scenario[0]->filename[0];
 	client->secret = talloc_strdup(client, "testing123");
 	client->nas_type = talloc_strdup(client, "load");
 	client->use_connected = false;
 
-	if (inst->filename) {
-		FILE *fp;
-		bool done = false;
+	inst->attr_state = fr_dict_attr_by_name(NULL, fr_dict_root(inst->parent->dict), "State");
+	inst->attr_nas_ip_address = fr_dict_attr_by_name(NULL, fr_dict_root(inst->parent->dict), "NAS-IP-Address");
+	if (inst->attr_nas_ip_address && (inst->attr_nas_ip_address->type != FR_TYPE_IPV4_ADDR)) {
+		inst->attr_nas_ip_address = NULL;
+	}
+
+	for (i = 0; i < talloc_array_length(inst->scenario); i++) {
+		proto_load_step_scenario_t *scenario = inst->scenario[i];
+		size_t num_rounds = talloc_array_length(scenario->filename);
 
-		fp = fopen(inst->filename, "r");
-		if (!fp) {
-			cf_log_err(conf, "Failed opening %s - %s",
-				   inst->filename, fr_syserror(errno));
+		if ((num_rounds > 1) && (!inst->attr_state || (inst->attr_state->type != FR_TYPE_OCTETS))) {
+			cf_log_err(conf, "Conversations need a 'State' attribute of type 'octets' in namespace %s",
+				   fr_dict_root(inst->parent->dict)->name);
 			return -1;
 		}
 
-		if (fr_pair_list_afrom_file(inst, inst->parent->dict, &inst->pair_list, fp, &done) < 0) {
-			cf_log_perr(conf, "Failed reading %s", inst->filename);
+		MEM(scenario->pair_list = talloc_array(scenario, fr_pair_list_t, num_rounds));
+		MEM(scenario->code = talloc_zero_array(scenario, uint32_t, num_rounds));
+
+		for (j = 0; j < num_rounds; j++) {
+			FILE *fp;
+			bool done = false;
+
+			fr_pair_list_init(&scenario->pair_list[j]);
+
+			fp = fopen(scenario->filename[j], "r");
+			if (!fp) {
+				cf_log_err(conf, "Failed opening %s - %s",
+					   scenario->filename[j], fr_syserror(errno));
+				return -1;
+			}
+
+			if (fr_pair_list_afrom_file(scenario, inst->parent->dict, &scenario->pair_list[j], fp, &done) < 0) {
+				cf_log_perr(conf, "Failed reading %s", scenario->filename[j]);
+				fclose(fp);
+				return -1;
+			}
+
 			fclose(fp);
-			return -1;
-		}
 
-		fclose(fp);
+			vp = fr_pair_find_by_da(&scenario->pair_list[j], NULL, inst->parent->attr_packet_type);
+			if (vp) scenario->code[j] = vp->vp_uint32;
+		}
 	}
 
-	vp = fr_pair_find_by_da(&inst->pair_list, NULL, inst->parent->attr_packet_type);
-	if (vp) inst->code = vp->vp_uint32;
-
 	return 0;
 }
 
@@ -456,4 +758,5 @@ fr_app_io_t proto_load_step = {
 	.get_name      		= mod_name,
 
 	.decode			= mod_decode,
+	.encode			= mod_encode,
 };
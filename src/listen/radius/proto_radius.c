@@ -75,6 +75,9 @@ static CONF_PARSER const proto_radius_config[] = {
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_radius_t, io.submodule),
 	  .func = transport_parse },
 
+	{ FR_CONF_OFFSET("per_network_socket", FR_TYPE_BOOL, proto_radius_t, io.per_network_socket), .dflt = "no" },
+	{ FR_CONF_OFFSET("steer_by_client", FR_TYPE_BOOL, proto_radius_t, io.steer_by_client), .dflt = "no" },
+
 	/*
 	 *	Check whether or not the *trailing* bits of a
 	 *	Tunnel-Password are zero, as they should be.
@@ -41,6 +41,9 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*batch;			//!< for reading multiple packets at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple replies at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 
 } proto_radius_udp_thread_t;
@@ -60,6 +63,10 @@ typedef struct {
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 	uint32_t			send_buff;		//!< How big the kernel's send buffer should be.
 
+	uint32_t			recv_batch;		//!< How many packets to read with one system call.
+	uint32_t			send_batch;		//!< How many replies to write with one system call.
+	fr_time_delta_t			send_batch_delay;	//!< How long a reply can wait for the batch to fill.
+
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
@@ -101,6 +108,10 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_radius_udp_t, recv_buff) },
 	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, proto_radius_udp_t, send_buff) },
 
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_radius_udp_t, recv_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("send_batch", FR_TYPE_UINT32, proto_radius_udp_t, send_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("send_batch_delay", FR_TYPE_TIME_DELTA, proto_radius_udp_t, send_batch_delay), .dflt = "100us" },
+
 	{ FR_CONF_OFFSET("accept_conflicting_packets", FR_TYPE_BOOL, proto_radius_udp_t, dedup_authenticator) } ,
 	{ FR_CONF_OFFSET("dynamic_clients", FR_TYPE_BOOL, proto_radius_udp_t, dynamic_clients) } ,
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
@@ -138,7 +149,17 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (thread->batch) {
+		if (!udp_recv_batch_pending(thread->batch) &&
+		    (udp_recv_batch_read(thread->batch, thread->sockfd) < 0)) {
+			PDEBUG2("proto_radius_udp got read error");
+			return -1;
+		}
+
+		data_size = udp_recv_batch_pop(thread->batch, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		PDEBUG2("proto_radius_udp got read error");
 		return data_size;
@@ -196,6 +217,57 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	return packet_len;
 }
 
+static unsigned int mod_read_batch(fr_listen_t *li, bool refill)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	/*
+	 *	Errors are returned by the next call to mod_read().
+	 */
+	if (refill && !udp_recv_batch_pending(thread->batch)) (void) udp_recv_batch_read(thread->batch, thread->sockfd);
+
+	return udp_recv_batch_pending(thread->batch);
+}
+
+/** Queue a reply, and write out the batch if it's full, or has waited too long
+ *
+ */
+static ssize_t mod_send_batch_add(fr_listen_t *li, proto_radius_udp_thread_t *thread,
+				  fr_socket_t const *socket, void *buffer, size_t buffer_len)
+{
+	if (udp_send_batch_add(thread->send_batch, socket, buffer, buffer_len) < 0) return -1;
+
+	/*
+	 *	The packet has been queued, so failing to write
+	 *	the batch is only logged.  Returning an error here
+	 *	would cause the caller to retry this packet.  If the
+	 *	socket is full, the packets stay queued, and are
+	 *	written by mod_flush() once the socket is writable.
+	 */
+	if (udp_send_batch_ready(thread->send_batch) && (udp_send_batch_flush(thread->send_batch) < 0) &&
+	    (errno != EWOULDBLOCK)) {
+		RATE_LIMIT_GLOBAL(PERROR, "%s - Failed writing replies", li->name);
+	}
+
+	return buffer_len;
+}
+
+/** Write all queued replies
+ *
+ *  Called by the network side once it has passed all of the
+ *  currently available replies to mod_write().
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->send_batch || !udp_send_batch_pending(thread->send_batch)) return 0;
+
+	return (udp_send_batch_flush(thread->send_batch) < 0) ? -1 : 0;
+}
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -245,7 +317,11 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
-			(void) udp_send(&socket, flags, packet, track->reply_len);
+			if (thread->send_batch) {
+				(void) mod_send_batch_add(li, thread, &socket, packet, track->reply_len);
+			} else {
+				(void) udp_send(&socket, flags, packet, track->reply_len);
+			}
 		}
 
 		return buffer_len;
@@ -260,7 +336,11 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	if (thread->send_batch) {
+		data_size = mod_send_batch_add(li, thread, &socket, buffer, buffer_len);
+	} else {
+		data_size = udp_send(&socket, flags, buffer, buffer_len);
+	}
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -361,6 +441,29 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Connected sockets are set up via mod_fd_set(), and
+	 *	always read one packet at a time.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			ERROR("Failed allocating receive batch");
+			goto error;
+		}
+	}
+
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size,
+							  inst->send_batch_delay);
+		if (!thread->send_batch) {
+			close(sockfd);
+			ERROR("Failed allocating send batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_udp,
@@ -465,6 +568,13 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+	FR_TIME_DELTA_BOUND_CHECK("send_batch_delay", inst->send_batch_delay, <=, fr_time_delta_from_sec(1));
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -554,7 +664,9 @@ fr_app_io_t proto_radius_udp = {
 
 	.open			= mod_open,
 	.read			= mod_read,
+	.read_batch		= mod_read_batch,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
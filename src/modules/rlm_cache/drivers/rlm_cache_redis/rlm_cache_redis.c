@@ -19,6 +19,10 @@
  * @file rlm_cache_redis.c
  * @brief redis based cache.
  *
+ * Unlike rlm_redis and rlm_redis_ippool, commands are run on the cluster's
+ * connection pools rather than on per-thread trunks, as the cache driver API
+ * returns results synchronously.  The pools use TLS when use_tls is set.
+ *
  * @copyright 2015 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  */
 #define LOG_PREFIX "cache - redis"
@@ -26,6 +26,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/htrie.h>
 #include <freeradius-devel/util/debug.h>
 
@@ -59,12 +60,16 @@ typedef struct {
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
 	fr_type_t	*field_types;
 	fr_rb_tree_t	*tree;
-	fr_htrie_t	*trie;
+	fr_htrie_type_t	htype;		//!< Of the fr_htrie_t the entries are stored in.
 
 	tmpl_t		*key;
 	fr_type_t	key_data_type;
 
 	map_list_t	map;		//!< if there is an "update" section in the configuration.
+
+	CONF_SECTION	*cs;		//!< For errors in the file.
+	fr_time_delta_t	reload_interval;
+	fr_reload_t	*reload;	//!< Holds the fr_htrie_t of entries built from the file.
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_s rlm_csv_entry_t;
@@ -86,13 +91,14 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_csv_t, allow_multiple_keys) },
 	{ FR_CONF_OFFSET("index_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_csv_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -185,13 +191,13 @@ static int csv_to_key(uint8_t **out, size_t *outlen, void const *data)
 }
 
 
-static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e, int lineno)
+static bool insert_entry(CONF_SECTION *conf, rlm_csv_t const *inst, fr_htrie_t *trie, rlm_csv_entry_t *e, int lineno)
 {
 	rlm_csv_entry_t *old;
 
 	fr_assert(e != NULL);
 
-	old = fr_htrie_find(inst->trie, e);
+	old = fr_htrie_find(trie, e);
 	if (old) {
 		if (!inst->allow_multiple_keys && !inst->multiple_index_fields) {
 			cf_log_err(conf, "%s[%d]: Multiple entries are disallowed", inst->filename, lineno);
@@ -207,7 +213,7 @@ static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e
 		return true;
 	}
 
-	if (!fr_htrie_insert(inst->trie, e)) {
+	if (!fr_htrie_insert(trie, e)) {
 		cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
 			   inst->filename, lineno, fr_strerror());
 fail:
@@ -219,13 +225,14 @@ fail:
 }
 
 
-static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *old, char *p, int lineno)
+static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t const *inst, fr_htrie_t *trie,
+			    rlm_csv_entry_t *old, char *p, int lineno)
 {
 	int i;
 	fr_type_t type = inst->key_data_type;
 	rlm_csv_entry_t *e;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(trie, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
@@ -244,22 +251,22 @@ static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t
 	 *	Copy the other fields;
 	 */
 	for (i = 0; i < inst->used_fields; i++) {
-		if (old->data[i]) e->data[i] = old->data[i]; /* no need to dup it, it's never freed... */
+		if (old->data[i]) e->data[i] = old->data[i]; /* no need to dup it, it's freed with the trie */
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return insert_entry(conf, inst, trie, e, lineno);
 }
 
 /*
  *	Convert a buffer to a CSV entry
  */
-static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static bool file2csv(CONF_SECTION *conf, rlm_csv_t const *inst, fr_htrie_t *trie, int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(trie, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
@@ -305,7 +312,7 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 				while (l) {
 					*l = '\0';
 
-					if (!duplicate_entry(conf, inst, e, p, lineno)) goto fail;
+					if (!duplicate_entry(conf, inst, trie, e, p, lineno)) goto fail;
 
 					p = l + 1;
 					l = strchr(p, ',');
@@ -359,7 +366,7 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 		goto fail;
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return insert_entry(conf, inst, trie, e, lineno);
 }
 
 
@@ -557,15 +564,7 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	inst->trie = fr_htrie_alloc(inst, htype,
-				    (fr_hash_t) csv_hash,
-				    (fr_cmp_t) csv_cmp,
-				    (fr_trie_key_t) csv_to_key,
-				    NULL);
-	if (!inst->trie) {
-		cf_log_err(conf, "Failed creating internal trie: %s", fr_strerror());
-		return -1;
-	}
+	inst->htype = htype;
 
 	if ((*inst->index_field_name == ',') || (*inst->index_field_name == *inst->delimiter)) {
 		cf_log_err(conf, "Field names cannot begin with the '%c' character", *inst->index_field_name);
@@ -743,6 +742,80 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 }
 
 
+/*
+ *	Read the file into a new trie.
+ *
+ *	The field layout was taken from the configuration, or the
+ *	header, at bootstrap, and can't change after that.
+ */
+static int csv_load(void **out, void *uctx)
+{
+	rlm_csv_t const	*inst = talloc_get_type_abort_const(uctx, rlm_csv_t);
+	fr_htrie_t	*trie;
+	int		lineno;
+	FILE		*fp;
+	char		buffer[8192];
+
+	trie = fr_htrie_alloc(NULL, inst->htype,
+			      (fr_hash_t) csv_hash,
+			      (fr_cmp_t) csv_cmp,
+			      (fr_trie_key_t) csv_to_key,
+			      NULL);
+	if (!trie) {
+		fr_strerror_printf_push("Failed creating internal trie");
+		return -1;
+	}
+
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		talloc_free(trie);
+		return -1;
+	}
+	lineno = 1;
+
+	/*
+	 *	If there is a header in the file, then read that first.
+	 *	It has to be the one the fields were taken from.
+	 */
+	if (inst->header) {
+		char *p = fgets(buffer, sizeof(buffer), fp);
+		if (!p) {
+			fr_strerror_printf("Error reading filename %s: Unexpected EOF", inst->filename);
+		error:
+			fclose(fp);
+			talloc_free(trie);
+			return -1;
+		}
+
+		p = strchr(buffer, '\n');
+		if (p) *p = '\0';
+
+		if (strcmp(buffer, inst->fields) != 0) {
+			fr_strerror_printf("Header of %s has changed, the server must be restarted to use it",
+					   inst->filename);
+			goto error;
+		}
+		lineno++;
+	}
+
+	/*
+	 *	Read the rest of the file.
+	 */
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		if (!file2csv(inst->cs, inst, trie, lineno, buffer)) {
+			fr_strerror_printf("Failed reading %s", inst->filename);
+			goto error;
+		}
+
+		lineno++;
+	}
+	fclose(fp);
+
+	*out = trie;
+	return 0;
+}
+
 /** Instantiate the module
  *
  * Creates a new instance of the module reading parameters from a configuration section.
@@ -757,14 +830,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	rlm_csv_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
 	CONF_SECTION	*conf = mctx->inst->conf;
 	CONF_SECTION	*cs;
-	int		lineno;
-	FILE		*fp;
 	tmpl_rules_t	parse_rules = {
 		.attr = {
 			.allow_foreign = true	/* Because we don't know where we'll be called */
 		}
 	};
-	char buffer[8192];
 
 	map_list_init(&inst->map);
 	/*
@@ -795,42 +865,27 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 
 	/*
-	 *	Re-open the file and read it all.
+	 *	Read the file, and re-read it when it changes.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+	inst->cs = conf;
+	inst->reload = fr_reload_alloc(inst, mctx->inst->name, csv_load, inst);
+	if ((fr_reload_watch(inst->reload, inst->filename) < 0) ||
+	    (fr_reload_start(inst->reload, inst->reload_interval) < 0)) {
+		cf_log_perr(conf, "Failed loading CSV file");
 		return -1;
 	}
-	lineno = 1;
 
-	/*
-	 *	If there is a header in the file, then read that first.
-	 *	This time we just ignore it.
-	 */
-	if (inst->header) {
-		char *p = fgets(buffer, sizeof(buffer), fp);
-		if (!p) {
-			cf_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
-			fclose(fp);
-			return -1;
-		}
-		lineno++;
-	}
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_csv_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
 
 	/*
-	 *	Read the rest of the file.
+	 *	Stops the reload thread, and frees the entries.
 	 */
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		if (!file2csv(conf, inst, lineno, buffer)) {
-			fclose(fp);
-			return -1;
-		}
-
-		lineno++;
-	}
-	fclose(fp);
-
+	TALLOC_FREE(inst->reload);
 	return 0;
 }
 
@@ -902,8 +957,12 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, request_t *request,
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
 	rlm_csv_entry_t		*e;
 	map_t const		*map = NULL;
+	fr_htrie_t		*trie;
+	unsigned int		slot;
+
+	trie = fr_reload_data_acquire(inst->reload, &slot);
 
-	e = fr_htrie_find(inst->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	e = fr_htrie_find(trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
@@ -959,6 +1018,7 @@ redo:
 	}
 
 finish:
+	fr_reload_data_release(inst->reload, slot);
 	return rcode;
 }
 
@@ -1058,6 +1118,7 @@ module_rlm_t rlm_csv = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = CF_IDENT_ANY,	.name2 = CF_IDENT_ANY,	.method = mod_process },
@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/users_file.h>
 #include <freeradius-devel/util/htrie.h>
 
@@ -38,29 +39,47 @@ typedef struct {
 	fr_type_t	key_data_type;
 
 	char const *filename;
+
+	/* autz */
+	char const *usersfile;
+
+	/* authenticate */
+	char const *auth_usersfile;
+
+	/* preacct */
+	char const *acct_usersfile;
+
+	/* post-authenticate */
+	char const *postauth_usersfile;
+
+	fr_time_delta_t	reload_interval;
+	fr_reload_t	*reload;	//!< Holds the rlm_files_data_t built from the files.
+} rlm_files_t;
+
+/** The entries read from the files
+ *
+ * Rebuilt as a whole when any of the files change.
+ */
+typedef struct {
 	fr_htrie_t *common;
 	PAIR_LIST_LIST *common_def;
 
 	/* autz */
-	char const *usersfile;
 	fr_htrie_t *users;
 	PAIR_LIST_LIST *users_def;
 
 	/* authenticate */
-	char const *auth_usersfile;
 	fr_htrie_t *auth_users;
 	PAIR_LIST_LIST *auth_users_def;
 
 	/* preacct */
-	char const *acct_usersfile;
 	fr_htrie_t *acct_users;
 	PAIR_LIST_LIST *acct_users_def;
 
 	/* post-authenticate */
-	char const *postauth_usersfile;
 	fr_htrie_t *postauth_users;
 	PAIR_LIST_LIST *postauth_users_def;
-} rlm_files_t;
+} rlm_files_data_t;
 
 typedef struct {
 	fr_value_box_t	key;
@@ -95,6 +114,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, rlm_files_t, key), .dflt = "%{%{Stripped-User-Name}:-%{User-Name}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -117,7 +137,8 @@ static int pairlist_to_key(uint8_t **out, size_t *outlen, void const *a)
 	return fr_value_box_to_key(out, outlen, ((PAIR_LIST_LIST const *)a)->box);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault, fr_type_t data_type)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault,
+			fr_type_t data_type, bool reloadable)
 {
 	int rcode;
 	PAIR_LIST_LIST users;
@@ -134,7 +155,11 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 	}
 
 	pairlist_list_init(&users);
-	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1);
+	/*
+	 *	Files which are reloaded are parsed by the reload
+	 *	thread, so they can't contain function calls.
+	 */
+	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1, reloadable);
 	if (rcode < 0) {
 		return -1;
 	}
@@ -351,8 +376,29 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	(Re-)read the "users" files into memory.
  */
+static int files_load(void **out, void *uctx)
+{
+	rlm_files_t const	*inst = talloc_get_type_abort_const(uctx, rlm_files_t);
+	rlm_files_data_t	*data;
+	bool			reloadable = fr_time_delta_ispos(inst->reload_interval);
+
+	MEM(data = talloc_zero(NULL, rlm_files_data_t));
+
+#undef READFILE
+#define READFILE(_x, _y, _d) if (getusersfile(data, inst->_x, &data->_y, &data->_d, inst->key_data_type, reloadable) != 0) do { fr_strerror_printf("Failed reading %s", inst->_x); talloc_free(data); return -1;} while (0)
+
+	READFILE(filename, common, common_def);
+	READFILE(usersfile, users, users_def);
+	READFILE(acct_usersfile, acct_users, acct_users_def);
+	READFILE(auth_usersfile, auth_users, auth_users_def);
+	READFILE(postauth_usersfile, postauth_users, postauth_users_def);
+
+	*out = data;
+	return 0;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
@@ -364,15 +410,32 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-#undef READFILE
-#define READFILE(_x, _y, _d) if (getusersfile(inst, inst->_x, &inst->_y, &inst->_d, inst->key_data_type) != 0) do { ERROR("Failed reading %s", inst->_x); return -1;} while (0)
+	/*
+	 *	$INCLUDE'd files aren't checked for changes, only
+	 *	the ones named in the configuration.
+	 */
+	inst->reload = fr_reload_alloc(inst, mctx->inst->name, files_load, inst);
+	if ((fr_reload_watch(inst->reload, inst->filename) < 0) ||
+	    (fr_reload_watch(inst->reload, inst->usersfile) < 0) ||
+	    (fr_reload_watch(inst->reload, inst->acct_usersfile) < 0) ||
+	    (fr_reload_watch(inst->reload, inst->auth_usersfile) < 0) ||
+	    (fr_reload_watch(inst->reload, inst->postauth_usersfile) < 0) ||
+	    (fr_reload_start(inst->reload, inst->reload_interval) < 0)) {
+		PERROR("Failed loading users files");
+		return -1;
+	}
 
-	READFILE(filename, common, common_def);
-	READFILE(usersfile, users, users_def);
-	READFILE(acct_usersfile, acct_users, acct_users_def);
-	READFILE(auth_usersfile, auth_users, auth_users_def);
-	READFILE(postauth_usersfile, postauth_users, postauth_users_def);
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
 
+	/*
+	 *	Stops the reload thread, and frees the entries.
+	 */
+	TALLOC_FREE(inst->reload);
 	return 0;
 }
 
@@ -412,6 +475,9 @@ static unlang_action_t file_common(rlm_rcode_t *p_result, UNUSED rlm_files_t con
 	PAIR_LIST_LIST		my_list;
 	uint8_t			key_buffer[16], *key;
 	size_t			keylen = 0;
+	void			*prefixes[(sizeof(key_buffer) * 8) + 1];
+	size_t			prefix_lens[NUM_ELEMENTS(prefixes)];
+	int			num_prefixes = -1, prefix = 0;
 
 	if (!tree && !default_list) RETURN_MODULE_NOOP;
 
@@ -609,22 +675,23 @@ redo:
 		/*
 		 *	Walk back up the trie looking for shorter prefixes.
 		 *
-		 *	Note that we've already found an entry, so we
-		 *	MUST start with that prefix, otherwise we
-		 *	would end up in an loop of finding the same
-		 *	prefix over and over.
+		 *	The first time we're asked to do this, find
+		 *	all of the prefixes in one pass.  They're
+		 *	ordered longest first, so the first one is the
+		 *	entry we've already found.
 		 */
-		if (keylen > user_list->box->vb_ip.prefix) keylen = user_list->box->vb_ip.prefix;
+		if (num_prefixes < 0) {
+			num_prefixes = fr_trie_lookup_all_prefixes(tree->store, key, keylen,
+								   prefixes, prefix_lens, NUM_ELEMENTS(prefixes));
+			prefix = 0;
+		}
 
-		do {
-			keylen--;
-			user_list = fr_trie_lookup_by_key(tree->store, key, keylen);
-			if (!user_list) continue;
+		if (++prefix >= num_prefixes) break;
 
-			user_pl = fr_dlist_head(&user_list->head);
-			RDEBUG("Found matching shorter subnet %s at key length %ld", user_pl->name, keylen);
-			goto redo;
-		} while (keylen > 0);
+		user_list = prefixes[prefix];
+		user_pl = fr_dlist_head(&user_list->head);
+		RDEBUG("Found matching shorter subnet %s at key length %zu", user_pl->name, prefix_lens[prefix]);
+		goto redo;
 	}
 
 	/*
@@ -648,10 +715,17 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 {
 	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_data_t const *data;
+	unsigned int slot;
+	unlang_action_t ret;
+
+	data = fr_reload_data_acquire(inst->reload, &slot);
+	ret = file_common(p_result, inst, env_data, request,
+			  data->users ? data->users : data->common,
+			  data->users ? data->users_def : data->common_def);
+	fr_reload_data_release(inst->reload, slot);
 
-	return file_common(p_result, inst, env_data, request,
-			   inst->users ? inst->users : inst->common,
-			   inst->users ? inst->users_def : inst->common_def);
+	return ret;
 }
 
 
@@ -664,30 +738,51 @@ static unlang_action_t CC_HINT(nonnull) mod_preacct(rlm_rcode_t *p_result, modul
 {
 	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_data_t const *data;
+	unsigned int slot;
+	unlang_action_t ret;
 
-	return file_common(p_result, inst, env_data, request,
-			   inst->acct_users ? inst->acct_users : inst->common,
-			   inst->acct_users ? inst->acct_users_def : inst->common_def);
+	data = fr_reload_data_acquire(inst->reload, &slot);
+	ret = file_common(p_result, inst, env_data, request,
+			  data->acct_users ? data->acct_users : data->common,
+			  data->acct_users ? data->acct_users_def : data->common_def);
+	fr_reload_data_release(inst->reload, slot);
+
+	return ret;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_data_t const *data;
+	unsigned int slot;
+	unlang_action_t ret;
+
+	data = fr_reload_data_acquire(inst->reload, &slot);
+	ret = file_common(p_result, inst, env_data, request,
+			  data->auth_users ? data->auth_users : data->common,
+			  data->auth_users ? data->auth_users_def : data->common_def);
+	fr_reload_data_release(inst->reload, slot);
 
-	return file_common(p_result, inst, env_data, request,
-			   inst->auth_users ? inst->auth_users : inst->common,
-			   inst->auth_users ? inst->auth_users_def : inst->common_def);
+	return ret;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_data_t const *data;
+	unsigned int slot;
+	unlang_action_t ret;
+
+	data = fr_reload_data_acquire(inst->reload, &slot);
+	ret = file_common(p_result, inst, env_data, request,
+			  data->postauth_users ? data->postauth_users : data->common,
+			  data->postauth_users ? data->postauth_users_def : data->common_def);
+	fr_reload_data_release(inst->reload, slot);
 
-	return file_common(p_result, inst, env_data, request,
-			   inst->postauth_users ? inst->postauth_users : inst->common,
-			   inst->postauth_users ? inst->postauth_users_def : inst->common_def);
+	return ret;
 }
 
 /*
@@ -715,7 +810,8 @@ module_rlm_t rlm_files = {
 		.name		= "files",
 		.inst_size	= sizeof(rlm_files_t),
 		.config		= module_config,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach
 	},
 	.method_names = (module_method_name_t[]){
 		/*
@@ -1817,19 +1817,19 @@ static int apply(rlm_isc_dhcp_t const *inst, request_t *request, rlm_isc_dhcp_in
 
 subnet:
 	/*
-	 *	Look in the trie for matching subnets, and apply any
-	 *	subnets that match.
+	 *	Look in the trie for the most specific subnet which
+	 *	matches, and apply only that one.
 	 */
 	if (head->subnets && yiaddr) {
-		info = fr_trie_lookup_by_key(head->subnets, &yiaddr->vp_ipv4addr, 32);
-		if (!info) goto recurse;
+		void *subnet;
 
-		child_ret = apply(inst, request, info);
-		if (child_ret < 0) return child_ret;
-		if (child_ret == 1) ret = 1;
+		if (fr_trie_lookup_all_prefixes(head->subnets, &yiaddr->vp_ipv4addr, 32, &subnet, NULL, 1) == 1) {
+			child_ret = apply(inst, request, subnet);
+			if (child_ret < 0) return child_ret;
+			if (child_ret == 1) ret = 1;
+		}
 	}
 
-recurse:
 	for (info = head->child; info != NULL; info = info->next) {
 		if (!info->cmd) return -1; /* internal error */
 
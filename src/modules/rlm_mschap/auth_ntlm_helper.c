@@ -0,0 +1,749 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_ntlm_helper.c
+ * @brief NTLM authentication against persistent ntlm_auth helper processes
+ *
+ * Each thread runs a trunk of ntlm_auth processes, started with
+ * --helper-protocol=ntlm-server-1.  Each process is a trunk connection,
+ * and authenticates one request at a time.  Requests are written to the
+ * helper's stdin, and the response is read from its stdout when it's
+ * readable, so the worker doesn't block while the helper runs.
+ *
+ * Idle helpers are sent an empty request every health_check_interval,
+ * which they must answer within ntlm_auth_timeout.  A helper which
+ * exits, times out, or sends something we don't understand is killed,
+ * and the trunk starts a new one.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX helper->conn->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <sys/wait.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "auth_ntlm_helper.h"
+
+#define HELPER_MAX_ARGV		64
+#define HELPER_MAX_LINE		1024
+
+/** A helper process in a thread's trunk
+ *
+ */
+typedef struct {
+	rlm_mschap_thread_t	*t;			//!< Thread the helper belongs to.
+	fr_trunk_connection_t	*tconn;			//!< Trunk connection this is the helper for.
+	fr_connection_t		*conn;			//!< Connection this is the handle for.
+
+	pid_t			pid;			//!< Of the helper.  -1 if it's been reaped.
+	int			stdin_fd;		//!< To write requests to.
+	int			stdout_fd;		//!< To read responses from.
+	fr_event_pid_t const	*ev_pid;		//!< Tells us if the helper exits.
+	fr_event_timer_t const	*ev;			//!< Response timeout, next health check,
+							///< or connected signal.
+
+	fr_trunk_request_t	*treq;			//!< Request being authenticated.  NULL if the
+							///< helper is idle, running a health check, or
+							///< the request was cancelled.
+	bool			busy;			//!< Waiting for a response.
+	bool			probing;		//!< The response is to a health check.
+
+	char			buff[HELPER_MAX_LINE];	//!< Partial line read from the helper.
+	size_t			used;			//!< How much of buff is used.
+} mschap_helper_t;
+
+static void helper_health_check_arm(mschap_helper_t *helper);
+
+/** Fail the request being authenticated, and restart the helper
+ *
+ * The request must be failed first.  Otherwise the trunk requeues it
+ * when the connection is closed, and a request which makes ntlm_auth
+ * exit would be sent to each helper in turn.
+ */
+static void helper_reconnect(mschap_helper_t *helper)
+{
+	if (helper->treq) {
+		fr_trunk_request_t *treq = helper->treq;
+
+		helper->treq = NULL;
+		fr_trunk_request_signal_fail(treq);
+	}
+	fr_connection_signal_reconnect(helper->conn, FR_CONNECTION_FAILED);
+}
+
+/** The helper didn't respond within ntlm_auth_timeout
+ *
+ * Fail the request, and restart the helper to abandon it.
+ */
+static void _helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	rlm_mschap_thread_t	*t = helper->t;
+
+	ERROR("ntlm_auth %s timed out after %pV seconds",
+	      helper->probing ? "health check" : "request", fr_box_time_delta(t->inst->ntlm_auth_timeout));
+
+	helper_reconnect(helper);
+}
+
+/** Write a request to the helper, and wait for its response
+ *
+ * Requests are much smaller than PIPE_BUF, so they're either written in
+ * full, or not at all.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the helper can't be written to.
+ */
+static int helper_write(mschap_helper_t *helper, char const *data, size_t data_len)
+{
+	rlm_mschap_thread_t	*t = helper->t;
+	ssize_t			slen;
+
+	slen = write(helper->stdin_fd, data, data_len);
+	if (slen != (ssize_t) data_len) {
+		ERROR("Failed writing to ntlm_auth: %s", (slen < 0) ? fr_syserror(errno) : "Short write");
+		return -1;
+	}
+	helper->busy = true;
+
+	if (fr_event_timer_in(helper, t->el, &helper->ev, t->inst->ntlm_auth_timeout,
+			      _helper_timeout, helper) < 0) {
+		PERROR("Failed inserting response timeout");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Send an empty request to an idle helper
+ *
+ * The helper responds with an error, which is enough to know it's alive.
+ */
+static void _helper_health_check(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(uctx, mschap_helper_t);
+
+	if (helper->busy) return;
+
+	DEBUG3("Checking ntlm_auth is responding");
+
+	helper->probing = true;
+	if (helper_write(helper, ".\n", 2) < 0) {
+		fr_trunk_connection_signal_reconnect(helper->tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+}
+
+static void helper_health_check_arm(mschap_helper_t *helper)
+{
+	rlm_mschap_thread_t	*t = helper->t;
+
+	if (helper->ev) fr_event_timer_delete(&helper->ev);
+
+	if (!fr_time_delta_ispos(t->inst->ntlm_helper_health_check_interval)) return;
+
+	if (fr_event_timer_in(helper, t->el, &helper->ev, t->inst->ntlm_helper_health_check_interval,
+			      _helper_health_check, helper) < 0) {
+		PERROR("Failed inserting health check timer");
+	}
+}
+
+/** Decode the value of a response line
+ *
+ * Values following "::" are base64 encoded, values following ":" are not.
+ *
+ * @return
+ *	- The length of the value.
+ *	- -1 if the value couldn't be decoded.
+ */
+static ssize_t helper_line_value(char *out, size_t outlen, char const *p, char const *end)
+{
+	ssize_t slen;
+	bool	encoded = false;
+
+	if ((p < end) && (*p == ':')) {
+		encoded = true;
+		p++;
+	}
+	while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+
+	if (encoded) {
+		slen = fr_base64_decode(&FR_DBUFF_TMP((uint8_t *) out, outlen - 1),
+					&FR_SBUFF_IN(p, end - p), true, true);
+		if (slen < 0) return -1;
+	} else {
+		slen = end - p;
+		if ((size_t) slen >= outlen) slen = outlen - 1;
+		memcpy(out, p, slen);
+	}
+	out[slen] = '\0';
+
+	return slen;
+}
+
+/** Process one line of a response
+ *
+ * @return
+ *	- 1 if the response is complete.
+ *	- 0 if more lines are expected.
+ *	- -1 if the line is malformed.
+ */
+static int helper_line_process(mschap_helper_t *helper, char const *line, char const *end)
+{
+	mschap_helper_auth_t	*auth = NULL;
+	request_t		*request = NULL;
+	char const		*p;
+	char			value[HELPER_MAX_LINE];
+	ssize_t			slen;
+
+	if ((end - line == 1) && (*line == '.')) return 1;
+
+	p = memchr(line, ':', end - line);
+	if (!p) {
+		ERROR("Malformed line from ntlm_auth: %.*s", (int) (end - line), line);
+		return -1;
+	}
+
+	slen = helper_line_value(value, sizeof(value), p + 1, end);
+	if (slen < 0) {
+		ERROR("Malformed value from ntlm_auth: %.*s", (int) (end - line), line);
+		return -1;
+	}
+
+	/*
+	 *	Health checks always get an error, and responses
+	 *	to cancelled requests are ignored.
+	 */
+	if (!helper->treq) return 0;
+	auth = talloc_get_type_abort(helper->treq->preq, mschap_helper_auth_t);
+	request = auth->request;
+
+#define IS_KEY(_key) ((p - line == sizeof(_key) - 1) && (strncasecmp(line, _key, sizeof(_key) - 1) == 0))
+	if (IS_KEY("Authenticated")) {
+		auth->authenticated = (strcasecmp(value, "Yes") == 0);
+
+	} else if (IS_KEY("User-Session-Key")) {
+		if (fr_base16_decode(NULL, &FR_DBUFF_TMP(auth->nthashhash, sizeof(auth->nthashhash)),
+				     &FR_SBUFF_IN(value, slen), true) != sizeof(auth->nthashhash)) {
+			REDEBUG("Invalid User-Session-Key from ntlm_auth");
+			auth->failed = true;
+			return 0;
+		}
+		auth->have_key = true;
+
+	} else if (IS_KEY("Authentication-Error")) {
+		talloc_const_free(auth->error);
+		MEM(auth->error = talloc_bstrndup(auth, value, slen));
+
+	} else if (IS_KEY("Error")) {
+		REDEBUG("ntlm_auth failed: %s", value);
+		auth->failed = true;
+
+	} else {
+		RDEBUG3("Ignoring %.*s from ntlm_auth", (int) (end - line), line);
+	}
+#undef IS_KEY
+
+	return 0;
+}
+
+/** A response is complete
+ *
+ */
+static void helper_response_done(mschap_helper_t *helper)
+{
+	fr_trunk_request_t	*treq = helper->treq;
+
+	if (helper->probing) DEBUG3("ntlm_auth is responding");
+
+	helper->treq = NULL;
+	helper->busy = false;
+	helper->probing = false;
+	helper_health_check_arm(helper);
+
+	if (treq) fr_trunk_request_signal_complete(treq);
+}
+
+/** Tell the connection it's connected
+ *
+ * This can't be signalled from the init callback, so it's done from
+ * a timer, as soon as we're back in the event loop.
+ */
+static void _helper_connected(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(uctx, mschap_helper_t);
+
+	helper_health_check_arm(helper);
+	fr_connection_signal_connected(helper->conn);
+}
+
+/** The helper exited
+ *
+ */
+static void _helper_exited(UNUSED fr_event_list_t *el, pid_t pid, int status, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	int			wait_status = status;
+
+	if (waitpid(pid, &wait_status, WNOHANG) <= 0) wait_status = status;
+	helper->pid = -1;
+
+	if (WIFEXITED(wait_status)) {
+		ERROR("ntlm_auth exited with status code %d", WEXITSTATUS(wait_status));
+	} else if (WIFSIGNALED(wait_status)) {
+		ERROR("ntlm_auth exited due to signal %d", WTERMSIG(wait_status));
+	}
+
+	helper_reconnect(helper);
+}
+
+/** The helper's stdout is readable
+ *
+ * After reading a response, the helper can authenticate the next request.
+ */
+static void _helper_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(uctx, mschap_helper_t);
+
+	fr_trunk_connection_signal_readable(helper->tconn);
+	fr_trunk_connection_signal_writable(helper->tconn);
+}
+
+static void _helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(uctx, mschap_helper_t);
+
+	ERROR("Failed reading from ntlm_auth: %s", fr_syserror(fd_errno));
+
+	helper_reconnect(helper);
+}
+
+/** Start a helper process
+ *
+ */
+static fr_connection_state_t _helper_init(void **h, fr_connection_t *conn, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	rlm_mschap_thread_t	*t = helper->t;
+
+	helper->used = 0;
+	helper->busy = false;
+	helper->probing = false;
+	helper->treq = NULL;
+
+	if (fr_exec_fork_wait(&helper->pid, &helper->stdin_fd, &helper->stdout_fd, NULL,
+			      t->inst->ntlm_helper_argv, NULL, true, false) < 0) {
+		PERROR("Failed starting ntlm_auth");
+		helper->pid = -1;
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	if (fr_event_pid_wait(helper, conn->el, &helper->ev_pid, helper->pid, _helper_exited, helper) < 0) {
+		PERROR("Failed waiting for ntlm_auth to exit");
+	error:
+		if (helper->ev_pid) talloc_const_free(helper->ev_pid);
+		helper->ev_pid = NULL;
+		close(helper->stdin_fd);
+		close(helper->stdout_fd);
+		kill(helper->pid, SIGKILL);
+		if (fr_event_pid_reap(conn->el, helper->pid, NULL, NULL) < 0) {
+			int status;
+
+			waitpid(helper->pid, &status, WNOHANG);
+		}
+		helper->pid = -1;
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	if (fr_event_fd_insert(helper, conn->el, helper->stdout_fd,
+			       _helper_readable, NULL, _helper_error, helper) < 0) {
+		PERROR("Failed inserting FD event");
+		goto error;
+	}
+
+	if (fr_event_timer_in(helper, conn->el, &helper->ev, fr_time_delta_wrap(0),
+			      _helper_connected, helper) < 0) {
+		PERROR("Failed inserting connected timer");
+		fr_event_fd_delete(conn->el, helper->stdout_fd, FR_EVENT_FILTER_IO);
+		goto error;
+	}
+
+	DEBUG2("Started ntlm_auth with PID %u", helper->pid);
+
+	*h = helper;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Stop a helper process
+ *
+ */
+static void _helper_close(fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(h, mschap_helper_t);
+
+	if (helper->ev) fr_event_timer_delete(&helper->ev);
+
+	fr_event_fd_delete(el, helper->stdout_fd, FR_EVENT_FILTER_IO);
+	close(helper->stdin_fd);
+	close(helper->stdout_fd);
+
+	/*
+	 *	Closing stdin is enough for ntlm_auth to exit, but
+	 *	it may be stuck, so we make sure.
+	 */
+	if (helper->ev_pid) {
+		talloc_const_free(helper->ev_pid);
+		helper->ev_pid = NULL;
+	}
+	if (helper->pid >= 0) {
+		kill(helper->pid, SIGTERM);
+		if (fr_event_pid_reap(el, helper->pid, NULL, NULL) < 0) {
+			int status;
+
+			PERROR("Failed setting up async PID reaper, PID %u may now be a zombie", helper->pid);
+			kill(helper->pid, SIGKILL);
+			waitpid(helper->pid, &status, WNOHANG);
+		}
+		helper->pid = -1;
+	}
+
+	helper->treq = NULL;
+	helper->busy = false;
+	helper->probing = false;
+}
+
+static fr_connection_t *helper_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						fr_connection_conf_t const *conf,
+						char const *log_prefix, void *uctx)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(uctx, rlm_mschap_thread_t);
+	mschap_helper_t		*helper;
+
+	MEM(helper = talloc_zero(NULL, mschap_helper_t));
+	helper->t = t;
+	helper->tconn = tconn;
+	helper->pid = -1;
+	helper->stdin_fd = -1;
+	helper->stdout_fd = -1;
+
+	helper->conn = fr_connection_alloc(tconn, el,
+					   &(fr_connection_funcs_t){
+						.init = _helper_init,
+						.close = _helper_close
+					   },
+					   conf, log_prefix, helper);
+	if (!helper->conn) {
+		talloc_free(helper);
+		return NULL;
+	}
+	talloc_steal(helper->conn, helper);
+
+	return helper->conn;
+}
+
+/** Send a request to each idle helper
+ *
+ * Helpers authenticate one request at a time, so this only sends a
+ * request if the helper isn't waiting for a response.
+ */
+static void helper_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+			       fr_connection_t *conn, UNUSED void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(conn->h, mschap_helper_t);
+	fr_trunk_request_t	*treq;
+	mschap_helper_auth_t	*auth;
+	request_t		*request;
+
+	if (helper->busy) return;
+
+	if ((fr_trunk_connection_pop_request(&treq, tconn) < 0) || !treq) return;
+
+	auth = talloc_get_type_abort(treq->preq, mschap_helper_auth_t);
+	request = treq->request;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Sending request to ntlm_auth (PID %u)", helper->pid);
+
+	if (helper_write(helper, auth->query, auth->query_len) < 0) {
+		fr_trunk_request_signal_fail(treq);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	helper->treq = treq;
+	fr_trunk_request_signal_sent(treq);
+}
+
+/** Read responses from the helper
+ *
+ */
+static void helper_request_demux(UNUSED fr_event_list_t *el, UNUSED fr_trunk_connection_t *tconn,
+				 fr_connection_t *conn, UNUSED void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(conn->h, mschap_helper_t);
+
+	for (;;) {
+		ssize_t		slen;
+		char		*line, *end;
+
+		slen = read(helper->stdout_fd, helper->buff + helper->used, sizeof(helper->buff) - helper->used);
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+			ERROR("Failed reading from ntlm_auth: %s", fr_syserror(errno));
+		reconnect:
+			helper_reconnect(helper);
+			return;
+		}
+		if (slen == 0) {
+			ERROR("ntlm_auth closed its output");
+			goto reconnect;
+		}
+		helper->used += slen;
+
+		line = helper->buff;
+		while ((end = memchr(line, '\n', (helper->buff + helper->used) - line))) {
+			if (!helper->busy) {
+				ERROR("Unexpected output from ntlm_auth: %.*s", (int) (end - line), line);
+				goto reconnect;
+			}
+
+			switch (helper_line_process(helper, line, end)) {
+			case 1:
+				helper_response_done(helper);
+				break;
+
+			case 0:
+				break;
+
+			default:
+				goto reconnect;
+			}
+
+			line = end + 1;
+		}
+
+		helper->used -= line - helper->buff;
+		memmove(helper->buff, line, helper->used);
+
+		if (helper->used == sizeof(helper->buff)) {
+			ERROR("Line from ntlm_auth is too long");
+			goto reconnect;
+		}
+	}
+}
+
+/** Stop tracking a request which has been cancelled, or moved to another helper
+ *
+ * If the request has been sent, the helper stays busy until its response
+ * has been read and discarded.
+ */
+static void helper_request_cancel(fr_connection_t *conn, void *preq, UNUSED fr_trunk_cancel_reason_t reason,
+				  UNUSED void *uctx)
+{
+	mschap_helper_t *helper = talloc_get_type_abort(conn->h, mschap_helper_t);
+
+	if (helper->treq && (helper->treq->preq == preq)) helper->treq = NULL;
+}
+
+static void helper_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	mschap_helper_auth_t	*auth = talloc_get_type_abort(preq, mschap_helper_auth_t);
+
+	auth->treq = NULL;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+static void helper_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+				UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	mschap_helper_auth_t	*auth = talloc_get_type_abort(preq, mschap_helper_auth_t);
+
+	auth->treq = NULL;
+	auth->failed = true;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+/** Split the helper's command line into arguments
+ *
+ * @param[in] inst	Module instance.  The arguments are allocated in it.
+ * @param[in] conf	Module section, for error messages.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mschap_helper_instantiate(rlm_mschap_t *inst, CONF_SECTION *conf)
+{
+	char const	*argv[HELPER_MAX_ARGV];
+	char		argv_buf[4096];
+	int		argc, i;
+
+	if (strchr(inst->ntlm_helper_program, '%')) {
+		cf_log_err(conf, "ntlm_auth_helper.program must not contain expansions");
+		return -1;
+	}
+
+	argc = rad_expand_xlat(NULL, inst->ntlm_helper_program, HELPER_MAX_ARGV, argv, false,
+			       sizeof(argv_buf), argv_buf);
+	if (argc < 0) {
+		cf_log_perr(conf, "Invalid ntlm_auth_helper.program");
+		return -1;
+	}
+
+	if (argv[0][0] != '/') {
+		cf_log_err(conf, "ntlm_auth_helper.program must start with the absolute path to ntlm_auth");
+		return -1;
+	}
+
+	MEM(inst->ntlm_helper_argv = talloc_zero_array(inst, char *, argc + 1));
+	for (i = 0; i < argc; i++) {
+		MEM(inst->ntlm_helper_argv[i] = talloc_typed_strdup(inst->ntlm_helper_argv, argv[i]));
+	}
+
+	/*
+	 *	Helpers only authenticate one request at a time.
+	 */
+	inst->ntlm_helper_trunk_conf.always_writable = true;
+	inst->ntlm_helper_trunk_conf.target_req_per_conn = 1;
+	inst->ntlm_helper_trunk_conf.max_req_per_conn = 1;
+
+	return 0;
+}
+
+/** Allocate a trunk of helpers for a thread
+ *
+ * @param[in] t		Thread specific data.  The trunk is allocated in it.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on error.
+ */
+fr_trunk_t *mschap_helper_trunk_alloc(rlm_mschap_thread_t *t)
+{
+	return fr_trunk_alloc(t, t->el,
+			      &(fr_trunk_io_funcs_t){
+				.connection_alloc = helper_connection_alloc,
+				.request_mux = helper_request_mux,
+				.request_demux = helper_request_demux,
+				.request_cancel = helper_request_cancel,
+				.request_complete = helper_request_complete,
+				.request_fail = helper_request_fail
+			      },
+			      &t->inst->ntlm_helper_trunk_conf, t->name, t, false);
+}
+
+/** Allocate an authentication to run on a helper
+ *
+ * @param[in] ctx		to allocate the authentication in.
+ * @param[in] request		the authentication is for.
+ * @param[in] username		to authenticate.
+ * @param[in] domain		of the user.  May be NULL.
+ * @param[in] challenge		MS-CHAP challenge.
+ * @param[in] response		NT-Response from the client.
+ * @return A new authentication.
+ */
+mschap_helper_auth_t *mschap_helper_auth_alloc(TALLOC_CTX *ctx, request_t *request,
+					       char const *username, char const *domain,
+					       uint8_t const challenge[static 8], uint8_t const response[static 24])
+{
+	mschap_helper_auth_t	*auth;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+
+	MEM(auth = talloc_zero(ctx, mschap_helper_auth_t));
+	auth->request = request;
+
+	MEM(fr_sbuff_init_talloc(auth, &sbuff, &tctx, 256, PIPE_BUF - 1));
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "Username:: ") < 0) ||
+	    (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *) username, strlen(username)), true) < 0) ||
+	    (fr_sbuff_in_char(&sbuff, '\n') < 0)) {
+	error:
+		REDEBUG("Request to ntlm_auth is too long");
+		talloc_free(auth);
+		return NULL;
+	}
+
+	if (domain &&
+	    ((fr_sbuff_in_strcpy_literal(&sbuff, "NT-Domain:: ") < 0) ||
+	     (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *) domain, strlen(domain)), true) < 0) ||
+	     (fr_sbuff_in_char(&sbuff, '\n') < 0))) goto error;
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "LANMAN-Challenge: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(challenge, 8)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nNT-Response: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(response, 24)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nRequest-User-Session-Key: Yes\n.\n") < 0)) goto error;
+
+	auth->query_len = fr_sbuff_used(&sbuff);
+	auth->query = sbuff.buff;
+
+	return auth;
+}
+
+/** Queue an authentication to run on a thread's helpers
+ *
+ * The request is marked runnable once the authentication is complete.
+ * Until then, auth->treq is set.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] auth	to run.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the authentication couldn't be queued.
+ */
+int mschap_helper_auth_enqueue(rlm_mschap_thread_t *t, mschap_helper_auth_t *auth)
+{
+	switch (fr_trunk_request_enqueue(&auth->treq, t->helpers, auth->request, auth, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return 0;
+
+	default:
+		auth->treq = NULL;
+		auth->failed = true;
+		return -1;
+	}
+}
+
+/** Stop waiting for an authentication
+ *
+ * @param[in] auth	to cancel.
+ */
+void mschap_helper_auth_cancel(mschap_helper_auth_t *auth)
+{
+	fr_trunk_request_t *treq = auth->treq;
+
+	if (!treq) return;
+
+	auth->treq = NULL;
+	fr_trunk_request_signal_cancel(treq);
+}
@@ -0,0 +1,32 @@
+#pragma once
+/* @copyright 2026 The FreeRADIUS server project */
+RCSIDH(auth_ntlm_helper_h, "$Id$")
+
+/** An authentication run by an ntlm_auth helper
+ *
+ */
+typedef struct {
+	request_t		*request;		//!< The authentication is for.
+	fr_trunk_request_t	*treq;			//!< Trunk request.  NULL once complete.
+
+	char			*query;			//!< Sent to the helper.
+	size_t			query_len;		//!< Length of the query.
+
+	bool			failed;			//!< The helper didn't respond.
+	bool			authenticated;		//!< Authenticated: Yes.
+	bool			have_key;		//!< Whether nthashhash was set.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< From User-Session-Key.
+	char			*error;			//!< From Authentication-Error, or Error.
+} mschap_helper_auth_t;
+
+int			mschap_helper_instantiate(rlm_mschap_t *inst, CONF_SECTION *conf);
+
+fr_trunk_t		*mschap_helper_trunk_alloc(rlm_mschap_thread_t *t);
+
+mschap_helper_auth_t	*mschap_helper_auth_alloc(TALLOC_CTX *ctx, request_t *request,
+						  char const *username, char const *domain,
+						  uint8_t const challenge[static 8], uint8_t const response[static 24]);
+
+int			mschap_helper_auth_enqueue(rlm_mschap_thread_t *t, mschap_helper_auth_t *auth);
+
+void			mschap_helper_auth_cancel(mschap_helper_auth_t *auth);
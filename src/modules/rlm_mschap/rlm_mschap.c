@@ -49,6 +49,7 @@ RCSID("$Id$")
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "smbdes.h"
+#include "auth_ntlm_helper.h"
 
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
@@ -96,6 +97,15 @@ static const CONF_PARSER winbind_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_helper_program) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	{ FR_CONF_OFFSET("health_check_interval", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_helper_health_check_interval), .dflt = "30" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_mschap_t, ntlm_helper_trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_mschap_t, normify), .dflt = "yes" },
 
@@ -109,6 +119,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
 
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
+
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
 	{ FR_CONF_OFFSET("retry_msg", FR_TYPE_STRING, rlm_mschap_t, retry_msg) },
@@ -1188,6 +1200,99 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Convert a failure message from ntlm_auth into an MS-CHAP result
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Output from ntlm_auth.  Is truncated at the first
+ *			newline.
+ * @return
+ *	- -648 if the password has expired.
+ *	- -647 if the account is locked out.
+ *	- -691 if the account is disabled.
+ *	- -2 if there are no logon servers available.
+ *	- -1 for any other failure.
+ */
+static int mschap_ntlm_auth_error(request_t *request, char *buffer)
+{
+	char	*p;
+	int	result;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+	if (p) *p = '\0';
+
+	REDEBUG("External script says: %s", buffer);
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1253,84 +1358,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program_legacy(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return mschap_ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1676,7 +1704,7 @@ static int CC_HINT(nonnull(1, 2, 3)) nt_password_find(bool *ephemeral, fr_pair_t
 		 *	..if we're not, then we can call out to external sources.
 		 */
 		} else {
-			return -1;
+			return 0;
 		}
 	}
 
@@ -1851,22 +1879,53 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method,
-									       mschap_auth_call_env_t *env_data)
+/** State for an MS-CHAP authentication
+ *
+ * Kept across yields, while ntlm_auth helpers authenticate the user.
+ */
+typedef struct {
+	mschap_auth_call_env_t	*env_data;		//!< Call environment data.
+	MSCHAP_AUTH_METHOD	method;			//!< How to authenticate the user.
+
+	fr_pair_t		*nt_password;		//!< Known good password.  May be NULL.
+	bool			ephemeral;		//!< Whether we created nt_password, and
+							///< must free it.
+	fr_pair_t		*smb_ctrl;		//!< SMB-Account-Ctrl.  May be NULL.
+
+	fr_pair_t		*challenge;		//!< MS-CHAP-Challenge.
+	fr_pair_t		*response;		//!< MS-CHAP-Response or MS-CHAP2-Response.
+	int			mschap_version;		//!< 1 or 2.
+
+	uint8_t const		*auth_challenge;	//!< 8 octet challenge to check the response with.
+	uint8_t			mschap_challenge[16];	//!< Challenge derived from the MS-CHAPv2 challenges.
+	uint8_t const		*peer_challenge;	//!< MS-CHAPv2 peer challenge.
+	char const		*username_str;		//!< MS-CHAPv2 username, without the domain.
+	size_t			username_len;		//!< Length of username_str.
+#ifdef __APPLE__
+	bool			od_authenticated;	//!< OpenDirectory authenticated the user.
+#endif
+
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+
+	mschap_helper_auth_t	*helper;		//!< Authentication running on an ntlm_auth helper.
+} mschap_auth_ctx_t;
+
+static int _mschap_auth_ctx_free(mschap_auth_ctx_t *auth_ctx)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
 
-	*mschap_version = 1;
+	return 0;
+}
+
+static CC_HINT(nonnull) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
+								request_t *request,
+								mschap_auth_ctx_t *auth_ctx)
+{
+	mschap_auth_call_env_t	*env_data = auth_ctx->env_data;
+	fr_pair_t		*challenge = auth_ctx->challenge;
+	fr_pair_t		*response = auth_ctx->response;
+
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1895,42 +1954,24 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
+	auth_ctx->auth_challenge = challenge->vp_octets;
 
-	/*
-	 *	Do the MS-CHAP authentication.
-	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method, env_data);
-
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl, env_data);
+	RETURN_MODULE_OK;
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method,
-										  mschap_auth_call_env_t *env_data)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result,
+								   rlm_mschap_t const *inst,
+								   request_t *request,
+								   mschap_auth_ctx_t *auth_ctx)
 {
-		uint8_t		mschap_challenge[16];
-		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
-		char const	*username_str;
-		size_t		username_len;
-		int		mschap_result;
-		rlm_rcode_t	rcode;
-		char		msch2resp[42];
+		mschap_auth_call_env_t	*env_data = auth_ctx->env_data;
+		fr_pair_t		*challenge = auth_ctx->challenge;
+		fr_pair_t		*response = auth_ctx->response;
+		fr_pair_t		*user_name, *name_vp, *response_name, *peer_challenge_attr;
+		char const		*username_str;
+		size_t			username_len;
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1997,18 +2038,23 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
+			rlm_rcode_t rcode;
+
 			RDEBUG2("No Password.NT available. Trying OpenDirectory Authentication");
 			od_mschap_auth(&rcode, request, challenge, user_name, env_data);
-			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
+			if (rcode != RLM_MODULE_NOOP) {
+				auth_ctx->od_authenticated = (rcode == RLM_MODULE_OK);
+				RETURN_MODULE_RCODE(rcode);
+			}
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da(&request->control_pairs, NULL, attr_ms_chap_peer_challenge);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
 		/*
@@ -2020,23 +2066,37 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 */
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
-		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+		mschap_challenge_hash(auth_ctx->mschap_challenge,	/* resulting challenge */
+				      auth_ctx->peer_challenge,		/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method, env_data);
+		auth_ctx->auth_challenge = auth_ctx->mschap_challenge;
+		auth_ctx->username_str = username_str;
+		auth_ctx->username_len = username_len;
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl, env_data);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+		RETURN_MODULE_OK;
+}
+
+/** Add MS-CHAP2-Success once the MS-CHAPv2 response has been checked
+ *
+ */
+static void mschap_process_v2_success(
+#ifndef WITH_AUTH_WINBIND
+				      UNUSED
+#endif
+				      rlm_mschap_t const *inst,
+				      request_t *request, mschap_auth_ctx_t *auth_ctx)
+{
+		fr_pair_t	*response = auth_ctx->response;
+		char const	*username_str = auth_ctx->username_str;
+		size_t		username_len = auth_ctx->username_len;
+		char		msch2resp[42];
 
 #ifdef WITH_AUTH_WINBIND
 		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
 			response_name = fr_pair_find_by_da(&request->request_pairs, NULL, attr_ms_chap_user_name);
 			if (response_name) {
 				if (strcmp(username_str, response_name->vp_strvalue)) {
@@ -2051,15 +2111,172 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 
 		mschap_auth_response(username_str,		/* without the domain */
 				     username_len,		/* Length of username str */
-				     nthashhash,		/* nt-hash-hash */
+				     auth_ctx->nthashhash,	/* nt-hash-hash */
 				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
 				     msch2resp);		/* calculated MPPE key */
-		if (env_data->chap2_success) mschap_add_reply(request, *response->vp_octets,
-							      tmpl_attr_tail_da(env_data->chap2_success), msch2resp, 42);
+		if (auth_ctx->env_data->chap2_success) {
+			mschap_add_reply(request, *response->vp_octets,
+					 tmpl_attr_tail_da(auth_ctx->env_data->chap2_success), msch2resp, 42);
+		}
+}
 
-		RETURN_MODULE_OK;
+/** Create MPPE attributes
+ *
+ */
+static void mschap_mppe_add(rlm_mschap_t const *inst, request_t *request, mschap_auth_ctx_t *auth_ctx)
+{
+	mschap_auth_call_env_t	*env_data = auth_ctx->env_data;
+	fr_pair_t		*vp;
+	uint8_t			mppe_sendkey[34];
+	uint8_t			mppe_recvkey[34];
+
+	switch (auth_ctx->mschap_version) {
+	case 1:
+		RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+		memset(mppe_sendkey, 0, 32);
+
+		/*
+		 *	According to RFC 2548 we
+		 *	should send NT hash.  But in
+		 *	practice it doesn't work.
+		 *	Instead, we should send nthashhash
+		 *
+		 *	This is an error in RFC 2548.
+		 */
+		/*
+		 *	do_mschap cares to zero nthashhash if NT hash
+		 *	is not available.
+		 */
+		memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+		mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->chap_mppe_keys), mppe_sendkey, 24);	//-V666
+		break;
+
+	case 2:
+		RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+		mppe_chap2_gen_keys128(auth_ctx->nthashhash, auth_ctx->response->vp_octets + 26,
+				       mppe_sendkey, mppe_recvkey);
+
+		mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->mppe_recv_key), mppe_recvkey, 16);
+		mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->mppe_send_key), mppe_sendkey, 16);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+	MEM(pair_update_reply(&vp, tmpl_attr_tail_da(env_data->mppe_encryption_policy)) >= 0);
+	vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+	MEM(pair_update_reply(&vp, tmpl_attr_tail_da(env_data->mppe_encryption_types)) >= 0);
+	vp->vp_uint32 = inst->require_strong ? 4 : 6;
+}
+
+/** Finish an authentication, once the response has been checked
+ *
+ * Frees the authentication state.
+ */
+static unlang_action_t mschap_auth_finish(rlm_rcode_t *p_result, rlm_mschap_t const *inst, request_t *request,
+					  mschap_auth_ctx_t *auth_ctx, int mschap_result)
+{
+	rlm_rcode_t	rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *auth_ctx->response->vp_octets,
+		     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl, auth_ctx->env_data);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (auth_ctx->mschap_version == 2) mschap_process_v2_success(inst, request, auth_ctx);
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) mschap_mppe_add(inst, request, auth_ctx);
+
+finish:
+	talloc_free(auth_ctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Check the result from an ntlm_auth helper
+ *
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+	mschap_helper_auth_t	*helper = auth_ctx->helper;
+	int			mschap_result = 0;
+
+	if (helper->failed) {
+		REDEBUG("No response from ntlm_auth");
+		talloc_free(auth_ctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!helper->authenticated) {
+		mschap_result = helper->error ? mschap_ntlm_auth_error(request, helper->error) : -1;
+
+	} else if (!helper->have_key) {
+		REDEBUG("Invalid output from ntlm_auth: expecting User-Session-Key");
+		mschap_result = -1;
+
+	} else {
+		memcpy(auth_ctx->nthashhash, helper->nthashhash, NT_DIGEST_LENGTH);
+	}
+
+	return mschap_auth_finish(p_result, inst, request, auth_ctx, mschap_result);
+}
+
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+
+	mschap_helper_auth_cancel(auth_ctx->helper);
+}
+
+/** Send the response to an ntlm_auth helper, and wait for the result
+ *
+ */
+static unlang_action_t mschap_helper_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					  mschap_auth_ctx_t *auth_ctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+	char			*username = NULL, *domain = NULL;
+
+	if (tmpl_aexpand(auth_ctx, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding ntlm_auth_helper.username");
+	fail:
+		talloc_free(auth_ctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->ntlm_helper_domain &&
+	    (tmpl_aexpand(auth_ctx, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0)) {
+		RPEDEBUG("Failed expanding ntlm_auth_helper.domain");
+		goto fail;
+	}
+
+	auth_ctx->helper = mschap_helper_auth_alloc(auth_ctx, request, username, domain,
+						    auth_ctx->auth_challenge, auth_ctx->response->vp_octets + 26);
+	if (!auth_ctx->helper) goto fail;
+
+	(void) unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, ~FR_SIGNAL_CANCEL,
+				   auth_ctx);
+
+	/*
+	 *	If the authentication couldn't be queued,
+	 *	process the failure immediately.
+	 */
+	if ((mschap_helper_auth_enqueue(t, auth_ctx->helper) < 0) || !auth_ctx->helper->treq) {
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	return UNLANG_ACTION_YIELD;
 }
 
 /*
@@ -2082,16 +2299,15 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 {
 	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
 	mschap_auth_call_env_t	*env_data = talloc_get_type_abort(mctx->env_data, mschap_auth_call_env_t);
+	mschap_auth_ctx_t	*auth_ctx;
 	fr_pair_t		*challenge = NULL;
 	fr_pair_t		*response = NULL;
 	fr_pair_t		*cpw = NULL;
 	fr_pair_t		*parent;
-	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
+	fr_pair_t		*smb_ctrl;
+	int			mschap_result;
 
 	MSCHAP_AUTH_METHOD	method;
-	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
 	/*
@@ -2138,6 +2354,15 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		}
 	}
 
+	/*
+	 *	The authentication state outlives this call if
+	 *	we have to wait for an ntlm_auth helper.
+	 */
+	MEM(auth_ctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), mschap_auth_ctx_t));
+	auth_ctx->env_data = env_data;
+	auth_ctx->method = method;
+	auth_ctx->smb_ctrl = smb_ctrl;
+
 	/*
 	 *	Look for or create an Password.NT
 	 *
@@ -2145,7 +2370,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 *	input attribute, and we're calling out to an
 	 *	external password store.
 	 */
-	if (nt_password_find(&ephemeral, &nt_password, mctx->inst->data, request) < 0) RETURN_MODULE_FAIL;
+	if (nt_password_find(&auth_ctx->ephemeral, &auth_ctx->nt_password, mctx->inst->data, request) < 0) {
+		talloc_free(auth_ctx);
+		RETURN_MODULE_FAIL;
+	}
+	talloc_set_destructor(auth_ctx, _mschap_auth_ctx_free);
 
 	/*
 	 *	Check to see if this is a change password request, and process
@@ -2156,7 +2385,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	if (cpw) {
 		uint8_t		*p;
 
-		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, nt_password, env_data);
+		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, auth_ctx->nt_password, env_data);
 		if (rcode != RLM_MODULE_OK) goto finish;
 
 		/*
@@ -2191,6 +2420,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		rcode = RLM_MODULE_INVALID;
 		goto finish;
 	}
+	auth_ctx->challenge = challenge;
 
 	/*
 	 *	The responses MUST be in the same group as the challenge.
@@ -2202,20 +2432,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 *	We also require an MS-CHAP-Response.
 	 */
 	if ((response = fr_pair_find_by_da(&parent->vp_group, NULL, tmpl_attr_tail_da(env_data->chap_response)))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method, env_data);
+		auth_ctx->response = response;
+		mschap_process_response(&rcode, request, auth_ctx);
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else if ((response = fr_pair_find_by_da_nested(&parent->vp_group, NULL, tmpl_attr_tail_da(env_data->chap2_response)))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method, env_data);
+		auth_ctx->response = response;
+		mschap_process_v2_response(&rcode, inst, request, auth_ctx);
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
@@ -2224,57 +2446,62 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
+#ifdef __APPLE__
+	if (auth_ctx->od_authenticated) {
+		if (inst->use_mppe) mschap_mppe_add(inst, request, auth_ctx);
+		goto finish;
+	}
+#endif
 
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
+	/*
+	 *	Do the MS-CHAP authentication.
+	 */
+	if (method == AUTH_NTLMAUTH_HELPER) return mschap_helper_auth(p_result, mctx, request, auth_ctx);
 
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->chap_mppe_keys), mppe_sendkey, 24);	//-V666
-			break;
+	mschap_result = do_mschap(inst, request, auth_ctx->nt_password, auth_ctx->auth_challenge,
+				  response->vp_octets + 26, auth_ctx->nthashhash, method, env_data);
 
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+	return mschap_auth_finish(p_result, inst, request, auth_ctx, mschap_result);
 
-			mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->mppe_recv_key), mppe_recvkey, 16);
-			mppe_add_reply(inst, request, tmpl_attr_tail_da(env_data->mppe_send_key), mppe_sendkey, 16);
-			break;
+finish:
+	talloc_free(auth_ctx);
 
-		default:
-			fr_assert(0);
-			break;
-		}
+	RETURN_MODULE_RCODE(rcode);
+}
 
-		MEM(pair_update_reply(&vp, tmpl_attr_tail_da(env_data->mppe_encryption_policy)) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+/** Start this thread's ntlm_auth helpers
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
 
-		MEM(pair_update_reply(&vp, tmpl_attr_tail_da(env_data->mppe_encryption_types)) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	t->inst = inst;
+	t->name = mctx->inst->name;
+	t->el = mctx->el;
 
-finish:
-	if (ephemeral) TALLOC_FREE(nt_password);
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
 
-	RETURN_MODULE_RCODE(rcode);
+	t->helpers = mschap_helper_trunk_alloc(t);
+	if (!t->helpers) {
+		ERROR("Failed creating trunk of ntlm_auth helpers");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop this thread's ntlm_auth helpers
+ *
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	TALLOC_FREE(t->helpers);
+
+	return 0;
 }
 
 /*
@@ -2317,6 +2544,19 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/*
+	 *	...unless we've been told to keep ntlm_auth running.
+	 */
+	if (inst->ntlm_helper_program) {
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(conf, "ntlm_auth_helper.username must be set when ntlm_auth_helper.program is set");
+			return -1;
+		}
+		if (mschap_helper_instantiate(inst, conf) < 0) return -1;
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2324,6 +2564,9 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating with persistent 'ntlm_auth' helpers");
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
@@ -2418,7 +2661,12 @@ module_rlm_t rlm_mschap = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+		.thread_inst_type	= "rlm_mschap_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = "recv",		.name2 = CF_IDENT_ANY,		.method = mod_authorize,
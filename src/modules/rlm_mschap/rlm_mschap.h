@@ -6,6 +6,7 @@ RCSIDH(rlm_mschap_h, "$Id$")
 
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/server/tmpl.h>
+#include <freeradius-devel/server/trunk.h>
 
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
@@ -16,7 +17,8 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 3
 #ifdef WITH_AUTH_WINBIND
 	,AUTH_WBCLIENT       	= 2
 #endif
@@ -49,6 +51,12 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper_program;
+	char			**ntlm_helper_argv;	//!< ntlm_helper_program split into arguments.
+	tmpl_t			*ntlm_helper_username;
+	tmpl_t			*ntlm_helper_domain;
+	fr_time_delta_t		ntlm_helper_health_check_interval;
+	fr_trunk_conf_t		ntlm_helper_trunk_conf;
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -68,6 +76,13 @@ typedef struct {
 #endif
 } rlm_mschap_t;
 
+typedef struct {
+	rlm_mschap_t const	*inst;		//!< Module instance.
+	char const		*name;		//!< Module instance name, for logging.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	fr_trunk_t		*helpers;	//!< Pool of ntlm_auth helper processes.
+} rlm_mschap_thread_t;
+
 typedef struct {
 	tmpl_t const	*username;
 	tmpl_t const	*chap_error;
@@ -33,6 +33,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_util.h>
@@ -85,6 +86,13 @@ typedef struct {
 	fr_redis_cluster_t	*cluster;				//!< Redis cluster.
 } rlm_redis_t;
 
+/** rlm_redis thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;			//!< Trunks to each cluster node.
+} rlm_redis_thread_t;
+
 static int lua_func_body_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static CONF_PARSER module_lua_func[] = {
@@ -572,6 +580,119 @@ static int redis_lua_func_instantiate(xlat_inst_ctx_t const *xctx)
 	return 0;
 }
 
+/** State of a command set being run by redis_xlat
+ *
+ */
+typedef struct {
+	fr_redis_command_set_t	*cmds;		//!< Commands being run.  NULL once the command set
+						///< has completed, and been freed.
+	redisReply		*reply;		//!< Reply to the user's command.
+	bool			read_only;	//!< Command was wrapped in READONLY/READWRITE.
+	bool			failed;		//!< Command set could not be run.
+} redis_xlat_rctx_t;
+
+static int _redis_xlat_rctx_free(redis_xlat_rctx_t *xlat_rctx)
+{
+	fr_redis_reply_free(&xlat_rctx->reply);
+
+	return 0;
+}
+
+/** Take the reply to the user's command from the completed command set
+ *
+ */
+static void redis_xlat_complete(request_t *request, fr_dlist_head_t *completed, void *rctx)
+{
+	redis_xlat_rctx_t	*xlat_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+	fr_redis_command_t	*cmd = fr_dlist_head(completed);
+
+	xlat_rctx->cmds = NULL;		/* Freed when we return */
+
+	if (cmd && xlat_rctx->read_only) {
+		redisReply *reply = fr_redis_command_get_result(cmd);
+
+		if (!reply || (reply->type == REDIS_REPLY_ERROR)) {
+			REDEBUG("Setting READONLY failed: %s", reply ? reply->str : "no reply");
+			xlat_rctx->failed = true;
+			goto finish;
+		}
+		cmd = fr_dlist_next(completed, cmd);
+	}
+
+	if (!cmd) {
+		xlat_rctx->failed = true;
+		goto finish;
+	}
+	xlat_rctx->reply = fr_redis_command_steal_result(cmd);
+
+finish:
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the command set could not be run
+ *
+ */
+static void redis_xlat_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *rctx)
+{
+	redis_xlat_rctx_t	*xlat_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+
+	xlat_rctx->cmds = NULL;		/* Freed when we return */
+	xlat_rctx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Convert the reply to the user's command into a value box
+ *
+ */
+static xlat_action_t redis_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				       xlat_ctx_t const *xctx,
+				       request_t *request, UNUSED fr_value_box_list_t *in)
+{
+	redis_xlat_rctx_t	*xlat_rctx = talloc_get_type_abort(xctx->rctx, redis_xlat_rctx_t);
+	fr_value_box_t		*vb_out;
+	xlat_action_t		action = XLAT_ACTION_FAIL;
+
+	if (xlat_rctx->failed) {
+		REDEBUG("Failed executing command");
+		goto finish;
+	}
+
+	if (fr_redis_command_status(NULL, xlat_rctx->reply) != REDIS_RCODE_SUCCESS) {
+		RPERROR("Command failed");
+		goto finish;
+	}
+
+	MEM(vb_out = fr_value_box_alloc_null(ctx));
+	if (fr_redis_reply_to_value_box(ctx, vb_out, xlat_rctx->reply, FR_TYPE_VOID, NULL, false, false) < 0) {
+		RPERROR("Failed processing reply");
+		talloc_free(vb_out);
+		goto finish;
+	}
+	fr_dcursor_append(out, vb_out);
+	action = XLAT_ACTION_DONE;
+
+finish:
+	talloc_free(xlat_rctx);
+
+	return action;
+}
+
+/** Cancel the command set if the request is cancelled
+ *
+ */
+static void redis_xlat_signal(xlat_ctx_t const *xctx, request_t *request, UNUSED fr_signal_t action)
+{
+	redis_xlat_rctx_t	*xlat_rctx = talloc_get_type_abort(xctx->rctx, redis_xlat_rctx_t);
+
+	if (!xlat_rctx->cmds) return;
+
+	RDEBUG2("Cancelling pending REDIS command");
+
+	fr_redis_command_set_signal_cancel(xlat_rctx->cmds);
+	xlat_rctx->cmds = NULL;
+}
+
 static xlat_arg_parser_t const redis_args[] = {
 	{ .required = true, .concat = true, .type = FR_TYPE_STRING },
 	{ .variadic = XLAT_ARG_VARIADIC_EMPTY_KEEP, .concat = true, .type = FR_TYPE_STRING },
@@ -591,6 +712,7 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 				request_t *request, fr_value_box_list_t *in)
 {
 	rlm_redis_t const	*inst = talloc_get_type_abort_const(xctx->mctx->inst->data, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(xctx->mctx->thread, rlm_redis_thread_t);
 	xlat_action_t		action = XLAT_ACTION_DONE;
 	fr_redis_conn_t		*conn;
 
@@ -598,11 +720,11 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
+	fr_redis_rcode_t	status;
+	fr_redis_trunk_t	*rtrunk;
+	redis_xlat_rctx_t	*xlat_rctx;
 
 	redisReply		*reply = NULL;
-	int			s_ret;
 
 	fr_value_box_t		*first = fr_value_box_list_head(in);
 	fr_sbuff_t		sbuff = FR_SBUFF_IN(first->vb_strvalue, first->vb_length);
@@ -714,7 +836,7 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		if (argc == NUM_ELEMENTS(argv)) {
 			REDEBUG("Too many arguments (%i)", argc);
 			REXDENT();
-			goto finish;
+			return XLAT_ACTION_FAIL;
 		}
 
 		argv[argc] = vb->vb_strvalue;
@@ -723,6 +845,12 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	}
 	REXDENT();
 
+	/*
+	 *	Skip the read only marker
+	 */
+	argv[0] = fr_sbuff_current(&sbuff);
+	arg_len[0] = fr_sbuff_remaining(&sbuff);
+
 	/*
 	 *	If we've got multiple arguments, the second one is usually the key.
 	 *	The Redis docs say commands should be analysed first to get key
@@ -735,31 +863,50 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	 	key_len = arg_len[1];
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		RDEBUG2("Executing command: %pV", fr_value_box_list_head(in));
-		if (argc > 1) {
-			RDEBUG2("With arguments");
-			RINDENT();
-			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
-			REXDENT();
-		}
+	rtrunk = fr_redis_trunk_by_key(t->cluster, request, key, key_len, read_only);
+	if (!rtrunk) return XLAT_ACTION_FAIL;
 
-		if (redis_command(&status, &reply, request, conn, read_only, argc, argv, arg_len) == -2) {
-			state.close_conn = true;
-		}
+	MEM(xlat_rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), redis_xlat_rctx_t));
+	talloc_set_destructor(xlat_rctx, _redis_xlat_rctx_free);
+	xlat_rctx->read_only = read_only;
+	xlat_rctx->cmds = fr_redis_command_set_alloc(request, redis_xlat_complete, redis_xlat_fail, xlat_rctx);
+
+	/*
+	 *	Commands are pipelined with those from other
+	 *	requests, so the READWRITE must be in the same
+	 *	command set.
+	 */
+	if ((read_only &&
+	     (fr_redis_command_argv_add(xlat_rctx->cmds, 1, &(char const *){ "READONLY" },
+	     				&(size_t){ sizeof("READONLY") - 1 }) != FR_REDIS_PIPELINE_OK)) ||
+	    (fr_redis_command_argv_add(xlat_rctx->cmds, argc, argv, arg_len) != FR_REDIS_PIPELINE_OK) ||
+	    (read_only &&
+	     (fr_redis_command_argv_add(xlat_rctx->cmds, 1, &(char const *){ "READWRITE" },
+	     				&(size_t){ sizeof("READWRITE") - 1 }) != FR_REDIS_PIPELINE_OK))) {
+	error:
+		talloc_free(xlat_rctx->cmds);
+		talloc_free(xlat_rctx);
+		return XLAT_ACTION_FAIL;
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		action = XLAT_ACTION_FAIL;
-		goto finish;
+
+	RDEBUG2("Executing command: %pV", fr_value_box_list_head(in));
+	if (fr_redis_command_set_enqueue(rtrunk, xlat_rctx->cmds) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueueing command");
+		goto error;
 	}
 
-	if (!fr_cond_assert(reply)) {
-		action = XLAT_ACTION_FAIL;
-		goto finish;
+	/*
+	 *	Writing the commands failed, and the
+	 *	command set has already been freed.
+	 */
+	if (!xlat_rctx->cmds) {
+		REDEBUG("Failed sending command");
+		talloc_free(xlat_rctx);
+		return XLAT_ACTION_FAIL;
 	}
 
+	return unlang_xlat_yield(request, redis_xlat_resume, redis_xlat_signal, ~FR_SIGNAL_CANCEL, xlat_rctx);
+
 reply_parse:
 	MEM(vb_out = fr_value_box_alloc_null(ctx));
 	if (fr_redis_reply_to_value_box(ctx, vb_out, reply, FR_TYPE_VOID, NULL, false, false) < 0) {
@@ -858,6 +1005,16 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, mctx->el, inst->cluster, &inst->conf);
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_redis_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_redis_t);
@@ -905,6 +1062,9 @@ module_rlm_t rlm_redis = {
 		.config		= module_config,
 		.onload		= mod_load,
 		.bootstrap	= mod_bootstrap,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.thread_inst_size	= sizeof(rlm_redis_thread_t),
+		.thread_inst_type	= "rlm_redis_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	}
 };
@@ -50,6 +50,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+
+#include <freeradius-devel/unlang/module.h>
 #include "redis_ippool.h"
 
 /** rlm_redis module instance
@@ -75,6 +78,41 @@ typedef struct {
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Trunks to each cluster node.
+} rlm_redis_ippool_thread_t;
+
+#define IPPOOL_SCRIPT_MAX_ARGS		9	//!< Maximum number of arguments to EVALSHA.
+#define IPPOOL_SCRIPT_MAX_REPLIES	5	//!< Must be equal to the maximum number of pipelined commands.
+
+/** State of a script being run against a pool
+ *
+ */
+typedef struct {
+	fr_redis_command_set_t	*cmds;				//!< Commands being run.  NULL once the command
+								///< set has completed, and been freed.
+	redisReply		*replies[IPPOOL_SCRIPT_MAX_REPLIES];	//!< Replies to the commands.
+	size_t			reply_cnt;			//!< How many replies we received.
+	redisReply		*reply;				//!< Result of the script.
+
+	bool			failed;				//!< Command set could not be run.
+	bool			loaded;				//!< Script was sent with SCRIPT LOAD, because the
+								///< server didn't have it.
+
+	fr_value_box_t const	*key;				//!< Pool name.  Determines the cluster node.
+	char const		*digest;			//!< of the script.
+	char const		*script;			//!< to load if the server doesn't have it.
+
+	int			argc;				//!< Number of EVALSHA arguments.
+	char const		*argv[IPPOOL_SCRIPT_MAX_ARGS];	//!< EVALSHA arguments.
+	size_t			argv_len[IPPOOL_SCRIPT_MAX_ARGS];	//!< Length of each argument.
+
+	uint32_t		expires;			//!< Lease time we asked for.
+} redis_ippool_rctx_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -561,139 +599,344 @@ static void ippool_action_print(request_t *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+static int _redis_ippool_rctx_free(redis_ippool_rctx_t *rctx)
+{
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+	fr_redis_reply_free(&rctx->reply);
+
+	return 0;
+}
+
+/** Allocate the state for running a script
  *
- * Handles uploading the script to the server if required.
+ * @param[in] request	The current request.
+ * @param[in] key	Pool name, used to determine the cluster node.
+ * @param[in] digest	of script.
+ * @param[in] script	to upload.
+ * @return A new script context, with the EVALSHA command, digest, key
+ *	   count and key as the first arguments.
+ */
+static redis_ippool_rctx_t *ippool_script_alloc(request_t *request, fr_value_box_t const *key,
+						char const *digest, char const *script)
+{
+	redis_ippool_rctx_t *rctx;
+
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), redis_ippool_rctx_t));
+	talloc_set_destructor(rctx, _redis_ippool_rctx_free);
+	rctx->key = key;
+	rctx->digest = digest;
+	rctx->script = script;
+
+	rctx->argv[0] = "EVALSHA";
+	rctx->argv_len[0] = sizeof("EVALSHA") - 1;
+	rctx->argv[1] = digest;
+	rctx->argv_len[1] = SHA1_DIGEST_LENGTH * 2;
+	rctx->argv[2] = "1";
+	rctx->argv_len[2] = 1;
+	rctx->argv[3] = key->vb_strvalue;
+	rctx->argv_len[3] = key->vb_length;
+	rctx->argc = 4;
+
+	return rctx;
+}
+
+/** Add an argument to the EVALSHA command
  *
- * @note All replies will be freed on error.
+ */
+static inline CC_HINT(always_inline)
+void ippool_script_arg(redis_ippool_rctx_t *rctx, char const *arg, size_t arg_len)
+{
+	fr_assert(rctx->argc < IPPOOL_SCRIPT_MAX_ARGS);
+
+	rctx->argv[rctx->argc] = arg;
+	rctx->argv_len[rctx->argc++] = arg_len;
+}
+
+/** Add an integer argument to the EVALSHA command
  *
- * @param[out] out		Where to write Redis reply object resulting from the command.
- * @param[in] request		The current request.
- * @param[in] cluster		configuration.
- * @param[in] key		to use to determine the cluster node.
- * @param[in] key_len		length of the key.
- * @param[in] wait_num		If > 0 wait until this many slaves have replicated the data
- *				from the last command.
- * @param[in] wait_timeout	How long to wait for slaves to replicate the data.
- * @param[in] digest		of script.
- * @param[in] script		to upload.
- * @param[in] cmd		EVALSHA command to execute.
- * @param[in] ...		Arguments for the eval command.
- * @return status of the command.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, fr_time_delta_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static inline CC_HINT(always_inline)
+void ippool_script_arg_uint(redis_ippool_rctx_t *rctx, uint32_t num)
 {
-	fr_redis_conn_t			*conn;
-	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
-	size_t				reply_cnt = 0, i;
+	char *arg;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		s_ret, status;
-	unsigned int			pipelined = 0;
+	MEM(arg = talloc_typed_asprintf(rctx, "%u", num));
+	ippool_script_arg(rctx, arg, talloc_array_length(arg) - 1);
+}
 
-	va_list				ap;
+/** Add the address being updated or released to the EVALSHA command
+ *
+ */
+static void ippool_script_arg_ip(redis_ippool_rctx_t *rctx, bool ipv4_integer, fr_ipaddr_t *ip)
+{
+	char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+	char *arg;
 
-	*out = NULL;
+	if ((ip->af == AF_INET) && ipv4_integer) {
+		ippool_script_arg_uint(rctx, htonl(ip->addr.v4.s_addr));
+		return;
+	}
 
-#ifndef NDEBUG
-	memset(replies, 0, sizeof(replies));
-#endif
+	IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
+	MEM(arg = talloc_typed_strdup(rctx, ip_buff));
+	ippool_script_arg(rctx, arg, talloc_array_length(arg) - 1);
+}
 
-	va_start(ap, cmd);
+/** Take the replies from the completed command set
+ *
+ */
+static void ippool_script_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_ippool_rctx_t);
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
+	rctx->cmds = NULL;	/* Freed when we return */
 
-	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		pipelined = 1;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
-		}
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status != REDIS_RCODE_NO_SCRIPT) continue;
+	fr_dlist_foreach(completed, fr_redis_command_t, cmd) {
+		if (!fr_cond_assert(rctx->reply_cnt < NUM_ELEMENTS(rctx->replies))) break;
+		rctx->replies[rctx->reply_cnt++] = fr_redis_command_steal_result(cmd);
+	}
 
-		/*
-		 *	Clear out the existing reply
-		 */
-		fr_redis_pipeline_free(replies, reply_cnt);
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the command set could not be run
+ *
+ */
+static void ippool_script_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_ippool_rctx_t);
+
+	rctx->cmds = NULL;	/* Freed when we return */
+	rctx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Cancel the script if the request is cancelled
+ *
+ */
+static void ippool_script_signal(module_ctx_t const *mctx, request_t *request, UNUSED fr_signal_t action)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+
+	if (!rctx->cmds) return;
+
+	RDEBUG2("Cancelling pending REDIS commands");
+
+	fr_redis_command_set_signal_cancel(rctx->cmds);
+	rctx->cmds = NULL;
+}
 
+/** Execute a script against Redis cluster
+ *
+ * The commands are pipelined with those from other requests, on a
+ * connection to the node responsible for the pool.  If the server
+ * doesn't have the script cached, the result will be
+ * REDIS_RCODE_NO_SCRIPT, and this should be called again to upload
+ * the script.
+ *
+ * @param[out] p_result		Result of the module call, if we couldn't yield.
+ * @param[in] mctx		Module context.
+ * @param[in] request		The current request.
+ * @param[in] rctx		Script and arguments to run.  Freed on error.
+ * @param[in] resume		Function to call with the result of the script.
+ * @return
+ *	- UNLANG_ACTION_YIELD if the commands were sent.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if the commands failed, and resume
+ *	  should be called immediately.
+ */
+static unlang_action_t ippool_script(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				     redis_ippool_rctx_t *rctx, module_method_t resume)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	fr_redis_trunk_t		*rtrunk;
+	fr_redis_command_set_t		*cmds;
+	fr_redis_pipeline_status_t	ret = FR_REDIS_PIPELINE_OK;
+
+	rtrunk = fr_redis_trunk_by_key(t->cluster, request,
+				       (uint8_t const *)rctx->key->vb_strvalue, rctx->key->vb_length, false);
+	if (!rtrunk) {
+	error:
+		talloc_free(rctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+	rctx->reply_cnt = 0;
+
+	cmds = fr_redis_command_set_alloc(request, ippool_script_complete, ippool_script_fail, rctx);
+	if (!rctx->loaded) {
+		RDEBUG3("Calling script 0x%s", rctx->digest);
+		ret = fr_redis_command_argv_add(cmds, rctx->argc, rctx->argv, rctx->argv_len);
+	} else {
 		/*
 		 *	Last command failed with NOSCRIPT, this means
 		 *	we have to send the Lua script up to the node
 		 *	so it can be cached.
 		 */
-	     	RDEBUG3("Loading script 0x%s", digest);
-		redisAppendCommand(conn->handle, "MULTI");
-		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		redisAppendCommand(conn->handle, "EXEC");
-		pipelined = 4;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
+		RDEBUG3("Loading script 0x%s", rctx->digest);
+		ret = fr_redis_command_argv_add(cmds, 1, (char const *[]){ "MULTI" },
+						(size_t[]){ sizeof("MULTI") - 1 });
+		if (ret == FR_REDIS_PIPELINE_OK) {
+			ret = fr_redis_command_argv_add(cmds, 3, (char const *[]){ "SCRIPT", "LOAD", rctx->script },
+							(size_t[]){ sizeof("SCRIPT") - 1, sizeof("LOAD") - 1,
+								    strlen(rctx->script) });
+		}
+		if (ret == FR_REDIS_PIPELINE_OK) {
+			ret = fr_redis_command_argv_add(cmds, rctx->argc, rctx->argv, rctx->argv_len);
 		}
+		if (ret == FR_REDIS_PIPELINE_OK) {
+			ret = fr_redis_command_argv_add(cmds, 1, (char const *[]){ "EXEC" },
+							(size_t[]){ sizeof("EXEC") - 1 });
+		}
+	}
+	if ((ret == FR_REDIS_PIPELINE_OK) && inst->wait_num) {
+		char	wait_num[sizeof("4294967295")], wait_timeout[sizeof("4294967295")];
 
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status == REDIS_RCODE_SUCCESS) {
-			if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) {
-				fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
-			}
+		snprintf(wait_num, sizeof(wait_num), "%u", inst->wait_num);
+		snprintf(wait_timeout, sizeof(wait_timeout), "%u", (uint32_t)fr_time_delta_to_msec(inst->wait_timeout));
 
-			if (replies[3]->type != REDIS_REPLY_ARRAY) {
-				RERROR("Bad response to EXEC, expected array got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
-			error:
-				fr_redis_pipeline_free(replies, reply_cnt);
-				status = REDIS_RCODE_ERROR;
-				goto finish;
-			}
-			if (replies[3]->elements != 2) {
-				RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
-				       replies[3]->elements);
-				goto error;
-			}
-			if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
-				RERROR("Bad response to SCRIPT LOAD, expected string got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
-				goto error;
-			}
-			if (strcmp(replies[3]->element[0]->str, digest) != 0) {
-				RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
-					digest, replies[3]->element[0]->str);
-				goto error;
-			}
+		ret = fr_redis_command_argv_add(cmds, 3, (char const *[]){ "WAIT", wait_num, wait_timeout },
+						(size_t[]){ sizeof("WAIT") - 1, strlen(wait_num), strlen(wait_timeout) });
+	}
+	if (ret != FR_REDIS_PIPELINE_OK) {
+		talloc_free(cmds);
+		goto error;
+	}
+	rctx->cmds = cmds;
+
+	(void) unlang_module_yield(request, resume, ippool_script_signal, ~FR_SIGNAL_CANCEL, rctx);
+
+	if (fr_redis_command_set_enqueue(rtrunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueueing commands");
+		talloc_free(cmds);
+		rctx->cmds = NULL;
+		rctx->failed = true;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	/*
+	 *	The commands may have failed as they were
+	 *	being written.
+	 */
+	if (!rctx->cmds) return UNLANG_ACTION_CALCULATE_RESULT;
+
+	return UNLANG_ACTION_YIELD;
+}
+
+/** Check the replies to the commands sent by ippool_script
+ *
+ * @note All replies will be freed on error.
+ *
+ * @param[in] request		The current request.
+ * @param[in] wait_num		If > 0 check this many slaves replicated the data.
+ * @param[in] rctx		containing the replies.  The result of the script
+ *				is written to rctx->reply.
+ * @return
+ *	- REDIS_RCODE_SUCCESS if the script ran.
+ *	- REDIS_RCODE_NO_SCRIPT if the script should be uploaded, by calling
+ *	  ippool_script again.
+ *	- another REDIS_RCODE_* on failure.
+ */
+static fr_redis_rcode_t ippool_script_result(request_t *request, uint32_t wait_num, redis_ippool_rctx_t *rctx)
+{
+	redisReply		**replies = rctx->replies;
+	size_t			reply_cnt = rctx->reply_cnt, i;
+	fr_redis_rcode_t	status = REDIS_RCODE_SUCCESS;
+
+	if (rctx->failed) {
+		REDEBUG("Failed calling script 0x%s", rctx->digest);
+		return REDIS_RCODE_ERROR;
+	}
+
+	fr_strerror_clear();	/* Clear any outstanding errors */
+
+	for (i = 0; i < reply_cnt; i++) {
+		if (!replies[i]) {
+			REDEBUG("Missing reply");
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
+
+		status = fr_redis_command_status(NULL, replies[i]);
+		if (status != REDIS_RCODE_SUCCESS) break;
+	}
+
+	switch (status) {
+	case REDIS_RCODE_SUCCESS:
+		break;
+
+	case REDIS_RCODE_NO_SCRIPT:
+		if (!rctx->loaded) {
+			rctx->loaded = true;
+			return status;
+		}
+		FALL_THROUGH;
+
+	default:
+		RPEDEBUG("Failed calling script 0x%s", rctx->digest);
+	error:
+		fr_redis_pipeline_free(replies, reply_cnt);
+		rctx->reply_cnt = 0;
+		return status;
+	}
+
+	if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) {
+		fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+	}
+
+	if (rctx->loaded) {
+		if (reply_cnt < 4) {
+			RERROR("Expected at least 4 responses, got %zu", reply_cnt);
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
+		if (replies[3]->type != REDIS_REPLY_ARRAY) {
+			RERROR("Bad response to EXEC, expected array got %s",
+			       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
+		if (replies[3]->elements != 2) {
+			RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
+			       replies[3]->elements);
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
+		if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
+			RERROR("Bad response to SCRIPT LOAD, expected string got %s",
+			       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
+		if (strcmp(replies[3]->element[0]->str, rctx->digest) != 0) {
+			RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
+				rctx->digest, replies[3]->element[0]->str);
+			status = REDIS_RCODE_ERROR;
+			goto error;
 		}
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) goto error;
 
 	switch (reply_cnt) {
 	case 2:	/* EVALSHA with wait */
-		if (ippool_wait_check(request, wait_num, replies[1]) < 0) goto error;
+		if (ippool_wait_check(request, wait_num, replies[1]) < 0) {
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
 		fr_redis_reply_free(&replies[1]);	/* Free the wait response */
 		FALL_THROUGH;
 
 	case 1:	/* EVALSHA */
-		*out = replies[0];
+		rctx->reply = replies[0];
+		replies[0] = NULL;
 		break;
 
 	case 5: /* LOADSCRIPT + EVALSHA + WAIT */
-		if (ippool_wait_check(request, wait_num, replies[4]) < 0) goto error;
+		if (ippool_wait_check(request, wait_num, replies[4]) < 0) {
+			status = REDIS_RCODE_ERROR;
+			goto error;
+		}
 		fr_redis_reply_free(&replies[4]);	/* Free the wait response */
 		FALL_THROUGH;
 
@@ -701,52 +944,29 @@ static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_r
 		fr_redis_reply_free(&replies[2]);	/* Free the queued cmd response*/
 		fr_redis_reply_free(&replies[1]);	/* Free the queued script load response */
 		fr_redis_reply_free(&replies[0]);	/* Free the queued multi response */
-		*out = replies[3]->element[1];
+		rctx->reply = replies[3]->element[1];
 		replies[3]->element[1] = NULL;		/* Prevent double free */
 		fr_redis_reply_free(&replies[3]);	/* This works because hiredis checks for NULL elements */
 		break;
 
-	case 0:
-		break;
+	default:
+		REDEBUG("Unexpected number of responses (%zu)", reply_cnt);
+		status = REDIS_RCODE_ERROR;
+		goto error;
 	}
+	rctx->reply_cnt = 0;
 
-finish:
-	va_end(ap);
-	return s_ret;
+	return REDIS_RCODE_SUCCESS;
 }
 
-/** Allocate a new IP address from a pool
+/** Process the result of the allocation script
  *
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    redis_ippool_alloc_call_env_t *env, uint32_t lease_time)
+static ippool_rcode_t redis_ippool_allocate(request_t *request, redis_ippool_alloc_call_env_t *env,
+					    redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	fr_assert(env->pool_name.vb_length > 0);
-	fr_assert(env->owner.vb_length > 0);
-
-	now = fr_time_to_timeval(fr_time());
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-			       (unsigned int)now.tv_sec, lease_time,
-			       (uint8_t const *)env->owner.vb_strvalue, env->owner.vb_length,
-			       (uint8_t const *)env->gateway_id.vb_strvalue, env->gateway_id.vb_length);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
@@ -893,61 +1113,17 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		}
 	}
 finish:
-	fr_redis_reply_free(&reply);
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the result of the update script
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
-					  redis_ippool_update_call_env_t *env,
-					  fr_ipaddr_t *ip,
-					  fr_value_box_t const *owner,
-					  fr_value_box_t const *gateway_id,
-					  uint32_t expires)
+static ippool_rcode_t redis_ippool_update(request_t *request, redis_ippool_update_call_env_t *env,
+					  redisReply *reply, uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	now = fr_time_to_timeval(fr_time());
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       (uint8_t const *)owner->vb_strvalue, owner->vb_length,
-				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       (uint8_t const *)owner->vb_strvalue, owner->vb_length,
-				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -1029,58 +1205,16 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 	}
 
 finish:
-	fr_redis_reply_free(&reply);
-
 	return ret;
 }
 
-/** Release an existing IP address in a pool
+/** Process the result of the release script
  *
  */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
-					   fr_value_box_t const *key_prefix,
-					   fr_ipaddr_t *ip,
-					   fr_value_box_t const *owner)
+static ippool_rcode_t redis_ippool_release(request_t *request, redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	now = fr_time_to_timeval(fr_time());
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       (uint8_t const *)key_prefix->vb_strvalue, key_prefix->vb_length,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
-				       (uint8_t const *)key_prefix->vb_strvalue, key_prefix->vb_length,
-				       (unsigned int)now.tv_sec,
-				       htonl(ip->addr.v4.s_addr),
-				       (uint8_t const *)owner->vb_strvalue, owner->vb_length);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       (uint8_t const *)key_prefix->vb_strvalue, key_prefix->vb_length,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
-				       (uint8_t const *)key_prefix->vb_strvalue, key_prefix->vb_length,
-				       (unsigned int)now.tv_sec,
-				       ip_buff,
-				       (uint8_t const *)owner->vb_strvalue, owner->vb_length);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -1104,11 +1238,8 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, reque
 		goto finish;
 	}
 	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
 
 finish:
-	fr_redis_reply_free(&reply);
-
 	return ret;
 }
 
@@ -1123,10 +1254,54 @@ finish:
 		RETURN_MODULE_NOOP; \
 	}
 
-static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+/** Check the result of a script, and upload it if the server doesn't have it
+ *
+ * Frees the script context if the script has finished running.
+ */
+#define SCRIPT_RESULT(_resume) \
+	do { \
+		switch (ippool_script_result(request, inst->wait_num, rctx)) { \
+		case REDIS_RCODE_SUCCESS: \
+			break; \
+		case REDIS_RCODE_NO_SCRIPT: \
+			return ippool_script(p_result, mctx, request, rctx, _resume); \
+		default: \
+			talloc_free(rctx); \
+			RETURN_MODULE_FAIL; \
+		} \
+	} while (0)
+
+static unlang_action_t CC_HINT(nonnull) mod_alloc_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							 request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	redis_ippool_alloc_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_alloc_call_env_t);
+	redis_ippool_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+	ippool_rcode_t			ret;
+
+	SCRIPT_RESULT(mod_alloc_resume);
+
+	ret = redis_ippool_allocate(request, env, rctx->reply);
+	talloc_free(rctx);
+
+	switch (ret) {
+	case IPPOOL_RCODE_SUCCESS:
+		RDEBUG2("IP address lease allocated");
+		RETURN_MODULE_UPDATED;
+
+	case IPPOOL_RCODE_POOL_EMPTY:
+		RWDEBUG("Pool contains no free addresses");
+		RETURN_MODULE_NOTFOUND;
+
+	default:
+		RETURN_MODULE_FAIL;
+	}
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	redis_ippool_alloc_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_alloc_call_env_t);
+	redis_ippool_rctx_t		*rctx;
 	uint32_t			lease_time;
 
 	CHECK_POOL_NAME
@@ -1139,40 +1314,32 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 			env->offer_time.vb_uint32 : env->lease_time.vb_uint32;
 	ippool_action_print(request, POOL_ACTION_ALLOCATE, L_DBG_LVL_2, &env->pool_name, NULL,
 			    &env->owner, &env->gateway_id, lease_time);
-	switch (redis_ippool_allocate(inst, request, env, lease_time)) {
-	case IPPOOL_RCODE_SUCCESS:
-		RDEBUG2("IP address lease allocated");
-		RETURN_MODULE_UPDATED;
 
-	case IPPOOL_RCODE_POOL_EMPTY:
-		RWDEBUG("Pool contains no free addresses");
-		RETURN_MODULE_NOTFOUND;
+	fr_assert(env->owner.vb_length > 0);
 
-	default:
-		RETURN_MODULE_FAIL;
-	}
+	rctx = ippool_script_alloc(request, &env->pool_name, lua_alloc_digest, lua_alloc_cmd);
+	ippool_script_arg_uint(rctx, (uint32_t)fr_time_to_sec(fr_time()));
+	ippool_script_arg_uint(rctx, lease_time);
+	ippool_script_arg(rctx, env->owner.vb_strvalue, env->owner.vb_length);
+	ippool_script_arg(rctx, env->gateway_id.vb_strvalue, env->gateway_id.vb_length);
+
+	return ippool_script(p_result, mctx, request, rctx, mod_alloc_resume);
 }
 
-static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t CC_HINT(nonnull) mod_update_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							  request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	redis_ippool_update_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_update_call_env_t);
-	fr_ipaddr_t			ip;
+	redis_ippool_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+	ippool_rcode_t			ret;
 
-	CHECK_POOL_NAME
+	SCRIPT_RESULT(mod_update_resume);
 
-	if (fr_inet_pton(&ip, env->requested_address.vb_strvalue, env->requested_address.vb_length,
-			 AF_UNSPEC, false, true) < 0) {
-		RPEDEBUG("Failed parsing address");
-		RETURN_MODULE_FAIL;
-	}
+	ret = redis_ippool_update(request, env, rctx->reply, rctx->expires);
+	talloc_free(rctx);
 
-	ippool_action_print(request, POOL_ACTION_UPDATE, L_DBG_LVL_2, &env->pool_name,
-			    &env->requested_address, &env->owner, &env->gateway_id, env->lease_time.vb_uint32);
-	switch (redis_ippool_update(inst, request, env,
-				    &ip, &env->owner,
-				    &env->gateway_id,
-				    env->lease_time.vb_uint32)) {
+	switch (ret) {
 	case IPPOOL_RCODE_SUCCESS:
 		RDEBUG2("Requested IP address' \"%pV\" lease updated", &env->requested_address);
 
@@ -1222,10 +1389,11 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	}
 }
 
-static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
-	redis_ippool_release_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_release_call_env_t);
+	redis_ippool_update_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_update_call_env_t);
+	redis_ippool_rctx_t		*rctx;
 	fr_ipaddr_t			ip;
 
 	CHECK_POOL_NAME
@@ -1236,9 +1404,34 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 		RETURN_MODULE_FAIL;
 	}
 
-	ippool_action_print(request, POOL_ACTION_RELEASE, L_DBG_LVL_2, &env->pool_name,
-			    &env->requested_address, &env->owner, &env->gateway_id, 0);
-	switch (redis_ippool_release(inst, request, &env->pool_name, &ip, &env->owner)) {
+	ippool_action_print(request, POOL_ACTION_UPDATE, L_DBG_LVL_2, &env->pool_name,
+			    &env->requested_address, &env->owner, &env->gateway_id, env->lease_time.vb_uint32);
+
+	rctx = ippool_script_alloc(request, &env->pool_name, lua_update_digest, lua_update_cmd);
+	rctx->expires = env->lease_time.vb_uint32;
+	ippool_script_arg_uint(rctx, (uint32_t)fr_time_to_sec(fr_time()));
+	ippool_script_arg_uint(rctx, rctx->expires);
+	ippool_script_arg_ip(rctx, inst->ipv4_integer, &ip);
+	ippool_script_arg(rctx, env->owner.vb_strvalue, env->owner.vb_length);
+	ippool_script_arg(rctx, env->gateway_id.vb_strvalue, env->gateway_id.vb_length);
+
+	return ippool_script(p_result, mctx, request, rctx, mod_update_resume);
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_release_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							   request_t *request)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	redis_ippool_release_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_release_call_env_t);
+	redis_ippool_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+	ippool_rcode_t			ret;
+
+	SCRIPT_RESULT(mod_release_resume);
+
+	ret = redis_ippool_release(request, rctx->reply);
+	talloc_free(rctx);
+
+	switch (ret) {
 	case IPPOOL_RCODE_SUCCESS:
 		RDEBUG2("IP address \"%pV\" released", &env->requested_address);
 		RETURN_MODULE_UPDATED;
@@ -1263,6 +1456,32 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	}
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	redis_ippool_release_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_release_call_env_t);
+	redis_ippool_rctx_t		*rctx;
+	fr_ipaddr_t			ip;
+
+	CHECK_POOL_NAME
+
+	if (fr_inet_pton(&ip, env->requested_address.vb_strvalue, env->requested_address.vb_length,
+			 AF_UNSPEC, false, true) < 0) {
+		RPEDEBUG("Failed parsing address");
+		RETURN_MODULE_FAIL;
+	}
+
+	ippool_action_print(request, POOL_ACTION_RELEASE, L_DBG_LVL_2, &env->pool_name,
+			    &env->requested_address, &env->owner, &env->gateway_id, 0);
+
+	rctx = ippool_script_alloc(request, &env->pool_name, lua_release_digest, lua_release_cmd);
+	ippool_script_arg_uint(rctx, (uint32_t)fr_time_to_sec(fr_time()));
+	ippool_script_arg_ip(rctx, inst->ipv4_integer, &ip);
+	ippool_script_arg(rctx, env->owner.vb_strvalue, env->owner.vb_length);
+
+	return ippool_script(p_result, mctx, request, rctx, mod_release_resume);
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
 							 request_t *request)
 {
@@ -1313,6 +1532,16 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, mctx->el, inst->cluster, &inst->conf);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1329,7 +1558,11 @@ module_rlm_t rlm_redis_ippool = {
 		.inst_size	= sizeof(rlm_redis_ippool_t),
 		.config		= module_config,
 		.onload		= mod_load,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+		.thread_inst_type	= "rlm_redis_ippool_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_names = (module_method_name_t[]){
 		/*
@@ -88,6 +88,8 @@ typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+	MYSQL_STMT	**prepared;		//!< Cached prepared statements, by ID.
+	MYSQL_STMT	*stmt;			//!< Prepared statement last run.
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -160,6 +162,15 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	if (conn->prepared) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(conn->prepared); i++) {
+			if (conn->prepared[i]) mysql_stmt_close(conn->prepared[i]);
+		}
+		conn->prepared = NULL;
+	}
+
 	if (conn->sock) {
 		mysql_close(conn->sock);
 		conn->sock = NULL;
@@ -435,6 +446,78 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t c
 	return RLM_SQL_OK;
 }
 
+/** Run a prepared statement, preparing it if this is the first time it's been run on the connection
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config,
+				      sql_prepared_t const *stmt, fr_value_box_t const *params)
+{
+	rlm_sql_mysql_conn_t	*conn = talloc_get_type_abort(handle->conn, rlm_sql_mysql_conn_t);
+	MYSQL_STMT		*mysql_stmt;
+	MYSQL_BIND		*bind;
+	size_t			i, num = talloc_array_length(conn->prepared);
+	sql_rcode_t		rcode = RLM_SQL_OK;
+
+	if (stmt->id >= num) {
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, MYSQL_STMT *, stmt->id + 1));
+		for (i = num; i <= stmt->id; i++) conn->prepared[i] = NULL;
+	}
+
+	mysql_stmt = conn->prepared[stmt->id];
+	if (!mysql_stmt) {
+		mysql_stmt = mysql_stmt_init(conn->sock);
+		if (!mysql_stmt) {
+			ERROR("Failed allocating prepared statement");
+			return RLM_SQL_ERROR;
+		}
+
+		if (mysql_stmt_prepare(mysql_stmt, stmt->query, strlen(stmt->query)) != 0) {
+			ERROR("Failed preparing statement: %s", mysql_stmt_error(mysql_stmt));
+			rcode = sql_check_error(NULL, mysql_stmt_errno(mysql_stmt));
+			mysql_stmt_close(mysql_stmt);
+			return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+		}
+
+		conn->prepared[stmt->id] = mysql_stmt;
+	}
+	conn->stmt = mysql_stmt;
+
+	num = talloc_array_length(params);
+	MEM(bind = talloc_zero_array(NULL, MYSQL_BIND, num));
+
+	for (i = 0; i < num; i++) {
+		switch (params[i].type) {
+		case FR_TYPE_INT64:
+			bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+			bind[i].buffer = UNCONST(int64_t *, &params[i].vb_int64);
+			break;
+
+		case FR_TYPE_FLOAT64:
+			bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
+			bind[i].buffer = UNCONST(double *, &params[i].vb_float64);
+			break;
+
+		case FR_TYPE_STRING:
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			bind[i].buffer = UNCONST(char *, params[i].vb_strvalue);
+			bind[i].buffer_length = params[i].vb_length;
+			break;
+
+		default:
+			bind[i].buffer_type = MYSQL_TYPE_NULL;
+			break;
+		}
+	}
+
+	if ((mysql_stmt_bind_param(mysql_stmt, bind) != 0) || (mysql_stmt_execute(mysql_stmt) != 0)) {
+		rcode = sql_check_error(NULL, mysql_stmt_errno(mysql_stmt));
+		if (rcode == RLM_SQL_OK) rcode = RLM_SQL_ERROR;
+	}
+	talloc_free(bind);
+
+	return rcode;
+}
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
 {
 	rlm_sql_mysql_conn_t *conn = talloc_get_type_abort(handle->conn, rlm_sql_mysql_conn_t);
@@ -698,6 +781,20 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 
 	fr_assert(outlen > 0);
 
+	/*
+	 *	Errors from prepared statements are stored
+	 *	in the statement, not the connection.
+	 */
+	if (conn->stmt) {
+		error = mysql_stmt_error(conn->stmt);
+		if (!error || (error[0] == '\0')) return 0;
+
+		out[0].type = L_ERR;
+		out[0].msg = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt), error,
+						   mysql_stmt_sqlstate(conn->stmt));
+		return 1;
+	}
+
 	error = mysql_error(conn->sock);
 
 	/*
@@ -759,10 +856,22 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
  */
 static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t const *config)
 {
-#if (MYSQL_VERSION_ID >= 40100)
 	rlm_sql_mysql_conn_t	*conn = talloc_get_type_abort(handle->conn, rlm_sql_mysql_conn_t);
+#if (MYSQL_VERSION_ID >= 40100)
 	int			ret;
 	MYSQL_RES		*result;
+#endif
+
+	/*
+	 *	Prepared statements are kept for next time.
+	 */
+	if (conn->stmt) {
+		(void) mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		return RLM_SQL_OK;
+	}
+
+#if (MYSQL_VERSION_ID >= 40100)
 
 	/*
 	 *	If there's no result associated with the
@@ -807,6 +916,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t c
 {
 	rlm_sql_mysql_conn_t *conn = talloc_get_type_abort(handle->conn, rlm_sql_mysql_conn_t);
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -842,6 +953,7 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.number				= 3,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
+	.sql_query_prepared		= sql_query_prepared,
 	.sql_select_query		= sql_select_query,
 	.sql_store_result		= sql_store_result,
 	.sql_num_fields			= sql_num_fields,
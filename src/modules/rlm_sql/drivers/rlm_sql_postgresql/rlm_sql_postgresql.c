@@ -65,6 +65,19 @@ typedef struct {
 	fr_trie_t	*states;		//!< sql state trie.
 } rlm_sql_postgresql_t;
 
+/** A statement being prepared on a connection
+ *
+ */
+typedef struct {
+	sql_prepared_t const	*stmt;		//!< Statement being prepared.
+	char			name[NAMEDATALEN];	//!< Name it's being prepared with.
+	char const		*types;		//!< Parameter types it's being prepared for.
+	Oid const		*oids;		//!< Parameter types, as sent to the server.
+	char const		**values;	//!< Parameters to run it with once it's prepared.
+						///< NULL if it's already been sent in the pipeline.
+	bool			failed;		//!< Whether preparing it failed.
+} rlm_sql_postgres_prepare_t;
+
 typedef struct {
 	PGconn		*db;
 	PGresult	*result;
@@ -72,6 +85,10 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	char		***prepared;		//!< Parameter types of the statements prepared
+						///< on this connection, by statement ID.
+	rlm_sql_postgres_prepare_t *preparing;	//!< Statement being prepared.  Its result comes
+						///< before that of the query.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -179,9 +196,12 @@ static sql_rcode_t sql_classify_error(rlm_sql_postgresql_t *inst, ExecStatusType
 			break;
 
 	#ifdef HAVE_PGRES_PIPELINE_SYNC
-		case PGRES_PIPELINE_SYNC:
 		case PGRES_PIPELINE_ABORTED:
-			ERROR("libpq reported aborted pipeline");
+			DEBUG2("Query not run, as an earlier query in the pipeline failed");
+			return RLM_SQL_ERROR;
+
+		case PGRES_PIPELINE_SYNC:
+			ERROR("libpq reported unexpected pipeline sync");
 			return RLM_SQL_ERROR;
 	#endif
 
@@ -261,25 +281,91 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, UNUSED rlm
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
-					      char const *query)
+/** Start connecting to the database, without blocking
+ *
+ * The connection is completed by calling sql_socket_init_poll()
+ * when the socket is writable.
+ */
+static int CC_HINT(nonnull) sql_socket_init_start(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_postgres_conn_t	*conn = handle->conn;
 	rlm_sql_postgresql_t	*inst = talloc_get_type_abort(handle->inst->driver_submodule->dl_inst->data, rlm_sql_postgresql_t);
-	fr_time_delta_t		timeout = config->query_timeout;
-	fr_time_t		start;
-	int			sockfd;
-	PGresult		*tmp_result;
-	int			numfields = 0;
-	ExecStatusType		status;
+	rlm_sql_postgres_conn_t *conn;
+
+	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
+	talloc_set_destructor(conn, _sql_socket_destructor);
+
+	DEBUG2("Connecting using parameters: %s", inst->db_string);
+	conn->db = PQconnectStart(inst->db_string);
+	if (!conn->db) {
+		ERROR("Connection failed: Out of memory");
+		return -1;
+	}
+	if (PQstatus(conn->db) == CONNECTION_BAD) {
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		PQfinish(conn->db);
+		conn->db = NULL;
+		return -1;
+	}
+
+	return 2;
+}
+
+/** Continue connecting to the database
+ *
+ * Once connected, the connection is made non-blocking, so that sending
+ * queries never waits for the socket to become writable.
+ */
+static int CC_HINT(nonnull) sql_socket_init_poll(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	switch (PQconnectPoll(conn->db)) {
+	case PGRES_POLLING_READING:
+		return 1;
+
+	case PGRES_POLLING_WRITING:
+		return 2;
+
+	case PGRES_POLLING_OK:
+		break;
+
+	default:
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	if (PQsetnonblocking(conn->db, 1) != 0) {
+		ERROR("Failed making connection non-blocking: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	DEBUG2("Connected to database '%s' on '%s' server version %i, protocol version %i, backend PID %i ",
+	       PQdb(conn->db), PQhost(conn->db), PQserverVersion(conn->db), PQprotocolVersion(conn->db),
+	       PQbackendPID(conn->db));
+
+	return 0;
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config,
+						   char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
 
 	if (!conn->db) {
 		ERROR("Socket not connected");
 		return RLM_SQL_RECONNECT;
 	}
 
-	sockfd = PQsocket(conn->db);
-	if (sockfd < 0) {
+	if (PQsocket(conn->db) < 0) {
 		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
 		return RLM_SQL_RECONNECT;
 	}
@@ -289,42 +375,111 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		return RLM_SQL_RECONNECT;
 	}
 
+	return RLM_SQL_OK;
+}
+
+/** Record the statement which has been prepared, and run it if it's not already been sent
+ *
+ * If it couldn't be prepared, it's run unnamed, so that the error
+ * is reported as the result of the query.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the query couldn't be sent.
+ */
+static int sql_prepare_done(rlm_sql_postgres_conn_t *conn)
+{
+	rlm_sql_postgres_prepare_t	*preparing = conn->preparing;
+	sql_prepared_t const		*stmt = preparing->stmt;
+	size_t				num = talloc_array_length(preparing->oids);
+	int				ret = 1;
+
+	if (!preparing->failed) {
+		size_t prepared = talloc_array_length(conn->prepared[stmt->id]);
+
+		MEM(conn->prepared[stmt->id] = talloc_realloc(conn->prepared, conn->prepared[stmt->id],
+							      char *, prepared + 1));
+		conn->prepared[stmt->id][prepared] = talloc_typed_strdup(conn->prepared[stmt->id], preparing->types);
+	}
+
+	if (preparing->values) {
+		if (!preparing->failed) {
+			ret = PQsendQueryPrepared(conn->db, preparing->name, num, preparing->values, NULL, NULL, 0);
+		} else {
+			ret = PQsendQueryParams(conn->db, stmt->query, num, preparing->oids, preparing->values,
+						NULL, NULL, 0);
+		}
+	}
+
+	TALLOC_FREE(conn->preparing);
+
+	if (!ret) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sql_flush(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	switch (PQflush(conn->db)) {
+	case 0:
+		return 0;
+
+	case 1:
+		return 1;
+
+	default:
+		ERROR("Failed sending data: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+}
+
+static int sql_query_busy(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
 	/*
-	 *  We try to avoid blocking by waiting until the driver indicates that
-	 *  the result is ready or our timeout expires
+	 *  Read the result of preparing the statement,
+	 *  which ends with NULL as results of queries do.
 	 */
-	start = fr_time();
-	while (PQisBusy(conn->db)) {
-		int		r;
-		fd_set		read_fd;
-		fr_time_delta_t	elapsed = fr_time_delta_wrap(0);
+	while (conn->preparing) {
+		PGresult *result;
 
-		FD_ZERO(&read_fd);
-		FD_SET(sockfd, &read_fd);
+		if (PQisBusy(conn->db)) return 1;
 
-		if (fr_time_delta_ispos(config->query_timeout)) {
-			elapsed = fr_time_sub(fr_time(), start);
-			if (fr_time_delta_gteq(elapsed, timeout)) goto too_long;
+		result = PQgetResult(conn->db);
+		if (!result) {
+			if (sql_prepare_done(conn) < 0) return -1;
+			continue;
 		}
 
-		r = select(sockfd + 1, &read_fd, NULL, NULL, fr_time_delta_ispos(config->query_timeout) ?
-			   &fr_time_delta_to_timeval(fr_time_delta_sub(timeout, elapsed)) : NULL);
-		if (r == 0) {
-		too_long:
-			ERROR("Socket read timeout after %d seconds", (int) fr_time_delta_to_sec(config->query_timeout));
-			return RLM_SQL_RECONNECT;
-		}
-		if (r < 0) {
-			if (errno == EINTR) continue;
-			ERROR("Failed in select: %s", fr_syserror(errno));
-			return RLM_SQL_RECONNECT;
-		}
-		if (!PQconsumeInput(conn->db)) {
-			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
-			return RLM_SQL_RECONNECT;
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			WARN("Failed preparing statement: %s", PQresultErrorMessage(result));
+			conn->preparing->failed = true;
 		}
+		PQclear(result);
 	}
 
+	return PQisBusy(conn->db) ? 1 : 0;
+}
+
+static sql_rcode_t sql_query_recv(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgresql_t	*inst = talloc_get_type_abort(handle->inst->driver_submodule->dl_inst->data, rlm_sql_postgresql_t);
+	PGresult		*tmp_result;
+	int			numfields = 0;
+	ExecStatusType		status;
+
 	/*
 	 *  Returns a PGresult pointer or possibly a null pointer.
 	 *  A non-null pointer will generally be returned except in
@@ -400,6 +555,315 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	return sql_classify_error(inst, status, conn->result);
 }
 
+/** Send a prepared statement
+ *
+ * A statement is prepared once per connection for each combination of
+ * parameter types it's used with.  Preparing is asynchronous:
+ *
+ *  - Outside of a batch, the statement is prepared, and sql_query_busy()
+ *    runs it once the server has replied.
+ *  - At the start of a batch, the statement is prepared and run in the
+ *    pipeline, and sql_query_busy() reads the result of preparing it
+ *    first.
+ *  - Part way through a batch, the query is sent with its parameters,
+ *    but without being prepared, as only the result of the first query
+ *    in the pipeline can be preceded by that of preparing a statement.
+ */
+static CC_HINT(nonnull(1,2,3)) sql_rcode_t sql_query_send_prepared(rlm_sql_handle_t *handle,
+								   UNUSED rlm_sql_config_t const *config,
+								   sql_prepared_t const *stmt,
+								   fr_value_box_t const *params, bool batch)
+{
+	rlm_sql_postgres_conn_t		*conn = handle->conn;
+	size_t				i, k, num = talloc_array_length(params), prepared;
+	rlm_sql_postgres_prepare_t	*preparing;
+	char				*types;
+	char const			**values;
+	Oid				*oids;
+	bool				found = false;
+	int				ret;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	fr_assert(!conn->preparing);
+
+	/*
+	 *  Everything is allocated in the prepare context,
+	 *  which is kept if the statement is being prepared.
+	 */
+	MEM(preparing = talloc_zero(conn, rlm_sql_postgres_prepare_t));
+	MEM(types = talloc_array(preparing, char, num + 1));
+	MEM(values = talloc_array(preparing, char const *, num));
+	MEM(oids = talloc_array(preparing, Oid, num));
+
+	/*
+	 *  Numbers are sent as text, with a type so that
+	 *  the server doesn't have to guess.
+	 */
+	for (i = 0; i < num; i++) {
+		switch (params[i].type) {
+		case FR_TYPE_INT64:
+			types[i] = 'i';
+			oids[i] = 20;		/* int8 */
+			values[i] = talloc_asprintf(preparing, "%" PRId64, params[i].vb_int64);
+			break;
+
+		case FR_TYPE_FLOAT64:
+			types[i] = 'f';
+			oids[i] = 701;		/* float8 */
+			values[i] = talloc_asprintf(preparing, "%.17g", params[i].vb_float64);
+			break;
+
+		case FR_TYPE_STRING:
+			types[i] = 't';
+			oids[i] = 0;
+			values[i] = talloc_bstrndup(preparing, params[i].vb_strvalue, params[i].vb_length);
+			break;
+
+		default:
+			types[i] = 't';
+			oids[i] = 0;
+			values[i] = NULL;
+			break;
+		}
+	}
+	types[num] = '\0';
+
+	if (stmt->id >= talloc_array_length(conn->prepared)) {
+		prepared = talloc_array_length(conn->prepared);
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, char **, stmt->id + 1));
+		for (k = prepared; k <= stmt->id; k++) conn->prepared[k] = NULL;
+	}
+
+	prepared = talloc_array_length(conn->prepared[stmt->id]);
+	for (k = 0; k < prepared; k++) {
+		if (strcmp(conn->prepared[stmt->id][k], types) == 0) {
+			found = true;
+			break;
+		}
+	}
+	snprintf(preparing->name, sizeof(preparing->name), "fr_%u_%zu", stmt->id, k);
+	preparing->stmt = stmt;
+	preparing->types = types;
+	preparing->oids = oids;
+
+	if (!batch) {
+		if (found) {
+			ret = PQsendQueryPrepared(conn->db, preparing->name, num, values, NULL, NULL, 0);
+		} else {
+			ret = PQsendPrepare(conn->db, preparing->name, stmt->query, num, oids);
+			if (ret) {
+				preparing->values = values;
+				conn->preparing = preparing;
+				return RLM_SQL_OK;
+			}
+		}
+		goto sent;
+	}
+
+#ifdef HAVE_PGRES_PIPELINE_SYNC
+	if (PQpipelineStatus(conn->db) == PQ_PIPELINE_OFF) {
+		if (!PQenterPipelineMode(conn->db)) {
+			ERROR("Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+			talloc_free(preparing);
+			return RLM_SQL_RECONNECT;
+		}
+
+		if (!found) {
+			if (!PQsendPrepare(conn->db, preparing->name, stmt->query, num, oids)) {
+				ret = 0;
+				goto sent;
+			}
+			conn->preparing = preparing;
+			found = true;
+		}
+	}
+
+	if (found) {
+		ret = PQsendQueryPrepared(conn->db, preparing->name, num, values, NULL, NULL, 0);
+	} else {
+		ret = PQsendQueryParams(conn->db, stmt->query, num, oids, values, NULL, NULL, 0);
+	}
+#else
+	fr_assert(0);
+	ret = 0;
+#endif
+
+sent:
+	if (!ret) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		if (conn->preparing != preparing) talloc_free(preparing);
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  The values have been copied into libpq's
+	 *  output buffer, so they're not needed.
+	 */
+	if (conn->preparing == preparing) {
+		TALLOC_FREE(preparing->values);
+	} else {
+		talloc_free(preparing);
+	}
+
+	return RLM_SQL_OK;
+}
+
+#ifdef HAVE_PGRES_PIPELINE_SYNC
+/** Send a query in pipeline mode
+ *
+ * The queries are run in a single implicit transaction, which is
+ * committed when the pipeline is synced.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_batch_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config,
+						   char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if ((PQpipelineStatus(conn->db) == PQ_PIPELINE_OFF) && !PQenterPipelineMode(conn->db)) {
+		ERROR("Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  PQsendQuery can't be used in pipeline mode
+	 */
+	if (!PQsendQueryParams(conn->db, query, 0, NULL, NULL, NULL, NULL, 0)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_batch_flush(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!PQpipelineSync(conn->db)) {
+		ERROR("Failed to sync pipeline: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static int sql_batch_end(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	PGresult		*result;
+	ExecStatusType		status;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	if (PQisBusy(conn->db)) return 1;
+
+	result = PQgetResult(conn->db);
+	if (!result) {
+		ERROR("Failed getting pipeline sync: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+	status = PQresultStatus(result);
+	PQclear(result);
+
+	if (status != PGRES_PIPELINE_SYNC) {
+		ERROR("Expected pipeline sync, got %s", PQresStatus(status));
+		return -1;
+	}
+
+	if (!PQexitPipelineMode(conn->db)) {
+		ERROR("Failed leaving pipeline mode: %s", PQerrorMessage(conn->db));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/** Wait for the result of a query, and read it
+ *
+ */
+static sql_rcode_t sql_query_wait(rlm_sql_handle_t *handle, rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	fr_time_delta_t		timeout = config->query_timeout;
+	fr_time_t		start;
+	int			sockfd;
+
+	sockfd = PQsocket(conn->db);
+
+	/*
+	 *  We try to avoid blocking by waiting until the driver indicates that
+	 *  the result is ready or our timeout expires
+	 */
+	start = fr_time();
+	for (;;) {
+		int		r;
+		fd_set		read_fd;
+		fr_time_delta_t	elapsed = fr_time_delta_wrap(0);
+
+		r = sql_query_busy(handle, config);
+		if (r < 0) return RLM_SQL_RECONNECT;
+		if (r == 0) break;
+
+		FD_ZERO(&read_fd);
+		FD_SET(sockfd, &read_fd);
+
+		if (fr_time_delta_ispos(config->query_timeout)) {
+			elapsed = fr_time_sub(fr_time(), start);
+			if (fr_time_delta_gteq(elapsed, timeout)) goto too_long;
+		}
+
+		r = select(sockfd + 1, &read_fd, NULL, NULL, fr_time_delta_ispos(config->query_timeout) ?
+			   &fr_time_delta_to_timeval(fr_time_delta_sub(timeout, elapsed)) : NULL);
+		if (r == 0) {
+		too_long:
+			ERROR("Socket read timeout after %d seconds", (int) fr_time_delta_to_sec(config->query_timeout));
+			return RLM_SQL_RECONNECT;
+		}
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Failed in select: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+
+	return sql_query_recv(handle, config);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+					      char const *query)
+{
+	sql_rcode_t rcode;
+
+	rcode = sql_query_send(handle, config, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	return sql_query_wait(handle, config);
+}
+
+static CC_HINT(nonnull(1,2,3)) sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+							      sql_prepared_t const *stmt, fr_value_box_t const *params)
+{
+	sql_rcode_t rcode;
+
+	rcode = sql_query_send_prepared(handle, config, stmt, params, false);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	return sql_query_wait(handle, config);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t const *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -677,7 +1141,7 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 		.config				= driver_config,
 		.bootstrap			= mod_bootstrap
 	},
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_NUMBERED_PARAMS,
 	.number				= 2,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
@@ -689,5 +1153,19 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_socket_init_start		= sql_socket_init_start,
+	.sql_socket_init_poll		= sql_socket_init_poll,
+	.sql_fd				= sql_fd,
+	.sql_flush			= sql_flush,
+	.sql_query_send			= sql_query_send,
+	.sql_query_busy			= sql_query_busy,
+	.sql_query_recv			= sql_query_recv,
+	.sql_query_prepared		= sql_query_prepared,
+	.sql_query_send_prepared	= sql_query_send_prepared,
+#ifdef HAVE_PGRES_PIPELINE_SYNC
+	.sql_batch_send			= sql_batch_send,
+	.sql_batch_flush		= sql_batch_flush,
+	.sql_batch_end			= sql_batch_end
+#endif
 };
@@ -53,6 +53,8 @@ typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	sqlite3_stmt **prepared;		//!< Cached prepared statements, by ID.
+	bool statement_prepared;		//!< statement is one of the cached statements.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
@@ -384,6 +386,14 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	if (conn->prepared) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(conn->prepared); i++) {
+			if (conn->prepared[i]) (void) sqlite3_finalize(conn->prepared[i]);
+		}
+	}
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -505,6 +515,66 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t c
 	return sql_check_error(conn->db, status);
 }
 
+/** Run a prepared statement, preparing it if this is the first time it's been run on the connection
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config,
+				      sql_prepared_t const *stmt, fr_value_box_t const *params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sqlite3_stmt		*statement;
+	size_t			i, num = talloc_array_length(conn->prepared);
+	int			status = SQLITE_OK;
+
+	if (stmt->id >= num) {
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, sqlite3_stmt *, stmt->id + 1));
+		for (i = num; i <= stmt->id; i++) conn->prepared[i] = NULL;
+	}
+
+	statement = conn->prepared[stmt->id];
+	if (!statement) {
+		char const *z_tail;
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &statement, &z_tail);
+#else
+		status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &statement, &z_tail);
+#endif
+		if (status != SQLITE_OK) return sql_check_error(conn->db, status);
+
+		conn->prepared[stmt->id] = statement;
+	}
+
+	conn->statement = statement;
+	conn->statement_prepared = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < talloc_array_length(params); i++) {
+		switch (params[i].type) {
+		case FR_TYPE_INT64:
+			status = sqlite3_bind_int64(statement, i + 1, params[i].vb_int64);
+			break;
+
+		case FR_TYPE_FLOAT64:
+			status = sqlite3_bind_double(statement, i + 1, params[i].vb_float64);
+			break;
+
+		case FR_TYPE_STRING:
+			status = sqlite3_bind_text(statement, i + 1, params[i].vb_strvalue, params[i].vb_length,
+						   SQLITE_STATIC);
+			break;
+
+		default:
+			status = sqlite3_bind_null(statement, i + 1);
+			break;
+		}
+		if (status != SQLITE_OK) return sql_check_error(conn->db, status);
+	}
+
+	status = sqlite3_step(statement);
+	return sql_check_error(conn->db, status);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -625,7 +695,17 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Cached statements are kept for next time,
+		 *	but mustn't keep pointers to the parameters.
+		 */
+		if (conn->statement_prepared) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->statement_prepared = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -827,6 +907,7 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.number				= 4,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
+	.sql_query_prepared		= sql_query_prepared,
 	.sql_select_query		= sql_select_query,
 	.sql_num_fields			= sql_num_fields,
 	.sql_affected_rows		= sql_affected_rows,
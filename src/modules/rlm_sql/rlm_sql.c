@@ -82,6 +82,12 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_UINT32, rlm_sql_config_t, batch_size), .dflt = "1" },
+	{ FR_CONF_OFFSET("delay", FR_TYPE_TIME_DELTA, rlm_sql_config_t, batch_delay), .dflt = "0.01" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_VOID, rlm_sql_t, driver_submodule), .dflt = "null",
 			 .func = module_rlm_submodule_parse },
@@ -110,10 +116,16 @@ static const CONF_PARSER module_config[] = {
 	 *	This only works for a few drivers.
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_TIME_DELTA, rlm_sql_config_t, query_timeout) },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
+	{ FR_CONF_OFFSET("use_trunk", FR_TYPE_BOOL, rlm_sql_config_t, use_trunk), .dflt = "no" },
+
+	{ FR_CONF_POINTER("batch", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
 
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_sql_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1237,6 +1249,43 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 */
 	inst->sql_user = attr_sql_user_name;
 
+	/*
+	 *	Trunk connections must not block the worker, so
+	 *	drivers which can only connect and run queries
+	 *	by blocking use the pool.
+	 */
+	if (inst->config.use_trunk && !inst->driver->sql_query_send) {
+		WARN("Driver %s can't run queries without blocking, ignoring use_trunk", inst->driver->common.name);
+		inst->config.use_trunk = false;
+	}
+
+	if (inst->config.batch_size < 1) inst->config.batch_size = 1;
+	if (inst->config.batch_size > 1) {
+		if (!inst->config.use_trunk) {
+			WARN("Batches are only sent on trunk connections, ignoring batch.size");
+			inst->config.batch_size = 1;
+
+		} else if (!inst->driver->sql_batch_send) {
+			WARN("Driver %s can't send batches of queries, ignoring batch.size", inst->driver->common.name);
+			inst->config.batch_size = 1;
+		}
+	}
+
+	if (inst->config.prepared_statements) {
+		unsigned int id = 0;
+
+		if (!inst->driver->sql_query_prepared ||
+		    (inst->config.use_trunk && !inst->driver->sql_query_send_prepared)) {
+			WARN("Driver %s can't run prepared statements, ignoring prepared_statements",
+			     inst->driver->common.name);
+			inst->config.prepared_statements = false;
+
+		} else if ((sql_prepared_compile(inst, inst->config.accounting.cs, &id) < 0) ||
+			   (sql_prepared_compile(inst, inst->config.postauth.cs, &id) < 0)) {
+			return -1;
+		}
+	}
+
 	/*
 	 *	Export these methods, too.  This avoids RTDL_GLOBAL.
 	 */
@@ -1267,6 +1316,46 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->pool = module_rlm_connection_pool_init(conf, inst, sql_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	/*
+	 *	Queries are queued by the trunk connections,
+	 *	so they can always accept more.
+	 */
+	inst->trunk_conf.always_writable = true;
+
+	return 0;
+}
+
+/** Initialise thread specific data structure
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+
+	if (!inst->config.use_trunk) return 0;
+
+	t->trunk = sql_trunk_alloc(t);
+	if (!t->trunk) {
+		ERROR("Unable to launch SQL trunk");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Clean up thread specific data structure
+ *
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+
+	TALLOC_FREE(t->trunk);
+
 	return 0;
 }
 
@@ -1515,174 +1604,337 @@ release:
 	RETURN_MODULE_RCODE(rcode);
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
+/** Context for a redundant set of accounting or post-auth queries
  *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
+ */
+typedef struct {
+	sql_acct_section_t const	*section;	//!< Section the queries are from.
+	CONF_PAIR			*pair;		//!< Query being run.
+	char const			*attr;		//!< Name shared by the redundant queries.
+	fr_sql_query_t			*query;		//!< Query being run, or NULL.
+	rlm_sql_handle_t		*handle;	//!< Pool connection the queries are run on,
+							///< if there's no trunk.
+} sql_redundant_ctx_t;
+
+static unlang_action_t acct_redundant_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
+/** Release the resources used by a redundant set of queries
  *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+ */
+static void acct_redundant_done(rlm_sql_t const *inst, request_t *request, sql_redundant_ctx_t *redundant_ctx)
+{
+	if (redundant_ctx->handle) fr_pool_connection_release(inst->pool, request, redundant_ctx->handle);
+	redundant_ctx->handle = NULL;
+
+	sql_unset_user(inst, request);
+}
+
+/** Run a query on the pool connection, for when there's no trunk
  *
+ * Mirrors the result handling of the trunk, so that acct_redundant_resume()
+ * can process the result in the same way.
  */
-static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section)
+static void acct_redundant_pool_query(rlm_sql_t const *inst, request_t *request, sql_redundant_ctx_t *redundant_ctx)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	fr_sql_query_t *query = redundant_ctx->query;
 
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
+	if (query->stmt) {
+		query->rcode = rlm_sql_query_prepared(inst, request, &redundant_ctx->handle, query->stmt, query->params);
+	} else {
+		query->rcode = rlm_sql_query(inst, request, &redundant_ctx->handle, query->query_str);
+	}
+	if (query->rcode != RLM_SQL_OK) return;
 
-	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
+	query->affected_rows = (inst->driver->sql_affected_rows)(redundant_ctx->handle, &inst->config);
+	(inst->driver->sql_finish_query)(redundant_ctx->handle, &inst->config);
+}
 
-	char			path[FR_MAX_STRING_LEN];
-	char			*p = path;
-	char			*expanded = NULL;
+static void acct_redundant_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	sql_redundant_ctx_t	*redundant_ctx = talloc_get_type_abort(mctx->rctx, sql_redundant_ctx_t);
 
-	fr_assert(section);
+	if (redundant_ctx->query) fr_sql_trunk_query_cancel(redundant_ctx->query);
+}
 
-	if (section->reference[0] != '.') *p++ = '.';
+/** Check whether an expansion would print as an empty string
+ *
+ * Escaping doesn't change whether a value is empty, so this can be
+ * checked before the values are escaped.
+ */
+static bool sql_value_box_list_empty(fr_value_box_list_t *list)
+{
+	fr_value_box_t *vb = NULL;
 
-	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
+	while ((vb = fr_value_box_list_next(list, vb))) {
+		if (vb->type == FR_TYPE_NULL) continue;
+		if (!fr_type_is_variable_size(vb->type) || (vb->vb_length > 0)) return false;
+	}
 
-		goto finish;
+	return true;
+}
+
+/** Expand and run the current query
+ *
+ */
+static unlang_action_t acct_redundant_query(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					    sql_redundant_ctx_t *redundant_ctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+	rlm_sql_handle_t	*handle;
+	sql_prepared_t const	*stmt;
+	char const		*value;
+	char			*expanded = NULL;
+
+	value = cf_pair_value(redundant_ctx->pair);
+	if (!value) {
+		RDEBUG2("Ignoring null query");
+		acct_redundant_done(inst, request, redundant_ctx);
+		RETURN_MODULE_NOOP;
 	}
 
 	/*
-	 *	If we can't find a matching config item we do
-	 *	nothing so return RLM_MODULE_NOOP.
+	 *	Escaping may depend on the connection's
+	 *	character set, so we need a connection.
+	 *
+	 *	On the trunk, there may not be a connection
+	 *	open yet, so values are escaped when the query
+	 *	is sent.  Our own escape function, which is
+	 *	the only one used for prepared statements,
+	 *	doesn't need a connection.
 	 */
-	item = cf_reference_item(NULL, section->cs, path);
-	if (!item) {
-		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+	if (t->trunk) {
+		handle = t->escape_handle;
+	} else {
+		if (!redundant_ctx->handle) redundant_ctx->handle = fr_pool_connection_get(inst->pool, request);
+		handle = redundant_ctx->handle;
+	}
+	if (!handle) {
+	fail:
+		TALLOC_FREE(redundant_ctx->query);
+		acct_redundant_done(inst, request, redundant_ctx);
+		RETURN_MODULE_FAIL;
 	}
-	if (cf_item_is_section(item)){
-		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
 
-		goto finish;
+	/*
+	 *	Queries are only logged as strings, so we don't
+	 *	run prepared statements if there's a logfile.
+	 *
+	 *	Driver escape functions only quote values, so
+	 *	parameters are bound as they are.  Our own escape
+	 *	function changes the values, so it's applied to
+	 *	the parameters too, for them to match what's
+	 *	written by expanded queries.
+	 */
+	stmt = sql_prepared_find(redundant_ctx->pair);
+	if (stmt && !inst->config.logfile && !redundant_ctx->section->logfile) {
+		fr_value_box_t	*params = NULL;
+
+		switch (sql_prepared_params(redundant_ctx, &params, request, stmt,
+					    inst->driver->sql_escape_func ? NULL : inst->sql_escape_func, handle)) {
+		case 0:
+			redundant_ctx->query = fr_sql_query_alloc(redundant_ctx, inst, request, NULL);
+			redundant_ctx->query->query_str = stmt->query;
+			redundant_ctx->query->stmt = stmt;
+			redundant_ctx->query->params = talloc_steal(redundant_ctx->query, params);
+			goto run;
+
+		case 1:
+			break;
+
+		default:
+			goto fail;
+		}
 	}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
+	if (t->trunk) {
+		redundant_ctx->query = fr_sql_query_alloc(redundant_ctx, inst, request, NULL);
 
-	RDEBUG2("Using query template '%s'", attr);
+		if (xlat_aeval_list(redundant_ctx->query, &redundant_ctx->query->expanded, request, value) < 0) goto fail;
 
-	handle = fr_pool_connection_get(inst->pool, request);
-	if (!handle) {
-		rcode = RLM_MODULE_FAIL;
+		if (sql_value_box_list_empty(&redundant_ctx->query->expanded)) {
+			RDEBUG2("Ignoring null query");
+			TALLOC_FREE(redundant_ctx->query);
+			acct_redundant_done(inst, request, redundant_ctx);
+			RETURN_MODULE_NOOP;
+		}
 
-		goto finish;
+		redundant_ctx->query->log_name = rlm_sql_query_log_name(redundant_ctx->query, inst, request,
+									 redundant_ctx->section);
+		goto run;
 	}
 
-	sql_set_user(inst, request, NULL);
+	if (xlat_aeval(redundant_ctx, &expanded, request, value, inst->sql_escape_func, handle) < 0) goto fail;
 
-	while (true) {
-		value = cf_pair_value(pair);
-		if (!value) {
-			RDEBUG2("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+	if (!*expanded) {
+		RDEBUG2("Ignoring null query");
+		talloc_free(expanded);
+		acct_redundant_done(inst, request, redundant_ctx);
+		RETURN_MODULE_NOOP;
+	}
 
-			goto finish;
-		}
+	rlm_sql_query_log(inst, request, redundant_ctx->section, expanded);
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+	redundant_ctx->query = fr_sql_query_alloc(redundant_ctx, inst, request, expanded);
 
-			goto finish;
-		}
+run:
+	(void) unlang_module_yield(request, acct_redundant_resume, acct_redundant_signal, ~FR_SIGNAL_CANCEL,
+				   redundant_ctx);
 
-		if (!*expanded) {
-			RDEBUG2("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+	/*
+	 *	Without a trunk, the query is run now, and the
+	 *	result is processed immediately.  The same
+	 *	happens if the query couldn't be queued.
+	 */
+	if (!t->trunk) {
+		acct_redundant_pool_query(inst, request, redundant_ctx);
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
 
-			goto finish;
-		}
+	if (fr_sql_trunk_query(t, redundant_ctx->query) < 0) return UNLANG_ACTION_CALCULATE_RESULT;
 
-		rlm_sql_query_log(inst, request, section, expanded);
+	return UNLANG_ACTION_YIELD;
+}
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
-		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
+/** Check the result of a query, and try the next one if it didn't update anything
+ *
+ */
+static unlang_action_t acct_redundant_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	sql_redundant_ctx_t	*redundant_ctx = talloc_get_type_abort(mctx->rctx, sql_redundant_ctx_t);
+	fr_sql_query_t		*query = redundant_ctx->query;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
-		switch (sql_ret) {
-		/*
-		 *  Query was a success! Now we just need to check if it did anything.
-		 */
-		case RLM_SQL_OK:
-			break;
+	redundant_ctx->query = NULL;
 
-		/*
-		 *  A general, unrecoverable server fault.
-		 */
-		case RLM_SQL_ERROR:
-		/*
-		 *  If we get RLM_SQL_RECONNECT it means all connections in the pool
-		 *  were exhausted, and we couldn't create a new connection,
-		 *  so we do not need to call fr_pool_connection_release.
-		 */
-		case RLM_SQL_RECONNECT:
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+	RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, query->rcode, "<INVALID>"));
 
-		/*
-		 *  Query was invalid, this is a terminal error, but we still need
-		 *  to do cleanup, as the connection handle is still valid.
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
+	switch (query->rcode) {
+	/*
+	 *  Query was a success! Now we just need to check if it did anything.
+	 */
+	case RLM_SQL_OK:
+		break;
 
-		/*
-		 *  Driver found an error (like a unique key constraint violation)
-		 *  that hinted it might be a good idea to try an alternative query.
-		 */
-		case RLM_SQL_ALT_QUERY:
-			goto next;
-		}
-		fr_assert(handle);
+	/*
+	 *  A general, unrecoverable server fault, or no
+	 *  connection could run the query.
+	 */
+	case RLM_SQL_ERROR:
+	case RLM_SQL_RECONNECT:
+	default:
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
 
-		/*
-		 *  We need to have updated something for the query to have been
-		 *  counted as successful.
-		 */
-		numaffected = (inst->driver->sql_affected_rows)(handle, &inst->config);
-		(inst->driver->sql_finish_query)(handle, &inst->config);
-		RDEBUG2("%i record(s) updated", numaffected);
+	/*
+	 *  Query was invalid, this is a terminal error.
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
 
-		if (numaffected > 0) break;	/* A query succeeded, were done! */
-	next:
-		/*
-		 *  We assume all entries with the same name form a redundant
-		 *  set of queries.
-		 */
-		pair = cf_pair_find_next(section->cs, pair, attr);
+	/*
+	 *  Driver found an error (like a unique key constraint violation)
+	 *  that hinted it might be a good idea to try an alternative query.
+	 */
+	case RLM_SQL_ALT_QUERY:
+		goto next;
+	}
 
-		if (!pair) {
-			RDEBUG2("No additional queries configured");
-			rcode = RLM_MODULE_NOOP;
+	/*
+	 *  We need to have updated something for the query to have been
+	 *  counted as successful.
+	 */
+	RDEBUG2("%i record(s) updated", query->affected_rows);
 
-			goto finish;
-		}
+	if (query->affected_rows > 0) goto finish;	/* A query succeeded, were done! */
+next:
+	talloc_free(query);
 
-		RDEBUG2("Trying next query...");
+	/*
+	 *  We assume all entries with the same name form a redundant
+	 *  set of queries.
+	 */
+	redundant_ctx->pair = cf_pair_find_next(redundant_ctx->section->cs, redundant_ctx->pair, redundant_ctx->attr);
+	if (!redundant_ctx->pair) {
+		RDEBUG2("No additional queries configured");
+		acct_redundant_done(inst, request, redundant_ctx);
+		RETURN_MODULE_NOOP;
 	}
 
+	RDEBUG2("Trying next query...");
+
+	return acct_redundant_query(p_result, mctx, request, redundant_ctx);
+
 finish:
-	talloc_free(expanded);
-	fr_pool_connection_release(inst->pool, request, handle);
-	sql_unset_user(inst, request);
+	talloc_free(query);
+	acct_redundant_done(inst, request, redundant_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ *	If use_trunk is set, the queries are run on the thread's trunk, and the
+ *	request yields while they're running.  Otherwise they're run on a
+ *	connection from the pool.
+ */
+static unlang_action_t acct_redundant(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				      sql_acct_section_t const *section)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	sql_redundant_ctx_t	*redundant_ctx;
+
+	CONF_ITEM		*item;
+	CONF_PAIR 		*pair;
+
+	char			path[FR_MAX_STRING_LEN];
+	char			*p = path;
+
+	fr_assert(section);
+
+	if (section->reference[0] != '.') *p++ = '.';
+
+	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) RETURN_MODULE_FAIL;
+
+	/*
+	 *	If we can't find a matching config item we do
+	 *	nothing so return RLM_MODULE_NOOP.
+	 */
+	item = cf_reference_item(NULL, section->cs, path);
+	if (!item) {
+		RWDEBUG("No such configuration item %s", path);
+		RETURN_MODULE_NOOP;
+	}
+	if (cf_item_is_section(item)){
+		RWDEBUG("Sections are not supported as references");
+		RETURN_MODULE_NOOP;
+	}
+
+	pair = cf_item_to_pair(item);
+
+	MEM(redundant_ctx = talloc(unlang_interpret_frame_talloc_ctx(request), sql_redundant_ctx_t));
+	*redundant_ctx = (sql_redundant_ctx_t) {
+		.section = section,
+		.pair = pair,
+		.attr = cf_pair_attr(pair)
+	};
+
+	RDEBUG2("Using query template '%s'", redundant_ctx->attr);
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_redundant_query(p_result, mctx, request, redundant_ctx);
+}
+
 /*
  *	Accounting: Insert or update session data in our sql table
  */
@@ -1691,7 +1943,7 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
 
 	if (inst->config.accounting.reference_cp) {
-		return acct_redundant(p_result, inst, request, &inst->config.accounting);
+		return acct_redundant(p_result, mctx, request, &inst->config.accounting);
 	}
 
 	RETURN_MODULE_NOOP;
@@ -1705,7 +1957,7 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
 
 	if (inst->config.postauth.reference_cp) {
-		return acct_redundant(p_result, inst, request, &inst->config.postauth);
+		return acct_redundant(p_result, mctx, request, &inst->config.postauth);
 	}
 
 	RETURN_MODULE_NOOP;
@@ -1726,7 +1978,12 @@ module_rlm_t rlm_sql = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_sql_thread_t),
+		.thread_inst_type	= "rlm_sql_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_names = (module_method_name_t[]){
 		/*
@@ -29,6 +29,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/exfile.h>
 
@@ -125,6 +126,16 @@ typedef struct {
 
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
+
+	bool			prepared_statements;		//!< Run accounting and post-auth queries as
+								//!< prepared statements, where possible.
+
+	bool			use_trunk;			//!< Run accounting and post-auth queries on
+								//!< per-thread trunks, rather than the pool.
+
+	uint32_t		batch_size;			//!< Maximum number of accounting and post-auth
+								//!< queries to commit together.
+	fr_time_delta_t		batch_delay;			//!< How long to wait for a batch to fill.
 	/*
 	 *	@todo The rest of the queries should also be moved into
 	 *	their own sections.
@@ -157,6 +168,27 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_NUMBERED_PARAMS	2			//!< Parameter markers are $1, $2 ... rather than ?.
+
+/** A parameter of a prepared statement
+ *
+ */
+typedef struct {
+	char const		*xlat;				//!< Expansion which produces the value.
+	bool			quoted;				//!< The expansion was a quoted string in the template,
+								///< so the value is always bound as a string.
+} sql_param_t;
+
+/** A query template which can be run as a prepared statement
+ *
+ * Each expansion in the template is replaced by a parameter marker.
+ */
+typedef struct {
+	unsigned int		id;				//!< Unique within the module instance.  Used by drivers
+								///< to find the statement on a connection.
+	char const		*query;				//!< Template with expansions replaced by markers.
+	sql_param_t		*params;			//!< One per marker, in order.
+} sql_prepared_t;
 
 /** Retrieve errors from the last query operation
  *
@@ -209,11 +241,115 @@ typedef struct {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
 
 	xlat_escape_legacy_t	sql_escape_func;
+
+	/*
+	 *	Optional interface for drivers which can connect and run queries
+	 *	without blocking.  If sql_query_send is NULL, the driver can't be
+	 *	used with trunks, and all queries are run on the pool.  Otherwise
+	 *	all of these callbacks must be provided.
+	 */
+
+	/** Start opening a connection, without waiting for it to complete
+	 *
+	 * @return As sql_socket_init_poll.
+	 */
+	int (*sql_socket_init_start)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Continue opening a connection, once its socket is readable or writable
+	 *
+	 * The socket may change each time this is called.
+	 *
+	 * @return
+	 *	- 2 if we need to wait for the socket to be writable.
+	 *	- 1 if we need to wait for the socket to be readable.
+	 *	- 0 if the connection is open.
+	 *	- -1 if the connection failed.
+	 */
+	int (*sql_socket_init_poll)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Return the socket the connection's results are read from
+	 */
+	int (*sql_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Send data which couldn't be written when a query was sent
+	 *
+	 * @return
+	 *	- 1 if there's still data to send.
+	 *	- 0 if everything has been sent.
+	 *	- -1 if the connection failed.
+	 */
+	int (*sql_flush)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Send a query, without waiting for the result
+	 */
+	sql_rcode_t (*sql_query_send)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config, char const *query);
+
+	/** Read any data available on the socket
+	 *
+	 * @return
+	 *	- 1 if the result isn't complete.
+	 *	- 0 if the result is complete.
+	 *	- -1 if the connection failed.
+	 */
+	int (*sql_query_busy)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Process a complete result, returning what sql_query would have
+	 */
+	sql_rcode_t (*sql_query_recv)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/*
+	 *	Optional interface for drivers which can send several queries
+	 *	before reading their results.  Queries in a batch are committed
+	 *	together, so if one fails, none of them are.
+	 *
+	 *	Results are read with sql_query_busy and sql_query_recv, in the
+	 *	order the queries were sent.
+	 */
+
+	/** Add a query to the current batch, starting one if necessary
+	 */
+	sql_rcode_t (*sql_batch_send)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config, char const *query);
+
+	/** End the current batch, sending any queries which are buffered
+	 */
+	sql_rcode_t (*sql_batch_flush)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/** Finish a batch, after all of its results have been read
+	 *
+	 * @return
+	 *	- 1 if the batch isn't complete.
+	 *	- 0 if the batch is complete.
+	 *	- -1 if the connection failed.
+	 */
+	int (*sql_batch_end)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+
+	/*
+	 *	Optional interface for drivers which support prepared statements.
+	 *	Statements are prepared the first time they're run on a connection.
+	 *
+	 *	Parameters are FR_TYPE_STRING, FR_TYPE_INT64, FR_TYPE_FLOAT64,
+	 *	or FR_TYPE_NULL.  Results are handled as they are for queries.
+	 */
+
+	/** Run a prepared statement
+	 */
+	sql_rcode_t (*sql_query_prepared)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+					  sql_prepared_t const *stmt, fr_value_box_t const *params);
+
+	/** Send a prepared statement, without waiting for the result
+	 *
+	 * As sql_batch_send if batch is true, otherwise as sql_query_send.
+	 */
+	sql_rcode_t (*sql_query_send_prepared)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+					       sql_prepared_t const *stmt, fr_value_box_t const *params, bool batch);
 } rlm_sql_driver_t;
 
 struct sql_inst {
 	rlm_sql_config_t	config; /* HACK */
 	fr_pool_t		*pool;
+	fr_trunk_conf_t		trunk_conf;		//!< Configuration for the per-thread trunks
+							///< used for accounting and post-auth queries,
+							///< if use_trunk is set.
 
 	fr_dict_attr_t const	*sql_user;		//!< Cached pointer to SQL-User-Name
 							//!< dictionary attribute.
@@ -232,21 +368,79 @@ struct sql_inst {
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
 };
 
+/** Thread specific module data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance the thread belongs to.
+	fr_event_list_t		*el;			//!< Thread's event list.
+	fr_trunk_t		*trunk;			//!< Trunk connections queries are run on.
+							///< NULL if they're run on the pool.
+	rlm_sql_handle_t	*escape_handle;		//!< Handle without a connection, for our own escape
+							///< function, which only needs the instance.
+} rlm_sql_thread_t;
+
+typedef struct sql_trunk_conn_s sql_trunk_conn_t;
+
+/** A query run on a trunk connection
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance the query is being run for.
+	request_t		*request;		//!< Request the query is being run for.
+	fr_trunk_request_t	*treq;			//!< Trunk request for the query.  NULL once
+							///< the query is complete.
+	sql_trunk_conn_t	*sql_conn;		//!< Connection the query was sent on.
+	char const		*query_str;		//!< Query to run.  NULL until the expansion has
+							///< been escaped, when the query is sent.
+	fr_value_box_list_t	expanded;		//!< Expansion of the query, with tainted values
+							///< still to be escaped.
+	char const		*log_name;		//!< File to log the query to, or NULL.
+	sql_prepared_t const	*stmt;			//!< Prepared statement to run instead, or NULL.
+	fr_value_box_t		*params;		//!< Parameters for the prepared statement.
+
+	sql_rcode_t		rcode;			//!< Result of the query.
+	int			affected_rows;		//!< How many rows the query changed.
+} fr_sql_query_t;
+
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
 struct rlm_sql_grouplist_s {
 	char			*name;
 	rlm_sql_grouplist_t	*next;
 };
 
+rlm_sql_handle_t *sql_handle_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst);
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, fr_pair_list_t *out, char const *query);
+char		*rlm_sql_query_log_name(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request,
+				       sql_acct_section_t const *section) CC_HINT(nonnull (2, 3));
+void		rlm_sql_query_log_write(rlm_sql_t const *inst, char const *filename, char const *query) CC_HINT(nonnull);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_prepared(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				       sql_prepared_t const *stmt, fr_value_box_t const *params) CC_HINT(nonnull (1, 3, 4));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, request_t *request, char const *username);
 
+/*
+ *	sql_trunk.c
+ */
+fr_trunk_t		*sql_trunk_alloc(rlm_sql_thread_t *t);
+fr_sql_query_t		*fr_sql_query_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request,
+					    char const *query_str);
+int			fr_sql_trunk_query(rlm_sql_thread_t *t, fr_sql_query_t *query);
+void			fr_sql_trunk_query_cancel(fr_sql_query_t *query);
+
+/*
+ *	sql_prepared.c
+ */
+int		sql_prepared_compile(rlm_sql_t const *inst, CONF_SECTION *cs, unsigned int *id);
+sql_prepared_t const *sql_prepared_find(CONF_PAIR const *cp);
+int		sql_prepared_params(TALLOC_CTX *ctx, fr_value_box_t **out, request_t *request,
+				    sql_prepared_t const *stmt, xlat_escape_legacy_t escape, void const *escape_ctx);
+
 /*
  *	sql_state.c
  */
@@ -1,5 +1,5 @@
 TARGET		:= rlm_sql$(L)
-SOURCES		:= rlm_sql.c sql.c sql_state.c
+SOURCES		:= rlm_sql.c sql.c sql_prepared.c sql_state.c sql_trunk.c
 
 SRC_CFLAGS	:= $(rlm_sql_CFLAGS)
 TGT_LDLIBS	:= $(rlm_sql_LDLIBS)
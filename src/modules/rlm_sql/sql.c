@@ -62,16 +62,18 @@ fr_table_num_sorted_t const sql_rcode_table[] = {
 };
 size_t sql_rcode_table_len = NUM_ELEMENTS(sql_rcode_table);
 
-void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+/** Allocate a connection handle, without connecting it
+ *
+ * @param[in] ctx	to allocate the handle in.
+ * @param[in] inst	the handle belongs to.
+ * @return
+ *	- A new handle.
+ *	- NULL on error.
+ */
+rlm_sql_handle_t *sql_handle_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst)
 {
-	int rcode;
-	rlm_sql_t *inst = talloc_get_type_abort(instance, rlm_sql_t);
 	rlm_sql_handle_t *handle;
 
-	/*
-	 *	Connections cannot be alloced from the inst or
-	 *	pool contexts due to threading issues.
-	 */
 	handle = talloc_zero(ctx, rlm_sql_handle_t);
 	if (!handle) return NULL;
 
@@ -87,6 +89,22 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	 */
 	handle->inst = inst;
 
+	return handle;
+}
+
+void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+{
+	int rcode;
+	rlm_sql_t *inst = talloc_get_type_abort(instance, rlm_sql_t);
+	rlm_sql_handle_t *handle;
+
+	/*
+	 *	Connections cannot be alloced from the inst or
+	 *	pool contexts due to threading issues.
+	 */
+	handle = sql_handle_alloc(ctx, inst);
+	if (!handle) return NULL;
+
 	rcode = (inst->driver->sql_socket_init)(handle, &inst->config, timeout);
 	if (rcode != 0) {
 	fail:
@@ -371,23 +389,11 @@ void rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_hand
 	talloc_free_children(handle->log_ctx);
 }
 
-/** Call the driver's sql_query method, reconnecting if necessary.
+/** Call the driver's sql_query or sql_query_prepared method, reconnecting if necessary.
  *
- * @note Caller must call ``(inst->driver->sql_finish_query)(handle, &inst->config);``
- *	after they're done with the result.
- *
- * @param handle to query the database with. *handle should not be NULL, as this indicates
- * 	previous reconnection attempt has failed.
- * @param request Current request.
- * @param inst #rlm_sql_t instance data.
- * @param query to execute. Should not be zero length.
- * @return
- *	- #RLM_SQL_OK on success.
- *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
- *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
- *	- #RLM_SQL_ALT_QUERY on constraints violation.
  */
-sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query)
+static sql_rcode_t sql_query_run(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				 char const *query, sql_prepared_t const *stmt, fr_value_box_t const *params)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
@@ -411,9 +417,13 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 	 *  a new connection, then give up.
 	 */
 	for (i = 0; i < (count + 1); i++) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing %squery: %s", stmt ? "prepared " : "", query);
 
-		ret = (inst->driver->sql_query)(*handle, &inst->config, query);
+		if (stmt) {
+			ret = (inst->driver->sql_query_prepared)(*handle, &inst->config, stmt, params);
+		} else {
+			ret = (inst->driver->sql_query)(*handle, &inst->config, query);
+		}
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -473,6 +483,44 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 	return RLM_SQL_ERROR;
 }
 
+/** Call the driver's sql_query method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, &inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query)
+{
+	return sql_query_run(inst, request, handle, query, NULL, NULL);
+}
+
+/** Call the driver's sql_query_prepared method, reconnecting if necessary.
+ *
+ * As #rlm_sql_query, but runs a prepared statement.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with.
+ * @param stmt to run.
+ * @param params for the statement, as produced by #sql_prepared_params.
+ * @return As #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_prepared(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				   sql_prepared_t const *stmt, fr_value_box_t const *params)
+{
+	return sql_query_run(inst, request, handle, stmt->query, stmt, params);
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, &inst->config);``
@@ -582,33 +630,44 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rl
 	return rows;
 }
 
-/*
- *	Log the query to a file.
+/** Expand the name of the file queries are logged to
+ *
+ * @return
+ *	- The expanded name, allocated in ctx.
+ *	- NULL if queries aren't being logged, or the name couldn't be expanded.
  */
-void rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section, char const *query)
+char *rlm_sql_query_log_name(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request,
+			     sql_acct_section_t const *section)
 {
-	int fd;
 	char const *filename = NULL;
 	char *expanded = NULL;
-	size_t len;
-	bool failed = false;	/* Write the log message outside of the critical region */
 
 	filename = inst->config.logfile;
 	if (section && section->logfile) filename = section->logfile;
 
 	if (!filename || !*filename) {
-		return;
+		return NULL;
 	}
 
-	if (xlat_aeval(request, &expanded, request, filename, NULL, NULL) < 0) {
-		return;
+	if (xlat_aeval(ctx, &expanded, request, filename, NULL, NULL) < 0) {
+		return NULL;
 	}
 
+	return expanded;
+}
+
+/*
+ *	Log the query to a file, once its name has been expanded.
+ */
+void rlm_sql_query_log_write(rlm_sql_t const *inst, char const *filename, char const *query)
+{
+	int fd;
+	size_t len;
+	bool failed = false;	/* Write the log message outside of the critical region */
+
 	fd = exfile_open(inst->ef, filename, 0640, NULL);
 	if (fd < 0) {
-		ERROR("Couldn't open logfile '%s': %s", expanded, fr_syserror(errno));
-
-		talloc_free(expanded);
+		ERROR("Couldn't open logfile '%s': %s", filename, fr_syserror(errno));
 		return;
 	}
 
@@ -617,8 +676,21 @@ void rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_secti
 		failed = true;
 	}
 
-	if (failed) ERROR("Failed writing to logfile '%s': %s", expanded, fr_syserror(errno));
+	if (failed) ERROR("Failed writing to logfile '%s': %s", filename, fr_syserror(errno));
 
-	talloc_free(expanded);
 	exfile_close(inst->ef, fd);
 }
+
+/*
+ *	Log the query to a file.
+ */
+void rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section, char const *query)
+{
+	char *expanded;
+
+	expanded = rlm_sql_query_log_name(NULL, inst, request, section);
+	if (!expanded) return;
+
+	rlm_sql_query_log_write(inst, expanded, query);
+	talloc_free(expanded);
+}
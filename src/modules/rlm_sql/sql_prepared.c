@@ -0,0 +1,367 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_prepared.c
+ * @brief Compile query templates into prepared statements.
+ *
+ * Each expansion in a template becomes a parameter.  An expansion which
+ * is the whole of a quoted string, e.g. '%{User-Name}', is bound as a
+ * string.  An expansion outside of quotes is bound as a number, or as
+ * NULL if it expands to "NULL".  If it expands to anything else, it may
+ * be part of the SQL, so the query is expanded into a string instead.
+ *
+ * Templates with expansions inside longer strings or identifiers, or
+ * which already contain parameter markers, are always expanded into
+ * strings.
+ *
+ * Parameters must end up in the database exactly as they would if the
+ * query had been expanded, or values written by accounting wouldn't match
+ * those compared against by authorize, simul-use and counter queries.
+ * Drivers with their own escape function only quote values for the SQL
+ * syntax, so their parameters are bound without escaping.  rlm_sql's own
+ * escape function changes the data (unsafe characters are mime encoded),
+ * so it's applied to the parameters too.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_sql.h"
+
+/** Return the length of the expansion at the start of a string
+ *
+ * @return
+ *	- The length of the expansion.
+ *	- 0 if the string doesn't start with a complete expansion.
+ */
+static size_t sql_expansion_len(char const *p)
+{
+	char const	*q;
+	char		open, close;
+	int		depth = 0;
+
+	if (p[0] != '%') return 0;
+
+	switch (p[1]) {
+	case '{':
+		open = '{';
+		close = '}';
+		break;
+
+	case '(':
+		open = '(';
+		close = ')';
+		break;
+
+	default:
+		return isalpha((uint8_t) p[1]) ? 2 : 0;
+	}
+
+	for (q = p + 1; *q; q++) {
+		if (*q == open) {
+			depth++;
+		} else if (*q == close) {
+			if (--depth == 0) return (q - p) + 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Add a parameter to a statement, and its marker to the query
+ *
+ */
+static void sql_prepared_param_add(sql_prepared_t *stmt, char **query, rlm_sql_t const *inst,
+				   char const *p, size_t len, bool quoted)
+{
+	size_t num = talloc_array_length(stmt->params);
+
+	MEM(stmt->params = talloc_realloc(stmt, stmt->params, sql_param_t, num + 1));
+	stmt->params[num] = (sql_param_t) {
+		.xlat = talloc_bstrndup(stmt, p, len),
+		.quoted = quoted
+	};
+
+	if (inst->driver->flags & RLM_SQL_FLAGS_NUMBERED_PARAMS) {
+		MEM(*query = talloc_asprintf_append_buffer(*query, "$%zu", num + 1));
+	} else {
+		MEM(*query = talloc_strdup_append_buffer(*query, "?"));
+	}
+}
+
+/** Compile a query template
+ *
+ * @return
+ *	- A new statement.
+ *	- NULL if the template can't be run as a prepared statement.
+ */
+static sql_prepared_t *sql_prepared_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, char const *template)
+{
+	sql_prepared_t	*stmt;
+	char		*query;
+	char const	*p = template;
+	size_t		len;
+
+	MEM(stmt = talloc_zero(ctx, sql_prepared_t));
+	MEM(stmt->params = talloc_array(stmt, sql_param_t, 0));
+	MEM(query = talloc_typed_strdup(stmt, ""));
+
+	while (*p) {
+		char const *start;
+		char quote;
+
+		switch (*p) {
+		/*
+		 *	We don't try to work out what escape
+		 *	sequences mean, or markers which are
+		 *	already present.
+		 */
+		case '\\':
+		case '?':
+		case '$':
+		error:
+			talloc_free(stmt);
+			return NULL;
+
+		case '%':
+			if (p[1] == '%') {
+				MEM(query = talloc_strdup_append_buffer(query, "%"));
+				p += 2;
+				continue;
+			}
+
+			len = sql_expansion_len(p);
+			if (!len) goto error;
+
+			sql_prepared_param_add(stmt, &query, inst, p, len, false);
+			p += len;
+			continue;
+
+		/*
+		 *	A string or identifier.  It can only be a
+		 *	parameter if it's a single expansion.
+		 */
+		case '\'':
+		case '"':
+			quote = *p;
+
+			len = sql_expansion_len(p + 1);
+			if ((quote == '\'') && len && (p[len + 1] == quote) && (p[len + 2] != quote)) {
+				sql_prepared_param_add(stmt, &query, inst, p + 1, len, true);
+				p += len + 2;
+				continue;
+			}
+
+			start = p++;
+			for (;;) {
+				if (!*p) goto error;
+
+				if (*p == quote) {
+					if (p[1] != quote) break;
+					p += 2;
+					continue;
+				}
+
+				if (*p == '%') {
+					if (p[1] != '%') goto error;
+					MEM(query = talloc_strndup_append_buffer(query, start, (p - start) + 1));
+					p += 2;
+					start = p;
+					continue;
+				}
+
+				if (*p == '\\') goto error;
+				p++;
+			}
+			p++;
+
+			MEM(query = talloc_strndup_append_buffer(query, start, p - start));
+			continue;
+
+		default:
+			break;
+		}
+
+		start = p;
+		while (*p && !strchr("\\?$%'\"", *p)) p++;
+		MEM(query = talloc_strndup_append_buffer(query, start, p - start));
+	}
+
+	stmt->query = query;
+
+	return stmt;
+}
+
+/** Compile the query templates in a section into prepared statements
+ *
+ * The statements are stored as data on the pairs they were compiled from.
+ *
+ * @param[in] inst	Module instance.  Statements are allocated in it.
+ * @param[in] cs	Section to search for queries, e.g. accounting.
+ * @param[in,out] id	Next statement ID to assign.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_prepared_compile(rlm_sql_t const *inst, CONF_SECTION *cs, unsigned int *id)
+{
+	CONF_ITEM *ci = NULL;
+
+	if (!cs) return 0;
+
+	while ((ci = cf_item_next(cs, ci))) {
+		CONF_PAIR	*cp;
+		char const	*attr, *value;
+		sql_prepared_t	*stmt;
+
+		if (cf_item_is_section(ci)) {
+			if (sql_prepared_compile(inst, cf_item_to_section(ci), id) < 0) return -1;
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		attr = cf_pair_attr(cp);
+		value = cf_pair_value(cp);
+		if (!value || (strcmp(attr, "reference") == 0) || (strcmp(attr, "logfile") == 0)) continue;
+
+		stmt = sql_prepared_alloc(UNCONST(rlm_sql_t *, inst), inst, value);
+		if (!stmt) {
+			cf_log_debug(cp, "Query can't be run as a prepared statement");
+			continue;
+		}
+		stmt->id = (*id)++;
+
+		if (!cf_data_add(cp, stmt, NULL, false)) {
+			cf_log_err(cp, "Failed adding prepared statement");
+			talloc_free(stmt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Find the prepared statement compiled from a query template
+ *
+ * @param[in] cp	Pair containing the template.
+ * @return
+ *	- The statement.
+ *	- NULL if the template can't be run as a prepared statement.
+ */
+sql_prepared_t const *sql_prepared_find(CONF_PAIR const *cp)
+{
+	CONF_DATA const *cd;
+
+	cd = cf_data_find(cp, sql_prepared_t, CF_IDENT_ANY);
+	if (!cd) return NULL;
+
+	return cf_data_value(cd);
+}
+
+/** Whether a string is entirely a decimal integer or floating point number
+ *
+ */
+static bool sql_is_number(char const *value, bool *integer)
+{
+	char const *p = value;
+
+	if ((*p == '-') || (*p == '+')) p++;
+	if (!isdigit((uint8_t) *p)) return false;
+
+	*integer = (strspn(p, "0123456789") == strlen(p));
+	if (*integer) return true;
+
+	return strspn(p, "0123456789.eE+-") == strlen(p);
+}
+
+/** Expand the parameters of a prepared statement
+ *
+ * @param[in] ctx	to allocate the parameters in.
+ * @param[out] out	Array of parameters, one per marker.
+ * @param[in] request	to expand the parameters for.
+ * @param[in] stmt	to expand the parameters of.
+ * @param[in] escape	function to apply to the parameters.  NULL if the
+ *			driver's escaping only quotes values for the SQL syntax.
+ * @param[in] escape_ctx	passed to the escape function.
+ * @return
+ *	- 0 on success.
+ *	- 1 if a parameter can't be bound, so the query should be
+ *	  expanded into a string.
+ *	- -1 if expansion failed.
+ */
+int sql_prepared_params(TALLOC_CTX *ctx, fr_value_box_t **out, request_t *request, sql_prepared_t const *stmt,
+			xlat_escape_legacy_t escape, void const *escape_ctx)
+{
+	size_t		i, num = talloc_array_length(stmt->params);
+	fr_value_box_t	*params;
+
+	MEM(params = talloc_zero_array(ctx, fr_value_box_t, num));
+
+	for (i = 0; i < num; i++) {
+		char		*value = NULL;
+		char		*end;
+		bool		integer;
+
+		if (xlat_aeval(params, &value, request, stmt->params[i].xlat, escape, escape_ctx) < 0) {
+			talloc_free(params);
+			return -1;
+		}
+
+		if (stmt->params[i].quoted) {
+			fr_value_box_strdup_shallow(&params[i], NULL, value, true);
+			continue;
+		}
+
+		if (strcasecmp(value, "NULL") == 0) {
+			fr_value_box_init_null(&params[i]);
+			continue;
+		}
+
+		/*
+		 *	Anything else might be part of the query,
+		 *	so we can't bind it.
+		 */
+		if (!sql_is_number(value, &integer)) {
+			RDEBUG3("Parameter %zu (%s) isn't a number, expanding query", i + 1, value);
+			talloc_free(params);
+			return 1;
+		}
+
+		errno = 0;
+		if (integer) {
+			fr_value_box_init(&params[i], FR_TYPE_INT64, NULL, true);
+			params[i].vb_int64 = strtoll(value, &end, 10);
+		} else {
+			fr_value_box_init(&params[i], FR_TYPE_FLOAT64, NULL, true);
+			params[i].vb_float64 = strtod(value, &end);
+		}
+		if ((errno != 0) || (*end != '\0')) {
+			talloc_free(params);
+			return 1;
+		}
+	}
+
+	*out = params;
+
+	return 0;
+}
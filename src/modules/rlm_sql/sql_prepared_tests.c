@@ -0,0 +1,247 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for compiling query templates into prepared statements
+ *
+ * The expansions need the internal dictionaries, so FR_LIBRARY_PATH must
+ * point at the built libraries, e.g. build/lib/local/.libs.
+ *
+ * @file src/modules/rlm_sql/sql_prepared_tests.c
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict_test.h>
+
+#include "sql_prepared.c"
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*test_dict;
+
+static rlm_sql_driver_t const driver_numbered = { .flags = RLM_SQL_FLAGS_NUMBERED_PARAMS };
+static rlm_sql_driver_t const driver_positional = { .flags = 0 };
+
+static rlm_sql_t const inst_numbered = { .driver = &driver_numbered };
+static rlm_sql_t const inst_positional = { .driver = &driver_positional };
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("sql_prepared_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+
+	if (xlat_init(autofree) < 0) goto error;
+}
+
+/** Allocate a request containing the attributes the queries expand
+ *
+ */
+static request_t *test_request_alloc(char const *string)
+{
+	request_t	*request;
+	fr_pair_t	*vp;
+
+	request = request_local_alloc_internal(autofree, (&(request_init_args_t){ .namespace = test_dict }));
+	TEST_ASSERT(request != NULL);
+
+	TEST_ASSERT(fr_pair_append_by_da(request->request_ctx, &vp, &request->request_pairs,
+					 fr_dict_attr_test_string) == 0);
+	TEST_CHECK(fr_pair_value_strdup(vp, string, true) == 0);	/* Tainted, as if it came from a packet */
+
+	TEST_ASSERT(fr_pair_append_by_da(request->request_ctx, &vp, &request->request_pairs,
+					 fr_dict_attr_test_uint32) == 0);
+	vp->vp_uint32 = 42;
+
+	TEST_ASSERT(fr_pair_append_by_da(request->request_ctx, &vp, &request->request_pairs,
+					 fr_dict_attr_test_float64) == 0);
+	vp->vp_float64 = 1.5;
+
+	return request;
+}
+
+/** Double single quotes, as a driver's escape function might
+ *
+ */
+static size_t test_escape(UNUSED request_t *request, char *out, size_t outlen, char const *in, UNUSED void *arg)
+{
+	char *p = out, *end = out + outlen - 1;
+
+	while (*in && (p < end)) {
+		if (*in == '\'') {
+			if ((end - p) < 2) break;
+			*p++ = '\'';
+		}
+		*p++ = *in++;
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+static void test_markers(void)
+{
+	sql_prepared_t	*stmt;
+
+	TEST_CASE("Drivers with numbered parameters get $1, $2 ...");
+	stmt = sql_prepared_alloc(autofree, &inst_numbered,
+				  "INSERT INTO t (a, b, c) VALUES ('%{Test-String-0}', %{Test-Uint32-0}, %{Test-Float64-0})");
+	TEST_ASSERT(stmt != NULL);
+	TEST_CHECK_STRCMP(stmt->query, "INSERT INTO t (a, b, c) VALUES ($1, $2, $3)");
+	TEST_CHECK_RET(talloc_array_length(stmt->params), 3);
+	TEST_CHECK_STRCMP(stmt->params[0].xlat, "%{Test-String-0}");
+	TEST_CHECK(stmt->params[0].quoted);
+	TEST_CHECK_STRCMP(stmt->params[1].xlat, "%{Test-Uint32-0}");
+	TEST_CHECK(!stmt->params[1].quoted);
+	TEST_CHECK_STRCMP(stmt->params[2].xlat, "%{Test-Float64-0}");
+	TEST_CHECK(!stmt->params[2].quoted);
+	talloc_free(stmt);
+
+	TEST_CASE("Other drivers get ?");
+	stmt = sql_prepared_alloc(autofree, &inst_positional,
+				  "INSERT INTO t (a, b, c) VALUES ('%{Test-String-0}', %{Test-Uint32-0}, %{Test-Float64-0})");
+	TEST_ASSERT(stmt != NULL);
+	TEST_CHECK_STRCMP(stmt->query, "INSERT INTO t (a, b, c) VALUES (?, ?, ?)");
+	talloc_free(stmt);
+
+	TEST_CASE("Literal strings, identifiers and %% are kept");
+	stmt = sql_prepared_alloc(autofree, &inst_numbered,
+				  "UPDATE \"t\" SET a = 'it''s 100%%', b = %{Test-Uint32-0} WHERE c LIKE 'x%%'");
+	TEST_ASSERT(stmt != NULL);
+	TEST_CHECK_STRCMP(stmt->query, "UPDATE \"t\" SET a = 'it''s 100%', b = $1 WHERE c LIKE 'x%'");
+	TEST_CHECK_RET(talloc_array_length(stmt->params), 1);
+	talloc_free(stmt);
+
+	TEST_CASE("Function expansions are parameters");
+	stmt = sql_prepared_alloc(autofree, &inst_numbered, "SELECT %{Test-Uint32-0}, %(tolower:%{Test-String-0})");
+	TEST_ASSERT(stmt != NULL);
+	TEST_CHECK_STRCMP(stmt->query, "SELECT $1, $2");
+	TEST_CHECK_STRCMP(stmt->params[1].xlat, "%(tolower:%{Test-String-0})");
+	talloc_free(stmt);
+}
+
+static void test_refused(void)
+{
+	static char const *templates[] = {
+		"SELECT 'a\\'b' FROM t WHERE a = '%{Test-String-0}'",	/* Escape sequence in a string */
+		"SELECT a FROM t WHERE a = \\N OR b = %{Test-Uint32-0}",	/* Escape sequence outside a string */
+		"SELECT a FROM t WHERE a = ? AND b = %{Test-Uint32-0}",	/* Existing marker */
+		"SELECT a FROM t WHERE a = $1 AND b = %{Test-Uint32-0}",	/* Existing numbered marker */
+		"SELECT $$quoted$$, %{Test-Uint32-0}",			/* Dollar quoting */
+		"SELECT a FROM t WHERE a = 'user-%{Test-String-0}'",	/* Expansion inside a longer string */
+		"SELECT a FROM \"%{Test-String-0}\"",			/* Expansion as an identifier */
+		"SELECT a FROM t WHERE a = '%{Test-String-0}",		/* Unterminated string */
+		"SELECT a FROM t WHERE a = %{Test-String",		/* Unterminated expansion */
+	};
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(templates); i++) {
+		TEST_CASE(templates[i]);
+		TEST_CHECK(sql_prepared_alloc(autofree, &inst_numbered, templates[i]) == NULL);
+	}
+}
+
+static void test_params(void)
+{
+	sql_prepared_t	*stmt;
+	request_t	*request = test_request_alloc("o'brien");
+	fr_value_box_t	*params = NULL;
+
+	stmt = sql_prepared_alloc(autofree, &inst_numbered,
+				  "INSERT INTO t VALUES ('%{Test-String-0}', %{Test-Uint32-0}, %{Test-Float64-0})");
+	TEST_ASSERT(stmt != NULL);
+
+	TEST_CASE("Parameters are bound as strings, integers and floats");
+	TEST_CHECK_RET(sql_prepared_params(autofree, &params, request, stmt, NULL, NULL), 0);
+	TEST_ASSERT(params != NULL);
+
+	TEST_CHECK(params[0].type == FR_TYPE_STRING);
+	TEST_CHECK_STRCMP(params[0].vb_strvalue, "o'brien");
+
+	TEST_CHECK(params[1].type == FR_TYPE_INT64);
+	TEST_CHECK(params[1].vb_int64 == 42);
+
+	TEST_CHECK(params[2].type == FR_TYPE_FLOAT64);
+	TEST_CHECK(params[2].vb_float64 == 1.5);
+
+	talloc_free(params);
+	params = NULL;
+
+	talloc_free(stmt);
+	stmt = sql_prepared_alloc(autofree, &inst_numbered, "INSERT INTO t VALUES (%{Test-String-0}, '%{Test-String-0}')");
+	TEST_ASSERT(stmt != NULL);
+
+	TEST_CASE("Unquoted expansions which aren't numbers make the query be expanded");
+	TEST_CHECK_RET(sql_prepared_params(autofree, &params, request, stmt, NULL, NULL), 1);
+	TEST_CHECK(params == NULL);
+
+	TEST_CASE("Unquoted expansions of NULL are bound as NULL, quoted ones as the string");
+	talloc_free(request);
+	request = test_request_alloc("NULL");
+	TEST_CHECK_RET(sql_prepared_params(autofree, &params, request, stmt, NULL, NULL), 0);
+	TEST_ASSERT(params != NULL);
+	TEST_CHECK(params[0].type == FR_TYPE_NULL);
+	TEST_CHECK(params[1].type == FR_TYPE_STRING);
+	TEST_CHECK_STRCMP(params[1].vb_strvalue, "NULL");
+	talloc_free(params);
+	params = NULL;
+
+	TEST_CASE("The escape function is applied to the parameters");
+	talloc_free(request);
+	request = test_request_alloc("o'brien");
+	talloc_free(stmt);
+	stmt = sql_prepared_alloc(autofree, &inst_numbered, "INSERT INTO t VALUES ('%{Test-String-0}')");
+	TEST_ASSERT(stmt != NULL);
+	TEST_CHECK_RET(sql_prepared_params(autofree, &params, request, stmt, test_escape, NULL), 0);
+	TEST_ASSERT(params != NULL);
+	TEST_CHECK_STRCMP(params[0].vb_strvalue, "o''brien");
+
+	talloc_free(params);
+	talloc_free(stmt);
+	talloc_free(request);
+}
+
+TEST_LIST = {
+	{ "markers",	test_markers },
+	{ "refused",	test_refused },
+	{ "params",	test_params },
+
+	{ NULL }
+};
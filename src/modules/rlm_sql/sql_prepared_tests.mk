@@ -0,0 +1,9 @@
+TARGET		:= sql_prepared_tests$(E)
+SOURCES		:= sql_prepared_tests.c
+
+SRC_CFLAGS	:= $(rlm_sql_CFLAGS)
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-server$(L) libfreeradius-unlang$(L)
+
+TGT_INSTALLDIR	:=
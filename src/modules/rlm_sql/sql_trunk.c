@@ -0,0 +1,851 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_trunk.c
+ * @brief Run SQL queries on per-thread connection trunks.
+ *
+ * Each SQL connection can only run one query at a time.  Queries are
+ * queued on the trunk connections, and sent one after another.
+ *
+ * Escaping may depend on the connection's character set, so tainted
+ * values are only escaped once a query is sent.  Queries can then wait
+ * in the trunk's backlog while its connections are being opened.
+ *
+ * Trunks are only used with drivers which can connect and run queries
+ * without blocking.  The request yields while the query runs, and the
+ * result is read when the connection's socket is readable.  If a query
+ * can't be sent in one go, the rest is sent when the socket is writable.
+ *
+ * If batching is enabled, and the driver supports it, up to batch.size
+ * queries are sent on a connection before any results are read, and
+ * committed together.  The batch is ended when it's full, or batch.delay
+ * after its first query was sent.  Requests are resumed once the whole
+ * batch has been committed.  If a query fails, the rest of the batch is
+ * rolled back by the database, so the other queries are requeued.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "rlm_sql.h"
+
+/** A connection in a thread's trunk
+ *
+ */
+struct sql_trunk_conn_s {
+	rlm_sql_handle_t	*handle;		//!< Driver's connection handle.
+	rlm_sql_thread_t	*t;			//!< Thread the connection belongs to.
+	fr_connection_t		*conn;			//!< Connection this is the handle for.
+	fr_trunk_connection_t	*tconn;			//!< Trunk connection this is the handle for.
+	int			fd;			//!< Socket to wait for results on.
+	bool			open_query;		//!< Waiting for the result of open_query.
+	bool			read;			//!< The trunk is waiting for results.
+	bool			flushing;		//!< There's data which couldn't be sent yet.
+
+	fr_trunk_request_t	**batch;		//!< Queries sent, in the order they were sent.
+							///< Entries are NULL if the query was cancelled.
+	unsigned int		sent;			//!< Queries sent in the current batch.
+	unsigned int		recvd;			//!< Results read in the current batch.
+	bool			flushed;		//!< The current batch has ended, and no more
+							///< queries can be sent until it's complete.
+	bool			failed;			//!< A query in the current batch failed.
+	unsigned int		failed_idx;		//!< Which one.
+	fr_event_timer_t const	*ev;			//!< Query timeout, batch delay, or connected signal.
+};
+
+/** Stop tracking a query on the connection it was sent on
+ *
+ */
+static void sql_trunk_query_untrack(fr_sql_query_t *query)
+{
+	sql_trunk_conn_t	*sql_conn = query->sql_conn;
+	unsigned int		i;
+
+	if (!sql_conn) return;
+
+	for (i = 0; i < sql_conn->sent; i++) {
+		if (sql_conn->batch[i] && (sql_conn->batch[i]->preq == query)) sql_conn->batch[i] = NULL;
+	}
+	query->sql_conn = NULL;
+}
+
+/** Write the result of a query into the query
+ *
+ * Mirrors the error handling in rlm_sql_query().
+ */
+static void sql_trunk_query_result(sql_trunk_conn_t *sql_conn, fr_sql_query_t *query, request_t *request,
+				   sql_rcode_t rcode)
+{
+	rlm_sql_t const		*inst = query->inst;
+	rlm_sql_handle_t	*handle = sql_conn->handle;
+
+	switch (rcode) {
+	case RLM_SQL_OK:
+		query->affected_rows = (inst->driver->sql_affected_rows)(handle, &inst->config);
+		break;
+
+	/*
+	 *	The connection is unusable, so there's
+	 *	nothing to clean up.
+	 */
+	case RLM_SQL_RECONNECT:
+		query->rcode = rcode;
+		return;
+
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, handle, false);
+		break;
+
+	/*
+	 *	If the driver can't distinguish between duplicate
+	 *	row errors and other errors, try the alternative
+	 *	query.
+	 */
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, handle, false);
+			break;
+		}
+		rcode = RLM_SQL_ALT_QUERY;
+		FALL_THROUGH;
+
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, handle, true);
+		break;
+
+	default:
+		break;
+	}
+
+	(inst->driver->sql_finish_query)(handle, &inst->config);
+	query->rcode = rcode;
+}
+
+static int _sql_trunk_conn_free(sql_trunk_conn_t *sql_conn)
+{
+	unsigned int i;
+
+	for (i = 0; i < sql_conn->sent; i++) {
+		fr_sql_query_t *query;
+
+		if (!sql_conn->batch[i]) continue;
+
+		query = talloc_get_type_abort(sql_conn->batch[i]->preq, fr_sql_query_t);
+		query->sql_conn = NULL;
+	}
+
+	return 0;
+}
+
+static void sql_conn_connecting_io(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+static void sql_conn_connecting_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno,
+				      void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+
+	ERROR("%s - Connection failed: %s", sql_conn->conn->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(sql_conn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Wait for the socket to be readable or writable, while the connection is opening
+ *
+ * The socket is looked up again each time, as the driver may have
+ * opened a new one.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sql_conn_connecting_watch(sql_trunk_conn_t *sql_conn, bool read, bool write)
+{
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+
+	sql_conn->fd = (inst->driver->sql_fd)(sql_conn->handle, &inst->config);
+	if (sql_conn->fd < 0) {
+		ERROR("Failed getting connection's socket");
+		return -1;
+	}
+
+	if (fr_event_fd_insert(sql_conn, sql_conn->conn->el, sql_conn->fd,
+			       read ? sql_conn_connecting_io : NULL,
+			       write ? sql_conn_connecting_io : NULL,
+			       sql_conn_connecting_error, sql_conn) < 0) {
+		PERROR("Failed inserting FD event");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Continue opening the connection, then run open_query if there is one
+ *
+ */
+static void sql_conn_connecting_io(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+	rlm_sql_handle_t	*handle = sql_conn->handle;
+	int			ret;
+
+	fr_event_fd_delete(el, sql_conn->fd, FR_EVENT_FILTER_IO);
+
+	if (sql_conn->open_query) {
+		sql_rcode_t	rcode;
+		int		flush;
+
+		flush = (inst->driver->sql_flush)(handle, &inst->config);
+		if (flush < 0) goto fail;
+
+		ret = (inst->driver->sql_query_busy)(handle, &inst->config);
+		if (ret < 0) goto fail;
+		if (ret == 1) {
+			if (sql_conn_connecting_watch(sql_conn, true, (flush == 1)) < 0) goto fail;
+			return;
+		}
+
+		rcode = (inst->driver->sql_query_recv)(handle, &inst->config);
+		if (rcode != RLM_SQL_OK) {
+			rlm_sql_print_error(inst, NULL, handle, false);
+			(inst->driver->sql_finish_select_query)(handle, &inst->config);
+			ERROR("Failed running open_query");
+			goto fail;
+		}
+		(inst->driver->sql_finish_select_query)(handle, &inst->config);
+		sql_conn->open_query = false;
+		goto connected;
+	}
+
+	ret = (inst->driver->sql_socket_init_poll)(handle, &inst->config);
+	switch (ret) {
+	case 0:
+		break;
+
+	case 1:
+	case 2:
+		if (sql_conn_connecting_watch(sql_conn, (ret == 1), (ret == 2)) < 0) goto fail;
+		return;
+
+	default:
+	fail:
+		fr_connection_signal_reconnect(sql_conn->conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	sql_conn->fd = (inst->driver->sql_fd)(handle, &inst->config);
+	if (sql_conn->fd < 0) {
+		ERROR("Failed getting connection's socket");
+		goto fail;
+	}
+
+	if (inst->config.connect_query) {
+		DEBUG2("Executing query: %s", inst->config.connect_query);
+
+		if ((inst->driver->sql_query_send)(handle, &inst->config, inst->config.connect_query) != RLM_SQL_OK) {
+			goto fail;
+		}
+
+		ret = (inst->driver->sql_flush)(handle, &inst->config);
+		if (ret < 0) goto fail;
+
+		sql_conn->open_query = true;
+		if (sql_conn_connecting_watch(sql_conn, true, (ret == 1)) < 0) goto fail;
+		return;
+	}
+
+connected:
+	fr_connection_signal_connected(sql_conn->conn);
+}
+
+/** Start opening a connection to the database
+ *
+ * The driver connects without blocking.  We watch the connection's
+ * socket until it's open, then signal the connection.
+ */
+static fr_connection_state_t _sql_connection_init(void **h, fr_connection_t *conn, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+	sql_trunk_conn_t	*sql_conn;
+	int			ret;
+
+	MEM(sql_conn = talloc_zero(conn, sql_trunk_conn_t));
+	sql_conn->t = t;
+	sql_conn->conn = conn;
+	talloc_set_destructor(sql_conn, _sql_trunk_conn_free);
+
+	MEM(sql_conn->handle = sql_handle_alloc(sql_conn, inst));
+	MEM(sql_conn->batch = talloc_zero_array(sql_conn, fr_trunk_request_t *, inst->config.batch_size));
+
+	ret = (inst->driver->sql_socket_init_start)(sql_conn->handle, &inst->config);
+	if (ret < 0) {
+	fail:
+		talloc_free(sql_conn);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	/*
+	 *	The connection can't be signalled as connected
+	 *	from here.  If it's already open, we wait for
+	 *	the socket to be writable, and the driver tells
+	 *	us again.
+	 */
+	if (sql_conn_connecting_watch(sql_conn, (ret == 1), (ret != 1)) < 0) goto fail;
+
+	*h = sql_conn;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static void _sql_connection_close(fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(h, sql_trunk_conn_t);
+
+	fr_event_fd_delete(el, sql_conn->fd, FR_EVENT_FILTER_IO);
+
+	talloc_free(sql_conn);
+}
+
+static fr_connection_t *sql_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						   fr_connection_conf_t const *conf,
+						   char const *log_prefix, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _sql_connection_init,
+					.close = _sql_connection_close
+				   },
+				   conf, log_prefix, t);
+}
+
+static void sql_conn_readable(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void sql_conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+static void sql_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+
+	ERROR("%s - Connection failed: %s", sql_conn->conn->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(sql_conn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Watch the socket for results, and for being able to send more data
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sql_trunk_conn_watch(sql_trunk_conn_t *sql_conn)
+{
+	if (!sql_conn->read && !sql_conn->flushing) {
+		fr_event_fd_delete(sql_conn->t->el, sql_conn->fd, FR_EVENT_FILTER_IO);
+		return 0;
+	}
+
+	return fr_event_fd_insert(sql_conn, sql_conn->t->el, sql_conn->fd,
+				  sql_conn->read ? sql_conn_readable : NULL,
+				  sql_conn->flushing ? sql_conn_writable : NULL,
+				  sql_conn_error, sql_conn);
+}
+
+/** Send data which the driver couldn't write without blocking
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection failed.
+ */
+static int sql_trunk_conn_flush(sql_trunk_conn_t *sql_conn)
+{
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+	int			ret;
+
+	ret = (inst->driver->sql_flush)(sql_conn->handle, &inst->config);
+	if (ret < 0) {
+	fail:
+		fr_connection_signal_reconnect(sql_conn->conn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+
+	if (sql_conn->flushing == (ret == 1)) return 0;
+
+	sql_conn->flushing = (ret == 1);
+	if (sql_trunk_conn_watch(sql_conn) < 0) {
+		PERROR("Failed inserting FD event");
+		goto fail;
+	}
+
+	return 0;
+}
+
+/** The connection's socket is readable
+ *
+ * After reading the result, the connection can send the next query.
+ */
+static void sql_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	fr_trunk_connection_t	*tconn = sql_conn->tconn;
+
+	fr_trunk_connection_signal_readable(tconn);
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+/** The connection's socket is writable, so we can send the rest of the data
+ *
+ */
+static void sql_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+
+	(void) sql_trunk_conn_flush(sql_conn);
+}
+
+static void sql_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+				        UNUSED fr_event_list_t *el,
+				        fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(conn->h, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+
+	sql_conn->tconn = tconn;
+
+	/*
+	 *	The trunk is always writable, so we're only
+	 *	interested in results.
+	 */
+	sql_conn->read = (notify_on & FR_TRUNK_CONN_EVENT_READ);
+
+	if (sql_trunk_conn_watch(sql_conn) < 0) {
+		PERROR("Failed inserting FD event");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** The database took too long to respond
+ *
+ * Fail the queries, and reconnect to abandon them.  The queries are
+ * removed from the connection first.  Failing them may free them, and
+ * the connection must not reference them when it's freed.
+ */
+static void _sql_trunk_query_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+	fr_trunk_connection_t	*tconn = sql_conn->tconn;
+	unsigned int		i;
+
+	ERROR("Query timed out after %pV seconds", fr_box_time_delta(inst->config.query_timeout));
+
+	for (i = 0; i < sql_conn->sent; i++) {
+		fr_trunk_request_t *treq = sql_conn->batch[i];
+
+		if (!treq) continue;
+
+		sql_trunk_query_untrack(talloc_get_type_abort(treq->preq, fr_sql_query_t));
+		fr_trunk_request_signal_fail(treq);
+	}
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** End the current batch, so that the database commits it
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection failed.
+ */
+static int sql_trunk_batch_flush(sql_trunk_conn_t *sql_conn)
+{
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+
+	if (sql_conn->ev) fr_event_timer_delete(&sql_conn->ev);
+
+	if ((inst->config.batch_size > 1) &&
+	    ((inst->driver->sql_batch_flush)(sql_conn->handle, &inst->config) != RLM_SQL_OK)) {
+		fr_trunk_connection_signal_reconnect(sql_conn->tconn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+	if (sql_trunk_conn_flush(sql_conn) < 0) return -1;
+	sql_conn->flushed = true;
+
+	if (fr_time_delta_ispos(inst->config.query_timeout) &&
+	    (fr_event_timer_in(sql_conn, sql_conn->t->el, &sql_conn->ev, inst->config.query_timeout,
+			       _sql_trunk_query_timeout, sql_conn) < 0)) {
+		PERROR("Failed inserting query timeout");
+	}
+
+	return 0;
+}
+
+/** No more queries arrived within batch.delay, so send what we have
+ *
+ */
+static void _sql_trunk_batch_delay(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+
+	(void) sql_trunk_batch_flush(sql_conn);
+}
+
+/** Send queries
+ *
+ * Connections can only run one batch of queries at a time, so we stop as
+ * soon as a batch has been ended, and send the next one once all of its
+ * results have been read.  Without batching, a batch is a single query.
+ */
+static void sql_trunk_request_mux(fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				  fr_connection_t *conn, UNUSED void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(conn->h, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+	fr_trunk_request_t	*treq;
+
+	sql_conn->tconn = tconn;
+
+	while (!sql_conn->flushed && (fr_trunk_connection_pop_request(&treq, tconn) == 0)) {
+		fr_sql_query_t	*query;
+		request_t	*request;
+		sql_rcode_t	rcode;
+
+		if (!treq) break;
+
+		query = talloc_get_type_abort(treq->preq, fr_sql_query_t);
+		request = treq->request;
+
+		/*
+		 *	Escaping may depend on the connection's
+		 *	character set, so it's done once we know
+		 *	which connection the query is sent on.
+		 */
+		if (!query->query_str) {
+			char *query_str;
+
+			if (xlat_list_aprint(query, &query_str, request, &query->expanded,
+					     inst->sql_escape_func, sql_conn->handle) < 0) {
+				RPERROR("Failed escaping query");
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			query->query_str = query_str;
+
+			if (query->log_name) rlm_sql_query_log_write(inst, query->log_name, query->query_str);
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing %squery: %s", query->stmt ? "prepared " : "", query->query_str);
+		if (query->stmt && request && RDEBUG_ENABLED3) {
+			size_t i;
+
+			for (i = 0; i < talloc_array_length(query->params); i++) {
+				RDEBUG3("Parameter %zu: %pV", i + 1, &query->params[i]);
+			}
+		}
+
+		if (query->stmt) {
+			rcode = (inst->driver->sql_query_send_prepared)(sql_conn->handle, &inst->config,
+									query->stmt, query->params,
+									inst->config.batch_size > 1);
+		} else if (inst->config.batch_size > 1) {
+			rcode = (inst->driver->sql_batch_send)(sql_conn->handle, &inst->config, query->query_str);
+		} else {
+			rcode = (inst->driver->sql_query_send)(sql_conn->handle, &inst->config, query->query_str);
+		}
+		if (rcode != RLM_SQL_OK) {
+			fr_trunk_request_signal_fail(treq);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		sql_conn->batch[sql_conn->sent++] = treq;
+		query->sql_conn = sql_conn;
+
+		fr_trunk_request_signal_sent(treq);
+
+		if (sql_conn->sent == inst->config.batch_size) {
+			if (sql_trunk_batch_flush(sql_conn) < 0) return;
+			break;
+		}
+
+		/*
+		 *	First query in a batch, wait for more.
+		 */
+		if ((sql_conn->sent == 1) &&
+		    (fr_event_timer_in(sql_conn, el, &sql_conn->ev, inst->config.batch_delay,
+				       _sql_trunk_batch_delay, sql_conn) < 0)) {
+			PERROR("Failed inserting batch delay");
+			if (sql_trunk_batch_flush(sql_conn) < 0) return;
+		}
+	}
+
+	(void) sql_trunk_conn_flush(sql_conn);
+}
+
+/** Read the results of the batch in progress
+ *
+ * Requests are only resumed once all of the batch's results have been
+ * read, as until then, the queries may still be rolled back.
+ */
+static void sql_trunk_request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				    fr_connection_t *conn, UNUSED void *uctx)
+{
+	sql_trunk_conn_t	*sql_conn = talloc_get_type_abort(conn->h, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sql_conn->t->inst;
+	unsigned int		i;
+
+	while (sql_conn->recvd < sql_conn->sent) {
+		fr_trunk_request_t	*treq;
+		sql_rcode_t		rcode;
+		bool			aborted = sql_conn->failed;
+
+		switch ((inst->driver->sql_query_busy)(sql_conn->handle, &inst->config)) {
+		case 0:
+			break;
+
+		/*
+		 *	Reading a result may make the driver
+		 *	send more, e.g. a statement which has
+		 *	just been prepared.
+		 */
+		case 1:
+			(void) sql_trunk_conn_flush(sql_conn);
+			return;
+
+		default:
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		rcode = (inst->driver->sql_query_recv)(sql_conn->handle, &inst->config);
+		treq = sql_conn->batch[sql_conn->recvd++];
+
+		if (rcode == RLM_SQL_RECONNECT) {
+			if (treq) {
+				sql_trunk_query_untrack(talloc_get_type_abort(treq->preq, fr_sql_query_t));
+				fr_trunk_request_signal_fail(treq);
+			}
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		if ((inst->config.batch_size > 1) && !aborted && (rcode != RLM_SQL_OK)) {
+			sql_conn->failed = true;
+			sql_conn->failed_idx = sql_conn->recvd - 1;
+		}
+
+		/*
+		 *	The query was cancelled, or wasn't run
+		 *	because an earlier query in the batch
+		 *	failed.  We just need to free the result.
+		 */
+		if (!treq || aborted) {
+			(inst->driver->sql_finish_query)(sql_conn->handle, &inst->config);
+			continue;
+		}
+
+		sql_trunk_query_result(sql_conn, talloc_get_type_abort(treq->preq, fr_sql_query_t),
+				       treq->request, rcode);
+	}
+
+	/*
+	 *	More queries may still be added to the batch.
+	 */
+	if (!sql_conn->flushed) return;
+
+	if (inst->config.batch_size > 1) {
+		switch ((inst->driver->sql_batch_end)(sql_conn->handle, &inst->config)) {
+		case 0:
+			break;
+
+		case 1:
+			return;
+
+		default:
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	if (sql_conn->ev) fr_event_timer_delete(&sql_conn->ev);
+
+	/*
+	 *	The connection stays busy until we're done, so
+	 *	requeued queries aren't sent in the middle of
+	 *	this loop.
+	 */
+	for (i = 0; i < sql_conn->sent; i++) {
+		fr_trunk_request_t	*treq = sql_conn->batch[i];
+		fr_sql_query_t		*query;
+		request_t		*request;
+
+		if (!treq) continue;
+
+		request = treq->request;
+		sql_conn->batch[i] = NULL;
+		query = talloc_get_type_abort(treq->preq, fr_sql_query_t);
+		query->sql_conn = NULL;
+
+		if (sql_conn->failed && (i != sql_conn->failed_idx)) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Query was rolled back, requeueing it");
+			(void) fr_trunk_request_requeue(treq);
+			continue;
+		}
+
+		fr_trunk_request_signal_complete(treq);
+	}
+
+	sql_conn->sent = 0;
+	sql_conn->recvd = 0;
+	sql_conn->flushed = false;
+	sql_conn->failed = false;
+}
+
+/** Stop tracking a query which has been cancelled, or moved to another connection
+ *
+ * If the query has been sent, the connection stays busy until its result
+ * has been read, and the rest of its batch is complete.
+ */
+static void sql_request_cancel(UNUSED fr_connection_t *conn, void *preq, UNUSED fr_trunk_cancel_reason_t reason,
+			       UNUSED void *uctx)
+{
+	sql_trunk_query_untrack(talloc_get_type_abort(preq, fr_sql_query_t));
+}
+
+static void sql_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	fr_sql_query_t		*query = talloc_get_type_abort(preq, fr_sql_query_t);
+
+	query->treq = NULL;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+static void sql_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+			     UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_sql_query_t		*query = talloc_get_type_abort(preq, fr_sql_query_t);
+
+	sql_trunk_query_untrack(query);
+	query->treq = NULL;
+	query->rcode = RLM_SQL_RECONNECT;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+/** Allocate a trunk for a thread
+ *
+ * @param[in] t		Thread specific data.  The trunk is allocated in it.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on error.
+ */
+fr_trunk_t *sql_trunk_alloc(rlm_sql_thread_t *t)
+{
+	MEM(t->escape_handle = sql_handle_alloc(t, t->inst));
+
+	return fr_trunk_alloc(t, t->el,
+			      &(fr_trunk_io_funcs_t){
+				.connection_alloc = sql_trunk_connection_alloc,
+				.connection_notify = sql_trunk_connection_notify,
+				.request_mux = sql_trunk_request_mux,
+				.request_demux = sql_trunk_request_demux,
+				.request_cancel = sql_request_cancel,
+				.request_complete = sql_request_complete,
+				.request_fail = sql_request_fail
+			      },
+			      &t->inst->trunk_conf, t->inst->name, t, false);
+}
+
+/** Allocate a query to run on a trunk
+ *
+ * @param[in] ctx		to allocate the query in.
+ * @param[in] inst		Module instance.
+ * @param[in] request		the query is being run for.
+ * @param[in] query_str		to run.  Is reparented to the query.  NULL if the
+ *				query is escaped from query->expanded when it's sent.
+ * @return A new query.
+ */
+fr_sql_query_t *fr_sql_query_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, char const *query_str)
+{
+	fr_sql_query_t *query;
+
+	MEM(query = talloc(ctx, fr_sql_query_t));
+	*query = (fr_sql_query_t) {
+		.inst = inst,
+		.request = request,
+		.query_str = talloc_steal(query, query_str),
+		.rcode = RLM_SQL_OK
+	};
+	fr_value_box_list_init(&query->expanded);
+
+	return query;
+}
+
+/** Queue a query to run on a thread's trunk
+ *
+ * The request is marked runnable once the query is complete.  Until
+ * then, query->treq is set.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] query	to run.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the query couldn't be queued.  query->rcode is set to
+ *	  #RLM_SQL_RECONNECT.
+ */
+int fr_sql_trunk_query(rlm_sql_thread_t *t, fr_sql_query_t *query)
+{
+	switch (fr_trunk_request_enqueue(&query->treq, t->trunk, query->request, query, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return 0;
+
+	default:
+		query->treq = NULL;
+		query->rcode = RLM_SQL_RECONNECT;
+		return -1;
+	}
+}
+
+/** Stop waiting for a query
+ *
+ * @param[in] query	to cancel.
+ */
+void fr_sql_trunk_query_cancel(fr_sql_query_t *query)
+{
+	fr_trunk_request_t *treq = query->treq;
+
+	/*
+	 *	The query may be complete, with the request not
+	 *	yet resumed.
+	 */
+	if (!treq) return;
+
+	query->treq = NULL;
+	fr_trunk_request_signal_cancel(treq);
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+#  Stands in for "ntlm_auth --helper-protocol=ntlm-server-1".
+#  The answer depends on the username:
+#
+#	bob	- authenticated, with a User-Session-Key
+#	expired	- password expired
+#	slow	- authenticated, but only after ntlm_auth_timeout
+#	crash	- exits without answering
+#	others	- logon failure
+#
+#  Requests without a username (health checks) get an error.
+#
+user=
+while read -r line; do
+	case "$line" in
+	"Username:: "*)
+		user=$(echo "${line#Username:: }" | base64 -d)
+		;;
+
+	"Username: "*)
+		user="${line#Username: }"
+		;;
+
+	.)
+		case "$user" in
+		'')
+			echo "Error: No username supplied!"
+			;;
+
+		bob)
+			echo "Authenticated: Yes"
+			echo "User-Session-Key: 000102030405060708090A0B0C0D0E0F"
+			;;
+
+		expired)
+			echo "Authenticated: No"
+			echo "Authentication-Error: Password expired (0xc0000224)"
+			;;
+
+		slow)
+			sleep 3
+			echo "Authenticated: Yes"
+			echo "User-Session-Key: 000102030405060708090A0B0C0D0E0F"
+			;;
+
+		crash)
+			exit 1
+			;;
+
+		*)
+			echo "Authenticated: No"
+			echo "Authentication-Error: Logon failure (0xc000006d)"
+			;;
+		esac
+		echo .
+		user=
+		;;
+	esac
+done
@@ -1,4 +1,4 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk atomic_queue_bench.mk radius_decode_bench.mk
 
 #
 #  This uses an old API, and we don't have time to fix it.
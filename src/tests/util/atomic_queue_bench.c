@@ -0,0 +1,321 @@
+/*
+ * atomic_queue_bench.c	Benchmark for atomic queues
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Count the cache misses of all of the threads.
+ */
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#define MAX_THREADS	(64)
+#define MAX_BATCH	(256)
+
+typedef struct {
+	pthread_t		id;
+	int			cpu;		//!< to pin the thread to, or -1.
+	uint64_t		count;		//!< messages this thread pushed or popped.
+	uint64_t		spins;		//!< times the queue was full or empty.
+} bench_thread_t;
+
+static fr_atomic_queue_t	*aq;
+static unsigned int		batch = 1;
+static uint64_t			num_messages = 10 * 1000 * 1000;
+static uint64_t			num_total;
+static atomic_uint64_t		num_popped;
+static atomic_uint32_t		go;
+
+/**********************************************************************/
+typedef struct request_s request_t;
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request);
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request)
+{
+}
+/**********************************************************************/
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "usage: atomic_queue_bench [OPTS]\n");
+	fprintf(stderr, "  -a                     Pin each producer / consumer pair to adjacent CPUs.\n");
+	fprintf(stderr, "  -b batch               Push and pop this many messages at once.\n");
+	fprintf(stderr, "  -c consumers           Number of consumer threads.\n");
+	fprintf(stderr, "  -n messages            Messages sent by each producer.\n");
+	fprintf(stderr, "  -p producers           Number of producer threads.\n");
+	fprintf(stderr, "  -s size                Set queue size.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static void bench_pin(bench_thread_t *t)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (t->cpu < 0) return;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	(void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void) t;
+#endif
+}
+
+static void *bench_producer(void *arg)
+{
+	bench_thread_t	*t = arg;
+	void		*data[MAX_BATCH];
+	uint64_t	i = 0;
+	unsigned int	j;
+
+	bench_pin(t);
+
+	/*
+	 *	The values don't matter, so long as they're not NULL.
+	 */
+	for (j = 0; j < batch; j++) data[j] = t;
+
+	while (!atomic_load(&go));
+
+	while (i < num_messages) {
+		unsigned int num = batch;
+
+		if ((num_messages - i) < num) num = num_messages - i;
+
+		if (num == 1) {
+			if (!fr_atomic_queue_push(aq, data[0])) {
+				t->spins++;
+				continue;
+			}
+		} else {
+			num = fr_atomic_queue_push_n(aq, data, num);
+			if (!num) {
+				t->spins++;
+				continue;
+			}
+		}
+
+		i += num;
+	}
+
+	t->count = i;
+	return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+	bench_thread_t	*t = arg;
+	void		*data[MAX_BATCH];
+
+	bench_pin(t);
+
+	while (!atomic_load(&go));
+
+	while (atomic_load_explicit(&num_popped, memory_order_relaxed) < num_total) {
+		unsigned int num;
+
+		if (batch == 1) {
+			num = fr_atomic_queue_pop(aq, &data[0]);
+		} else {
+			num = fr_atomic_queue_pop_n(aq, data, batch);
+		}
+
+		if (!num) {
+			t->spins++;
+			continue;
+		}
+
+		t->count += num;
+		atomic_fetch_add_explicit(&num_popped, num, memory_order_relaxed);
+	}
+
+	return NULL;
+}
+
+#ifdef __linux__
+static int cache_misses_open(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.inherit = 1;		/* count the threads we create */
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	unsigned int		i;
+	unsigned int		num_producers = 1, num_consumers = 1, pairs;
+	int			size = 1024;
+	bool			pin = false;
+	int			fd = -1;
+	uint64_t		misses = 0;
+	bool			have_misses = false;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+	double			rate;
+	bench_thread_t		producers[MAX_THREADS], consumers[MAX_THREADS];
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "ab:c:hn:p:s:")) != -1) switch (c) {
+		case 'a':
+			pin = true;
+			break;
+
+		case 'b':
+			batch = atoi(optarg);
+			if ((batch < 1) || (batch > MAX_BATCH)) usage();
+			break;
+
+		case 'c':
+			num_consumers = atoi(optarg);
+			if ((num_consumers < 1) || (num_consumers > MAX_THREADS)) usage();
+			break;
+
+		case 'n':
+			num_messages = strtoull(optarg, NULL, 10);
+			if (!num_messages) usage();
+			break;
+
+		case 'p':
+			num_producers = atoi(optarg);
+			if ((num_producers < 1) || (num_producers > MAX_THREADS)) usage();
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size < 2) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_time_start();
+
+	aq = fr_atomic_queue_alloc(autofree, size);
+	if (!aq) {
+		fprintf(stderr, "atomic_queue_bench: Failed allocating queue\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	num_total = num_messages * num_producers;
+
+	/*
+	 *	Producer N and consumer N share a core pair.
+	 */
+	memset(producers, 0, sizeof(producers));
+	memset(consumers, 0, sizeof(consumers));
+	for (i = 0; i < num_producers; i++) producers[i].cpu = pin ? (int) (2 * i) : -1;
+	for (i = 0; i < num_consumers; i++) consumers[i].cpu = pin ? (int) ((2 * i) + 1) : -1;
+
+#ifdef __linux__
+	fd = cache_misses_open();
+	if (fd < 0) fprintf(stderr, "atomic_queue_bench: Can't count cache misses: %s\n", fr_syserror(errno));
+	if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+
+	for (i = 0; i < num_consumers; i++) {
+		(void) pthread_create(&consumers[i].id, NULL, bench_consumer, &consumers[i]);
+	}
+	for (i = 0; i < num_producers; i++) {
+		(void) pthread_create(&producers[i].id, NULL, bench_producer, &producers[i]);
+	}
+
+	start = fr_time();
+	atomic_store(&go, 1);
+
+	for (i = 0; i < num_producers; i++) (void) pthread_join(producers[i].id, NULL);
+	for (i = 0; i < num_consumers; i++) (void) pthread_join(consumers[i].id, NULL);
+
+	elapsed = fr_time_sub(fr_time(), start);
+
+#ifdef __linux__
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		have_misses = (read(fd, &misses, sizeof(misses)) == sizeof(misses));
+		close(fd);
+	}
+#endif
+
+	rate = (double) num_total * NSEC / fr_time_delta_unwrap(elapsed);
+	pairs = (num_producers < num_consumers) ? num_producers : num_consumers;
+
+	printf("producers\t\t%u\n", num_producers);
+	printf("consumers\t\t%u\n", num_consumers);
+	printf("batch\t\t\t%u\n", batch);
+	printf("queue_size\t\t%d\n", size);
+	printf("messages\t\t%" PRIu64 "\n", num_total);
+	printf("elapsed\t\t\t%.6f\n", fr_time_delta_unwrap(elapsed) / (double) NSEC);
+	printf("messages_per_sec\t%.0f\n", rate);
+	printf("messages_per_sec_pair\t%.0f\n", rate / pairs);
+	if (have_misses) {
+		printf("cache_misses_per_msg\t%.3f\n", (double) misses / num_total);
+	} else {
+		printf("cache_misses_per_msg\tn/a\n");
+	}
+
+	for (i = 0; i < num_producers; i++) {
+		printf("producer.%u.full\t\t%" PRIu64 "\n", i, producers[i].spins);
+	}
+	for (i = 0; i < num_consumers; i++) {
+		printf("consumer.%u.messages\t%" PRIu64 "\n", i, consumers[i].count);
+		printf("consumer.%u.empty\t%" PRIu64 "\n", i, consumers[i].spins);
+	}
+
+	if ((uint64_t) atomic_load(&num_popped) != num_total) {
+		fprintf(stderr, "atomic_queue_bench: Sent %" PRIu64 " messages, but received %" PRIu64 "\n",
+			num_total, (uint64_t) atomic_load(&num_popped));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	return 0;
+}
@@ -61,8 +61,10 @@ int main(int argc, char *argv[])
 {
 	int			c, i, ret = 0;
 	int			size;
+	unsigned int		num;
 	intptr_t		val;
 	void			*data;
+	void			**batch;
 	fr_atomic_queue_t	*aq;
 	TALLOC_CTX		*autofree = talloc_autofree_context();
 
@@ -172,6 +174,65 @@ int main(int argc, char *argv[])
 	if (debug_lvl) {
 		printf("Empty\n");
 		fr_atomic_queue_debug(aq, stdout);
+
+		if (debug_lvl > 1) printf("Filling with %d in one batch\n", size + 1);
+	}
+#endif
+
+	/*
+	 *	Do it all again, but in batches.  Only "size" entries
+	 *	will fit.
+	 */
+	batch = talloc_array(autofree, void *, size + 1);
+	for (i = 0; i <= size; i++) {
+		val = i + OFFSET;
+		batch[i] = (void *) val;
+	}
+
+	num = fr_atomic_queue_push_n(aq, batch, size + 1);
+	if (num != (unsigned int) size) {
+		fprintf(stderr, "Batch push expected %d, pushed %u\n", size, num);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_atomic_queue_push_n(aq, batch, 1) != 0) {
+		fprintf(stderr, "Batch pushed an entry past the end of the queue.");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Pop one entry, and then the rest as a batch.
+	 */
+	if (!fr_atomic_queue_pop(aq, &data) || ((intptr_t) data != OFFSET)) {
+		fprintf(stderr, "Failed popping first entry of batch\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	memset(batch, 0, talloc_array_length(batch) * sizeof(batch[0]));
+	num = fr_atomic_queue_pop_n(aq, batch, size + 1);
+	if (num != (unsigned int) (size - 1)) {
+		fprintf(stderr, "Batch pop expected %d, popped %u\n", size - 1, num);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < (int) num; i++) {
+		val = (intptr_t) batch[i];
+		if (val != (i + 1 + OFFSET)) {
+			fprintf(stderr, "Batch pop expected %d, got %d\n",
+				i + 1 + OFFSET, (int) val);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	if (fr_atomic_queue_pop_n(aq, batch, size) != 0) {
+		fprintf(stderr, "Batch popped an entry past the end of the queue.");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+#ifndef NDEBUG
+	if (debug_lvl) {
+		printf("Empty after batches\n");
+		fr_atomic_queue_debug(aq, stdout);
 	}
 #endif
 
@@ -0,0 +1,275 @@
+/*
+ * radius_decode_bench.c	Benchmark for decoding RADIUS attributes
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/pair.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/**********************************************************************/
+typedef struct request_s request_t;
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request);
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request)
+{
+}
+/**********************************************************************/
+
+/*
+ *	A typical Access-Request, with some attributes from the
+ *	bigger vendor dictionaries.  The length is filled in by main().
+ */
+static uint8_t packet[] = {
+	0x01, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+
+	0x01, 0x05, 'b', 'o', 'b',				/* User-Name */
+	0x04, 0x06, 0xc0, 0x00, 0x02, 0x01,			/* NAS-IP-Address */
+	0x05, 0x06, 0x00, 0x00, 0x00, 0x01,			/* NAS-Port */
+	0x06, 0x06, 0x00, 0x00, 0x00, 0x02,			/* Service-Type */
+	0x08, 0x06, 0xc0, 0x00, 0x02, 0x02,			/* Framed-IP-Address */
+	0x19, 0x03, 'x',					/* Class */
+	0x1e, 0x04, 'a', 'b',					/* Called-Station-Id */
+	0x1f, 0x04, 'c', 'd',					/* Calling-Station-Id */
+	0x20, 0x05, 'n', 'a', 's',				/* NAS-Identifier */
+	0x2c, 0x04, '0', '1',					/* Acct-Session-Id */
+	0x3d, 0x06, 0x00, 0x00, 0x00, 0x0f,			/* NAS-Port-Type */
+
+	0x1a, 0x0b, 0x00, 0x00, 0x00, 0x09,			/* Cisco-AVPair */
+	0x01, 0x05, 'a', '=', 'b',
+
+	0x1a, 0x0a, 0x00, 0x00, 0x28, 0xaf,			/* 3GPP-IMSI */
+	0x01, 0x04, '1', '2',
+
+	0x1a, 0x0c, 0x00, 0x00, 0x28, 0xaf,			/* 3GPP-Charging-ID */
+	0x02, 0x06, 0x00, 0x00, 0x00, 0x01,
+
+	0x1a, 0x09, 0x00, 0x00, 0x01, 0x37,			/* MS-CHAP-Error */
+	0x02, 0x03, 'e',
+
+	0x1a, 0x0e, 0x00, 0x00, 0x60, 0xb5,			/* WiMAX-Capability.Release */
+	0x01, 0x08, 0x00, 0x01, 0x05, '1', '.', '0'
+};
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "usage: radius_decode_bench [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -n packets             Number of packets to decode in each pass.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Count all of the pairs in a list, including nested ones
+ *
+ */
+static uint64_t pair_count(fr_pair_list_t const *list)
+{
+	fr_pair_t	*vp;
+	uint64_t	count = 0;
+
+	for (vp = fr_pair_list_head(list); vp; vp = fr_pair_list_next(list, vp)) {
+		count++;
+		if (fr_type_is_structural(vp->vp_type)) count += pair_count(&vp->vp_group);
+	}
+
+	return count;
+}
+
+/** Record the parent and number of all of the pairs in a list, including nested ones
+ *
+ */
+static void lookup_add(fr_dict_attr_t const **parents, unsigned int *nums, size_t *num_lookups, size_t max,
+		       fr_pair_list_t const *list)
+{
+	fr_pair_t	*vp;
+
+	for (vp = fr_pair_list_head(list); vp; vp = fr_pair_list_next(list, vp)) {
+		if ((*num_lookups < max) && vp->da->parent) {
+			parents[*num_lookups] = vp->da->parent;
+			nums[*num_lookups] = vp->da->attr;
+			(*num_lookups)++;
+		}
+		if (fr_type_is_structural(vp->vp_type)) lookup_add(parents, nums, num_lookups, max, &vp->vp_group);
+	}
+}
+
+/** Look up the children of the decoded attributes a number of times
+ *
+ * This is the part of decoding which the dictionary layout affects.
+ *
+ * @return the number of lookups per second, or < 0 on error.
+ */
+static double lookup_pass(fr_dict_attr_t const **parents, unsigned int *nums, size_t num_lookups,
+			  uint64_t num_packets)
+{
+	uint64_t		i;
+	size_t			j;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+
+	start = fr_time();
+
+	for (i = 0; i < num_packets; i++) {
+		for (j = 0; j < num_lookups; j++) {
+			if (!fr_dict_attr_child_by_num(parents[j], nums[j])) {
+				fr_perror("radius_decode_bench: Failed finding child %u of %s", nums[j], parents[j]->name);
+				return -1;
+			}
+		}
+	}
+
+	elapsed = fr_time_sub(fr_time(), start);
+
+	return (double) (num_lookups * num_packets) * NSEC / fr_time_delta_unwrap(elapsed);
+}
+
+/** Decode the packet a number of times
+ *
+ * @return the number of attributes decoded per second, or < 0 on error.
+ */
+static double bench_pass(TALLOC_CTX *ctx, uint64_t num_packets, uint64_t *num_attrs)
+{
+	fr_pair_list_t		list;
+	uint64_t		i, count = 0;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+
+	fr_pair_list_init(&list);
+
+	start = fr_time();
+
+	for (i = 0; i < num_packets; i++) {
+		if (fr_radius_decode(ctx, &list, packet, sizeof(packet), NULL, "testing123", 10) < 0) {
+			fr_perror("radius_decode_bench");
+			return -1;
+		}
+
+		if (!count) count = pair_count(&list);
+		fr_pair_list_free(&list);
+	}
+
+	elapsed = fr_time_sub(fr_time(), start);
+
+	*num_attrs = count;
+
+	return (double) (count * num_packets) * NSEC / fr_time_delta_unwrap(elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	char const		*dict_dir = DICTDIR;
+	uint64_t		num_packets = 1000 * 1000;
+	uint64_t		num_attrs;
+	double			before, after, lookup_before, lookup_after;
+	fr_pair_list_t		list;
+	fr_dict_attr_t const	*parents[64];
+	unsigned int		nums[64];
+	size_t			num_lookups = 0;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "D:hn:")) != -1) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_packets = strtoull(optarg, NULL, 10);
+			if (!num_packets) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_time_start();
+
+	if (!fr_dict_global_ctx_init(NULL, true, dict_dir)) {
+		fr_perror("radius_decode_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_radius_init() < 0) {
+		fr_perror("radius_decode_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	packet[2] = sizeof(packet) >> 8;
+	packet[3] = sizeof(packet) & 0xff;
+
+	fr_pair_list_init(&list);
+	if (fr_radius_decode(autofree, &list, packet, sizeof(packet), NULL, "testing123", 10) < 0) {
+		fr_perror("radius_decode_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+	lookup_add(parents, nums, &num_lookups, NUM_ELEMENTS(parents), &list);
+
+	/*
+	 *	Warm up the caches, then decode with the dictionaries
+	 *	as they are after loading.
+	 */
+	if (bench_pass(autofree, num_packets / 10, &num_attrs) < 0) fr_exit_now(EXIT_FAILURE);
+
+	before = bench_pass(autofree, num_packets, &num_attrs);
+	if (before < 0) fr_exit_now(EXIT_FAILURE);
+
+	lookup_before = lookup_pass(parents, nums, num_lookups, num_packets);
+	if (lookup_before < 0) fr_exit_now(EXIT_FAILURE);
+
+	/*
+	 *	Freeze the dictionaries, as the server does once it
+	 *	has bootstrapped, and decode again.
+	 */
+	fr_dict_global_ctx_read_only();
+
+	after = bench_pass(autofree, num_packets, &num_attrs);
+	if (after < 0) fr_exit_now(EXIT_FAILURE);
+
+	lookup_after = lookup_pass(parents, nums, num_lookups, num_packets);
+	if (lookup_after < 0) fr_exit_now(EXIT_FAILURE);
+
+	printf("packets\t\t\t%" PRIu64 "\n", num_packets);
+	printf("attrs_per_packet\t%" PRIu64 "\n", num_attrs);
+	printf("loaded.attrs_per_sec\t%.0f\n", before);
+	printf("frozen.attrs_per_sec\t%.0f\n", after);
+	printf("speedup\t\t\t%.3f\n", after / before);
+	printf("loaded.lookups_per_sec\t%.0f\n", lookup_before);
+	printf("frozen.lookups_per_sec\t%.0f\n", lookup_after);
+	printf("lookup_speedup\t\t%.3f\n", lookup_after / lookup_before);
+
+	fr_pair_list_free(&list);
+	fr_radius_free();
+
+	return 0;
+}
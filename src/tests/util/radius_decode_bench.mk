@@ -0,0 +1,6 @@
+TARGET 		:= radius_decode_bench$(E)
+
+SOURCES		:= radius_decode_bench.c
+
+TGT_PREREQS	:= libfreeradius-radius$(L)
+TGT_LDLIBS	:= $(LIBS)